@@ -3946,8 +3946,24 @@ static bool ParseBuffer(Buffer *buffer, std::string *err, const json &o,
   buffer->uri.clear();
   ParseStringProperty(&buffer->uri, err, o, "uri", false, "Buffer");
 
+  // EXT_meshopt_compression: a fallback buffer only reserves room for the
+  // decompressed bufferViews. Its uri (if any) is not loaded, the application
+  // decodes the compressed bufferViews into the zero initialized storage.
+  bool meshopt_fallback = false;
+  {
+    json_const_iterator extensions;
+    if (FindMember(o, "extensions", extensions)) {
+      json_const_iterator meshopt;
+      if (FindMember(GetValue(extensions), "EXT_meshopt_compression",
+                     meshopt)) {
+        ParseBooleanProperty(&meshopt_fallback, /* err */ nullptr,
+                             GetValue(meshopt), "fallback", false);
+      }
+    }
+  }
+
   // having an empty uri for a non embedded image should not be valid
-  if (!is_binary && buffer->uri.empty()) {
+  if (!is_binary && buffer->uri.empty() && !meshopt_fallback) {
     if (err) {
       (*err) += "'uri' is missing from non binary glTF file buffer.\n";
     }
@@ -3963,7 +3979,9 @@ static bool ParseBuffer(Buffer *buffer, std::string *err, const json &o,
     }
   }
 
-  if (is_binary) {
+  if (meshopt_fallback) {
+    buffer->data.resize(byteLength);
+  } else if (is_binary) {
     // Still binary glTF accepts external dataURI.
     if (!buffer->uri.empty()) {
       // First try embedded data URI.
@@ -1,6 +1,11 @@
 @echo on
+rem Compiles the viewer shaders next to their sources, or into the directory given as the first argument
 
-..\Dependencies\glslc.exe Shaders/model.frag -o Shaders/model.frag.spv
-..\Dependencies\glslc.exe Shaders/model.frag -o Shaders/model.frag.spv
+set GLSLC="%~dp0..\..\Dependencies\glslc.exe"
+set OUTPUT=%~dp0.
+if not "%~1"=="" set OUTPUT=%~1
+if not exist "%OUTPUT%" mkdir "%OUTPUT%"
 
-pause
\ No newline at end of file
+for %%s in (model.frag model.vert depthpyramid.comp occlusion.comp) do (
+	%GLSLC% "%~dp0%%s" -o "%OUTPUT%\%%s.spv" || exit /b 1
+)
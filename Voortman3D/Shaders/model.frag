@@ -4,11 +4,46 @@ layout (location = 0) in vec3 inNormal;
 layout (location = 1) in vec3 inColor;
 layout (location = 2) in vec3 inViewVec;
 layout (location = 3) in vec3 inLightVec;
+layout (location = 4) in vec2 inUV;
+layout (location = 5) flat in uint inMaterial;
+
+// Layout shared with vkglTF::Model::MaterialParameters
+struct Material {
+	vec4 baseColorFactor;
+	uint baseColorTexture;
+	float alphaCutoff;
+	float minLod;
+	uint padding;
+};
+
+layout (std430, set = 1, binding = 2) readonly buffer Materials {
+	Material materials[];
+};
+
+// vkglTF::textureSlotCount, slot 0 is white or empty with bindless textures and never sampled
+layout (constant_id = 0) const uint TEXTURE_SLOTS = 64;
+layout (set = 1, binding = 3) uniform sampler2D textures[TEXTURE_SLOTS];
 
 layout (location = 0) out vec4 outFragColor;
 
 void main() 
 {
+	// The material is the same for the whole draw, so the texture index is dynamically uniform
+	Material material = materials[inMaterial];
+	vec4 color = vec4(inColor, material.baseColorFactor.a);
+	if (material.baseColorTexture != 0u) {
+		// Levels finer than minLod are still streaming in
+		if (material.minLod > 0.0) {
+			float lod = max(textureQueryLod(textures[material.baseColorTexture], inUV).y, material.minLod);
+			color *= textureLod(textures[material.baseColorTexture], inUV, lod);
+		}
+		else {
+			color *= texture(textures[material.baseColorTexture], inUV);
+		}
+	}
+	if (color.a < material.alphaCutoff)
+		discard;
+
 	vec3 N = normalize(inNormal);
 	vec3 L = normalize(inLightVec);
 	vec3 V = normalize(inViewVec);
@@ -21,5 +56,5 @@ void main()
 	// Verlaag de specular intensiteit en exponent
 	vec3 specular = pow(max(dot(R, V), 0.0), 8.0) * vec3(0.3); // Minder intens en bredere reflectie
 
-	outFragColor = vec4((ambient + diffuse) * inColor.rgb + specular, 1.0);		
+	outFragColor = vec4((ambient + diffuse) * color.rgb + specular, 1.0);		
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 
 layout (location = 0) in vec3 inPos;
 layout (location = 1) in vec3 inNormal;
+layout (location = 2) in vec2 inUV;
 
 layout (set = 0, binding = 0) uniform UBO {
 	mat4 projection;
@@ -9,18 +10,39 @@ layout (set = 0, binding = 0) uniform UBO {
 	mat4 model;
 } ubo;
 
-layout (set = 1, binding = 0) uniform Node {
-	mat4 matrix;
-} node;
+layout (std430, set = 1, binding = 0) readonly buffer NodeMatrices {
+	mat4 matrices[];
+} nodes;
 
-layout(push_constant) uniform PushBlock {
+// Per draw data, every indirect draw starts at the instances of its primitive
+struct Instance {
+	uint node;
+	uint material;
+};
+
+layout (std430, set = 1, binding = 1) readonly buffer Instances {
+	Instance instances[];
+};
+
+// Layout shared with vkglTF::Model::MaterialParameters
+struct Material {
 	vec4 baseColorFactor;
-} material;
+	uint baseColorTexture;
+	float alphaCutoff;
+	float minLod;
+	uint padding;
+};
+
+layout (std430, set = 1, binding = 2) readonly buffer Materials {
+	Material materials[];
+};
 
 layout (location = 0) out vec3 outNormal;
 layout (location = 1) out vec3 outColor;
 layout (location = 2) out vec3 outViewVec;
 layout (location = 3) out vec3 outLightVec;
+layout (location = 4) out vec2 outUV;
+layout (location = 5) flat out uint outMaterial;
 
 out gl_PerVertex
 {
@@ -29,12 +51,15 @@ out gl_PerVertex
 
 void main() 
 {
+	Instance instance = instances[gl_InstanceIndex];
 	vec4 pos = vec4(inPos, 1.0);
-	mat4 evaluated = ubo.view * ubo.model * node.matrix;
+	mat4 evaluated = ubo.view * ubo.model * nodes.matrices[instance.node];
 
 	gl_Position = ubo.projection * evaluated * pos;
 
-	outColor = material.baseColorFactor.rgb;
+	outColor = materials[instance.material].baseColorFactor.rgb;
+	outUV = inUV;
+	outMaterial = instance.material;
 
 	outNormal = mat3(evaluated) * inNormal;
 
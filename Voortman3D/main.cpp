@@ -1,4 +1,5 @@
 #include "main.hpp"
+#include <unordered_map>
 
 #define LOAD_MODEL = 0xDF;
 
@@ -15,7 +16,6 @@ namespace Voortman3D {
 		camera.setMovementSpeed(0.5f);
 
 		enabledInstanceExtensions.push_back(VK_KHR_GET_PHYSICAL_DEVICE_PROPERTIES_2_EXTENSION_NAME);
-		enabledDeviceExtensions.push_back(VK_EXT_CONDITIONAL_RENDERING_EXTENSION_NAME);
 
 		// Allocate TCconnection on heap memory as it is long time use
 		TCconnection = new TwinCATConnection();
@@ -25,6 +25,30 @@ namespace Voortman3D {
 		if (deviceFeatures.fillModeNonSolid) _LIKELY {
 			enabledFeatures.fillModeNonSolid = VK_TRUE;
 		}
+		// Lets the whole scene go out in a single indirect draw
+		if (deviceFeatures.multiDrawIndirect) _LIKELY {
+			enabledFeatures.multiDrawIndirect = VK_TRUE;
+		}
+		// Indirect draws find their node and material through the instance they start at
+		if (deviceFeatures.drawIndirectFirstInstance) _LIKELY {
+			enabledFeatures.drawIndirectFirstInstance = VK_TRUE;
+		}
+		// Lets the GPU skip the unused tail of the indirect draws
+		if (deviceFeatures12.drawIndirectCount) _LIKELY {
+			enabledFeatures12.drawIndirectCount = VK_TRUE;
+		}
+		// Materials select their texture from the texture array of the node set
+		if (deviceFeatures.shaderSampledImageArrayDynamicIndexing) _LIKELY {
+			enabledFeatures.shaderSampledImageArrayDynamicIndexing = VK_TRUE;
+		}
+		if (deviceFeatures.samplerAnisotropy) _LIKELY {
+			enabledFeatures.samplerAnisotropy = VK_TRUE;
+		}
+		// Lets the texture array grow past vkglTF::maxTextures and fill up as textures stream in without recording command buffers again
+		if (deviceFeatures12.descriptorBindingPartiallyBound && deviceFeatures12.descriptorBindingSampledImageUpdateAfterBind) _LIKELY {
+			enabledFeatures12.descriptorBindingPartiallyBound = VK_TRUE;
+			enabledFeatures12.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+		}
 	}
 
 	Voortman3D::~Voortman3D() {
@@ -45,7 +69,27 @@ namespace Voortman3D {
 				vkDestroyDescriptorSetLayout(device, descriptorSetLayout, nullptr);
 
 			uniformBuffer.destroy();
-			conditionalBuffer.destroy();
+			drawBuffer.destroy();
+			drawCountBuffer.destroy();
+
+			if (occlusion)
+				delete occlusion;
+
+			if (occlusionRenderPass)
+				vkDestroyRenderPass(device, occlusionRenderPass, nullptr);
+
+			// The loader may still be uploading into the scene and the reloader reads it, so both have to stop first
+			if (modelLoader)
+				delete modelLoader;
+
+			if (modelReloader)
+				delete modelReloader;
+
+			if (scene)
+				delete scene;
+
+			vkglTF::destroyDefaultTexture();
+			vkglTF::destroyDescriptorSetLayouts(device);
 		}
 	}
 
@@ -53,30 +97,55 @@ namespace Voortman3D {
 		if (uioverlay->header("Visibility")) {
 
 			if (uioverlay->button("All")) _UNLIKELY { // Wont be true very often
-				for (auto i = 0; i < conditionalVisibility.size(); i++) {
-					conditionalVisibility[i] = 1;
+				for (auto i = 0; i < nodeVisibility.size(); i++) {
+					nodeVisibility[i] = 1;
 				}
-				updateConditionalBuffer();
+				updateInstances();
 			}
 			ImGui::SameLine();
 			if (uioverlay->button("None")) _UNLIKELY {
-				for (auto i = 0; i < conditionalVisibility.size(); i++) {
-					conditionalVisibility[i] = 0;
+				for (auto i = 0; i < nodeVisibility.size(); i++) {
+					nodeVisibility[i] = 0;
 				}
-				updateConditionalBuffer();
+				updateInstances();
 			}
 
 			if (uioverlay->checkBox("Wireframe", &wireframe)) _UNLIKELY {
 				buildCommandBuffers();
 			}
 
-			if (uioverlay->button("Load Model")) {
+			if (occlusion && uioverlay->checkBox("Occlusion culling", &occlusionCulling)) _UNLIKELY {
+				buildCommandBuffers();
+			}
+
+			// The selection picks the new threshold up on the next frame
+			uioverlay->sliderFloat("LOD pixel error", &lodPixelError, 0.0f, 8.0f);
+			ImGui::Text("Triangles: %u", drawnTriangles);
+			ImGui::Text("Draws: %u (%u with 16-bit indices)", shortDrawCount + wideDrawCount, shortDrawCount);
+			ImGui::Text("BVH culled: %.1f%% in %.3f ms", culledDrawRatio * 100.0f, cullTime);
+			if (occlusionActive()) {
+				ImGui::Text("Occlusion culled: %.1f%%", occlusionCulledRatio * 100.0f);
+			}
+			if (scene && !scene->meshlets.empty()) {
+				ImGui::Text("Culled: %.1f%%", culledTriangleRatio * 100.0f);
+			}
+
+			if (scene && scene->residency) {
+				const double megabyte = 1024.0 * 1024.0;
+				ImGui::Text("Geometry: %.0f of %.0f MB resident", scene->residency->getResidentBytes() / megabyte, scene->residency->getCachedBytes() / megabyte);
+				ImGui::Text("Paging in: %u meshes", scene->residency->getLoadingCount());
+			}
+
+			if (modelLoader->busy()) {
+				ImGui::Text("Loading model: %.0f%%", modelLoader->getProgress() * 100.0f);
+			}
+			else if (uioverlay->button("Load Model")) {
 				OpenFileDialog();
 			}
 
 			float transform{};
-			if (uioverlay->sliderFloat("Model Height", &transform, -0.2f, 0.2f)) {
-				scene.linearNodes[0]->Translate(glm::vec3(.0f, .0f, transform));
+			if (uioverlay->sliderFloat("Model Height", &transform, -0.2f, 0.2f) && scene) {
+				scene->linearNodes[0]->Translate(glm::vec3(.0f, .0f, transform));
 			}
 
 			// Read 10 times per second
@@ -88,14 +157,40 @@ namespace Voortman3D {
 		
 			uioverlay->inputFloat("Saw Height", &sawHeight);
 
+			if (picking.picked) {
+				if (picking.hit.node != vkglTF::Model::Hierarchy::none) {
+					ImGui::Text("Picked: [%u] at %.3f in %.3f ms", picking.hit.node, picking.hit.distance, picking.time);
+					ImGui::Text("Point: %.3f %.3f %.3f", picking.hit.point.x, picking.hit.point.y, picking.hit.point.z);
+				}
+				else {
+					ImGui::Text("Picked: nothing in %.3f ms", picking.time);
+				}
+			}
+
+			// Edits go straight into the material buffer, the recorded command buffers stay as they are
+			if (scene && selectedNode != vkglTF::Model::Hierarchy::none && scene->hierarchy.meshes[selectedNode] != vkglTF::Model::Hierarchy::none) {
+				std::vector<uint32_t> shownMaterials;
+				for (const vkglTF::Primitive* primitive : scene->meshes[scene->hierarchy.meshes[selectedNode]]->primitives) {
+					const uint32_t material = static_cast<uint32_t>(primitive->material - scene->materials.data());
+					if (std::find(shownMaterials.begin(), shownMaterials.end(), material) != shownMaterials.end())
+						continue;
+					shownMaterials.push_back(material);
+					if (ImGui::ColorEdit4(("Material " + std::to_string(material)).c_str(), &scene->materials[material].baseColorFactor.x))
+						scene->updateMaterial(material);
+				}
+			}
+
 			ImGui::NewLine();
 
 			ImGui::BeginChild("InnerRegion", ImVec2(200.0f * uioverlay->scale, 400.0f * uioverlay->scale), false);
 
 			// Itereer door de knooppunten en creer een boomstructuur
-			for (auto node : scene.nodes) {
-				RenderChildNodesInUI(node);
+			if (scene) {
+				for (auto node : scene->nodes) {
+					RenderChildNodesInUI(node);
+				}
 			}
+			picking.revealSelection = false;
 
 			ImGui::EndChild();
 		}
@@ -103,13 +198,29 @@ namespace Voortman3D {
 
 
 	void Voortman3D::RenderChildNodesInUI(vkglTF::Node* node) {
-		bool isOpen = ImGui::TreeNodeEx(("[" + std::to_string(node->index) + "]").c_str(), ImGuiTreeNodeFlags_OpenOnArrow | ImGuiTreeNodeFlags_NavLeftJumpsBackHere);
+		// A picked node is revealed by opening every node whose subtree contains it
+		if (picking.revealSelection && node->index < selectedNode && selectedNode < scene->hierarchy.subtreeEnds[node->index]) {
+			ImGui::SetNextTreeNodeOpen(true);
+		}
+
+		ImGuiTreeNodeFlags flags = ImGuiTreeNodeFlags_OpenOnArrow | ImGuiTreeNodeFlags_NavLeftJumpsBackHere;
+		if (node->index == selectedNode) {
+			flags |= ImGuiTreeNodeFlags_Selected;
+		}
+		bool isOpen = ImGui::TreeNodeEx(("[" + std::to_string(node->index) + "]").c_str(), flags);
+		// Clicks on the arrow only open the node, clicks on the label select it
+		if (ImGui::IsItemClicked() && ImGui::GetMousePos().x - ImGui::GetItemRectMin().x > ImGui::GetTreeNodeToLabelSpacing()) {
+			selectedNode = node->index;
+		}
+		if (picking.revealSelection && node->index == selectedNode) {
+			ImGui::SetScrollHere();
+		}
 
 		// Voeg een checkbox toe binnen de boomknop
-		bool visibility = conditionalVisibility[node->index];
+		bool visibility = nodeVisibility[node->index];
 		if (ImGui::Checkbox("Visible", (bool*)&visibility)) {
-			conditionalVisibility[node->index] = visibility;
-			updateConditionalBuffer();
+			nodeVisibility[node->index] = visibility;
+			updateInstances();
 		}
 
 		// Variables for string input and edit state
@@ -155,18 +266,14 @@ namespace Voortman3D {
 
 	void Voortman3D::OpenFileDialog() {
 		OPENFILENAME ofn;
-
-		// 520 bytes and short time usage use alloca instead of malloc or new
-#pragma warning(disable:6255)
-		LPWSTR szFile = (LPWSTR)_alloca(260*sizeof(wchar_t));
-#pragma warning(default:6255)
+		wchar_t szFile[MAX_PATH] = L"";
 
 		ZeroMemory(&ofn, sizeof(ofn));
 		ofn.lStructSize = sizeof(ofn);
 		ofn.hwndOwner = window->window();
 		ofn.lpstrFile = szFile;
-		ofn.nMaxFile = sizeof(szFile);
-		ofn.lpstrFilter = L"All Files\0*.*\0Text Files\0*.TXT\0";
+		ofn.nMaxFile = MAX_PATH;
+		ofn.lpstrFilter = L"glTF Files\0*.gltf;*.glb\0Assembly Manifests\0*.json\0All Files\0*.*\0";
 		ofn.nFilterIndex = 1;
 		ofn.lpstrFileTitle = NULL;
 		ofn.nMaxFileTitle = 0;
@@ -174,44 +281,59 @@ namespace Voortman3D {
 		ofn.Flags = OFN_PATHMUSTEXIST | OFN_FILEMUSTEXIST;
 
 		if (GetOpenFileName(&ofn)) {
-
+			// tinygltf expects UTF-8 paths
+			const int length = WideCharToMultiByte(CP_UTF8, 0, szFile, -1, nullptr, 0, nullptr, nullptr);
+			if (length <= 1) _UNLIKELY
+				return;
+
+			std::string filePath(length - 1, '\0');
+			WideCharToMultiByte(CP_UTF8, 0, szFile, -1, filePath.data(), length, nullptr, nullptr);
+			loadAssets(filePath);
 		}
 	}
 
-	void Voortman3D::renderNode(const vkglTF::Node* node, const VkCommandBuffer commandBuffer) {
-		if (node->mesh) {
-			for (vkglTF::Primitive* primitive : node->mesh->primitives) {
-				const std::array<VkDescriptorSet, 2> descriptorsets = {
-					descriptorSet,
-					node->mesh->uniformBuffer.descriptorSet
-				};
-				vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, static_cast<uint32_t>(descriptorsets.size()), descriptorsets.data(), 0, NULL);
-
-				vkCmdPushConstants(commandBuffer, pipelineLayout, VK_SHADER_STAGE_VERTEX_BIT, 0, sizeof(primitive->material->baseColorFactor), &primitive->material->baseColorFactor);
-
-				/*
-					[POI] Setup the conditional rendering
-				*/
-				VkConditionalRenderingBeginInfoEXT conditionalRenderingBeginInfo{};
-				conditionalRenderingBeginInfo.sType = VK_STRUCTURE_TYPE_CONDITIONAL_RENDERING_BEGIN_INFO_EXT;
-				conditionalRenderingBeginInfo.buffer = conditionalBuffer.buffer;
-				conditionalRenderingBeginInfo.offset = sizeof(int32_t) * node->index;
+	void Voortman3D::bindScene(const VkCommandBuffer commandBuffer, const VkDescriptorSet nodeSet) {
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 1, 1, &nodeSet, 0, NULL);
 
-				/*
-					[POI] Begin conditionally rendered section
+		constexpr VkDeviceSize offsets[1] = { 0 };
+		vkCmdBindVertexBuffers(commandBuffer, 0, 1, &scene->vertices.buffer, offsets);
+	}
 
-					If the value from the conditional rendering buffer at the given offset is != 0, the draw commands will be executed
-				*/
-				vkCmdBeginConditionalRenderingEXT(commandBuffer, &conditionalRenderingBeginInfo);
+	void Voortman3D::drawScene(const VkCommandBuffer commandBuffer, const Buffer& draws) {
+		if (!draws.buffer)
+			return;
 
-				vkCmdDrawIndexed(commandBuffer, primitive->indexCount, 1, primitive->firstIndex, 0, 0);
+		// Grouped by index type, so the index buffer only changes once between the two pools
+		if (maxShortDrawCount > 0) {
+			vkCmdBindIndexBuffer(commandBuffer, scene->shortIndices.buffer, 0, VK_INDEX_TYPE_UINT16);
+			drawRegion(commandBuffer, draws, 0, maxShortDrawCount, shortDrawCount, 0);
+		}
+		if (maxDrawCount > maxShortDrawCount) {
+			vkCmdBindIndexBuffer(commandBuffer, scene->indices.buffer, 0, VK_INDEX_TYPE_UINT32);
+			drawRegion(commandBuffer, draws, maxShortDrawCount, maxDrawCount - maxShortDrawCount, wideDrawCount, sizeof(uint32_t));
+		}
+	}
 
-				vkCmdEndConditionalRenderingEXT(commandBuffer);
+	void Voortman3D::drawRegion(const VkCommandBuffer commandBuffer, const Buffer& draws, uint32_t firstDraw, uint32_t maxCount, uint32_t count, VkDeviceSize countOffset) {
+		// Without a first instance the draws can't find their data, so the ones of this frame are recorded directly
+		if (!enabledFeatures.drawIndirectFirstInstance) _UNLIKELY {
+			const VkDrawIndexedIndirectCommand* commands = static_cast<const VkDrawIndexedIndirectCommand*>(draws.mapped) + firstDraw;
+			for (uint32_t i = 0; i < count; i++) {
+				vkCmdDrawIndexed(commandBuffer, commands[i].indexCount, commands[i].instanceCount, commands[i].firstIndex, commands[i].vertexOffset, commands[i].firstInstance);
 			}
+			return;
+		}
 
-		};
-		for (const auto child : node->children) {
-			renderNode(child, commandBuffer);
+		// The recorded calls only depend on the size of the draw buffer, its contents are rewritten every frame
+		constexpr VkDeviceSize stride = sizeof(VkDrawIndexedIndirectCommand);
+		const uint32_t maxDrawsPerCall = enabledFeatures.multiDrawIndirect ? deviceProperties.limits.maxDrawIndirectCount : 1;
+		if (enabledFeatures12.drawIndirectCount && maxCount <= maxDrawsPerCall) _LIKELY {
+			vkCmdDrawIndexedIndirectCount(commandBuffer, draws.buffer, firstDraw * stride, drawCountBuffer.buffer, countOffset, maxCount, stride);
+		}
+		else {
+			for (uint32_t first = 0; first < maxCount; first += maxDrawsPerCall) {
+				vkCmdDrawIndexedIndirect(commandBuffer, draws.buffer, (firstDraw + first) * stride, (std::min)(maxDrawsPerCall, maxCount - first), stride);
+			}
 		}
 	}
 
@@ -259,14 +381,11 @@ namespace Voortman3D {
 	void Voortman3D::preparePipelines() {
 		// Layout
 		const std::array<VkDescriptorSetLayout, 2> setLayouts = {
-			descriptorSetLayout, vkglTF::descriptorSetLayoutUbo
+			descriptorSetLayout, vkglTF::descriptorSetLayoutNodes
 		};
 
-		VkPipelineLayoutCreateInfo pipelineLayoutCI = Initializers::pipelineLayoutCreateInfo(setLayouts.data(), 2);
-		const VkPushConstantRange pushConstantRange = Initializers::pushConstantRange(VK_SHADER_STAGE_VERTEX_BIT, sizeof(glm::vec4), 0);
-
-		pipelineLayoutCI.pushConstantRangeCount = 1;
-		pipelineLayoutCI.pPushConstantRanges = &pushConstantRange;
+		// Node and material of every draw are looked up through its instance, so there are no push constants
+		const VkPipelineLayoutCreateInfo pipelineLayoutCI = Initializers::pipelineLayoutCreateInfo(setLayouts.data(), 2);
 		VK_CHECK_RESULT(vkCreatePipelineLayout(device, &pipelineLayoutCI, nullptr, &pipelineLayout));
 
 		// Pipeline most of the info can be set at compile time
@@ -293,7 +412,7 @@ namespace Voortman3D {
 		pipelineCI.pViewportState = &viewportStateCI;
 		pipelineCI.pDepthStencilState = &depthStencilStateCI;
 		pipelineCI.pDynamicState = &dynamicStateCI;
-		pipelineCI.pVertexInputState = vkglTF::Vertex::getPipelineVertexInputState({ vkglTF::VertexComponent::Position, vkglTF::VertexComponent::Normal});
+		pipelineCI.pVertexInputState = vkglTF::Vertex::getPipelineVertexInputState({ vkglTF::VertexComponent::Position, vkglTF::VertexComponent::Normal, vkglTF::VertexComponent::UV });
 
 		// Load shader from resource
 		const HRSRC FragmentResource = FindResource(GetModuleHandle(nullptr), MAKEINTRESOURCE(IDR_MODEL_FRAGMENT), L"Shader");
@@ -312,12 +431,17 @@ namespace Voortman3D {
 		const size_t VertexDataSize = SizeofResource(GetModuleHandle(nullptr), VertexResource);
 
 		// LockResource will result in a void* which can be used to load the binary .spv file which is required for our shader
-		const std::array<VkPipelineShaderStageCreateInfo, 2> shaderStagesRender = {
+		std::array<VkPipelineShaderStageCreateInfo, 2> shaderStagesRender = {
 			loadShader(VK_SHADER_STAGE_FRAGMENT_BIT, LockResource(fragmentData), fragmentDataSize),
 			loadShader(VK_SHADER_STAGE_VERTEX_BIT, LockResource(vertexData), VertexDataSize)
 		};
 #pragma warning(default:6387)
 
+		// The texture array of the fragment shader is sized like the one of the node set layout
+		constexpr VkSpecializationMapEntry textureSlotsEntry = Initializers::specializationMapEntry(0, 0, sizeof(uint32_t));
+		const VkSpecializationInfo fragmentSpecialization = Initializers::specializationInfo(1, &textureSlotsEntry, sizeof(uint32_t), &vkglTF::textureSlotCount);
+		shaderStagesRender[0].pSpecializationInfo = &fragmentSpecialization;
+
 		pipelineCI.stageCount = static_cast<uint32_t>(shaderStagesRender.size());
 		pipelineCI.pStages = shaderStagesRender.data();
 		VK_CHECK_RESULT(vkCreateGraphicsPipelines(device, pipelineCache, 1, &pipelineCI, nullptr, &pipelines.solid));
@@ -329,7 +453,137 @@ namespace Voortman3D {
 	}
 
 	void Voortman3D::loadAssets(const std::string& FilePath) {
-		scene.loadFromFile(FilePath, vulkanDevice, queue);
+		// Parsing and processing happen on the loader thread, updateModelLoading picks the result up
+		loadingPath = FilePath;
+		modelLoader->load(FilePath, fileLoadingFlags);
+	}
+
+	void Voortman3D::updateModelLoading() {
+		const uint32_t updateFlags = modelLoader->update();
+
+		// The first model is shown while its nodes arrive, a replacement only once it is complete so the current one stays on screen
+		const vkglTF::ModelLoader::State state = modelLoader->getState();
+		if ((state == vkglTF::ModelLoader::State::Uploading && !scene) || state == vkglTF::ModelLoader::State::Done) {
+			if (vkglTF::Model* model = modelLoader->takeModel()) {
+				setScene(model);
+				return;
+			}
+		}
+
+		if (updateFlags & vkglTF::ModelLoader::UpdateFlags::NodesResident)
+			updateInstances();
+
+		// A texture of the scene got its first levels, without bindless textures the node sets are bound in the recorded command buffers
+		if ((updateFlags & vkglTF::ModelLoader::UpdateFlags::TexturesChanged) && scene) {
+			if (!vkglTF::bindlessTextures) {
+				if (occlusion)
+					occlusion->invalidateDescriptors();
+				buildCommandBuffers();
+			}
+			else if (occlusion) {
+				occlusion->updateTextureDescriptors();
+			}
+		}
+
+		// Changed files are only applied while nothing uploads into the scene, a replacement that is loading takes over anyway
+		if (scene && !modelLoader->busy()) {
+			const uint32_t reloadFlags = modelReloader->update();
+			if (reloadFlags & vkglTF::ModelReloader::UpdateFlags::ReloadRequired)
+				loadAssets(modelPath);
+			else if (reloadFlags & vkglTF::ModelReloader::UpdateFlags::GeometryChanged)
+				prepareSceneBuffers();
+		}
+	}
+
+	namespace {
+		/** @brief Names from the root down to every node, siblings with the same name are numbered in order */
+		std::vector<std::string> nodePaths(const vkglTF::Model& model) {
+			const vkglTF::Model::Hierarchy& hierarchy = model.hierarchy;
+			std::vector<std::string> paths(hierarchy.size());
+			std::unordered_map<std::string, uint32_t> counts;
+			for (uint32_t i = 0; i < hierarchy.size(); i++) {
+				const uint32_t parent = hierarchy.parents[i];
+				std::string path = (parent == vkglTF::Model::Hierarchy::none ? std::string() : paths[parent]) + "/" + hierarchy.names[hierarchy.nameIds[i]];
+				if (const uint32_t count = counts[path]++; count > 0)
+					path += "#" + std::to_string(count);
+				paths[i] = std::move(path);
+			}
+			return paths;
+		}
+	}
+
+	void Voortman3D::setScene(vkglTF::Model* model) {
+		// Only happens when a model is swapped, so simply wait for the frames that still use the old one
+		VK_CHECK_RESULT(vkQueueWaitIdle(queue));
+		modelReloader->stop();
+
+		// A reload of the same file, after a change that didn't fit or from the menu, finds hidden and selected nodes again by name
+		std::unordered_map<std::string, uint32_t> previousNodes;
+		if (scene && modelPath == loadingPath) {
+			const std::vector<std::string> paths = nodePaths(*scene);
+			for (uint32_t i = 0; i < paths.size(); i++)
+				previousNodes.emplace(paths[i], i);
+		}
+		const std::vector<uint8_t> previousVisibility = std::move(nodeVisibility);
+		const uint32_t previousSelection = selectedNode;
+
+		if (scene)
+			delete scene;
+		scene = model;
+		modelPath = loadingPath;
+
+		// By default, all parts of the glTF are visible
+		nodeVisibility.assign(scene->hierarchy.size(), 1);
+		selectedNode = vkglTF::Model::Hierarchy::none;
+		if (!previousNodes.empty()) {
+			const std::vector<std::string> paths = nodePaths(*scene);
+			for (uint32_t i = 0; i < paths.size(); i++) {
+				const auto previous = previousNodes.find(paths[i]);
+				if (previous == previousNodes.end())
+					continue;
+				nodeVisibility[i] = previousVisibility[previous->second];
+				if (previous->second == previousSelection)
+					selectedNode = i;
+			}
+		}
+		picking.hit = {};
+		picking.picked = false;
+
+		prepareSceneBuffers();
+		modelReloader->watch(scene, modelPath, fileLoadingFlags);
+	}
+
+	void Voortman3D::prepareSceneBuffers() {
+		// Sized by the primitives and meshlets of the scene, the GPU is idle whenever these change
+		drawBuffer.destroy();
+		drawBuffer = {};
+		drawCountBuffer.destroy();
+		drawCountBuffer = {};
+		if (occlusion)
+			occlusion->destroyBuffers();
+		visibleItems.clear();
+
+		prepareDrawBuffers();
+		if (occlusion && drawBuffer.buffer && !scene->bvh.empty())
+			occlusion->prepareBuffers(scene, drawBuffer, maxDrawCount, maxShortDrawCount);
+		updateInstances();
+		buildCommandBuffers();
+	}
+
+	void Voortman3D::updateInstances() {
+		if (!scene)
+			return;
+
+		// The first instanceCount nodes of a group are drawn, they are swapped to the front so the group keeps all of its nodes.
+		// Hidden nodes are left out here, updateDraws writes the instances of the remaining ones that survive culling
+		for (vkglTF::Model::InstanceGroup& group : scene->instanceGroups) {
+			uint32_t count = 0;
+			for (size_t i = 0; i < group.nodes.size(); i++) {
+				if (group.nodes[i]->resident && nodeVisibility[group.nodes[i]->index])
+					std::swap(group.nodes[i], group.nodes[count++]);
+			}
+			group.instanceCount = count;
+		}
 	}
 
 	void Voortman3D::buildCommandBuffers() {
@@ -354,11 +608,31 @@ namespace Voortman3D {
 
 		vkUpdateDescriptorSets(device, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
 
+		const bool occluded = occlusionActive();
+		if (occluded) {
+			occlusion->preparePyramid(depthStencil.image, depthFormat, width, height);
+			occlusion->updateDescriptors();
+		}
+
 		for (int32_t i = 0; i < drawCmdBuffers.size(); ++i) {
 			renderPassBeginInfo.framebuffer = frameBuffers[i];
 
 			VK_CHECK_RESULT(vkBeginCommandBuffer(drawCmdBuffers[i], &cmdBufInfo));
 
+			if (occluded) {
+				// The render pass of the core clears the frame in the early pass, the UI is drawn on top of the late pass
+				occlusion->record(drawCmdBuffers[i], renderPassBeginInfo, occlusionRenderPass, [this](const VkCommandBuffer commandBuffer, const Buffer& draws, bool late) {
+					vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &descriptorSet, 0, NULL);
+					vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, wireframe ? pipelines.wireframe : pipelines.solid);
+					bindScene(commandBuffer, occlusion->getDrawSet());
+					drawScene(commandBuffer, draws);
+					if (late)
+						drawUI(commandBuffer);
+				});
+				VK_CHECK_RESULT(vkEndCommandBuffer(drawCmdBuffers[i]));
+				continue;
+			}
+
 			vkCmdBeginRenderPass(drawCmdBuffers[i], &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
 
 			VkViewport viewport = Initializers::viewport((float)width, (float)height, 0.0f, 1.0f);
@@ -374,11 +648,9 @@ namespace Voortman3D {
 			// Choose wether we bind the wireframe pipeline or the solid pipeline
 			vkCmdBindPipeline(drawCmdBuffers[i], VK_PIPELINE_BIND_POINT_GRAPHICS, wireframe ? pipelines.wireframe : pipelines.solid);
 
-			constexpr VkDeviceSize offsets[1] = { 0 };
-			vkCmdBindVertexBuffers(drawCmdBuffers[i], 0, 1, &scene.vertices.buffer, offsets);
-			vkCmdBindIndexBuffer(drawCmdBuffers[i], scene.indices.buffer, 0, VK_INDEX_TYPE_UINT32);
-			for (const auto node : scene.nodes) {
-				renderNode(node, drawCmdBuffers[i]);
+			if (scene) {
+				bindScene(drawCmdBuffers[i], scene->nodeMatrices.descriptorSet);
+				drawScene(drawCmdBuffers[i], drawBuffer);
 			}
 
 			drawUI(drawCmdBuffers[i]);
@@ -389,60 +661,367 @@ namespace Voortman3D {
 		}
 	}
 
-	void Voortman3D::prepareConditionalRendering()
+	void Voortman3D::updateUniformBuffers()
 	{
-		if (scene.linearNodes.size() == 0) return; // there are no nodes loaded
+		uniformData.projection = camera.matrices.perspective;
+		uniformData.view = glm::scale(camera.matrices.view, glm::vec3(0.1f, -0.1f, 0.1f));
+		uniformData.model = scene && !scene->linearNodes.empty() ? scene->linearNodes[0]->getMatrix() : glm::mat4(1.0f);
+		memcpy(uniformBuffer.mapped, &uniformData, sizeof(UniformData));
+	}
 
-		/*
-			The conditional rendering functions are part of an extension so they have to be loaded manually
-		*/
-		vkCmdBeginConditionalRenderingEXT = (PFN_vkCmdBeginConditionalRenderingEXT)vkGetDeviceProcAddr(device, "vkCmdBeginConditionalRenderingEXT");
-		if (!vkCmdBeginConditionalRenderingEXT) _UNLIKELY {
-			std::cerr << "Could not get a valid function pointer for vkCmdBeginConditionalRenderingEXT\n";
+	void Voortman3D::updateModelViews() {
+		if (!scene) _UNLIKELY
+			return;
+
+		modelViews.resize(scene->hierarchy.size());
+		BatchMath::multiply(uniformData.view * uniformData.model, scene->hierarchy.worldMatrices.data(), modelViews.data(), modelViews.size());
+	}
+
+	void Voortman3D::updateLODSelection() {
+		if (!scene) _UNLIKELY
+			return;
+
+		// Pixels covered by one unit at distance one, the projection already holds 1 / tan(fov / 2)
+		const float pixelsPerUnit = fabsf(uniformData.projection[1][1]) * static_cast<float>(height) * 0.5f;
+
+		for (const vkglTF::Model::InstanceGroup& group : scene->instanceGroups) {
+			if (group.instanceCount == 0)
+				continue;
+
+			for (vkglTF::Primitive* primitive : group.mesh->primitives) {
+				// All instances share one draw, so the primitive gets the most detailed level any of them needs
+				uint32_t lod = UINT32_MAX;
+				for (uint32_t i = 0; i < group.instanceCount && lod > 0; i++) {
+					const glm::mat4& modelView = modelViews[group.nodes[i]->index];
+					const float scale = (std::max)({ glm::length(glm::vec3(modelView[0])), glm::length(glm::vec3(modelView[1])), glm::length(glm::vec3(modelView[2])) });
+
+					// Distance to the nearest point of the bounding sphere, a camera inside the sphere always gets full detail
+					const glm::vec3 center = glm::vec3(modelView * glm::vec4(primitive->dimensions.center, 1.0f));
+					const float radius = primitive->dimensions.radius * scale;
+					const float distance = glm::length(center) - radius;
+
+					uint32_t instanceLod = 0;
+					if (distance > camera.getNearClip() && primitive->dimensions.radius > 0.0f) _LIKELY {
+						// Object space error to pixels, scaled by how large the projected bounding sphere is
+						const float projectedRadius = radius * pixelsPerUnit / distance;
+						instanceLod = primitive->selectLOD(projectedRadius / primitive->dimensions.radius, lodPixelError);
+					}
+					lod = (std::min)(lod, instanceLod);
+				}
+				primitive->lod = lod;
+			}
 		}
+	}
+
+	void Voortman3D::prepareDrawBuffers() {
+		if (!scene)
+			return;
 
-		vkCmdEndConditionalRenderingEXT = (PFN_vkCmdEndConditionalRenderingEXT)vkGetDeviceProcAddr(device, "vkCmdEndConditionalRenderingEXT");
-		if (!vkCmdEndConditionalRenderingEXT) _UNLIKELY {
-			std::cerr << "Could not get a valid function pointer for vkCmdEndConditionalRenderingEXT\n";
+		// Worst case every meshlet survives on its own, primitives without meshlets always take a single draw
+		maxShortDrawCount = 0;
+		maxDrawCount = 0;
+		shortDrawCount = 0;
+		wideDrawCount = 0;
+		for (const vkglTF::Model::InstanceGroup& group : scene->instanceGroups) {
+			for (const vkglTF::Primitive* primitive : group.mesh->primitives) {
+				const uint32_t primitiveDraws = (std::max)(primitive->meshletCount, 1u);
+				maxDrawCount += primitiveDraws;
+				if (primitive->shortIndices)
+					maxShortDrawCount += primitiveDraws;
+			}
 		}
+		if (maxDrawCount == 0)
+			return;
 
-		/*
-			Create the buffer that contains the conditional rendering information
+		// Also read by the occlusion pass, which derives the draws it issues from these
+		VK_CHECK_RESULT(vulkanDevice->createBuffer(
+			VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			&drawBuffer,
+			sizeof(VkDrawIndexedIndirectCommand) * maxDrawCount));
+		VK_CHECK_RESULT(drawBuffer.map());
+		memset(drawBuffer.mapped, 0, sizeof(VkDrawIndexedIndirectCommand) * maxDrawCount);
 
-			A single conditional value is 32 bits and if it's zero the rendering commands are discarded
-			This sample renders multiple rows of objects conditionally, so we setup a buffer with one value per row
-		*/
-		conditionalVisibility.resize(scene.linearNodes.size());
+		std::array<uint32_t, 2> initialCounts = { 0, 0 };
 		VK_CHECK_RESULT(vulkanDevice->createBuffer(
-			VK_BUFFER_USAGE_CONDITIONAL_RENDERING_BIT_EXT,
+			VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT,
 			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-			&conditionalBuffer,
-			sizeof(VkBool32) * conditionalVisibility.size(),
-			&conditionalVisibility[0]));
+			&drawCountBuffer,
+			sizeof(initialCounts),
+			initialCounts.data()));
+		VK_CHECK_RESULT(drawCountBuffer.map());
+	}
 
-		VK_CHECK_RESULT(conditionalBuffer.map());
+	void Voortman3D::cullScene() {
+		if (!scene || scene->bvh.empty())
+			return;
 
-		// By default, all parts of the glTF are visible
-		for (auto i = 0; i < conditionalVisibility.size(); i++) {
-			conditionalVisibility[i] = 1;
+		// The tree holds world space boxes, so the frustum goes through the same model matrix as the vertices
+		const auto start = std::chrono::high_resolution_clock::now();
+		const std::array<glm::vec4, 6> planes = vkglTF::extractFrustumPlanes(uniformData.projection * uniformData.view * uniformData.model);
+		scene->bvh.cull(planes, visibleItems);
+		cullTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	}
+
+	void Voortman3D::updateResidency() {
+		if (!scene || !scene->residency)
+			return;
+
+		// Pixels covered by one unit at distance one, like for the level of detail selection
+		const float pixelsPerUnit = fabsf(uniformData.projection[1][1]) * static_cast<float>(height) * 0.5f;
+		const bool culled = !visibleItems.empty();
+
+		// Meshes are requested with the largest size any of their visible instances has on screen, the largest ones are paged in first
+		for (size_t m = 0; m < scene->instanceGroups.size(); m++) {
+			const vkglTF::Model::InstanceGroup& group = scene->instanceGroups[m];
+			float priority = -1.0f;
+			for (uint32_t i = 0; i < group.instanceCount; i++) {
+				const uint32_t node = group.nodes[i]->index;
+				const glm::mat4& modelView = modelViews[node];
+				const float scale = (std::max)({ glm::length(glm::vec3(modelView[0])), glm::length(glm::vec3(modelView[1])), glm::length(glm::vec3(modelView[2])) });
+
+				for (size_t p = 0; p < group.mesh->primitives.size(); p++) {
+					if (culled && !visibleItems[scene->bvh.firstItem(node) + p])
+						continue;
+
+					const vkglTF::Primitive* primitive = group.mesh->primitives[p];
+					const glm::vec3 center = glm::vec3(modelView * glm::vec4(primitive->dimensions.center, 1.0f));
+					const float radius = primitive->dimensions.radius * scale;
+					const float distance = glm::length(center) - radius;
+					priority = (std::max)(priority, distance > camera.getNearClip() ? radius * pixelsPerUnit / distance : FLT_MAX);
+				}
+			}
+			if (priority >= 0.0f)
+				scene->residency->request(static_cast<uint32_t>(m), priority);
+		}
+		scene->residency->update();
+	}
+
+	void Voortman3D::updateDraws() {
+		if (!drawBuffer.mapped)
+			return;
+
+		// Frames are waited on before the next one is recorded, so the draws and instances can be rewritten in place
+		VkDrawIndexedIndirectCommand* draws = static_cast<VkDrawIndexedIndirectCommand*>(drawBuffer.mapped);
+		const bool culled = !visibleItems.empty();
+
+		// The instances that survive the BVH become candidates of the occlusion pass, which writes the instances of its own draws
+		const bool occluded = occlusionActive();
+		if (occluded) {
+			// The last frame has finished, so its early and late draws tell how many triangles were left after occlusion culling
+			occlusionCulledRatio = occlusion->getCulledRatio();
+			occlusion->beginFrame();
+		}
+
+		uint32_t shortCount = 0, wideCount = 0;
+		size_t totalTriangles = 0, triangles = 0, candidateDraws = 0, keptDraws = 0;
+		std::vector<std::array<glm::vec4, 6>> planes;
+		std::vector<glm::vec3> cameraPositions;
+		std::vector<uint32_t> visibleInstances;
+		const vkglTF::GeometryResidency* residency = scene->residency;
+		for (const vkglTF::Model::InstanceGroup& group : scene->instanceGroups) {
+			if (group.instanceCount == 0)
+				continue;
+
+			// Meshes that are not paged in are drawn as the boxes of their primitives until they are
+			const uint32_t mesh = static_cast<uint32_t>(&group - scene->instanceGroups.data());
+			const bool resident = !residency || residency->isResident(mesh);
+
+			// Culling runs in object space, so neither the bounds nor the cones have to be transformed, only the frustum of every instance
+			bool frustumsReady = false;
+			for (size_t p = 0; p < group.mesh->primitives.size(); p++) {
+				const vkglTF::Primitive* primitive = group.mesh->primitives[p];
+				const uint32_t firstInstance = group.firstInstance + static_cast<uint32_t>(p * group.nodes.size());
+				const uint32_t material = static_cast<uint32_t>(primitive->material - scene->materials.data());
+				totalTriangles += primitive->indexCount / 3 * group.instanceCount;
+
+				// Only the instances whose primitive box survived the BVH are written, so every draw starts at its visible nodes
+				visibleInstances.clear();
+				for (uint32_t i = 0; i < group.instanceCount; i++) {
+					const uint32_t node = group.nodes[i]->index;
+					if (culled && !visibleItems[scene->bvh.firstItem(node) + p])
+						continue;
+					scene->instances.mapped[firstInstance + visibleInstances.size()] = { node, material };
+					visibleInstances.push_back(i);
+				}
+				const uint32_t instanceCount = static_cast<uint32_t>(visibleInstances.size());
+				candidateDraws += group.instanceCount;
+				keptDraws += instanceCount;
+				if (instanceCount == 0)
+					continue;
+
+				// Paged geometry sits wherever its pages were allocated, otherwise every level is where it was placed in its index pool
+				const vkglTF::GeometryResidency::DrawRange placement = !resident ? residency->proxyRange(mesh, static_cast<uint32_t>(p))
+					: residency ? residency->primitiveRange(mesh, static_cast<uint32_t>(p), primitive->lod)
+					: vkglTF::GeometryResidency::DrawRange{ primitive->levelPoolFirstIndex(primitive->lod), primitive->poolVertexOffset() };
+
+				// Every pool has its own region of the draw buffer, the draws of a primitive are written to the one of its index size
+				uint32_t& count = primitive->shortIndices ? shortCount : wideCount;
+				const uint32_t regionFirstDraw = primitive->shortIndices ? 0 : maxShortDrawCount;
+				const uint32_t primitiveFirstDraw = count;
+				if (!resident) {
+					draws[regionFirstDraw + count++] = { vkglTF::GeometryResidency::proxyIndexCount, instanceCount, placement.firstIndex, placement.vertexOffset, firstInstance };
+					triangles += vkglTF::GeometryResidency::proxyIndexCount / 3 * instanceCount;
+				}
+				else if (primitive->lod > 0) {
+					// Simplified levels are small enough to draw whole
+					const vkglTF::Primitive::LOD& lod = primitive->lods[primitive->lod - 1];
+					draws[regionFirstDraw + count++] = { lod.indexCount, instanceCount, placement.firstIndex, placement.vertexOffset, firstInstance };
+					triangles += lod.indexCount / 3 * instanceCount;
+				}
+				else if (primitive->meshletCount == 0) {
+					draws[regionFirstDraw + count++] = { primitive->indexCount, instanceCount, placement.firstIndex, placement.vertexOffset, firstInstance };
+					triangles += primitive->indexCount / 3 * instanceCount;
+				}
+				else {
+					if (!frustumsReady) {
+						planes.resize(group.instanceCount);
+						cameraPositions.resize(group.instanceCount);
+						for (uint32_t i = 0; i < group.instanceCount; i++) {
+							const glm::mat4& modelView = modelViews[group.nodes[i]->index];
+							planes[i] = vkglTF::extractFrustumPlanes(uniformData.projection * modelView);
+							cameraPositions[i] = glm::vec3(glm::inverse(modelView)[3]);
+						}
+						frustumsReady = true;
+					}
+
+					for (uint32_t i = 0; i < primitive->meshletCount; i++) {
+						// The instances share the draws, so a meshlet stays as long as one of them sees it
+						const vkglTF::Meshlet& meshlet = scene->meshlets[primitive->firstMeshlet + i];
+						bool visible = false;
+						for (uint32_t k = 0; k < instanceCount && !visible; k++)
+							visible = vkglTF::isMeshletVisible(meshlet, planes[visibleInstances[k]], cameraPositions[visibleInstances[k]]);
+						if (!visible)
+							continue;
+
+						// Meshlets of a primitive are stored back to back, so neighbouring survivors merge into one draw
+						const uint32_t meshletFirstIndex = placement.firstIndex + (meshlet.firstIndex - primitive->firstIndex);
+						VkDrawIndexedIndirectCommand* previous = count > primitiveFirstDraw ? &draws[regionFirstDraw + count - 1] : nullptr;
+						if (previous && previous->firstIndex + previous->indexCount == meshletFirstIndex)
+							previous->indexCount += meshlet.indexCount;
+						else
+							draws[regionFirstDraw + count++] = { meshlet.indexCount, instanceCount, meshletFirstIndex, placement.vertexOffset, firstInstance };
+						triangles += meshlet.indexCount / 3 * instanceCount;
+					}
+				}
+
+				if (!occluded)
+					continue;
+
+				// All draws of the primitive share one range, the GPU appends the instances that pass its tests to it
+				const uint32_t range = occlusion->addRange(firstInstance);
+				for (uint32_t i = primitiveFirstDraw; i < count; i++) {
+					occlusion->setDrawRange(regionFirstDraw + i, range);
+				}
+				for (uint32_t k = 0; k < instanceCount; k++) {
+					const uint32_t node = group.nodes[visibleInstances[k]]->index;
+					occlusion->addCandidate(range, node, scene->bvh.firstItem(node) + static_cast<uint32_t>(p), material);
+				}
+			}
 		}
 
-		/*
-			Copy visibility data
-		*/
-		updateConditionalBuffer();
+		// Without a draw count the GPU walks the whole buffer, so the draws left over from the last frame are emptied
+		for (uint32_t i = shortCount; i < shortDrawCount; i++) {
+			draws[i] = {};
+		}
+		for (uint32_t i = wideCount; i < wideDrawCount; i++) {
+			draws[maxShortDrawCount + i] = {};
+		}
+		shortDrawCount = shortCount;
+		wideDrawCount = wideCount;
+		uint32_t* drawCounts = static_cast<uint32_t*>(drawCountBuffer.mapped);
+		drawCounts[0] = shortCount;
+		drawCounts[1] = wideCount;
+
+		drawnTriangles = static_cast<uint32_t>(triangles);
+		culledTriangleRatio = totalTriangles ? 1.0f - static_cast<float>(triangles) / totalTriangles : 0.0f;
+		culledDrawRatio = candidateDraws ? 1.0f - static_cast<float>(keptDraws) / candidateDraws : 0.0f;
+
+		// Same space as the BVH boxes, like the frustum the tree was culled against
+		if (occluded)
+			occlusion->endFrame(uniformData.projection * uniformData.view * uniformData.model, shortCount, wideCount, triangles);
 	}
 
-	void Voortman3D::updateConditionalBuffer() {
-		memcpy(conditionalBuffer.mapped, &conditionalVisibility[0], sizeof(VkBool32) * conditionalVisibility.size());
+	bool Voortman3D::occlusionActive() const noexcept {
+		return occlusion && occlusionCulling && scene && occlusion->hasBuffers() && width > 0 && height > 0;
 	}
 
-	void Voortman3D::updateUniformBuffers()
-	{
-		uniformData.projection = camera.matrices.perspective;
-		uniformData.view = glm::scale(camera.matrices.view, glm::vec3(0.1f, -0.1f, 0.1f));
-		uniformData.model = scene.linearNodes[0]->getMatrix();
-		memcpy(uniformBuffer.mapped, &uniformData, sizeof(UniformData));
+	void Voortman3D::prepareOcclusion() {
+		if (!vkglTF::OcclusionCulling::isSupported(physicalDevice, enabledFeatures, depthFormat)) _UNLIKELY {
+			std::cerr << "Occlusion culling is not supported by this device, only the BVH culls the scene\n";
+			return;
+		}
+
+		// Load shaders from resource
+		const HRSRC cullResource = FindResource(GetModuleHandle(nullptr), MAKEINTRESOURCE(IDR_OCCLUSION_COMPUTE), L"Shader");
+		const HRSRC pyramidResource = FindResource(GetModuleHandle(nullptr), MAKEINTRESOURCE(IDR_DEPTH_PYRAMID_COMPUTE), L"Shader");
+
+		assert(cullResource);
+		assert(pyramidResource);
+
+#pragma warning(disable:6387)
+		const HGLOBAL cullData = LoadResource(GetModuleHandle(nullptr), cullResource);
+		const HGLOBAL pyramidData = LoadResource(GetModuleHandle(nullptr), pyramidResource);
+
+		const vkglTF::OcclusionCulling::Shaders shaders = {
+			loadShader(VK_SHADER_STAGE_COMPUTE_BIT, LockResource(cullData), SizeofResource(GetModuleHandle(nullptr), cullResource)),
+			loadShader(VK_SHADER_STAGE_COMPUTE_BIT, LockResource(pyramidData), SizeofResource(GetModuleHandle(nullptr), pyramidResource))
+		};
+#pragma warning(default:6387)
+		occlusion = new vkglTF::OcclusionCulling(vulkanDevice, pipelineCache, shaders);
+
+		// Same attachments as the render pass of the core, but it keeps what the early pass drew and presents the result
+		std::array<VkAttachmentDescription, 2> attachments = {};
+		attachments[0].format = swapChain.colorFormat;
+		attachments[0].samples = VK_SAMPLE_COUNT_1_BIT;
+		attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+		attachments[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+		attachments[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+		attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		attachments[0].initialLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+		attachments[0].finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+		attachments[1].format = depthFormat;
+		attachments[1].samples = VK_SAMPLE_COUNT_1_BIT;
+		attachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+		attachments[1].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+		attachments[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+		attachments[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		attachments[1].initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+		attachments[1].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+		constexpr VkAttachmentReference colorReference = { 0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL };
+		constexpr VkAttachmentReference depthReference = { 1, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL };
+
+		VkSubpassDescription subpassDescription = {};
+		subpassDescription.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+		subpassDescription.colorAttachmentCount = 1;
+		subpassDescription.pColorAttachments = &colorReference;
+		subpassDescription.pDepthStencilAttachment = &depthReference;
+
+		// The depth buffer is handed over by explicit barriers, only the color writes of the early pass have to be waited on
+		VkSubpassDependency dependency = {};
+		dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+		dependency.dstSubpass = 0;
+		dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+		dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+		dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_READ_BIT;
+
+		VkRenderPassCreateInfo renderPassCI = Initializers::renderPassCreateInfo();
+		renderPassCI.attachmentCount = static_cast<uint32_t>(attachments.size());
+		renderPassCI.pAttachments = attachments.data();
+		renderPassCI.subpassCount = 1;
+		renderPassCI.pSubpasses = &subpassDescription;
+		renderPassCI.dependencyCount = 1;
+		renderPassCI.pDependencies = &dependency;
+		VK_CHECK_RESULT(vkCreateRenderPass(device, &renderPassCI, nullptr, &occlusionRenderPass));
+	}
+
+	void Voortman3D::setupDepthStencil() {
+		Voortman3DCore::setupDepthStencil();
+		// The pyramid follows the size of the depth buffer and samples it, so both are recreated on the next command buffer build
+		if (occlusion)
+			occlusion->destroyPyramid();
 	}
 
 	void Voortman3D::renderFrame() {
@@ -462,11 +1041,30 @@ namespace Voortman3D {
 
 	void Voortman3D::prepare() {
 		Voortman3DCore::prepare();
+		// With descriptor indexing a model may have as many textures as the device can bind in update after bind sets
+		if (enabledFeatures12.descriptorBindingPartiallyBound && enabledFeatures12.descriptorBindingSampledImageUpdateAfterBind) {
+			VkPhysicalDeviceVulkan12Properties properties12{};
+			properties12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_PROPERTIES;
+			VkPhysicalDeviceProperties2 properties2{};
+			properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+			properties2.pNext = &properties12;
+			vkGetPhysicalDeviceProperties2(physicalDevice, &properties2);
+			const uint32_t slotCount = (std::min)({ vkglTF::maxBindlessTextures,
+				properties12.maxPerStageDescriptorUpdateAfterBindSampledImages, properties12.maxPerStageDescriptorUpdateAfterBindSamplers,
+				properties12.maxDescriptorSetUpdateAfterBindSampledImages, properties12.maxDescriptorSetUpdateAfterBindSamplers });
+			if (slotCount > vkglTF::maxTextures) _LIKELY
+				vkglTF::enableBindlessTextures(slotCount);
+		}
+		// Shared by every model, the pipeline layout needs them before the first model has loaded
+		vkglTF::createDescriptorSetLayouts(device);
+		vkglTF::createDefaultTexture(vulkanDevice);
+		modelLoader = new vkglTF::ModelLoader(vulkanDevice);
+		modelReloader = new vkglTF::ModelReloader(vulkanDevice);
 		loadAssets("C:/Git/Voortman3D/Dependencies/chinesedragon.gltf");
-		prepareConditionalRendering();
 		prepareUniformBuffers();
 		setupDescriptors();
 		preparePipelines();
+		prepareOcclusion();
 		buildCommandBuffers();
 		TwinCATPreperation();
 		prepared = true;
@@ -480,10 +1078,66 @@ namespace Voortman3D {
 		Voortman3DCore::submitFrame();
 	}
 
+	void Voortman3D::updatePicking() {
+		// Further than this in pixels and the press rotated the camera
+		constexpr float maxClickDistance = 3.0f;
+
+		if (mouseButtons.left && !picking.pressed) {
+			picking.pressed = true;
+			picking.pressOnScene = !(uiOverlay.visible && ImGui::GetIO().WantCaptureMouse);
+			picking.pressPosition = mousePos;
+		}
+		else if (!mouseButtons.left && picking.pressed) {
+			picking.pressed = false;
+			if (picking.pressOnScene && glm::distance(mousePos, picking.pressPosition) <= maxClickDistance)
+				pickNode(mousePos);
+		}
+	}
+
+	void Voortman3D::pickNode(const glm::vec2& position) {
+		if (!scene) _UNLIKELY
+			return;
+
+		const auto start = std::chrono::high_resolution_clock::now();
+
+		// The cursor unprojected at the near and the far plane with the camera matrices the scene is drawn with, which ends up in the space of the world matrices
+		const glm::mat4 inverse = glm::inverse(uniformData.projection * uniformData.view * uniformData.model);
+		const glm::vec2 ndc = position / glm::vec2(static_cast<float>(width), static_cast<float>(height)) * 2.0f - 1.0f;
+		const glm::vec4 nearPoint = inverse * glm::vec4(ndc, 0.0f, 1.0f);
+		const glm::vec4 farPoint = inverse * glm::vec4(ndc, 1.0f, 1.0f);
+		const glm::vec3 origin = glm::vec3(nearPoint) / nearPoint.w;
+		const glm::vec3 direction = glm::vec3(farPoint) / farPoint.w - origin;
+
+		// Hidden nodes are not drawn, so the ray passes through them
+		picking.hit = scene->pick(origin, direction, nodeVisibility);
+		picking.time = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		picking.picked = true;
+
+		if (picking.hit.node != vkglTF::Model::Hierarchy::none) {
+			selectedNode = picking.hit.node;
+			picking.revealSelection = true;
+		}
+	}
+
 	void Voortman3D::render() {
 		if (!prepared)
 			return;
+		updateModelLoading();
+		// Only the subtrees of nodes that were moved since the last frame are recomputed
+		if (scene)
+			scene->updateDirtyWorldMatrices();
 		updateUniformBuffers();
+		updateModelViews();
+		// Levels, culling and visibility all end up in the indirect draws, so the recorded command buffers stay as they are
+		updateLODSelection();
+		cullScene();
+		// After culling, which refits the BVH to the nodes that moved
+		updatePicking();
+		// Requests the meshes that survived culling, a mesh that is paged in is drawn from the next frame on
+		updateResidency();
+		updateDraws();
+		if (!enabledFeatures.drawIndirectFirstInstance) _UNLIKELY
+			buildCommandBuffers();
 		draw();
 	}
 }
\ No newline at end of file
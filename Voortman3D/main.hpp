@@ -2,6 +2,11 @@
 #include "Voortman3DCore.hpp"
 #include "resource.h"
 #include "VulkanglTFModel.hpp"
+#include "VulkanglTFMeshlet.hpp"
+#include "VulkanglTFLoader.hpp"
+#include "VulkanglTFReload.hpp"
+#include "VulkanglTFOcclusion.hpp"
+#include "BatchMath.hpp"
 #include "TwinCATConnection.hpp"
 #include "commdlg.h"
 
@@ -15,13 +20,54 @@ namespace Voortman3D {
 
 		~Voortman3D();
 
-		PFN_vkCmdBeginConditionalRenderingEXT vkCmdBeginConditionalRenderingEXT{};
-		PFN_vkCmdEndConditionalRenderingEXT vkCmdEndConditionalRenderingEXT{};
-
-		vkglTF::Model scene;
+		// Null until the loader has the first model ready, replaced as a whole when another model finishes loading
+		vkglTF::Model* scene{};
+		vkglTF::ModelLoader* modelLoader{};
+		// Applies changes to the files of the scene while it stays on screen
+		vkglTF::ModelReloader* modelReloader{};
+		// File of the scene and of the model that is loading, a reload of the same file keeps the visibility and selection of its nodes
+		std::string modelPath;
+		std::string loadingPath;
+		// Meshes are hashed so a changed file can be diffed against the scene
+		static constexpr uint32_t fileLoadingFlags = vkglTF::FileLoadingFlags::OptimizeMeshes | vkglTF::FileLoadingFlags::GenerateLODs |
+			vkglTF::FileLoadingFlags::GenerateMeshlets | vkglTF::FileLoadingFlags::HashMeshes;
 
 		bool wireframe = false;
 
+		// View * model * world matrix of every node indexed by Node::index, computed in one batch per frame for level of detail selection and culling
+		std::vector<glm::mat4> modelViews;
+
+		// Largest error in pixels a simplified level of detail may show on screen
+		float lodPixelError{ 1.0f };
+		uint32_t drawnTriangles{};
+
+		// Indirect draws of the whole scene, rewritten every frame with the levels and meshlet ranges that survive culling.
+		// Draws from the 16-bit index pool come first, the ones from the 32-bit pool start at maxShortDrawCount
+		Buffer drawBuffer{};
+		// Count of the draws of both pools
+		Buffer drawCountBuffer{};
+		uint32_t maxShortDrawCount{};
+		uint32_t maxDrawCount{};
+		uint32_t shortDrawCount{};
+		uint32_t wideDrawCount{};
+		float culledTriangleRatio{};
+
+		// Result of culling the BVH of the scene, indexed by BVH item
+		std::vector<uint8_t> visibleItems;
+		float culledDrawRatio{};
+		float cullTime{};
+
+		/*
+			Two phase occlusion culling: the instances that were visible last frame are drawn first, their depth is reduced to a
+			pyramid and the remaining instances are tested against it on the GPU before the ones that became visible are drawn
+		*/
+		bool occlusionCulling{ true };
+		float occlusionCulledRatio{};
+		// Null when the device can't run it, only the BVH culls the scene then
+		vkglTF::OcclusionCulling* occlusion{};
+		// Continues the frame the regular render pass started, the UI is drawn in here
+		VkRenderPass occlusionRenderPass{ VK_NULL_HANDLE };
+
 		// Value that will be read from TwinCAT
 		float sawHeight{};
 
@@ -36,8 +82,26 @@ namespace Voortman3D {
 		} uniformData{};
 		Buffer uniformBuffer{};
 
-		std::vector<VkBool32> conditionalVisibility{};
-		Buffer conditionalBuffer{};
+		// Indexed by Node::index, hidden nodes are left out of the instances
+		std::vector<uint8_t> nodeVisibility{};
+
+		// Node selected in the tree, either by clicking it there or by picking it in the scene
+		uint32_t selectedNode{ vkglTF::Model::Hierarchy::none };
+
+		/*
+			Left clicks on the scene cast a ray from the cursor, a press that dragged the camera around is not a click
+		*/
+		struct Picking {
+			vkglTF::Model::PickResult hit{};
+			float time{};
+			bool picked{};
+			bool pressed{};
+			// False when the press went to the UI
+			bool pressOnScene{};
+			glm::vec2 pressPosition{};
+			// Set by a pick, the tree opens up to the selection and scrolls to it once
+			bool revealSelection{};
+		} picking;
 
 		VkPipelineLayout pipelineLayout{ VK_NULL_HANDLE };
 
@@ -53,21 +117,36 @@ namespace Voortman3D {
 
 		void RenderChildNodesInUI(vkglTF::Node* node);
 
-		void renderNode(const vkglTF::Node* node, const VkCommandBuffer commandBuffer);
+		void drawScene(const VkCommandBuffer commandBuffer, const Buffer& draws);
+		void drawRegion(const VkCommandBuffer commandBuffer, const Buffer& draws, uint32_t firstDraw, uint32_t maxCount, uint32_t count, VkDeviceSize countOffset);
+		void bindScene(const VkCommandBuffer commandBuffer, const VkDescriptorSet nodeSet);
 
 		void loadAssets(const std::string& FilePath);
+		void updateModelLoading();
+		void setScene(vkglTF::Model* model);
+		void prepareSceneBuffers();
 		void prepareUniformBuffers();
 		void setupDescriptors();
 		void preparePipelines();
 		void updateUniformBuffers();
+		void updateModelViews();
+		void updateLODSelection();
+		void prepareDrawBuffers();
+		void cullScene();
+		void updateResidency();
+		void updatePicking();
+		void pickNode(const glm::vec2& position);
+		void updateDraws();
+		void prepareOcclusion();
+		_NODISCARD bool occlusionActive() const noexcept;
 		void renderFrame();
-		void updateConditionalBuffer();
-		void prepareConditionalRendering();
+		void updateInstances();
 		void TwinCATPreperation();
 		void draw();
 		void OpenFileDialog();
 
 		void buildCommandBuffers()                   override;
+		void setupDepthStencil()                     override;
 		void OnUpdateUIOverlay(UIOverlay* uioverlay) override;
 		void prepare()                               override;
 		void GetEnabledFeatures()                    override;
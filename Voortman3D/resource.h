@@ -5,12 +5,14 @@
 #define IDI_ICON1                       101
 #define IDR_MODEL_FRAGMENT              102
 #define IDR_MODEL_VERTEX                103
+#define IDR_DEPTH_PYRAMID_COMPUTE       106
+#define IDR_OCCLUSION_COMPUTE           107
 
 // Next default values for new objects
 // 
 #ifdef APSTUDIO_INVOKED
 #ifndef APSTUDIO_READONLY_SYMBOLS
-#define _APS_NEXT_RESOURCE_VALUE        106
+#define _APS_NEXT_RESOURCE_VALUE        108
 #define _APS_NEXT_COMMAND_VALUE         40001
 #define _APS_NEXT_CONTROL_VALUE         1001
 #define _APS_NEXT_SYMED_VALUE           101
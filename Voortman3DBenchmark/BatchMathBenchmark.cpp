@@ -0,0 +1,72 @@
+/*
+* Batched math benchmark
+*
+* Times the BatchMath kernels against glm from 1k to 1M matrices for every instruction set the CPU supports
+*/
+
+#include "BatchMathBenchmark.hpp"
+#include "BatchMath.hpp"
+
+#include <random>
+
+namespace Voortman3D {
+	using BatchMath::InstructionSet;
+
+	void BatchMathBenchmark::run() {
+		const InstructionSet previous = BatchMath::getInstructionSet();
+		std::vector<InstructionSet> instructionSets = { InstructionSet::Scalar, InstructionSet::SSE };
+		if (BatchMath::getSupportedInstructionSet() == InstructionSet::AVX2)
+			instructionSets.push_back(InstructionSet::AVX2);
+		const char* names[] = { "glm", "SSE", "AVX2" };
+
+		std::mt19937 random(1);
+		std::uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+		// Keeps the results alive so the compiler cannot drop the work
+		volatile float sink = 0.0f;
+
+		// Runs each case long enough to not measure the clock, reported in nanoseconds per matrix
+		const auto measure = [](size_t count, const std::function<void()>& run) {
+			const size_t repetitions = (std::max)(size_t(1), size_t(1 << 22) / count);
+			run();
+			const auto start = std::chrono::high_resolution_clock::now();
+			for (size_t i = 0; i < repetitions; i++)
+				run();
+			const std::chrono::duration<double, std::nano> elapsed = std::chrono::high_resolution_clock::now() - start;
+			return elapsed.count() / static_cast<double>(repetitions * count);
+		};
+
+		std::cout << "Batched math, nanoseconds per matrix" << std::endl;
+		for (size_t count = 1000; count <= 1000000; count *= 10) {
+			std::vector<glm::mat4> left(count), right(count), result(count);
+			std::vector<uint32_t> parents(count);
+			std::vector<const glm::mat4*> boxMatrices(count);
+			BatchMath::BoundsSoA bounds;
+			for (size_t i = 0; i < count; i++) {
+				for (uint32_t c = 0; c < 4; c++) {
+					left[i][c] = glm::vec4(distribution(random), distribution(random), distribution(random), distribution(random));
+					right[i][c] = glm::vec4(distribution(random), distribution(random), distribution(random), distribution(random));
+				}
+				// Assemblies of eight parts, the same shape the hierarchy of a machine has
+				parents[i] = i == 0 ? UINT32_MAX : static_cast<uint32_t>((i - 1) / 8);
+				boxMatrices[i] = &left[i];
+				const glm::vec3 center(distribution(random), distribution(random), distribution(random));
+				bounds.push_back(center - 0.1f, center + 0.1f);
+			}
+
+			for (InstructionSet instructionSet : instructionSets) {
+				BatchMath::setInstructionSet(instructionSet);
+				glm::vec3 min(FLT_MAX), max(-FLT_MAX);
+				const double pairs = measure(count, [&] { BatchMath::multiply(left.data(), right.data(), result.data(), count); });
+				const double broadcast = measure(count, [&] { BatchMath::multiply(left[0], right.data(), result.data(), count); });
+				const double hierarchy = measure(count, [&] { BatchMath::multiplyHierarchy(parents.data(), left.data(), result.data(), 0, static_cast<uint32_t>(count), UINT32_MAX); });
+				const double boxes = measure(count, [&] { BatchMath::mergeTransformedBounds(boxMatrices.data(), bounds, min, max); });
+				sink = sink + result[count - 1][3][3] + min.x + max.x;
+
+				std::cout << std::setw(8) << count << " " << std::setw(4) << names[static_cast<size_t>(instructionSet)] << std::fixed << std::setprecision(2)
+					<< " | pairs " << pairs << " | broadcast " << broadcast << " | hierarchy " << hierarchy << " | bounds " << boxes << std::endl;
+			}
+		}
+
+		BatchMath::setInstructionSet(previous);
+	}
+}
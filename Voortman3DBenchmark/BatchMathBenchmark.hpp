@@ -0,0 +1,15 @@
+/*
+* Batched math benchmark
+*
+* Times the BatchMath kernels against glm from 1k to 1M matrices for every instruction set the CPU supports
+*/
+
+#pragma once
+#include "pch.hpp"
+
+namespace Voortman3D {
+	namespace BatchMathBenchmark {
+		/** @brief Run all cases and print nanoseconds per matrix to stdout */
+		void run();
+	}
+}
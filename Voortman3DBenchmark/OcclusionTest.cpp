@@ -0,0 +1,572 @@
+/*
+* Occlusion culling test
+*
+* Runs the two phase occlusion culling of the viewer without a window on a generated interior view, see OcclusionTest.hpp
+*/
+
+#include "OcclusionTest.hpp"
+#include "VulkanUploader.hpp"
+#include "VulkanglTFMeshlet.hpp"
+#include "Tools.hpp"
+
+#include <filesystem>
+#include <fstream>
+
+namespace Voortman3D {
+	namespace {
+		constexpr VkFormat colorFormat = VK_FORMAT_R8G8B8A8_UNORM;
+
+		// Walls of the housing are ten units wide, the camera sits in its center
+		constexpr float housingSize = 10.0f;
+		// Every face of a part is a grid of quads, so a part has 6 * 2 * partGrid^2 triangles
+		constexpr uint32_t partGrid = 8;
+		constexpr uint32_t partTriangles = 6 * 2 * partGrid * partGrid;
+		// Parts in front of the camera inside the housing, all of them have to be drawn
+		constexpr uint32_t insideParts = 3;
+		// Layers of parts behind the front wall, all of them are hidden
+		constexpr uint32_t hiddenLayers = 2;
+		constexpr uint32_t hiddenParts = 16;
+	}
+
+	OcclusionTest::OcclusionTest(VulkanDevice* device, VkQueue queue, VkPipelineCache pipelineCache, VkFormat depthFormat, const VkPhysicalDeviceFeatures& features)
+		: device(device), queue(queue), pipelineCache(pipelineCache), depthFormat(depthFormat), features(features) {
+	}
+
+	OcclusionTest::~OcclusionTest() {
+		const VkDevice logicalDevice = device->logicalDevice;
+		VK_CHECK_RESULT(vkQueueWaitIdle(queue));
+
+		if (occlusion)
+			delete occlusion;
+		uniformBuffer.destroy();
+		drawBuffer.destroy();
+
+		if (pipeline)
+			vkDestroyPipeline(logicalDevice, pipeline, nullptr);
+		if (pipelineLayout)
+			vkDestroyPipelineLayout(logicalDevice, pipelineLayout, nullptr);
+		if (uniformSetLayout)
+			vkDestroyDescriptorSetLayout(logicalDevice, uniformSetLayout, nullptr);
+		if (descriptorPool)
+			vkDestroyDescriptorPool(logicalDevice, descriptorPool, nullptr);
+		for (VkRenderPass handle : { earlyRenderPass, lateRenderPass }) {
+			if (handle)
+				vkDestroyRenderPass(logicalDevice, handle, nullptr);
+		}
+		if (framebuffer)
+			vkDestroyFramebuffer(logicalDevice, framebuffer, nullptr);
+
+		for (VkImageView view : { colorView, depthAttachmentView }) {
+			if (view)
+				vkDestroyImageView(logicalDevice, view, nullptr);
+		}
+		if (colorImage) {
+			vkDestroyImage(logicalDevice, colorImage, nullptr);
+			device->freeMemory(colorMemory);
+		}
+		if (depthImage) {
+			vkDestroyImage(logicalDevice, depthImage, nullptr);
+			device->freeMemory(depthMemory);
+		}
+
+		if (scene)
+			delete scene;
+	}
+
+	bool OcclusionTest::generateScene(const std::string& filename) {
+		// A quad for the walls and a cube with subdivided faces for the parts, both centered on the origin
+		std::vector<glm::vec3> positions, normals;
+		std::vector<glm::vec2> texcoords;
+		std::vector<uint32_t> indices;
+		const auto addFace = [&](const glm::vec3& normal, const glm::vec3& tangent, const glm::vec3& bitangent, uint32_t grid) {
+			const uint32_t first = static_cast<uint32_t>(positions.size());
+			for (uint32_t y = 0; y <= grid; y++) {
+				for (uint32_t x = 0; x <= grid; x++) {
+					const glm::vec2 uv(static_cast<float>(x) / grid, static_cast<float>(y) / grid);
+					positions.push_back(normal * 0.5f + tangent * (uv.x - 0.5f) + bitangent * (uv.y - 0.5f));
+					normals.push_back(normal);
+					texcoords.push_back(uv);
+				}
+			}
+			for (uint32_t y = 0; y < grid; y++) {
+				for (uint32_t x = 0; x < grid; x++) {
+					const uint32_t corner = first + y * (grid + 1) + x;
+					indices.insert(indices.end(), { corner, corner + 1, corner + grid + 2, corner, corner + grid + 2, corner + grid + 1 });
+				}
+			}
+		};
+
+		addFace(glm::vec3(0.0f), glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f), 1);
+		const uint32_t wallVertices = static_cast<uint32_t>(positions.size());
+		const uint32_t wallIndices = static_cast<uint32_t>(indices.size());
+		for (int axis = 0; axis < 3; axis++) {
+			for (float sign : { 1.0f, -1.0f }) {
+				glm::vec3 normal(0.0f), tangent(0.0f), bitangent(0.0f);
+				normal[axis] = sign;
+				tangent[(axis + 1) % 3] = sign;
+				bitangent[(axis + 2) % 3] = 1.0f;
+				addFace(normal, tangent, bitangent, partGrid);
+			}
+		}
+		const uint32_t partVertices = static_cast<uint32_t>(positions.size()) - wallVertices;
+		const uint32_t partIndices = static_cast<uint32_t>(indices.size()) - wallIndices;
+
+		// Indices of the parts are relative to their own first vertex
+		for (uint32_t i = wallIndices; i < indices.size(); i++)
+			indices[i] -= wallVertices;
+
+		// One view per attribute and mesh, the walls come first
+		const struct {
+			size_t offset;
+			size_t size;
+		} views[] = {
+			{ 0, wallVertices * sizeof(glm::vec3) },
+			{ 0, wallVertices * sizeof(glm::vec3) },
+			{ 0, wallVertices * sizeof(glm::vec2) },
+			{ 0, wallIndices * sizeof(uint32_t) },
+			{ wallVertices * sizeof(glm::vec3), partVertices * sizeof(glm::vec3) },
+			{ wallVertices * sizeof(glm::vec3), partVertices * sizeof(glm::vec3) },
+			{ wallVertices * sizeof(glm::vec2), partVertices * sizeof(glm::vec2) },
+			{ wallIndices * sizeof(uint32_t), partIndices * sizeof(uint32_t) },
+		};
+		const std::array<const uint8_t*, 4> blocks = {
+			reinterpret_cast<const uint8_t*>(positions.data()), reinterpret_cast<const uint8_t*>(normals.data()),
+			reinterpret_cast<const uint8_t*>(texcoords.data()), reinterpret_cast<const uint8_t*>(indices.data())
+		};
+
+		std::filesystem::path binaryPath(filename);
+		binaryPath.replace_extension(".bin");
+		std::ofstream binary(binaryPath, std::ios::binary);
+		size_t bufferSize = 0;
+		for (size_t view = 0; view < std::size(views); view++) {
+			binary.write(reinterpret_cast<const char*>(blocks[view % 4] + views[view].offset), static_cast<std::streamsize>(views[view].size));
+			bufferSize += views[view].size;
+		}
+		if (!binary) _UNLIKELY {
+			std::cerr << "Could not write \"" + binaryPath.string() + "\"\n";
+			return false;
+		}
+
+		const auto vector = [](const glm::vec3& v) { return "[" + std::to_string(v.x) + "," + std::to_string(v.y) + "," + std::to_string(v.z) + "]"; };
+		const auto quaternion = [](const glm::quat& q) { return "[" + std::to_string(q.x) + "," + std::to_string(q.y) + "," + std::to_string(q.z) + "," + std::to_string(q.w) + "]"; };
+
+		// The housing, its walls face the camera in the center
+		std::vector<std::string> nodes;
+		for (int axis = 0; axis < 3; axis++) {
+			for (float sign : { 1.0f, -1.0f }) {
+				glm::vec3 translation(0.0f);
+				translation[axis] = sign * housingSize * 0.5f;
+				// Turns the quad from facing +z to facing the center, a half turn about y for the wall in front
+				glm::quat rotation(0.0f, 0.0f, 1.0f, 0.0f);
+				if (axis == 0)
+					rotation = glm::quat(0.7071068f, 0.0f, -sign * 0.7071068f, 0.0f);
+				else if (axis == 1)
+					rotation = glm::quat(0.7071068f, sign * 0.7071068f, 0.0f, 0.0f);
+				else if (sign < 0.0f)
+					rotation = glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+				nodes.push_back("{\"mesh\":0,\"translation\":" + vector(translation) + ",\"rotation\":" + quaternion(rotation) + ",\"scale\":" + vector(glm::vec3(housingSize, housingSize, 1.0f)) + "}");
+			}
+		}
+		// Parts inside the housing in front of the camera, then layers of them behind the front wall
+		for (uint32_t y = 0; y < insideParts; y++) {
+			for (uint32_t x = 0; x < insideParts; x++) {
+				const glm::vec3 translation(static_cast<float>(x) - (insideParts - 1) * 0.5f, static_cast<float>(y) - (insideParts - 1) * 0.5f, housingSize * 0.3f);
+				nodes.push_back("{\"mesh\":1,\"translation\":" + vector(translation) + ",\"scale\":[0.5,0.5,0.5]}");
+			}
+		}
+		for (uint32_t layer = 0; layer < hiddenLayers; layer++) {
+			for (uint32_t y = 0; y < hiddenParts; y++) {
+				for (uint32_t x = 0; x < hiddenParts; x++) {
+					const glm::vec3 translation(static_cast<float>(x) - (hiddenParts - 1) * 0.5f, static_cast<float>(y) - (hiddenParts - 1) * 0.5f, housingSize * (0.8f + 0.2f * layer));
+					nodes.push_back("{\"mesh\":1,\"translation\":" + vector(translation) + ",\"scale\":[0.5,0.5,0.5]}");
+				}
+			}
+		}
+
+		std::string gltf = "{\"asset\":{\"version\":\"2.0\",\"generator\":\"Voortman3D occlusion test\"},\"scene\":0,\"scenes\":[{\"nodes\":[0]}],\"nodes\":[{\"children\":[";
+		for (size_t node = 0; node < nodes.size(); node++)
+			gltf += (node > 0 ? "," : "") + std::to_string(node + 1);
+		gltf += "]}";
+		for (const std::string& node : nodes)
+			gltf += "," + node;
+		gltf += "],\"meshes\":[{\"primitives\":[{\"attributes\":{\"POSITION\":0,\"NORMAL\":1,\"TEXCOORD_0\":2},\"indices\":3}]},"
+			"{\"primitives\":[{\"attributes\":{\"POSITION\":4,\"NORMAL\":5,\"TEXCOORD_0\":6},\"indices\":7}]}],\"accessors\":[";
+		for (uint32_t mesh = 0; mesh < 2; mesh++) {
+			const std::string count = std::to_string(mesh == 0 ? wallVertices : partVertices);
+			const std::string first = std::to_string(mesh * 4);
+			const std::string depth = mesh == 0 ? "0" : "0.5";
+			gltf += std::string(mesh > 0 ? "," : "")
+				+ "{\"bufferView\":" + first + ",\"componentType\":5126,\"count\":" + count + ",\"type\":\"VEC3\",\"min\":[-0.5,-0.5,-" + depth + "],\"max\":[0.5,0.5," + depth + "]},"
+				+ "{\"bufferView\":" + std::to_string(mesh * 4 + 1) + ",\"componentType\":5126,\"count\":" + count + ",\"type\":\"VEC3\"},"
+				+ "{\"bufferView\":" + std::to_string(mesh * 4 + 2) + ",\"componentType\":5126,\"count\":" + count + ",\"type\":\"VEC2\"},"
+				+ "{\"bufferView\":" + std::to_string(mesh * 4 + 3) + ",\"componentType\":5125,\"count\":" + std::to_string(mesh == 0 ? wallIndices : partIndices) + ",\"type\":\"SCALAR\"}";
+		}
+		gltf += "],\"bufferViews\":[";
+		size_t viewOffset = 0;
+		for (size_t view = 0; view < std::size(views); view++) {
+			gltf += std::string(view > 0 ? "," : "") + "{\"buffer\":0,\"byteOffset\":" + std::to_string(viewOffset) + ",\"byteLength\":" + std::to_string(views[view].size)
+				+ ",\"target\":" + (view % 4 == 3 ? "34963" : "34962") + "}";
+			viewOffset += views[view].size;
+		}
+		gltf += "],\"buffers\":[{\"byteLength\":" + std::to_string(bufferSize) + ",\"uri\":\"" + binaryPath.filename().string() + "\"}]}";
+
+		std::ofstream file(filename, std::ios::binary);
+		file.write(gltf.data(), static_cast<std::streamsize>(gltf.size()));
+		if (!file) _UNLIKELY {
+			std::cerr << "Could not write \"" + filename + "\"\n";
+			return false;
+		}
+		return true;
+	}
+
+	void OcclusionTest::prepareBuffers() {
+		// No levels or meshlets, so every primitive takes a single draw
+		for (const vkglTF::Model::InstanceGroup& group : scene->instanceGroups) {
+			for (const vkglTF::Primitive* primitive : group.mesh->primitives) {
+				maxDrawCount++;
+				if (primitive->shortIndices)
+					maxShortDrawCount++;
+			}
+		}
+
+		constexpr VkMemoryPropertyFlags hostVisible = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+		VK_CHECK_RESULT(device->createBuffer(VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, hostVisible, &uniformBuffer, sizeof(UniformData)));
+		VK_CHECK_RESULT(uniformBuffer.map());
+		VK_CHECK_RESULT(device->createBuffer(VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, hostVisible, &drawBuffer, sizeof(VkDrawIndexedIndirectCommand) * maxDrawCount));
+		VK_CHECK_RESULT(drawBuffer.map());
+		memset(drawBuffer.mapped, 0, sizeof(VkDrawIndexedIndirectCommand) * maxDrawCount);
+
+		occlusion->prepareBuffers(scene, drawBuffer, maxDrawCount, maxShortDrawCount);
+	}
+
+	void OcclusionTest::prepareTargets() {
+		const VkDevice logicalDevice = device->logicalDevice;
+
+		VkImageCreateInfo imageCI = Initializers::imageCreateInfo();
+		imageCI.imageType = VK_IMAGE_TYPE_2D;
+		imageCI.format = colorFormat;
+		imageCI.extent = { width, height, 1 };
+		imageCI.mipLevels = 1;
+		imageCI.arrayLayers = 1;
+		imageCI.samples = VK_SAMPLE_COUNT_1_BIT;
+		imageCI.tiling = VK_IMAGE_TILING_OPTIMAL;
+		imageCI.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+		imageCI.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		VK_CHECK_RESULT(vkCreateImage(logicalDevice, &imageCI, nullptr, &colorImage));
+		VK_CHECK_RESULT(device->allocateImageMemory(colorImage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &colorMemory));
+
+		// Sampled for the first level of the pyramid like the depth buffer of the core
+		imageCI.format = depthFormat;
+		imageCI.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+		VK_CHECK_RESULT(vkCreateImage(logicalDevice, &imageCI, nullptr, &depthImage));
+		VK_CHECK_RESULT(device->allocateImageMemory(depthImage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &depthMemory));
+
+		VkImageViewCreateInfo viewCI = Initializers::imageViewCreateInfo();
+		viewCI.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		viewCI.format = colorFormat;
+		viewCI.image = colorImage;
+		viewCI.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+		VK_CHECK_RESULT(vkCreateImageView(logicalDevice, &viewCI, nullptr, &colorView));
+
+		viewCI.format = depthFormat;
+		viewCI.image = depthImage;
+		viewCI.subresourceRange = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1 };
+		if (Tools::formatHasStencil(depthFormat))
+			viewCI.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
+		VK_CHECK_RESULT(vkCreateImageView(logicalDevice, &viewCI, nullptr, &depthAttachmentView));
+
+		// The early pass clears both targets, the late pass draws on top of it
+		std::array<VkAttachmentDescription, 2> attachments = {};
+		attachments[0].format = colorFormat;
+		attachments[0].samples = VK_SAMPLE_COUNT_1_BIT;
+		attachments[0].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+		attachments[0].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+		attachments[0].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+		attachments[0].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		attachments[0].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		attachments[0].finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+		attachments[1].format = depthFormat;
+		attachments[1].samples = VK_SAMPLE_COUNT_1_BIT;
+		attachments[1].loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+		attachments[1].storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+		attachments[1].stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+		attachments[1].stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+		attachments[1].initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		attachments[1].finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+		constexpr VkAttachmentReference colorReference = { 0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL };
+		constexpr VkAttachmentReference depthReference = { 1, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL };
+
+		VkSubpassDescription subpassDescription = {};
+		subpassDescription.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+		subpassDescription.colorAttachmentCount = 1;
+		subpassDescription.pColorAttachments = &colorReference;
+		subpassDescription.pDepthStencilAttachment = &depthReference;
+
+		// Frames are waited on one by one, the depth buffer is handed over to the pyramid by explicit barriers
+		VkSubpassDependency dependency = {};
+		dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
+		dependency.dstSubpass = 0;
+		dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+		dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+		dependency.srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+		dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT | VK_ACCESS_COLOR_ATTACHMENT_READ_BIT;
+
+		VkRenderPassCreateInfo renderPassCI = Initializers::renderPassCreateInfo();
+		renderPassCI.attachmentCount = static_cast<uint32_t>(attachments.size());
+		renderPassCI.pAttachments = attachments.data();
+		renderPassCI.subpassCount = 1;
+		renderPassCI.pSubpasses = &subpassDescription;
+		renderPassCI.dependencyCount = 1;
+		renderPassCI.pDependencies = &dependency;
+		VK_CHECK_RESULT(vkCreateRenderPass(logicalDevice, &renderPassCI, nullptr, &earlyRenderPass));
+
+		for (VkAttachmentDescription& attachment : attachments) {
+			attachment.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+			attachment.initialLayout = attachment.finalLayout;
+		}
+		VK_CHECK_RESULT(vkCreateRenderPass(logicalDevice, &renderPassCI, nullptr, &lateRenderPass));
+
+		const std::array<VkImageView, 2> framebufferAttachments = { colorView, depthAttachmentView };
+		VkFramebufferCreateInfo framebufferCI = Initializers::framebufferCreateInfo();
+		framebufferCI.renderPass = earlyRenderPass;
+		framebufferCI.attachmentCount = static_cast<uint32_t>(framebufferAttachments.size());
+		framebufferCI.pAttachments = framebufferAttachments.data();
+		framebufferCI.width = width;
+		framebufferCI.height = height;
+		framebufferCI.layers = 1;
+		VK_CHECK_RESULT(vkCreateFramebuffer(logicalDevice, &framebufferCI, nullptr, &framebuffer));
+	}
+
+	void OcclusionTest::preparePipelines(const Shaders& shaders) {
+		const VkDevice logicalDevice = device->logicalDevice;
+
+		static constexpr std::array<VkDescriptorSetLayoutBinding, 1> uniformBindings = {
+			Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 0)
+		};
+		constexpr VkDescriptorSetLayoutCreateInfo uniformLayoutCI = Initializers::descriptorLayoutCI(uniformBindings);
+		VK_CHECK_RESULT(vkCreateDescriptorSetLayout(logicalDevice, &uniformLayoutCI, nullptr, &uniformSetLayout));
+
+		const std::array<VkDescriptorSetLayout, 2> setLayouts = { uniformSetLayout, vkglTF::descriptorSetLayoutNodes };
+		const VkPipelineLayoutCreateInfo graphicsLayoutCI = Initializers::pipelineLayoutCreateInfo(setLayouts.data(), static_cast<uint32_t>(setLayouts.size()));
+		VK_CHECK_RESULT(vkCreatePipelineLayout(logicalDevice, &graphicsLayoutCI, nullptr, &pipelineLayout));
+
+		// The solid pipeline of the viewer, except that the walls are seen from inside the housing
+		constexpr VkPipelineInputAssemblyStateCreateInfo inputAssemblyStateCI = Initializers::pipelineInputAssemblyStateCreateInfo(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST, 0, VK_FALSE);
+		constexpr VkPipelineRasterizationStateCreateInfo rasterizationStateCI = Initializers::pipelineRasterizationStateCreateInfo(VK_POLYGON_MODE_FILL, VK_CULL_MODE_NONE, VK_FRONT_FACE_COUNTER_CLOCKWISE, 0);
+		static constexpr VkPipelineColorBlendAttachmentState blendAttachmentState = Initializers::pipelineColorBlendAttachmentState(0xf, VK_FALSE);
+		constexpr VkPipelineColorBlendStateCreateInfo colorBlendStateCI = Initializers::pipelineColorBlendStateCreateInfo(1, &blendAttachmentState);
+		constexpr VkPipelineDepthStencilStateCreateInfo depthStencilStateCI = Initializers::pipelineDepthStencilStateCreateInfo(VK_TRUE, VK_TRUE, VK_COMPARE_OP_LESS_OR_EQUAL);
+		constexpr VkPipelineViewportStateCreateInfo viewportStateCI = Initializers::pipelineViewportStateCreateInfo(1, 1, 0);
+		constexpr VkPipelineMultisampleStateCreateInfo multisampleStateCI = Initializers::pipelineMultisampleStateCreateInfo(VK_SAMPLE_COUNT_1_BIT, 0);
+		static constexpr std::array<VkDynamicState, 2> dynamicStateEnables = { VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR };
+		constexpr VkPipelineDynamicStateCreateInfo dynamicStateCI = Initializers::pipelineDynamicStateCreateInfo(dynamicStateEnables, 0);
+
+		std::array<VkPipelineShaderStageCreateInfo, 2> shaderStages = { shaders.fragment, shaders.vertex };
+		constexpr VkSpecializationMapEntry textureSlotsEntry = Initializers::specializationMapEntry(0, 0, sizeof(uint32_t));
+		const VkSpecializationInfo fragmentSpecialization = Initializers::specializationInfo(1, &textureSlotsEntry, sizeof(uint32_t), &vkglTF::textureSlotCount);
+		shaderStages[0].pSpecializationInfo = &fragmentSpecialization;
+
+		VkGraphicsPipelineCreateInfo pipelineCI = Initializers::pipelineCreateInfo(pipelineLayout, earlyRenderPass, 0);
+		pipelineCI.pInputAssemblyState = &inputAssemblyStateCI;
+		pipelineCI.pRasterizationState = &rasterizationStateCI;
+		pipelineCI.pColorBlendState = &colorBlendStateCI;
+		pipelineCI.pMultisampleState = &multisampleStateCI;
+		pipelineCI.pViewportState = &viewportStateCI;
+		pipelineCI.pDepthStencilState = &depthStencilStateCI;
+		pipelineCI.pDynamicState = &dynamicStateCI;
+		pipelineCI.pVertexInputState = vkglTF::Vertex::getPipelineVertexInputState({ vkglTF::VertexComponent::Position, vkglTF::VertexComponent::Normal, vkglTF::VertexComponent::UV });
+		pipelineCI.stageCount = static_cast<uint32_t>(shaderStages.size());
+		pipelineCI.pStages = shaderStages.data();
+		VK_CHECK_RESULT(vkCreateGraphicsPipelines(logicalDevice, pipelineCache, 1, &pipelineCI, nullptr, &pipeline));
+	}
+
+	void OcclusionTest::setupDescriptors() {
+		const VkDevice logicalDevice = device->logicalDevice;
+
+		const std::array<VkDescriptorPoolSize, 1> poolSizes = {
+			Initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1)
+		};
+		const VkDescriptorPoolCreateInfo descriptorPoolCI = Initializers::descriptorPoolCreateInfo(poolSizes, 1);
+		VK_CHECK_RESULT(vkCreateDescriptorPool(logicalDevice, &descriptorPoolCI, nullptr, &descriptorPool));
+
+		const VkDescriptorSetAllocateInfo allocateInfo = Initializers::descriptorSetAllocateInfo(descriptorPool, &uniformSetLayout, 1);
+		VK_CHECK_RESULT(vkAllocateDescriptorSets(logicalDevice, &allocateInfo, &uniformSet));
+		const VkWriteDescriptorSet write = Initializers::writeDescriptorSet(uniformSet, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 0, &uniformBuffer.descriptor);
+		vkUpdateDescriptorSets(logicalDevice, 1, &write, 0, nullptr);
+
+		occlusion->preparePyramid(depthImage, depthFormat, width, height);
+		occlusion->updateDescriptors();
+	}
+
+	size_t OcclusionTest::updateDraws(const glm::mat4& viewProjection) {
+		std::vector<uint8_t> visibleItems;
+		scene->bvh.cull(vkglTF::extractFrustumPlanes(viewProjection), visibleItems);
+
+		VkDrawIndexedIndirectCommand* draws = static_cast<VkDrawIndexedIndirectCommand*>(drawBuffer.mapped);
+		uint32_t shortCount = 0, wideCount = 0;
+		size_t triangles = 0;
+		occlusion->beginFrame();
+		for (const vkglTF::Model::InstanceGroup& group : scene->instanceGroups) {
+			for (size_t p = 0; p < group.mesh->primitives.size(); p++) {
+				const vkglTF::Primitive* primitive = group.mesh->primitives[p];
+				const uint32_t firstInstance = group.firstInstance + static_cast<uint32_t>(p * group.nodes.size());
+				const uint32_t material = static_cast<uint32_t>(primitive->material - scene->materials.data());
+
+				// All instances of the primitive share one draw and one range, the GPU appends the ones that pass its tests.
+				// A range without candidates is never read, every primitive has room for one
+				const uint32_t range = occlusion->addRange(firstInstance);
+				uint32_t instanceCount = 0;
+				for (uint32_t i = 0; i < group.instanceCount; i++) {
+					const uint32_t node = group.nodes[i]->index;
+					const uint32_t item = scene->bvh.firstItem(node) + static_cast<uint32_t>(p);
+					if (!visibleItems[item])
+						continue;
+					occlusion->addCandidate(range, node, item, material);
+					instanceCount++;
+				}
+				if (instanceCount == 0)
+					continue;
+
+				uint32_t& count = primitive->shortIndices ? shortCount : wideCount;
+				const uint32_t draw = (primitive->shortIndices ? 0 : maxShortDrawCount) + count++;
+				draws[draw] = { primitive->indexCount, instanceCount, primitive->levelPoolFirstIndex(0), primitive->poolVertexOffset(), firstInstance };
+				occlusion->setDrawRange(draw, range);
+				triangles += primitive->indexCount / 3 * instanceCount;
+			}
+		}
+		for (uint32_t i = shortCount; i < shortDrawCount; i++) {
+			draws[i] = {};
+		}
+		for (uint32_t i = wideCount; i < wideDrawCount; i++) {
+			draws[maxShortDrawCount + i] = {};
+		}
+		shortDrawCount = shortCount;
+		wideDrawCount = wideCount;
+
+		occlusion->endFrame(viewProjection, shortCount, wideCount, triangles);
+		return triangles;
+	}
+
+	void OcclusionTest::drawScene(const VkCommandBuffer commandBuffer, const Buffer& draws) {
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 0, 1, &uniformSet, 0, nullptr);
+		const VkDescriptorSet drawSet = occlusion->getDrawSet();
+		vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, 1, 1, &drawSet, 0, nullptr);
+		vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+		constexpr VkDeviceSize offsets[1] = { 0 };
+		vkCmdBindVertexBuffers(commandBuffer, 0, 1, &scene->vertices.buffer, offsets);
+
+		// Draws that were not written this frame have no instances, so the whole region of both pools is walked
+		constexpr VkDeviceSize stride = sizeof(VkDrawIndexedIndirectCommand);
+		const uint32_t maxDrawsPerCall = features.multiDrawIndirect ? device->properties.limits.maxDrawIndirectCount : 1;
+		const auto drawRegion = [&](uint32_t firstDraw, uint32_t count) {
+			for (uint32_t first = 0; first < count; first += maxDrawsPerCall) {
+				vkCmdDrawIndexedIndirect(commandBuffer, draws.buffer, (firstDraw + first) * stride, (std::min)(maxDrawsPerCall, count - first), stride);
+			}
+		};
+		if (maxShortDrawCount > 0) {
+			vkCmdBindIndexBuffer(commandBuffer, scene->shortIndices.buffer, 0, VK_INDEX_TYPE_UINT16);
+			drawRegion(0, maxShortDrawCount);
+		}
+		if (maxDrawCount > maxShortDrawCount) {
+			vkCmdBindIndexBuffer(commandBuffer, scene->indices.buffer, 0, VK_INDEX_TYPE_UINT32);
+			drawRegion(maxShortDrawCount, maxDrawCount - maxShortDrawCount);
+		}
+	}
+
+	void OcclusionTest::recordFrame(const VkCommandBuffer commandBuffer) {
+		VkClearValue clearValues[2];
+		clearValues[0].color = { { 1.0f, 1.0f, 1.0f, 1.0f } };
+		clearValues[1].depthStencil = { 1.0f, 0 };
+		VkRenderPassBeginInfo renderPassBeginInfo = Initializers::renderPassBeginInfo();
+		renderPassBeginInfo.renderPass = earlyRenderPass;
+		renderPassBeginInfo.framebuffer = framebuffer;
+		renderPassBeginInfo.renderArea.extent = { width, height };
+		renderPassBeginInfo.clearValueCount = 2;
+		renderPassBeginInfo.pClearValues = clearValues;
+
+		occlusion->record(commandBuffer, renderPassBeginInfo, lateRenderPass, [this](const VkCommandBuffer commandBuffer, const Buffer& draws, bool) {
+			drawScene(commandBuffer, draws);
+		});
+	}
+
+	bool OcclusionTest::run(const Shaders& shaders, const Options& options) {
+		if (!vkglTF::OcclusionCulling::isSupported(device->physicalDevice, features, depthFormat)) _UNLIKELY {
+			std::cerr << "Occlusion culling is not supported by this device\n";
+			return false;
+		}
+		if (options.frames < 3) _UNLIKELY {
+			std::cerr << "Occlusion culling needs three frames to settle, the first one tests against an empty pyramid\n";
+			return false;
+		}
+
+		const std::filesystem::path scenePath = std::filesystem::temp_directory_path() / "occlusion-test.gltf";
+		if (!generateScene(scenePath.string())) _UNLIKELY
+			return false;
+		scene = new vkglTF::Model();
+		scene->loadFromFile(scenePath.string(), device);
+		std::error_code error;
+		std::filesystem::remove(scenePath, error);
+		std::filesystem::remove(std::filesystem::path(scenePath).replace_extension(".bin"), error);
+		if (scene->bvh.empty()) _UNLIKELY {
+			std::cerr << "Could not load the generated scene\n";
+			return false;
+		}
+
+		width = options.width;
+		height = options.height;
+		occlusion = new vkglTF::OcclusionCulling(device, pipelineCache, { shaders.cull, shaders.pyramid });
+		prepareBuffers();
+		prepareTargets();
+		preparePipelines(shaders);
+		setupDescriptors();
+
+		// The frames are waited on by the CPU anyway, so the uploads of the scene and the cleared visibility are as well
+		VulkanUploader* uploader = device->uploader;
+		const uint64_t uploadValue = uploader->submit(false);
+		const VkSemaphore semaphore = uploader->getSemaphore();
+		VkSemaphoreWaitInfo waitInfo{};
+		waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+		waitInfo.semaphoreCount = 1;
+		waitInfo.pSemaphores = &semaphore;
+		waitInfo.pValues = &uploadValue;
+		VK_CHECK_RESULT(vkWaitSemaphores(device->logicalDevice, &waitInfo, UINT64_MAX));
+		uploader->collect();
+
+		// Looking at the front wall from the center of the housing, with the projection of the camera of the core
+		UniformData uniformData{};
+		uniformData.projection = glm::perspective(glm::radians(60.0f), static_cast<float>(width) / static_cast<float>(height), 0.1f, 64.0f);
+		uniformData.projection[1][1] *= -1.0f;
+		uniformData.view = glm::lookAt(glm::vec3(0.0f), glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+		uniformData.model = glm::mat4(1.0f);
+		memcpy(uniformBuffer.mapped, &uniformData, sizeof(UniformData));
+		const glm::mat4 viewProjection = uniformData.projection * uniformData.view * uniformData.model;
+
+		std::cout << "Occlusion culling on " << device->properties.deviceName << ", " << width << "x" << height << std::endl;
+		size_t candidateTriangles = 0, triangles = 0;
+		for (uint32_t frame = 0; frame < options.frames; frame++) {
+			candidateTriangles = updateDraws(viewProjection);
+
+			const VkCommandBuffer commandBuffer = device->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+			recordFrame(commandBuffer);
+			device->flushCommandBuffer(commandBuffer, queue);
+
+			triangles = occlusion->getDrawnTriangles();
+			std::cout << "Frame " << frame << ": " << triangles << " of " << candidateTriangles << " triangles in the frustum drawn" << std::endl;
+		}
+
+		// Everything inside the housing is in view and nothing is in front of it
+		const size_t visibleTriangles = size_t(insideParts) * insideParts * partTriangles;
+		const float drawnRatio = candidateTriangles ? static_cast<float>(triangles) / candidateTriangles : 1.0f;
+		if (triangles < visibleTriangles) _UNLIKELY {
+			std::cerr << "Occlusion culling dropped visible parts, " << triangles << " triangles drawn where at least " << visibleTriangles << " are visible\n";
+			return false;
+		}
+		if (drawnRatio > options.maxDrawnRatio) _UNLIKELY {
+			std::cerr << "Occlusion culling drew " << drawnRatio * 100.0f << "% of the triangles in the frustum, at most " << options.maxDrawnRatio * 100.0f << "% expected\n";
+			return false;
+		}
+		std::cout << "Occlusion culling passed, " << (1.0f - drawnRatio) * 100.0f << "% of the triangles in the frustum culled" << std::endl;
+		return true;
+	}
+}
@@ -0,0 +1,115 @@
+/*
+* Occlusion culling test
+*
+* Runs the two phase occlusion culling of the viewer without a window, through the same vkglTF::OcclusionCulling and
+* shaders the viewer uses, into offscreen targets instead of the swap chain. The scene is generated, a housing of six walls around the camera with parts inside and behind the walls, so the late
+* frames must draw far fewer triangles than survive the frustum. Runs on any device, for CI on lavapipe:
+*
+*	set VK_ICD_FILENAMES=C:\lavapipe\share\vulkan\icd.d\lvp_icd.x86_64.json
+*	Voortman3DBenchmark.exe --occlusion
+*/
+
+#pragma once
+#include "pch.hpp"
+#include "VulkanDevice.hpp"
+#include "VulkanglTFModel.hpp"
+#include "VulkanglTFOcclusion.hpp"
+
+namespace Voortman3D {
+	class OcclusionTest {
+	public:
+		struct Options {
+			uint32_t width{ 640 };
+			uint32_t height{ 480 };
+			uint32_t frames{ 4 };
+			// The last frame may draw at most this share of the triangles that survived the frustum
+			float maxDrawnRatio{ 0.25f };
+		};
+
+		/*
+			Stages as loaded by Voortman3DCore::loadShader, which also destroys their modules
+		*/
+		struct Shaders {
+			VkPipelineShaderStageCreateInfo vertex;
+			VkPipelineShaderStageCreateInfo fragment;
+			VkPipelineShaderStageCreateInfo pyramid;
+			VkPipelineShaderStageCreateInfo cull;
+		};
+
+		/**
+		* @param features Features the device was created with, draws find their instances through their first instance
+		*/
+		OcclusionTest(VulkanDevice* device, VkQueue queue, VkPipelineCache pipelineCache, VkFormat depthFormat, const VkPhysicalDeviceFeatures& features);
+		~OcclusionTest();
+
+		/**
+		* Render the generated interior view for options.frames frames and check the triangles the last one drew
+		*
+		* @note The descriptor set layouts and the default texture have to exist, like for loading any model
+		*
+		* @return False when the device can't run the passes or too many triangles were drawn, reported on std::cerr
+		*/
+		_NODISCARD bool run(const Shaders& shaders, const Options& options);
+
+	private:
+		// Layout of model.vert
+		struct UniformData {
+			glm::mat4 projection;
+			glm::mat4 view;
+			glm::mat4 model;
+		};
+
+		VulkanDevice* device;
+		VkQueue queue;
+		VkPipelineCache pipelineCache;
+		VkFormat depthFormat;
+		VkPhysicalDeviceFeatures features;
+
+		vkglTF::Model* scene{};
+		vkglTF::OcclusionCulling* occlusion{};
+		uint32_t width{}, height{};
+
+		Buffer uniformBuffer{};
+		Buffer drawBuffer{};
+		uint32_t maxShortDrawCount{};
+		uint32_t maxDrawCount{};
+		uint32_t shortDrawCount{};
+		uint32_t wideDrawCount{};
+
+		// Offscreen targets of both passes, the depth is also sampled for the first level of the pyramid
+		VkImage colorImage{ VK_NULL_HANDLE };
+		Allocation colorMemory{};
+		VkImageView colorView{ VK_NULL_HANDLE };
+		VkImage depthImage{ VK_NULL_HANDLE };
+		Allocation depthMemory{};
+		VkImageView depthAttachmentView{ VK_NULL_HANDLE };
+		VkFramebuffer framebuffer{ VK_NULL_HANDLE };
+
+		VkDescriptorPool descriptorPool{ VK_NULL_HANDLE };
+		VkDescriptorSetLayout uniformSetLayout{ VK_NULL_HANDLE };
+		VkDescriptorSet uniformSet{ VK_NULL_HANDLE };
+
+		VkRenderPass earlyRenderPass{ VK_NULL_HANDLE };
+		VkRenderPass lateRenderPass{ VK_NULL_HANDLE };
+		VkPipelineLayout pipelineLayout{ VK_NULL_HANDLE };
+		VkPipeline pipeline{ VK_NULL_HANDLE };
+
+		/** @brief Write the housing with parts inside and behind its walls, see the top of this file */
+		_NODISCARD static bool generateScene(const std::string& filename);
+
+		void prepareBuffers();
+		void prepareTargets();
+		void preparePipelines(const Shaders& shaders);
+		void setupDescriptors();
+
+		/**
+		* Write the draws and candidates of all instances that survive the frustum, like Voortman3D::updateDraws does
+		*
+		* @return Triangles of those draws
+		*/
+		size_t updateDraws(const glm::mat4& viewProjection);
+
+		void drawScene(const VkCommandBuffer commandBuffer, const Buffer& draws);
+		void recordFrame(const VkCommandBuffer commandBuffer);
+	};
+}
@@ -0,0 +1,149 @@
+/*
+* Loading benchmark
+*
+* Creates the Vulkan device without a window and times loading glTF files phase by phase, see VulkanglTFBenchmark.hpp
+* for the phases and the JSON that is written:
+*
+*	Voortman3DBenchmark.exe [--model file.gltf]... [--max-triangles count] [--repetitions count] [--process] [--output file.json]
+*	Voortman3DBenchmark.exe --math
+*	Voortman3DBenchmark.exe --occlusion [--frames count]
+*
+* Without --model the dragon the viewer starts with is loaded. --process adds the mesh processing the viewer does on
+* load, which is left out by default like loadFromFile does. --math times the BatchMath kernels instead and needs no device.
+* --occlusion runs the occlusion culling of the viewer on a generated interior view, see OcclusionTest.hpp, and fails when
+* it doesn't cull the hidden parts
+*/
+
+#include "Voortman3DCore.hpp"
+#include "VulkanglTFModel.hpp"
+#include "VulkanglTFTexture.hpp"
+#include "VulkanglTFBenchmark.hpp"
+#include "BatchMathBenchmark.hpp"
+#include "OcclusionTest.hpp"
+#include "resource.h"
+
+namespace Voortman3D {
+	class Voortman3DBenchmark final : public Voortman3DCore {
+	public:
+		Voortman3DBenchmark(HINSTANCE hInstance) : Voortman3DCore(hInstance) {
+			// Nothing is drawn, so there is no overlay to free either
+			settings.overlay = false;
+		}
+
+		~Voortman3DBenchmark() {
+			if (device) {
+				vkglTF::destroyDefaultTexture();
+				vkglTF::destroyDescriptorSetLayouts(device);
+			}
+		}
+
+		_NODISCARD bool run(const vkglTF::LoadingBenchmark::Options& options) {
+			prepareDescriptors();
+			return vkglTF::LoadingBenchmark::run(vulkanDevice, options);
+		}
+
+		_NODISCARD bool runOcclusionTest(const OcclusionTest::Options& options) {
+			prepareDescriptors();
+
+			// The shaders of the viewer, built into this executable as well
+			const auto loadResource = [this](int id, VkShaderStageFlagBits stage) {
+				const HRSRC resource = FindResource(GetModuleHandle(nullptr), MAKEINTRESOURCE(id), L"Shader");
+				assert(resource);
+				const HGLOBAL data = LoadResource(GetModuleHandle(nullptr), resource);
+				return loadShader(stage, LockResource(data), SizeofResource(GetModuleHandle(nullptr), resource));
+			};
+			const OcclusionTest::Shaders shaders = {
+				loadResource(IDR_MODEL_VERTEX, VK_SHADER_STAGE_VERTEX_BIT),
+				loadResource(IDR_MODEL_FRAGMENT, VK_SHADER_STAGE_FRAGMENT_BIT),
+				loadResource(IDR_DEPTH_PYRAMID_COMPUTE, VK_SHADER_STAGE_COMPUTE_BIT),
+				loadResource(IDR_OCCLUSION_COMPUTE, VK_SHADER_STAGE_COMPUTE_BIT)
+			};
+
+			// Destroyed before the descriptor set layouts and the device
+			OcclusionTest test(vulkanDevice, queue, pipelineCache, depthFormat, enabledFeatures);
+			return test.run(shaders, options);
+		}
+
+	private:
+		void prepareDescriptors() {
+			// Descriptors are set up like the viewer does, with bindless textures when the device has them
+			if (enabledFeatures12.descriptorBindingPartiallyBound && enabledFeatures12.descriptorBindingSampledImageUpdateAfterBind) {
+				VkPhysicalDeviceVulkan12Properties properties12{};
+				properties12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_PROPERTIES;
+				VkPhysicalDeviceProperties2 properties2{};
+				properties2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+				properties2.pNext = &properties12;
+				vkGetPhysicalDeviceProperties2(physicalDevice, &properties2);
+				const uint32_t slotCount = (std::min)({ vkglTF::maxBindlessTextures,
+					properties12.maxPerStageDescriptorUpdateAfterBindSampledImages, properties12.maxPerStageDescriptorUpdateAfterBindSamplers,
+					properties12.maxDescriptorSetUpdateAfterBindSampledImages, properties12.maxDescriptorSetUpdateAfterBindSamplers });
+				if (slotCount > vkglTF::maxTextures) _LIKELY
+					vkglTF::enableBindlessTextures(slotCount);
+			}
+			vkglTF::createDescriptorSetLayouts(device);
+			vkglTF::createDefaultTexture(vulkanDevice);
+		}
+
+		void GetEnabledFeatures() override {
+			// Indirect draws of the occlusion test, as in the viewer
+			if (deviceFeatures.multiDrawIndirect) _LIKELY {
+				enabledFeatures.multiDrawIndirect = VK_TRUE;
+			}
+			if (deviceFeatures.drawIndirectFirstInstance) _LIKELY {
+				enabledFeatures.drawIndirectFirstInstance = VK_TRUE;
+			}
+			if (deviceFeatures.shaderSampledImageArrayDynamicIndexing) _LIKELY {
+				enabledFeatures.shaderSampledImageArrayDynamicIndexing = VK_TRUE;
+			}
+			if (deviceFeatures.samplerAnisotropy) _LIKELY {
+				enabledFeatures.samplerAnisotropy = VK_TRUE;
+			}
+			if (deviceFeatures12.descriptorBindingPartiallyBound && deviceFeatures12.descriptorBindingSampledImageUpdateAfterBind) _LIKELY {
+				enabledFeatures12.descriptorBindingPartiallyBound = VK_TRUE;
+				enabledFeatures12.descriptorBindingSampledImageUpdateAfterBind = VK_TRUE;
+			}
+		}
+
+		void render() override {}
+		void buildCommandBuffers() override {}
+		void OnUpdateUIOverlay(UIOverlay*) override {}
+	};
+}
+
+int main(int argc, char** argv) {
+	Voortman3D::vkglTF::LoadingBenchmark::Options options;
+	Voortman3D::OcclusionTest::Options occlusionOptions;
+	bool occlusion = false;
+	for (int i = 1; i < argc; i++) {
+		const std::string argument = argv[i];
+		const bool hasValue = i + 1 < argc;
+		if (argument == "--model" && hasValue)
+			options.files.push_back(argv[++i]);
+		else if (argument == "--max-triangles" && hasValue)
+			options.maxTriangles = std::strtoull(argv[++i], nullptr, 10);
+		else if (argument == "--repetitions" && hasValue)
+			options.repetitions = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+		else if (argument == "--output" && hasValue)
+			options.output = argv[++i];
+		else if (argument == "--math") {
+			Voortman3D::BatchMathBenchmark::run();
+			return 0;
+		}
+		else if (argument == "--occlusion")
+			occlusion = true;
+		else if (argument == "--frames" && hasValue)
+			occlusionOptions.frames = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+		else if (argument == "--process")
+			options.fileLoadingFlags = Voortman3D::vkglTF::FileLoadingFlags::OptimizeMeshes | Voortman3D::vkglTF::FileLoadingFlags::GenerateLODs | Voortman3D::vkglTF::FileLoadingFlags::GenerateMeshlets;
+		else
+			Voortman3D::Voortman3DCore::args.push_back(argv[i]);
+	}
+	if (options.files.empty())
+		options.files.push_back("C:/Git/Voortman3D/Dependencies/chinesedragon.gltf");
+
+	Voortman3D::Voortman3DBenchmark* benchmark = new(std::nothrow) Voortman3D::Voortman3DBenchmark(GetModuleHandle(nullptr));
+	benchmark->initVulkan();
+	const bool succeeded = occlusion ? benchmark->runOcclusionTest(occlusionOptions) : benchmark->run(options);
+	delete(benchmark);
+	return succeeded ? 0 : 1;
+}
@@ -0,0 +1,344 @@
+/*
+* Batched matrix math
+*
+* Multiplies arrays of 4x4 matrices and transforms arrays of bounding boxes with SSE or AVX2, picked at runtime from
+* what the CPU supports. The scalar path uses glm and is the reference the SIMD paths are benchmarked against
+*/
+
+#include "pch.hpp"
+#include "BatchMath.hpp"
+
+#include <immintrin.h>
+#include <atomic>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// MSVC compiles AVX2 intrinsics without /arch:AVX2, other compilers have to enable them per function
+#if defined(__GNUC__) || defined(__clang__)
+#define BATCHMATH_AVX2 __attribute__((target("avx2,fma")))
+#else
+#define BATCHMATH_AVX2
+#endif
+
+namespace Voortman3D {
+	using BatchMath::InstructionSet;
+
+	namespace {
+		std::atomic<InstructionSet> activeInstructionSet{ BatchMath::getSupportedInstructionSet() };
+
+		/*
+			Matrix products
+
+			glm stores columns, so column j of a * b is the columns of a weighted by the elements of column j of b.
+			The columns of a stay in registers, every column of b is read before the same column of the result is
+			written, which lets the result alias either input
+		*/
+		struct ColumnsSSE {
+			__m128 c0, c1, c2, c3;
+
+			explicit ColumnsSSE(const float* m) noexcept : c0(_mm_loadu_ps(m)), c1(_mm_loadu_ps(m + 4)), c2(_mm_loadu_ps(m + 8)), c3(_mm_loadu_ps(m + 12)) {}
+
+			inline void multiply(const float* b, float* result) const noexcept {
+				for (uint32_t j = 0; j < 16; j += 4) {
+					const __m128 column = _mm_loadu_ps(b + j);
+					__m128 r = _mm_mul_ps(c0, _mm_shuffle_ps(column, column, 0x00));
+					r = _mm_add_ps(r, _mm_mul_ps(c1, _mm_shuffle_ps(column, column, 0x55)));
+					r = _mm_add_ps(r, _mm_mul_ps(c2, _mm_shuffle_ps(column, column, 0xAA)));
+					r = _mm_add_ps(r, _mm_mul_ps(c3, _mm_shuffle_ps(column, column, 0xFF)));
+					_mm_storeu_ps(result + j, r);
+				}
+			}
+		};
+
+		// Both halves hold the same column, so two columns of the result are computed at once
+		struct ColumnsAVX2 {
+			__m256 c0, c1, c2, c3;
+
+			BATCHMATH_AVX2 explicit ColumnsAVX2(const float* m) noexcept :
+				c0(_mm256_broadcast_ps(reinterpret_cast<const __m128*>(m))),
+				c1(_mm256_broadcast_ps(reinterpret_cast<const __m128*>(m + 4))),
+				c2(_mm256_broadcast_ps(reinterpret_cast<const __m128*>(m + 8))),
+				c3(_mm256_broadcast_ps(reinterpret_cast<const __m128*>(m + 12))) {}
+
+			BATCHMATH_AVX2 inline void multiply(const float* b, float* result) const noexcept {
+				for (uint32_t j = 0; j < 16; j += 8) {
+					const __m256 columns = _mm256_loadu_ps(b + j);
+					__m256 r = _mm256_mul_ps(c0, _mm256_shuffle_ps(columns, columns, 0x00));
+					r = _mm256_fmadd_ps(c1, _mm256_shuffle_ps(columns, columns, 0x55), r);
+					r = _mm256_fmadd_ps(c2, _mm256_shuffle_ps(columns, columns, 0xAA), r);
+					r = _mm256_fmadd_ps(c3, _mm256_shuffle_ps(columns, columns, 0xFF), r);
+					_mm256_storeu_ps(result + j, r);
+				}
+			}
+		};
+
+		void multiplyBroadcastSSE(const glm::mat4& left, const glm::mat4* right, glm::mat4* result, size_t count) noexcept {
+			const ColumnsSSE a(glm::value_ptr(left));
+			for (size_t i = 0; i < count; i++)
+				a.multiply(glm::value_ptr(right[i]), glm::value_ptr(result[i]));
+		}
+
+		BATCHMATH_AVX2 void multiplyBroadcastAVX2(const glm::mat4& left, const glm::mat4* right, glm::mat4* result, size_t count) noexcept {
+			const ColumnsAVX2 a(glm::value_ptr(left));
+			for (size_t i = 0; i < count; i++)
+				a.multiply(glm::value_ptr(right[i]), glm::value_ptr(result[i]));
+		}
+
+		void multiplyPairsSSE(const glm::mat4* left, const glm::mat4* right, glm::mat4* result, size_t count) noexcept {
+			for (size_t i = 0; i < count; i++)
+				ColumnsSSE(glm::value_ptr(left[i])).multiply(glm::value_ptr(right[i]), glm::value_ptr(result[i]));
+		}
+
+		BATCHMATH_AVX2 void multiplyPairsAVX2(const glm::mat4* left, const glm::mat4* right, glm::mat4* result, size_t count) noexcept {
+			for (size_t i = 0; i < count; i++)
+				ColumnsAVX2(glm::value_ptr(left[i])).multiply(glm::value_ptr(right[i]), glm::value_ptr(result[i]));
+		}
+
+		// Nodes depend on their parent, so the hierarchy is walked in order and only the products themselves are vectorized
+		template <typename Columns>
+		inline void multiplyHierarchyKernel(const uint32_t* parents, const glm::mat4* local, glm::mat4* world, uint32_t first, uint32_t end, uint32_t noParent) noexcept {
+			for (uint32_t i = first; i < end; i++) {
+				const uint32_t parent = parents[i];
+				if (parent != noParent) _LIKELY // Most objects are going to have a parent
+					Columns(glm::value_ptr(local[i])).multiply(glm::value_ptr(world[parent]), glm::value_ptr(world[i]));
+				else
+					world[i] = local[i];
+			}
+		}
+
+		void multiplyHierarchySSE(const uint32_t* parents, const glm::mat4* local, glm::mat4* world, uint32_t first, uint32_t end, uint32_t noParent) noexcept {
+			multiplyHierarchyKernel<ColumnsSSE>(parents, local, world, first, end, noParent);
+		}
+
+		BATCHMATH_AVX2 void multiplyHierarchyAVX2(const uint32_t* parents, const glm::mat4* local, glm::mat4* world, uint32_t first, uint32_t end, uint32_t noParent) noexcept {
+			multiplyHierarchyKernel<ColumnsAVX2>(parents, local, world, first, end, noParent);
+		}
+
+		/*
+			Bounds
+
+			Lanes are boxes. The columns of the matrices of four boxes are transposed, so that every register holds one
+			matrix element for all lanes, after which the center is transformed as a point and the extent by the absolute
+			upper 3x3
+		*/
+		void mergeTransformedBoundsScalar(const glm::mat4* const* matrices, const BatchMath::BoundsSoA& bounds, size_t first, glm::vec3& min, glm::vec3& max) noexcept {
+			for (size_t i = first; i < bounds.size(); i++) {
+				const glm::mat4& m = *matrices[i];
+				const glm::vec3 center = glm::vec3(m * glm::vec4(bounds.centerX[i], bounds.centerY[i], bounds.centerZ[i], 1.0f));
+				const glm::vec3 extent = glm::abs(glm::vec3(m[0])) * bounds.extentX[i] + glm::abs(glm::vec3(m[1])) * bounds.extentY[i] + glm::abs(glm::vec3(m[2])) * bounds.extentZ[i];
+				min = glm::min(min, center - extent);
+				max = glm::max(max, center + extent);
+			}
+		}
+
+		_NODISCARD inline float horizontalMin(__m128 v) noexcept {
+			v = _mm_min_ps(v, _mm_movehl_ps(v, v));
+			return _mm_cvtss_f32(_mm_min_ss(v, _mm_shuffle_ps(v, v, 0x55)));
+		}
+
+		_NODISCARD inline float horizontalMax(__m128 v) noexcept {
+			v = _mm_max_ps(v, _mm_movehl_ps(v, v));
+			return _mm_cvtss_f32(_mm_max_ss(v, _mm_shuffle_ps(v, v, 0x55)));
+		}
+
+		// Element r of column c of four matrices, for the upper three rows of every column
+		inline void transposeMatrices(const glm::mat4* const* matrices, __m128 (&m)[4][3]) noexcept {
+			for (uint32_t c = 0; c < 4; c++) {
+				__m128 r0 = _mm_loadu_ps(glm::value_ptr(*matrices[0]) + c * 4);
+				__m128 r1 = _mm_loadu_ps(glm::value_ptr(*matrices[1]) + c * 4);
+				__m128 r2 = _mm_loadu_ps(glm::value_ptr(*matrices[2]) + c * 4);
+				__m128 r3 = _mm_loadu_ps(glm::value_ptr(*matrices[3]) + c * 4);
+				_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+				m[c][0] = r0;
+				m[c][1] = r1;
+				m[c][2] = r2;
+			}
+		}
+
+		void mergeTransformedBoundsSSE(const glm::mat4* const* matrices, const BatchMath::BoundsSoA& bounds, glm::vec3& min, glm::vec3& max) noexcept {
+			const __m128 signMask = _mm_set1_ps(-0.0f);
+			__m128 minimum[3] = { _mm_set1_ps(min.x), _mm_set1_ps(min.y), _mm_set1_ps(min.z) };
+			__m128 maximum[3] = { _mm_set1_ps(max.x), _mm_set1_ps(max.y), _mm_set1_ps(max.z) };
+
+			size_t i = 0;
+			for (; i + 4 <= bounds.size(); i += 4) {
+				__m128 m[4][3];
+				transposeMatrices(matrices + i, m);
+
+				const __m128 cx = _mm_loadu_ps(&bounds.centerX[i]), cy = _mm_loadu_ps(&bounds.centerY[i]), cz = _mm_loadu_ps(&bounds.centerZ[i]);
+				const __m128 ex = _mm_loadu_ps(&bounds.extentX[i]), ey = _mm_loadu_ps(&bounds.extentY[i]), ez = _mm_loadu_ps(&bounds.extentZ[i]);
+				for (uint32_t r = 0; r < 3; r++) {
+					__m128 center = _mm_add_ps(_mm_mul_ps(m[0][r], cx), m[3][r]);
+					center = _mm_add_ps(center, _mm_mul_ps(m[1][r], cy));
+					center = _mm_add_ps(center, _mm_mul_ps(m[2][r], cz));
+					__m128 extent = _mm_mul_ps(_mm_andnot_ps(signMask, m[0][r]), ex);
+					extent = _mm_add_ps(extent, _mm_mul_ps(_mm_andnot_ps(signMask, m[1][r]), ey));
+					extent = _mm_add_ps(extent, _mm_mul_ps(_mm_andnot_ps(signMask, m[2][r]), ez));
+					minimum[r] = _mm_min_ps(minimum[r], _mm_sub_ps(center, extent));
+					maximum[r] = _mm_max_ps(maximum[r], _mm_add_ps(center, extent));
+				}
+			}
+
+			min = glm::vec3(horizontalMin(minimum[0]), horizontalMin(minimum[1]), horizontalMin(minimum[2]));
+			max = glm::vec3(horizontalMax(maximum[0]), horizontalMax(maximum[1]), horizontalMax(maximum[2]));
+			mergeTransformedBoundsScalar(matrices, bounds, i, min, max);
+		}
+
+		BATCHMATH_AVX2 void mergeTransformedBoundsAVX2(const glm::mat4* const* matrices, const BatchMath::BoundsSoA& bounds, glm::vec3& min, glm::vec3& max) noexcept {
+			const __m256 signMask = _mm256_set1_ps(-0.0f);
+			__m256 minimum[3] = { _mm256_set1_ps(min.x), _mm256_set1_ps(min.y), _mm256_set1_ps(min.z) };
+			__m256 maximum[3] = { _mm256_set1_ps(max.x), _mm256_set1_ps(max.y), _mm256_set1_ps(max.z) };
+
+			size_t i = 0;
+			for (; i + 8 <= bounds.size(); i += 8) {
+				__m128 low[4][3], high[4][3];
+				transposeMatrices(matrices + i, low);
+				transposeMatrices(matrices + i + 4, high);
+				__m256 m[4][3];
+				for (uint32_t c = 0; c < 4; c++) {
+					for (uint32_t r = 0; r < 3; r++)
+						m[c][r] = _mm256_insertf128_ps(_mm256_castps128_ps256(low[c][r]), high[c][r], 1);
+				}
+
+				const __m256 cx = _mm256_loadu_ps(&bounds.centerX[i]), cy = _mm256_loadu_ps(&bounds.centerY[i]), cz = _mm256_loadu_ps(&bounds.centerZ[i]);
+				const __m256 ex = _mm256_loadu_ps(&bounds.extentX[i]), ey = _mm256_loadu_ps(&bounds.extentY[i]), ez = _mm256_loadu_ps(&bounds.extentZ[i]);
+				for (uint32_t r = 0; r < 3; r++) {
+					__m256 center = _mm256_fmadd_ps(m[0][r], cx, m[3][r]);
+					center = _mm256_fmadd_ps(m[1][r], cy, center);
+					center = _mm256_fmadd_ps(m[2][r], cz, center);
+					__m256 extent = _mm256_mul_ps(_mm256_andnot_ps(signMask, m[0][r]), ex);
+					extent = _mm256_fmadd_ps(_mm256_andnot_ps(signMask, m[1][r]), ey, extent);
+					extent = _mm256_fmadd_ps(_mm256_andnot_ps(signMask, m[2][r]), ez, extent);
+					minimum[r] = _mm256_min_ps(minimum[r], _mm256_sub_ps(center, extent));
+					maximum[r] = _mm256_max_ps(maximum[r], _mm256_add_ps(center, extent));
+				}
+			}
+
+			float reduced[2][3];
+			for (uint32_t r = 0; r < 3; r++) {
+				reduced[0][r] = horizontalMin(_mm_min_ps(_mm256_castps256_ps128(minimum[r]), _mm256_extractf128_ps(minimum[r], 1)));
+				reduced[1][r] = horizontalMax(_mm_max_ps(_mm256_castps256_ps128(maximum[r]), _mm256_extractf128_ps(maximum[r], 1)));
+			}
+			min = glm::make_vec3(reduced[0]);
+			max = glm::make_vec3(reduced[1]);
+			mergeTransformedBoundsScalar(matrices, bounds, i, min, max);
+		}
+	}
+
+	InstructionSet BatchMath::getSupportedInstructionSet() noexcept {
+		static const InstructionSet supported = [] {
+			// SSE2 is part of x64, so only AVX2 has to be checked
+#ifdef _MSC_VER
+			int info[4];
+			__cpuid(info, 0);
+			const int highestLeaf = info[0];
+			__cpuid(info, 1);
+			const bool fma = info[2] & (1 << 12);
+			const bool osxsave = info[2] & (1 << 27);
+			const bool avx = info[2] & (1 << 28);
+			bool avx2 = false;
+			if (highestLeaf >= 7) {
+				__cpuidex(info, 7, 0);
+				avx2 = info[1] & (1 << 5);
+			}
+			// The OS also has to save the upper halves of the ymm registers on a context switch
+			const bool ymmState = osxsave && (_xgetbv(0) & 0x6) == 0x6;
+			return fma && avx && avx2 && ymmState ? InstructionSet::AVX2 : InstructionSet::SSE;
+#else
+			__builtin_cpu_init();
+			return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ? InstructionSet::AVX2 : InstructionSet::SSE;
+#endif
+		}();
+		return supported;
+	}
+
+	InstructionSet BatchMath::getInstructionSet() noexcept {
+		return activeInstructionSet.load(std::memory_order_relaxed);
+	}
+
+	void BatchMath::setInstructionSet(InstructionSet instructionSet) noexcept {
+		if (instructionSet == InstructionSet::AVX2 && getSupportedInstructionSet() != InstructionSet::AVX2)
+			instructionSet = getSupportedInstructionSet();
+		activeInstructionSet.store(instructionSet, std::memory_order_relaxed);
+	}
+
+	void BatchMath::BoundsSoA::push_back(const glm::vec3& min, const glm::vec3& max) {
+		const glm::vec3 center = (min + max) * 0.5f;
+		const glm::vec3 extent = (max - min) * 0.5f;
+		centerX.push_back(center.x);
+		centerY.push_back(center.y);
+		centerZ.push_back(center.z);
+		extentX.push_back(extent.x);
+		extentY.push_back(extent.y);
+		extentZ.push_back(extent.z);
+	}
+
+	void BatchMath::BoundsSoA::clear() noexcept {
+		centerX.clear();
+		centerY.clear();
+		centerZ.clear();
+		extentX.clear();
+		extentY.clear();
+		extentZ.clear();
+	}
+
+	void BatchMath::multiply(const glm::mat4& left, const glm::mat4* right, glm::mat4* result, size_t count) noexcept {
+		switch (getInstructionSet()) {
+		case InstructionSet::AVX2: _LIKELY
+			multiplyBroadcastAVX2(left, right, result, count);
+			break;
+		case InstructionSet::SSE:
+			multiplyBroadcastSSE(left, right, result, count);
+			break;
+		default:
+			for (size_t i = 0; i < count; i++)
+				result[i] = left * right[i];
+			break;
+		}
+	}
+
+	void BatchMath::multiply(const glm::mat4* left, const glm::mat4* right, glm::mat4* result, size_t count) noexcept {
+		switch (getInstructionSet()) {
+		case InstructionSet::AVX2: _LIKELY
+			multiplyPairsAVX2(left, right, result, count);
+			break;
+		case InstructionSet::SSE:
+			multiplyPairsSSE(left, right, result, count);
+			break;
+		default:
+			for (size_t i = 0; i < count; i++)
+				result[i] = left[i] * right[i];
+			break;
+		}
+	}
+
+	void BatchMath::multiplyHierarchy(const uint32_t* parents, const glm::mat4* local, glm::mat4* world, uint32_t first, uint32_t end, uint32_t noParent) noexcept {
+		switch (getInstructionSet()) {
+		case InstructionSet::AVX2: _LIKELY
+			multiplyHierarchyAVX2(parents, local, world, first, end, noParent);
+			break;
+		case InstructionSet::SSE:
+			multiplyHierarchySSE(parents, local, world, first, end, noParent);
+			break;
+		default:
+			for (uint32_t i = first; i < end; i++)
+				world[i] = parents[i] != noParent ? local[i] * world[parents[i]] : local[i];
+			break;
+		}
+	}
+
+	void BatchMath::mergeTransformedBounds(const glm::mat4* const* matrices, const BoundsSoA& bounds, glm::vec3& min, glm::vec3& max) noexcept {
+		switch (getInstructionSet()) {
+		case InstructionSet::AVX2: _LIKELY
+			mergeTransformedBoundsAVX2(matrices, bounds, min, max);
+			break;
+		case InstructionSet::SSE:
+			mergeTransformedBoundsSSE(matrices, bounds, min, max);
+			break;
+		default:
+			mergeTransformedBoundsScalar(matrices, bounds, 0, min, max);
+			break;
+		}
+	}
+}
@@ -0,0 +1,62 @@
+/*
+* Batched matrix math
+*
+* Multiplies arrays of 4x4 matrices and transforms arrays of bounding boxes with SSE or AVX2, picked at runtime from
+* what the CPU supports. The scalar path uses glm and is the reference the SIMD paths are benchmarked against
+*/
+
+#pragma once
+#include "pch.hpp"
+
+namespace Voortman3D {
+	namespace BatchMath {
+		enum class InstructionSet {
+			Scalar,
+			SSE,
+			AVX2	// Including FMA
+		};
+
+		/** @brief Best instruction set supported by both the CPU and the OS */
+		_NODISCARD InstructionSet getSupportedInstructionSet() noexcept;
+		/** @brief Instruction set used by the functions below, the supported one unless another was forced */
+		_NODISCARD InstructionSet getInstructionSet() noexcept;
+		/** @brief Force an instruction set, one the CPU does not support falls back to the supported one */
+		void setInstructionSet(InstructionSet instructionSet) noexcept;
+
+		/*
+			Axis aligned boxes in SoA layout, stored as center and half extent
+		*/
+		struct BoundsSoA {
+			std::vector<float> centerX, centerY, centerZ;
+			std::vector<float> extentX, extentY, extentZ;
+
+			void push_back(const glm::vec3& min, const glm::vec3& max);
+			void clear() noexcept;
+			_NODISCARD size_t size() const noexcept { return centerX.size(); }
+		};
+
+		/** @brief result[i] = left * right[i], result may be right */
+		void multiply(const glm::mat4& left, const glm::mat4* right, glm::mat4* result, size_t count) noexcept;
+
+		/** @brief result[i] = left[i] * right[i], result may be left or right */
+		void multiply(const glm::mat4* left, const glm::mat4* right, glm::mat4* result, size_t count) noexcept;
+
+		/**
+		* World matrices of a hierarchy sorted parents first, world[i] = local[i] * world[parents[i]] and local[i] for roots
+		*
+		* @param noParent Parent index of roots
+		*
+		* @note Parents before first have to be final already
+		*/
+		void multiplyHierarchy(const uint32_t* parents, const glm::mat4* local, glm::mat4* world, uint32_t first, uint32_t end, uint32_t noParent) noexcept;
+
+		/**
+		* Grow min and max by boxes that are each transformed by their own matrix
+		*
+		* @param matrices Matrix of every box
+		*
+		* @note Boxes are transformed as center and extent, which gives the exact bounds of the transformed box without its corners
+		*/
+		void mergeTransformedBounds(const glm::mat4* const* matrices, const BoundsSoA& bounds, glm::vec3& min, glm::vec3& max) noexcept;
+	}
+}
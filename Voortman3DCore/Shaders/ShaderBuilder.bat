@@ -1,4 +1,7 @@
 @echo on
-..\Dependencies\glslc.exe Shaders/uioverlay.frag -o Shaders/uioverlay.frag.spv
-..\Dependencies\glslc.exe Shaders/uioverlay.frag -o Shaders/uioverlay.frag.spv
-pause
\ No newline at end of file
+
+set GLSLC="%~dp0..\..\Dependencies\glslc.exe"
+
+for %%s in (uioverlay.frag uioverlay.vert) do (
+	%GLSLC% "%~dp0%%s" -o "%~dp0%%s.spv" || exit /b 1
+)
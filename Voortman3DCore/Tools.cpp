@@ -338,5 +338,23 @@ namespace Voortman3D {
 			std::ifstream f(filename.c_str());
 			return !f.fail();
 		}
+
+		bool readFile(const std::string& filename, std::vector<unsigned char>& data)
+		{
+			std::ifstream is(filename, std::ios::binary | std::ios::in | std::ios::ate);
+			if (!is.is_open()) _UNLIKELY
+				return false;
+
+			data.resize(static_cast<size_t>(is.tellg()));
+			is.seekg(0, std::ios::beg);
+			is.read(reinterpret_cast<char*>(data.data()), data.size());
+			return !is.fail();
+		}
+
+		std::string getDirectory(const std::string& filename)
+		{
+			const size_t pos = filename.find_last_of("/\\");
+			return pos == std::string::npos ? std::string() : filename.substr(0, pos);
+		}
 	}
 }
\ No newline at end of file
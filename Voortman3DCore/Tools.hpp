@@ -73,6 +73,12 @@ namespace Voortman3D {
 		/** @brief Checks if a file exists */
 		_NODISCARD bool fileExists(const std::string& filename);
 
+		/** @brief Reads a whole file, false when it could not be opened */
+		_NODISCARD bool readFile(const std::string& filename, std::vector<unsigned char>& data);
+
+		/** @brief Directory part of a path without the trailing separator, empty for a bare file name */
+		_NODISCARD std::string getDirectory(const std::string& filename);
+
 		/// <summary>
 		/// Function to get the aligned size in any kind of integer.
 		/// </summary>
@@ -1,4 +1,5 @@
 #include "UIOverlay.hpp"
+#include "VulkanUploader.hpp"
 #include "Initializers.inl"
 
 namespace Voortman3D {
@@ -68,15 +69,10 @@ namespace Voortman3D {
 		imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
 		imageInfo.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
 		imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		device->setUploadSharingMode(imageInfo);
 		imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
 		VK_CHECK_RESULT(vkCreateImage(device->logicalDevice, &imageInfo, nullptr, &fontImage));
-		VkMemoryRequirements memReqs;
-		vkGetImageMemoryRequirements(device->logicalDevice, fontImage, &memReqs);
-		VkMemoryAllocateInfo memAllocInfo = Initializers::memoryAllocateInfo();
-		memAllocInfo.allocationSize = memReqs.size;
-		memAllocInfo.memoryTypeIndex = device->getMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-		VK_CHECK_RESULT(vkAllocateMemory(device->logicalDevice, &memAllocInfo, nullptr, &fontMemory));
-		VK_CHECK_RESULT(vkBindImageMemory(device->logicalDevice, fontImage, fontMemory, 0));
+		VK_CHECK_RESULT(device->allocateImageMemory(fontImage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &fontMemory));
 
 		// Image view
 		VkImageViewCreateInfo viewInfo = Initializers::imageViewCreateInfo();
@@ -88,33 +84,7 @@ namespace Voortman3D {
 		viewInfo.subresourceRange.layerCount = 1;
 		VK_CHECK_RESULT(vkCreateImageView(device->logicalDevice, &viewInfo, nullptr, &fontView));
 
-		// Staging buffers for font data upload
-		Buffer stagingBuffer;
-
-		VK_CHECK_RESULT(device->createBuffer(
-			VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-			&stagingBuffer,
-			uploadSize));
-
-		stagingBuffer.map();
-		memcpy(stagingBuffer.mapped, fontData, uploadSize);
-		stagingBuffer.unmap();
-
 		// Copy buffer data to font image
-		VkCommandBuffer copyCmd = device->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-
-		// Prepare for transfer
-		Tools::setImageLayout(
-			copyCmd,
-			fontImage,
-			VK_IMAGE_ASPECT_COLOR_BIT,
-			VK_IMAGE_LAYOUT_UNDEFINED,
-			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-			VK_PIPELINE_STAGE_HOST_BIT,
-			VK_PIPELINE_STAGE_TRANSFER_BIT);
-
-		// Copy
 		VkBufferImageCopy bufferCopyRegion = {};
 		bufferCopyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
 		bufferCopyRegion.imageSubresource.layerCount = 1;
@@ -122,28 +92,14 @@ namespace Voortman3D {
 		bufferCopyRegion.imageExtent.height = texHeight;
 		bufferCopyRegion.imageExtent.depth = 1;
 
-		vkCmdCopyBufferToImage(
-			copyCmd,
-			stagingBuffer.buffer,
-			fontImage,
-			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-			1,
-			&bufferCopyRegion
-		);
-
-		// Prepare for shader read
-		Tools::setImageLayout(
-			copyCmd,
-			fontImage,
-			VK_IMAGE_ASPECT_COLOR_BIT,
-			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-			VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
-			VK_PIPELINE_STAGE_TRANSFER_BIT,
-			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT);
-
-		device->flushCommandBuffer(copyCmd, queue, true);
+		VkImageSubresourceRange subresourceRange{};
+		subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+		subresourceRange.levelCount = 1;
+		subresourceRange.layerCount = 1;
 
-		stagingBuffer.destroy();
+		// The first frame waits for the upload
+		device->uploader->uploadImage(fontData, uploadSize, fontImage, subresourceRange, 1, &bufferCopyRegion);
+		device->uploader->submit();
 
 		// Font texture Sampler
 		constexpr VkSamplerCreateInfo samplerInfo = Initializers::FontTextureInitializer();
@@ -372,7 +328,7 @@ namespace Voortman3D {
 		indexBuffer.destroy();
 		vkDestroyImageView(device->logicalDevice, fontView, nullptr);
 		vkDestroyImage(device->logicalDevice, fontImage, nullptr);
-		vkFreeMemory(device->logicalDevice, fontMemory, nullptr);
+		device->freeMemory(fontMemory);
 		vkDestroySampler(device->logicalDevice, sampler, nullptr);
 		vkDestroyDescriptorSetLayout(device->logicalDevice, descriptorSetLayout, nullptr);
 		vkDestroyDescriptorPool(device->logicalDevice, descriptorPool, nullptr);
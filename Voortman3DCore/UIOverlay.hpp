@@ -31,7 +31,7 @@ namespace Voortman3D {
 		VkPipelineLayout pipelineLayout;
 		VkPipeline pipeline;
 
-		VkDeviceMemory fontMemory = VK_NULL_HANDLE;
+		Allocation fontMemory;
 		VkImage fontImage = VK_NULL_HANDLE;
 		VkImageView fontView = VK_NULL_HANDLE;
 		VkSampler sampler;
@@ -76,7 +76,7 @@ namespace Voortman3D {
 		appInfo.pEngineName = TO_CHAR(name.c_str());
 
 		// Use the newest version (older CPU or GPU cannot support this version so maybe reduce the version
-		appInfo.apiVersion = VK_VERSION_1_3;
+		appInfo.apiVersion = VK_API_VERSION_1_3;
 
 		std::vector<const char*> instanceExtensions = { VK_KHR_SURFACE_EXTENSION_NAME };
 
@@ -229,6 +229,9 @@ namespace Voortman3D {
 	}
 
 	void Voortman3DCore::destroyCommandBuffers() {
+		// Never created when the device is used without a window
+		if (!cmdPool) _UNLIKELY
+			return;
 		vkFreeCommandBuffers(device, cmdPool, static_cast<uint32_t>(drawCmdBuffers.size()), drawCmdBuffers.data());
 	}
 
@@ -289,6 +292,14 @@ namespace Voortman3D {
 		vkGetPhysicalDeviceFeatures(physicalDevice, &deviceFeatures);
 		vkGetPhysicalDeviceMemoryProperties(physicalDevice, &deviceMemoryProperties);
 
+		// Vulkan 1.2 features are queried separately, GetEnabledFeatures can request them through enabledFeatures12
+		deviceFeatures12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+		VkPhysicalDeviceFeatures2 deviceFeatures2{};
+		deviceFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+		deviceFeatures2.pNext = &deviceFeatures12;
+		vkGetPhysicalDeviceFeatures2(physicalDevice, &deviceFeatures2);
+		enabledFeatures12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+
 		GetEnabledFeatures();
 
 		// Don't throw as we will not catch exceptions
@@ -297,7 +308,16 @@ namespace Voortman3D {
 
 		GetEnabledExtensions();
 
-		VkResult res = vulkanDevice->createLogicalDevice(enabledFeatures, enabledDeviceExtensions, deviceCreatepNextChain);
+		// Uploads are tracked with a timeline semaphore, core since Vulkan 1.2
+		if (!deviceFeatures12.timelineSemaphore) _UNLIKELY {
+			std::cerr << "Selected device does not support timeline semaphores" << std::endl;
+			return;
+		}
+		enabledFeatures12.timelineSemaphore = VK_TRUE;
+		enabledFeatures12.pNext = deviceCreatepNextChain;
+
+		// A dedicated transfer family is used for uploads when the device has one
+		VkResult res = vulkanDevice->createLogicalDevice(enabledFeatures, enabledDeviceExtensions, &enabledFeatures12, true, VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT);
 
 		if (res != VK_SUCCESS) _UNLIKELY {
 			std::cerr << "Could not create Vulkan Device : \n" + Tools::errorString(res) << std::endl;
@@ -308,6 +328,12 @@ namespace Voortman3D {
 
 		vkGetDeviceQueue(device, vulkanDevice->queueFamilyIndices.graphics, 0, &queue);
 
+		vulkanDevice->allocator = new(std::nothrow) VulkanAllocator(vulkanDevice, settings.memoryBlockSize);
+		assert(vulkanDevice->allocator != nullptr);
+
+		vulkanDevice->uploader = new(std::nothrow) VulkanUploader(vulkanDevice, settings.stagingBufferSize);
+		assert(vulkanDevice->uploader != nullptr);
+
 		VkBool32 validFormat{ false };
 
 		validFormat = Tools::getSupportedDepthFormat(physicalDevice, &depthFormat);
@@ -332,10 +358,18 @@ namespace Voortman3D {
 		// Set up submit info structure
 		// Semaphores will stay the same during application lifetime
 		// Command buffer submission info is set by each example
+		submitWaitSemaphores = { semaphores.presentComplete, vulkanDevice->uploader->getSemaphore() };
+		// Uploads are read by the draws and by compute passes recorded before them, such as the occlusion cull
+		submitWaitStages = { submitPipelineStages, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT };
+		timelineSubmitInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+		timelineSubmitInfo.waitSemaphoreValueCount = static_cast<uint32_t>(submitWaitValues.size());
+		timelineSubmitInfo.pWaitSemaphoreValues = submitWaitValues.data();
+
 		submitInfo = Initializers::submitInfo();
-		submitInfo.pWaitDstStageMask = &submitPipelineStages;
-		submitInfo.waitSemaphoreCount = 1;
-		submitInfo.pWaitSemaphores = &semaphores.presentComplete;
+		submitInfo.pNext = &timelineSubmitInfo;
+		submitInfo.pWaitDstStageMask = submitWaitStages.data();
+		submitInfo.waitSemaphoreCount = static_cast<uint32_t>(submitWaitSemaphores.size());
+		submitInfo.pWaitSemaphores = submitWaitSemaphores.data();
 		submitInfo.signalSemaphoreCount = 1;
 		submitInfo.pSignalSemaphores = &semaphores.renderComplete;
 
@@ -399,6 +433,12 @@ namespace Voortman3D {
 		imageCI.samples = VK_SAMPLE_COUNT_1_BIT;
 		imageCI.tiling = VK_IMAGE_TILING_OPTIMAL;
 		imageCI.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+		// Lets the renderer read the depth of a frame back, e.g. for occlusion culling
+		VkFormatProperties formatProperties{};
+		vkGetPhysicalDeviceFormatProperties(physicalDevice, depthFormat, &formatProperties);
+		if (formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT) _LIKELY {
+			imageCI.usage |= VK_IMAGE_USAGE_SAMPLED_BIT;
+		}
 
 		VK_CHECK_RESULT(vkCreateImage(device, &imageCI, nullptr, &depthStencil.image));
 		VkMemoryRequirements memReqs{};
@@ -764,6 +804,9 @@ namespace Voortman3D {
 	}
 
 	void Voortman3DCore::prepareFrame() {
+		// Retire finished uploads and let this frame wait for the ones it may read
+		vulkanDevice->uploader->collect();
+		submitWaitValues[1] = vulkanDevice->uploader->getGraphicsWaitValue();
 
 		// Acquire the next image from the swap chain
 		VkResult result = swapChain.acquireNextImage(semaphores.presentComplete, &currentBuffer);
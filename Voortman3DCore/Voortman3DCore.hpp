@@ -4,6 +4,7 @@
 #include "Debug.hpp"
 #include "Tools.hpp"
 #include "VulkanDevice.hpp"
+#include "VulkanUploader.hpp"
 #include "VulkanSwapChain.hpp"
 #include "Initializers.inl"
 #include "Camera.hpp"
@@ -136,6 +137,10 @@ namespace Voortman3D {
 
 		VkPhysicalDeviceFeatures deviceFeatures{};
 
+		// Vulkan 1.2 features, timeline semaphores are always enabled for the uploader
+		VkPhysicalDeviceVulkan12Features deviceFeatures12{};
+		VkPhysicalDeviceVulkan12Features enabledFeatures12{};
+
 		VkPhysicalDeviceMemoryProperties deviceMemoryProperties{};
 
 		VkDescriptorPool descriptorPool{ VK_NULL_HANDLE };
@@ -153,8 +158,18 @@ namespace Voortman3D {
 			VkSemaphore renderComplete;
 		} semaphores;
 
+		// Frames wait on image acquisition and on the uploads they read, the value of the binary semaphore is ignored
+		std::array<VkSemaphore, 2> submitWaitSemaphores{};
+		std::array<VkPipelineStageFlags, 2> submitWaitStages{};
+		std::array<uint64_t, 2> submitWaitValues{};
+		VkTimelineSemaphoreSubmitInfo timelineSubmitInfo{};
+
 		struct Settings {
 			bool overlay = true;
+			// Persistently mapped memory that every upload is staged through
+			VkDeviceSize stagingBufferSize = 64 * 1024 * 1024;
+			// Device memory blocks that buffers and images are sub-allocated from, larger resources get their own allocation
+			VkDeviceSize memoryBlockSize = 64 * 1024 * 1024;
 		} settings;
 
 		std::vector<VkFence> waitFences;
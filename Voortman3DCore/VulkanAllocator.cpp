@@ -0,0 +1,217 @@
+/*
+* Vulkan device memory allocator
+*
+* Sub-allocates buffers and images from large blocks of device memory, so the number of vkAllocateMemory calls no longer
+* grows with the number of resources. Blocks are kept per memory type, per strategy and per resource type
+*/
+
+#include "pch.hpp"
+#include "VulkanAllocator.hpp"
+#include "VulkanDevice.hpp"
+#include "Initializers.inl"
+#include "Tools.hpp"
+#include <set>
+
+namespace Voortman3D {
+	struct MemoryBlock {
+		VkDeviceMemory memory{ VK_NULL_HANDLE };
+		uint8_t* mapped{ nullptr };
+		AllocationStrategy strategy{ AllocationStrategy::General };
+		std::vector<MemoryBlock*>* pool{ nullptr };
+		uint32_t liveCount{ 0 };
+
+		// General blocks, free ranges per level where level 0 is the whole block and every level halves the range size
+		std::vector<std::set<VkDeviceSize>> freeRanges;
+
+		// Linear blocks, start of the unused tail of the block
+		VkDeviceSize head{ 0 };
+	};
+
+	VulkanAllocator::VulkanAllocator(VulkanDevice* device, VkDeviceSize blockSize) : device(device) {
+		// Buddy ranges halve down to minBuddySize, which needs a power of two block
+		this->blockSize = minBuddySize;
+		levelCount = 1;
+		while (this->blockSize < blockSize) {
+			this->blockSize <<= 1;
+			levelCount++;
+		}
+
+		pools.resize(static_cast<size_t>(VK_MAX_MEMORY_TYPES) * 4);
+	}
+
+	VulkanAllocator::~VulkanAllocator() {
+		for (std::vector<MemoryBlock*>& pool : pools) {
+			for (MemoryBlock* block : pool) {
+				freeDeviceMemory(block->memory);
+				delete block;
+			}
+		}
+	}
+
+	std::vector<MemoryBlock*>& VulkanAllocator::getPool(uint32_t memoryType, AllocationStrategy strategy, ResourceType type) {
+		return pools[(static_cast<size_t>(memoryType) * 2 + static_cast<size_t>(strategy)) * 2 + static_cast<size_t>(type)];
+	}
+
+	VkResult VulkanAllocator::allocateDeviceMemory(uint32_t memoryType, VkDeviceSize size, const void* pNext, VkDeviceMemory& memory, uint8_t*& mapped) {
+		VkMemoryAllocateInfo memAlloc = Initializers::memoryAllocateInfo();
+		memAlloc.pNext = pNext;
+		memAlloc.allocationSize = size;
+		memAlloc.memoryTypeIndex = memoryType;
+		const VkResult result = vkAllocateMemory(device->logicalDevice, &memAlloc, nullptr, &memory);
+		if (result != VK_SUCCESS) _UNLIKELY {
+			std::cerr << "Could not allocate " << size << " bytes of device memory : \n" + Tools::errorString(result) << std::endl;
+			return result;
+		}
+		deviceAllocationCount++;
+
+		// Memory can only be mapped once, so host visible memory is mapped as a whole for the lifetime of the allocation
+		mapped = nullptr;
+		if (device->memoryProperties.memoryTypes[memoryType].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+			VK_CHECK_RESULT(vkMapMemory(device->logicalDevice, memory, 0, VK_WHOLE_SIZE, 0, reinterpret_cast<void**>(&mapped)));
+
+		return VK_SUCCESS;
+	}
+
+	void VulkanAllocator::freeDeviceMemory(VkDeviceMemory memory) {
+		// Freeing implicitly unmaps
+		vkFreeMemory(device->logicalDevice, memory, nullptr);
+		deviceAllocationCount--;
+	}
+
+	bool VulkanAllocator::allocateFromBlock(MemoryBlock* block, VkDeviceSize size, VkDeviceSize alignment, Allocation& allocation) {
+		if (block->strategy == AllocationStrategy::Linear) {
+			const VkDeviceSize offset = (block->head + alignment - 1) & ~(alignment - 1);
+			if (offset + size > blockSize)
+				return false;
+			block->head = offset + size;
+			allocation.offset = offset;
+			allocation.size = size;
+		}
+		else {
+			// Ranges are aligned to their own size, so a range that is large enough is also aligned enough
+			const VkDeviceSize rangeSize = (std::max)({ size, alignment, minBuddySize });
+			uint32_t level = 0;
+			while (level + 1 < levelCount && (blockSize >> (level + 1)) >= rangeSize)
+				level++;
+
+			// Split the smallest free range that fits, keeping the lower half each time
+			uint32_t freeLevel = level + 1;
+			while (freeLevel > 0 && block->freeRanges[freeLevel - 1].empty())
+				freeLevel--;
+			if (freeLevel == 0)
+				return false;
+			freeLevel--;
+
+			const VkDeviceSize offset = *block->freeRanges[freeLevel].begin();
+			block->freeRanges[freeLevel].erase(block->freeRanges[freeLevel].begin());
+			while (freeLevel < level) {
+				freeLevel++;
+				block->freeRanges[freeLevel].insert(offset + (blockSize >> freeLevel));
+			}
+
+			allocation.offset = offset;
+			allocation.size = blockSize >> level;
+			allocation.level = level;
+		}
+
+		block->liveCount++;
+		allocation.memory = block->memory;
+		allocation.mapped = block->mapped ? block->mapped + allocation.offset : nullptr;
+		allocation.block = block;
+		return true;
+	}
+
+	VkResult VulkanAllocator::allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties, ResourceType type, AllocationStrategy strategy, Allocation& allocation, const void* pNext) {
+		const uint32_t memoryType = device->getMemoryType(requirements.memoryTypeBits, properties);
+		const VkMemoryPropertyFlags typeFlags = device->memoryProperties.memoryTypes[memoryType].propertyFlags;
+
+		VkDeviceSize size = requirements.size;
+		VkDeviceSize alignment = requirements.alignment;
+		// Flushes of non coherent memory work on whole atoms, neighbouring ranges must not share one
+		if ((typeFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) && !(typeFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT)) {
+			const VkDeviceSize atomSize = device->properties.limits.nonCoherentAtomSize;
+			alignment = (std::max)(alignment, atomSize);
+			size = (size + atomSize - 1) / atomSize * atomSize;
+		}
+
+		allocation = Allocation();
+
+		// Large resources would waste most of a block, allocation flags would apply to every range of one
+		if (pNext != nullptr || size > blockSize / 2) {
+			const VkResult result = allocateDeviceMemory(memoryType, size, pNext, allocation.memory, allocation.mapped);
+			allocation.size = size;
+			return result;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		std::vector<MemoryBlock*>& pool = getPool(memoryType, strategy, type);
+		for (auto it = pool.rbegin(); it != pool.rend(); ++it) {
+			// Newest blocks first, older linear blocks are usually full
+			if (allocateFromBlock(*it, size, alignment, allocation))
+				return VK_SUCCESS;
+		}
+
+		MemoryBlock* block = new(std::nothrow) MemoryBlock();
+		assert(block != nullptr);
+		const VkResult result = allocateDeviceMemory(memoryType, blockSize, nullptr, block->memory, block->mapped);
+		if (result != VK_SUCCESS) _UNLIKELY {
+			delete block;
+			return result;
+		}
+		block->strategy = strategy;
+		block->pool = &pool;
+		if (strategy == AllocationStrategy::General) {
+			block->freeRanges.resize(levelCount);
+			block->freeRanges[0].insert(0);
+		}
+		pool.push_back(block);
+
+		const bool allocated = allocateFromBlock(block, size, alignment, allocation);
+		assert(allocated);
+		return VK_SUCCESS;
+	}
+
+	void VulkanAllocator::free(Allocation& allocation) {
+		if (!allocation.memory)
+			return;
+
+		if (!allocation.block) {
+			freeDeviceMemory(allocation.memory);
+			allocation = Allocation();
+			return;
+		}
+
+		std::lock_guard<std::mutex> lock(mutex);
+		MemoryBlock* block = allocation.block;
+		if (block->strategy == AllocationStrategy::Linear) {
+			// Space is only reused once everything in the block has been freed
+			if (block->liveCount == 1)
+				block->head = 0;
+		}
+		else {
+			// Merge with the buddy range as long as it is free as well
+			VkDeviceSize offset = allocation.offset;
+			uint32_t level = allocation.level;
+			while (level > 0) {
+				const VkDeviceSize buddy = offset ^ (blockSize >> level);
+				const auto it = block->freeRanges[level].find(buddy);
+				if (it == block->freeRanges[level].end())
+					break;
+				block->freeRanges[level].erase(it);
+				offset = (std::min)(offset, buddy);
+				level--;
+			}
+			block->freeRanges[level].insert(offset);
+		}
+		block->liveCount--;
+
+		// An empty block is kept when it is the last one of its pool, loading and unloading would otherwise allocate it again each time
+		if (block->liveCount == 0 && block->pool->size() > 1) {
+			block->pool->erase(std::find(block->pool->begin(), block->pool->end(), block));
+			freeDeviceMemory(block->memory);
+			delete block;
+		}
+
+		allocation = Allocation();
+	}
+}
@@ -0,0 +1,84 @@
+/*
+* Vulkan device memory allocator
+*
+* Sub-allocates buffers and images from large blocks of device memory, so the number of vkAllocateMemory calls no longer
+* grows with the number of resources. Blocks are kept per memory type, per strategy and per resource type
+*/
+
+#pragma once
+#include "pch.hpp"
+#include <atomic>
+
+namespace Voortman3D {
+	struct VulkanDevice;
+	struct MemoryBlock;
+
+	enum class AllocationStrategy {
+		General,	// Buddy allocation, for resources that are created and destroyed independently
+		Linear		// Bump allocation, for many small resources that are created together and destroyed together
+	};
+
+	/** @brief Buffers and optimally tiled images never share a block, which keeps them apart by more than bufferImageGranularity */
+	enum class ResourceType {
+		Buffer,
+		Image
+	};
+
+	/** @brief Range of device memory, either inside a block or a dedicated allocation when block is null */
+	struct Allocation {
+		VkDeviceMemory memory{ VK_NULL_HANDLE };
+		VkDeviceSize offset{ 0 };
+		VkDeviceSize size{ 0 };
+		/** @brief Persistently mapped address of the range for host visible memory, never unmapped by its users */
+		uint8_t* mapped{ nullptr };
+		MemoryBlock* block{ nullptr };
+		uint32_t level{ 0 };
+	};
+
+	/**
+	* @brief Sub-allocating device memory allocator
+	* @note Thread safe, the background loader allocates while the render thread does
+	*/
+	class VulkanAllocator {
+	public:
+		VulkanAllocator(VulkanDevice* device, VkDeviceSize blockSize);
+		~VulkanAllocator();
+
+		/**
+		* Allocate memory for a resource
+		*
+		* @param requirements Memory requirements of the resource
+		* @param properties Memory properties the memory type has to have
+		* @param type Kind of resource the memory is bound to
+		* @param strategy How the range is taken from a block
+		* @param allocation Receives the range
+		* @param pNext (Optional) Extension structures for vkAllocateMemory, forces a dedicated allocation
+		*
+		* @return VK_SUCCESS or the error of vkAllocateMemory
+		*/
+		VkResult allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags properties, ResourceType type, AllocationStrategy strategy, Allocation& allocation, const void* pNext = nullptr);
+
+		void free(Allocation& allocation);
+
+		/** @brief Number of live vkAllocateMemory allocations, blocks and dedicated allocations together */
+		_NODISCARD uint32_t getDeviceAllocationCount() const noexcept { return deviceAllocationCount; }
+
+	private:
+		// Smallest range of a general block, ranges are a power of two of this
+		static constexpr VkDeviceSize minBuddySize = 256;
+
+		VulkanDevice* device;
+		VkDeviceSize blockSize;
+		uint32_t levelCount;
+
+		std::mutex mutex;
+		// Indexed by memory type, strategy and resource type, see getPool
+		std::vector<std::vector<MemoryBlock*>> pools;
+		std::atomic<uint32_t> deviceAllocationCount{ 0 };
+
+		std::vector<MemoryBlock*>& getPool(uint32_t memoryType, AllocationStrategy strategy, ResourceType type);
+		VkResult allocateDeviceMemory(uint32_t memoryType, VkDeviceSize size, const void* pNext, VkDeviceMemory& memory, uint8_t*& mapped);
+		void freeDeviceMemory(VkDeviceMemory memory);
+		bool allocateFromBlock(MemoryBlock* block, VkDeviceSize size, VkDeviceSize alignment, Allocation& allocation);
+	};
+}
@@ -19,24 +19,27 @@ namespace Voortman3D {
 	* @param offset (Optional) Byte offset from beginning
 	*
 	* @return VkResult of the buffer mapping call
+	*
+	* @note Host visible memory of the allocator is persistently mapped, this only hands out the address
 	*/
 	VkResult Buffer::map(VkDeviceSize size, VkDeviceSize offset)
 	{
-		return vkMapMemory(device, memory, offset, size, 0, &mapped);
+		if (allocation.mapped == nullptr)
+		{
+			return VK_ERROR_MEMORY_MAP_FAILED;
+		}
+		mapped = allocation.mapped + offset;
+		return VK_SUCCESS;
 	}
 
 	/**
 	* Unmap a mapped memory range
 	*
-	* @note Does not return a result as vkUnmapMemory can't fail
+	* @note The memory stays mapped for the other ranges of its block, only the pointer is cleared
 	*/
 	void Buffer::unmap()
 	{
-		if (mapped)
-		{
-			vkUnmapMemory(device, memory);
-			mapped = nullptr;
-		}
+		mapped = nullptr;
 	}
 
 	/**
@@ -48,7 +51,7 @@ namespace Voortman3D {
 	*/
 	VkResult Buffer::bind(VkDeviceSize offset)
 	{
-		return vkBindBufferMemory(device, buffer, memory, offset);
+		return vkBindBufferMemory(device, buffer, memory, allocation.offset + offset);
 	}
 
 	/**
@@ -93,8 +96,8 @@ namespace Voortman3D {
 		VkMappedMemoryRange mappedRange = {};
 		mappedRange.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
 		mappedRange.memory = memory;
-		mappedRange.offset = offset;
-		mappedRange.size = size;
+		mappedRange.offset = allocation.offset + offset;
+		mappedRange.size = size == VK_WHOLE_SIZE ? allocation.size - offset : size;
 		return vkFlushMappedMemoryRanges(device, 1, &mappedRange);
 	}
 
@@ -113,8 +116,8 @@ namespace Voortman3D {
 		VkMappedMemoryRange mappedRange = {};
 		mappedRange.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
 		mappedRange.memory = memory;
-		mappedRange.offset = offset;
-		mappedRange.size = size;
+		mappedRange.offset = allocation.offset + offset;
+		mappedRange.size = size == VK_WHOLE_SIZE ? allocation.size - offset : size;
 		return vkInvalidateMappedMemoryRanges(device, 1, &mappedRange);
 	}
 
@@ -127,9 +130,12 @@ namespace Voortman3D {
 		{
 			vkDestroyBuffer(device, buffer, nullptr);
 		}
-		if (memory)
+		if (allocator)
 		{
-			vkFreeMemory(device, memory, nullptr);
+			allocator->free(allocation);
 		}
+		buffer = VK_NULL_HANDLE;
+		memory = VK_NULL_HANDLE;
+		mapped = nullptr;
 	}
 }
\ No newline at end of file
@@ -10,6 +10,7 @@
 
 #pragma once
 #include "pch.hpp"
+#include "VulkanAllocator.hpp"
 
 namespace Voortman3D {
 	/**
@@ -21,6 +22,9 @@ namespace Voortman3D {
 		VkDevice device{ VK_NULL_HANDLE };
 		VkBuffer buffer{VK_NULL_HANDLE};
 		VkDeviceMemory memory{VK_NULL_HANDLE};
+		/** @brief Range of memory the buffer is bound to, offsets passed to the functions below are relative to it */
+		Allocation allocation;
+		VulkanAllocator* allocator{ nullptr };
 		VkDescriptorBufferInfo descriptor{VK_NULL_HANDLE};
 		VkDeviceSize size = 0;
 		VkDeviceSize alignment = 0;
@@ -1,5 +1,6 @@
 #include "pch.hpp"
 #include "VulkanDevice.hpp"
+#include "VulkanUploader.hpp"
 #include "Initializers.inl"
 #include "Tools.hpp"
 
@@ -51,6 +52,15 @@ namespace Voortman3D {
 	*/
 	VulkanDevice::~VulkanDevice()
 	{
+		if (uploader)
+		{
+			delete uploader;
+		}
+		// After everything that returns memory to it
+		if (allocator)
+		{
+			delete allocator;
+		}
 		if (commandPool)
 		{
 			vkDestroyCommandPool(logicalDevice, commandPool, nullptr);
@@ -231,6 +241,7 @@ namespace Voortman3D {
 			// Else we use the same queue
 			queueFamilyIndices.transfer = queueFamilyIndices.graphics;
 		}
+		uploadQueueFamilyIndices = { queueFamilyIndices.graphics, queueFamilyIndices.transfer };
 
 		// Create the logical device representation
 		std::vector<const char*> deviceExtensions(enabledExtensions);
@@ -298,54 +309,53 @@ namespace Voortman3D {
 	* @param memoryPropertyFlags Memory properties for this buffer (i.e. device local, host visible, coherent)
 	* @param size Size of the buffer in byes
 	* @param buffer Pointer to the buffer handle acquired by the function
-	* @param memory Pointer to the memory handle acquired by the function
+	* @param allocation Pointer to the memory range acquired by the function, released with freeMemory
 	* @param data Pointer to the data that should be copied to the buffer after creation (optional, if not set, no data is copied over)
+	* @param strategy (Optional) How the memory is taken from the blocks of the allocator
 	*
 	* @return VK_SUCCESS if buffer handle and memory have been created and (optionally passed) data has been copied
 	*/
-	VkResult VulkanDevice::createBuffer(VkBufferUsageFlags usageFlags, VkMemoryPropertyFlags memoryPropertyFlags, VkDeviceSize size, VkBuffer* buffer, VkDeviceMemory* memory, void* data)
+	VkResult VulkanDevice::createBuffer(VkBufferUsageFlags usageFlags, VkMemoryPropertyFlags memoryPropertyFlags, VkDeviceSize size, VkBuffer* buffer, Allocation* allocation, void* data, AllocationStrategy strategy)
 	{
 		// Create the buffer handle
 		VkBufferCreateInfo bufferCreateInfo = Initializers::bufferCreateInfo(usageFlags, size);
 		bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+		if (usageFlags & VK_BUFFER_USAGE_TRANSFER_DST_BIT)
+		{
+			setUploadSharingMode(bufferCreateInfo);
+		}
 		VK_CHECK_RESULT(vkCreateBuffer(logicalDevice, &bufferCreateInfo, nullptr, buffer));
 
-		// Create the memory backing up the buffer handle
+		// Take the memory backing up the buffer handle from the allocator
 		VkMemoryRequirements memReqs;
-		VkMemoryAllocateInfo memAlloc = Initializers::memoryAllocateInfo();
 		vkGetBufferMemoryRequirements(logicalDevice, *buffer, &memReqs);
-		memAlloc.allocationSize = memReqs.size;
-		// Find a memory type index that fits the properties of the buffer
-		memAlloc.memoryTypeIndex = getMemoryType(memReqs.memoryTypeBits, memoryPropertyFlags);
 		// If the buffer has VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT set we also need to enable the appropriate flag during allocation
 		VkMemoryAllocateFlagsInfoKHR allocFlagsInfo{};
+		const void* pNext = nullptr;
 		if (usageFlags & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT) {
 			allocFlagsInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO_KHR;
 			allocFlagsInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT_KHR;
-			memAlloc.pNext = &allocFlagsInfo;
+			pNext = &allocFlagsInfo;
 		}
-		VK_CHECK_RESULT(vkAllocateMemory(logicalDevice, &memAlloc, nullptr, memory));
+		VK_CHECK_RESULT(allocator->allocate(memReqs, memoryPropertyFlags, ResourceType::Buffer, strategy, *allocation, pNext));
 
-		// If a pointer to the buffer data has been passed, map the buffer and copy over the data
+		// If a pointer to the buffer data has been passed, copy over the data through the persistent mapping
 		if (data != nullptr)
 		{
-			void* mapped;
-			VK_CHECK_RESULT(vkMapMemory(logicalDevice, *memory, 0, size, 0, &mapped));
-			memcpy(mapped, data, size);
+			memcpy(allocation->mapped, data, size);
 			// If host coherency hasn't been requested, do a manual flush to make writes visible
 			if ((memoryPropertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) == 0)
 			{
 				VkMappedMemoryRange mappedRange = Initializers::mappedMemoryRange();
-				mappedRange.memory = *memory;
-				mappedRange.offset = 0;
-				mappedRange.size = size;
+				mappedRange.memory = allocation->memory;
+				mappedRange.offset = allocation->offset;
+				mappedRange.size = allocation->size;
 				vkFlushMappedMemoryRanges(logicalDevice, 1, &mappedRange);
 			}
-			vkUnmapMemory(logicalDevice, *memory);
 		}
 
 		// Attach the memory to the buffer object
-		VK_CHECK_RESULT(vkBindBufferMemory(logicalDevice, *buffer, *memory, 0));
+		VK_CHECK_RESULT(vkBindBufferMemory(logicalDevice, *buffer, allocation->memory, allocation->offset));
 
 		return VK_SUCCESS;
 	}
@@ -364,26 +374,29 @@ namespace Voortman3D {
 	VkResult VulkanDevice::createBuffer(VkBufferUsageFlags usageFlags, VkMemoryPropertyFlags memoryPropertyFlags, Buffer* buffer, VkDeviceSize size, void* data)
 	{
 		buffer->device = logicalDevice;
+		buffer->allocator = allocator;
 
 		// Create the buffer handle
 		VkBufferCreateInfo bufferCreateInfo = Initializers::bufferCreateInfo(usageFlags, size);
+		if (usageFlags & VK_BUFFER_USAGE_TRANSFER_DST_BIT)
+		{
+			setUploadSharingMode(bufferCreateInfo);
+		}
 		VK_CHECK_RESULT(vkCreateBuffer(logicalDevice, &bufferCreateInfo, nullptr, &buffer->buffer));
 
-		// Create the memory backing up the buffer handle
+		// Take the memory backing up the buffer handle from the allocator
 		VkMemoryRequirements memReqs;
-		VkMemoryAllocateInfo memAlloc = Initializers::memoryAllocateInfo();
 		vkGetBufferMemoryRequirements(logicalDevice, buffer->buffer, &memReqs);
-		memAlloc.allocationSize = memReqs.size;
-		// Find a memory type index that fits the properties of the buffer
-		memAlloc.memoryTypeIndex = getMemoryType(memReqs.memoryTypeBits, memoryPropertyFlags);
 		// If the buffer has VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT set we also need to enable the appropriate flag during allocation
 		VkMemoryAllocateFlagsInfoKHR allocFlagsInfo{};
+		const void* pNext = nullptr;
 		if (usageFlags & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT) {
 			allocFlagsInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO_KHR;
 			allocFlagsInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT_KHR;
-			memAlloc.pNext = &allocFlagsInfo;
+			pNext = &allocFlagsInfo;
 		}
-		VK_CHECK_RESULT(vkAllocateMemory(logicalDevice, &memAlloc, nullptr, &buffer->memory));
+		VK_CHECK_RESULT(allocator->allocate(memReqs, memoryPropertyFlags, ResourceType::Buffer, AllocationStrategy::General, buffer->allocation, pNext));
+		buffer->memory = buffer->allocation.memory;
 
 		buffer->alignment = memReqs.alignment;
 		buffer->size = size;
@@ -409,20 +422,52 @@ namespace Voortman3D {
 	}
 
 	/**
-	* Copy buffer data from src to dst using VkCmdCopyBuffer
+	* Allocate and bind the memory of an image
+	*
+	* @param image Image to bind the memory to
+	* @param memoryPropertyFlags Memory properties for the image, usually device local
+	* @param allocation Pointer to the memory range acquired by the function, released with freeMemory
+	*
+	* @return VK_SUCCESS if the memory has been allocated and bound
+	*
+	* @note Only for optimally tiled images, they are kept in other blocks than buffers
+	*/
+	VkResult VulkanDevice::allocateImageMemory(VkImage image, VkMemoryPropertyFlags memoryPropertyFlags, Allocation* allocation)
+	{
+		VkMemoryRequirements memReqs;
+		vkGetImageMemoryRequirements(logicalDevice, image, &memReqs);
+		VK_CHECK_RESULT(allocator->allocate(memReqs, memoryPropertyFlags, ResourceType::Image, AllocationStrategy::General, *allocation));
+		return vkBindImageMemory(logicalDevice, image, allocation->memory, allocation->offset);
+	}
+
+	/**
+	* Return memory acquired by createBuffer or allocateImageMemory to the allocator
+	*
+	* @param allocation Range to release, reset to an empty range
+	*
+	* @note The resource bound to it has to be destroyed or no longer be in use
+	*/
+	void VulkanDevice::freeMemory(Allocation& allocation)
+	{
+		allocator->free(allocation);
+	}
+
+	/**
+	* Copy buffer data from src to dst using VkCmdCopyBuffer on the upload queue
 	*
 	* @param src Pointer to the source buffer to copy from
 	* @param dst Pointer to the destination buffer to copy to
-	* @param queue Pointer
 	* @param copyRegion (Optional) Pointer to a copy region, if NULL, the whole buffer is copied
 	*
+	* @return Timeline value of the uploader that is signaled once the copy has completed, frames submitted after this call wait for it
+	*
 	* @note Source and destination pointers must have the appropriate transfer usage flags set (TRANSFER_SRC / TRANSFER_DST)
+	* @note The source buffer has to stay alive until the returned value has been reached
 	*/
-	void VulkanDevice::copyBuffer(Buffer* src, Buffer* dst, VkQueue queue, VkBufferCopy* copyRegion)
+	uint64_t VulkanDevice::copyBuffer(Buffer* src, Buffer* dst, VkBufferCopy* copyRegion)
 	{
 		assert(dst->size <= src->size);
 		assert(src->buffer);
-		VkCommandBuffer copyCmd = createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
 		VkBufferCopy bufferCopy{};
 		if (copyRegion == nullptr)
 		{
@@ -433,9 +478,8 @@ namespace Voortman3D {
 			bufferCopy = *copyRegion;
 		}
 
-		vkCmdCopyBuffer(copyCmd, src->buffer, dst->buffer, 1, &bufferCopy);
-
-		flushCommandBuffer(copyCmd, queue);
+		uploader->copyBuffer(src->buffer, dst->buffer, 1, &bufferCopy);
+		return uploader->submit();
 	}
 
 	/**
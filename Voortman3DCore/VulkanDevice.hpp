@@ -13,6 +13,8 @@
 #include "VulkanBuffer.hpp"
 
 namespace Voortman3D {
+	class VulkanUploader;
+
 	struct VulkanDevice
 	{
 		/** @brief Physical device representation */
@@ -40,6 +42,12 @@ namespace Voortman3D {
 			uint32_t compute;
 			uint32_t transfer;
 		} queueFamilyIndices;
+		/** @brief Graphics and transfer queue family, shared by resources that the uploader writes on a dedicated transfer family */
+		std::array<uint32_t, 2> uploadQueueFamilyIndices{};
+		/** @brief Upload queue, created once the logical device has timeline semaphores enabled and destroyed with the device */
+		VulkanUploader* uploader{ nullptr };
+		/** @brief Device memory allocator all buffers and images take their memory from, created with the logical device */
+		VulkanAllocator* allocator{ nullptr };
 		operator VkDevice() const
 		{
 			return logicalDevice;
@@ -49,9 +57,11 @@ namespace Voortman3D {
 		uint32_t        getMemoryType(uint32_t typeBits, VkMemoryPropertyFlags properties, VkBool32* memTypeFound = nullptr) const;
 		uint32_t        getQueueFamilyIndex(VkQueueFlags queueFlags) const;
 		VkResult        createLogicalDevice(VkPhysicalDeviceFeatures enabledFeatures, std::vector<const char*> enabledExtensions, void* pNextChain, bool useSwapChain = true, VkQueueFlags requestedQueueTypes = VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT);
-		VkResult        createBuffer(VkBufferUsageFlags usageFlags, VkMemoryPropertyFlags memoryPropertyFlags, VkDeviceSize size, VkBuffer* buffer, VkDeviceMemory* memory, void* data = nullptr);
+		VkResult        createBuffer(VkBufferUsageFlags usageFlags, VkMemoryPropertyFlags memoryPropertyFlags, VkDeviceSize size, VkBuffer* buffer, Allocation* allocation, void* data = nullptr, AllocationStrategy strategy = AllocationStrategy::General);
 		VkResult        createBuffer(VkBufferUsageFlags usageFlags, VkMemoryPropertyFlags memoryPropertyFlags, Buffer* buffer, VkDeviceSize size, void* data = nullptr);
-		void            copyBuffer(Buffer* src, Buffer* dst, VkQueue queue, VkBufferCopy* copyRegion = nullptr);
+		VkResult        allocateImageMemory(VkImage image, VkMemoryPropertyFlags memoryPropertyFlags, Allocation* allocation);
+		void            freeMemory(Allocation& allocation);
+		uint64_t        copyBuffer(Buffer* src, Buffer* dst, VkBufferCopy* copyRegion = nullptr);
 		VkCommandPool   createCommandPool(uint32_t queueFamilyIndex, VkCommandPoolCreateFlags createFlags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT);
 		VkCommandBuffer createCommandBuffer(VkCommandBufferLevel level, VkCommandPool pool, bool begin = false);
 		VkCommandBuffer createCommandBuffer(VkCommandBufferLevel level, bool begin = false);
@@ -59,5 +69,17 @@ namespace Voortman3D {
 		void            flushCommandBuffer(VkCommandBuffer commandBuffer, VkQueue queue, bool free = true);
 		bool            extensionSupported(std::string extension);
 		VkFormat        getSupportedDepthFormat(bool checkSamplingSupport);
+
+		/** @brief Lets a resource written on a dedicated transfer family be read by the graphics queue without an ownership transfer */
+		template <typename CreateInfo>
+		void setUploadSharingMode(CreateInfo& createInfo) const noexcept
+		{
+			if (queueFamilyIndices.transfer != queueFamilyIndices.graphics)
+			{
+				createInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+				createInfo.queueFamilyIndexCount = static_cast<uint32_t>(uploadQueueFamilyIndices.size());
+				createInfo.pQueueFamilyIndices = uploadQueueFamilyIndices.data();
+			}
+		}
 	};
 }
\ No newline at end of file
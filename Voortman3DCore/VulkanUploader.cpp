@@ -0,0 +1,315 @@
+/*
+* Vulkan upload queue
+*
+* Records copies into device local resources on the dedicated transfer queue family when the device has one. Copies are
+* batched per submit and completion is tracked with a timeline semaphore that the graphics queue waits on, so the CPU
+* never has to wait for an upload. Source data goes through one persistently mapped staging ring
+*/
+
+#include "pch.hpp"
+#include "VulkanUploader.hpp"
+#include "Initializers.inl"
+#include "Tools.hpp"
+
+namespace Voortman3D {
+	StagingRing::StagingRing(VulkanDevice* device, VkDeviceSize size) : device(device), size(size & ~(alignment - 1)) {
+		VK_CHECK_RESULT(device->createBuffer(
+			VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			this->size,
+			&buffer,
+			&memory));
+	}
+
+	StagingRing::~StagingRing() {
+		assert(ranges.empty());
+		vkDestroyBuffer(device->logicalDevice, buffer, nullptr);
+		device->freeMemory(memory);
+	}
+
+	bool StagingRing::tryAllocate(VkDeviceSize requestedSize, StagingAllocation& allocation) {
+		const VkDeviceSize alignedSize = (requestedSize + alignment - 1) & ~(alignment - 1);
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (alignedSize == 0 || alignedSize > size) _UNLIKELY
+			return false;
+
+		// A range that doesn't fit before the end starts at the beginning and also holds on to the end of the buffer
+		VkDeviceSize offset = head;
+		VkDeviceSize consumed = alignedSize;
+		if (head + alignedSize > size) {
+			offset = 0;
+			consumed += size - head;
+		}
+		if (used + consumed > size)
+			return false;
+
+		ranges.push_back({ consumed, 0, false });
+		used += consumed;
+		head = offset + alignedSize;
+
+		allocation.id = nextId++;
+		allocation.offset = offset;
+		allocation.size = alignedSize;
+		allocation.mapped = memory.mapped + offset;
+		return true;
+	}
+
+	void StagingRing::release(const StagingAllocation& allocation, uint64_t uploadValue) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			Range& range = ranges[static_cast<size_t>(allocation.id - (nextId - ranges.size()))];
+			range.uploadValue = uploadValue;
+			range.released = true;
+		}
+		// Freed ranges may be at the front already
+		if (uploadValue == 0)
+			recycle(0);
+	}
+
+	void StagingRing::recycle(uint64_t completedValue) {
+		bool recycled = false;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			// Ranges are recycled in allocation order, which keeps the free space contiguous
+			while (!ranges.empty() && ranges.front().released && ranges.front().uploadValue <= completedValue) {
+				const VkDeviceSize consumed = ranges.front().consumed;
+				tail = tail + consumed >= size ? tail + consumed - size : tail + consumed;
+				used -= consumed;
+				ranges.pop_front();
+				recycled = true;
+			}
+			if (used == 0)
+				head = tail = 0;
+		}
+		if (recycled)
+			condition.notify_all();
+	}
+
+	void StagingRing::waitForSpace(std::chrono::milliseconds timeout) {
+		std::unique_lock<std::mutex> lock(mutex);
+		condition.wait_for(lock, timeout);
+	}
+
+	VulkanUploader::VulkanUploader(VulkanDevice* device, VkDeviceSize stagingSize) : device(device), stagingRing(device, stagingSize) {
+		vkGetDeviceQueue(device->logicalDevice, device->queueFamilyIndices.transfer, 0, &queue);
+		commandPool = device->createCommandPool(device->queueFamilyIndices.transfer);
+
+		VkSemaphoreTypeCreateInfo semaphoreTypeInfo{};
+		semaphoreTypeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+		semaphoreTypeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+		semaphoreTypeInfo.initialValue = 0;
+		VkSemaphoreCreateInfo semaphoreCreateInfo = Initializers::semaphoreCreateInfo();
+		semaphoreCreateInfo.pNext = &semaphoreTypeInfo;
+		VK_CHECK_RESULT(vkCreateSemaphore(device->logicalDevice, &semaphoreCreateInfo, nullptr, &semaphore));
+	}
+
+	VulkanUploader::~VulkanUploader() {
+		// Only at shutdown, uploads that are still running read from staging memory
+		if (recording.commandBuffer)
+			submit(false);
+		if (!inFlight.empty())
+			VK_CHECK_RESULT(vkQueueWaitIdle(queue));
+		collect();
+
+		vkDestroySemaphore(device->logicalDevice, semaphore, nullptr);
+		vkDestroyCommandPool(device->logicalDevice, commandPool, nullptr);
+	}
+
+	VkCommandBuffer VulkanUploader::getCommandBuffer() {
+		if (recording.commandBuffer)
+			return recording.commandBuffer;
+
+		if (freeCommandBuffers.empty()) {
+			recording.commandBuffer = device->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, commandPool);
+		}
+		else {
+			recording.commandBuffer = freeCommandBuffers.back();
+			freeCommandBuffers.pop_back();
+		}
+
+		VkCommandBufferBeginInfo beginInfo = Initializers::commandBufferBeginInfo();
+		beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+		VK_CHECK_RESULT(vkBeginCommandBuffer(recording.commandBuffer, &beginInfo));
+		return recording.commandBuffer;
+	}
+
+	bool VulkanUploader::beginStaging(VkDeviceSize size, Staging& staging) {
+		if (size > getStagingChunkSize()) _UNLIKELY {
+			staging = createDedicatedStaging(size);
+			return true;
+		}
+
+		if (!stagingRing.tryAllocate(size, staging.allocation)) _UNLIKELY {
+			// Send what has been recorded so its ranges come back, and take back those of batches that have completed by now
+			if (recording.commandBuffer)
+				submit();
+			collect();
+			if (!stagingRing.tryAllocate(size, staging.allocation))
+				return false;
+		}
+
+		staging.buffer = stagingRing.getBuffer();
+		staging.offset = staging.allocation.offset;
+		staging.mapped = staging.allocation.mapped;
+		return true;
+	}
+
+	VulkanUploader::Staging VulkanUploader::createDedicatedStaging(VkDeviceSize size) {
+		Staging staging;
+		Allocation memory;
+		VK_CHECK_RESULT(device->createBuffer(
+			VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			size,
+			&staging.buffer,
+			&memory));
+		staging.mapped = memory.mapped;
+		recording.stagingBuffers.emplace_back(staging.buffer, memory);
+		staging.dedicated = true;
+		return staging;
+	}
+
+	void VulkanUploader::endStaging(Staging& staging) {
+		// Dedicated buffers are destroyed once their batch has completed
+		if (!staging.dedicated) _LIKELY
+			releaseStaging(staging.allocation);
+	}
+
+	void VulkanUploader::uploadBuffer(const void* data, VkDeviceSize size, VkBuffer dst, VkDeviceSize dstOffset) {
+		const uint8_t* src = static_cast<const uint8_t*>(data);
+		const VkDeviceSize chunkSize = getStagingChunkSize();
+
+		while (size > 0) {
+			const VkDeviceSize copySize = (std::min)(size, chunkSize);
+			Staging staging;
+			// Instead of waiting for the ring, collect frees the buffer once its batch has completed
+			if (!beginStaging(copySize, staging)) _UNLIKELY
+				staging = createDedicatedStaging(copySize);
+			memcpy(staging.mapped, src, copySize);
+
+			const VkBufferCopy region{ staging.offset, dstOffset, copySize };
+			copyBuffer(staging.buffer, dst, 1, &region);
+			endStaging(staging);
+
+			src += copySize;
+			dstOffset += copySize;
+			size -= copySize;
+		}
+	}
+
+	void VulkanUploader::uploadImage(const void* data, VkDeviceSize size, VkImage dst, const VkImageSubresourceRange& subresourceRange, uint32_t regionCount, const VkBufferImageCopy* regions) {
+		// Regions can't be split over several ranges without knowing the image layout, an image is staged as a whole
+		Staging staging;
+		if (!beginStaging(size, staging)) _UNLIKELY
+			staging = createDedicatedStaging(size);
+		recordImageUpload(staging, data, size, dst, subresourceRange, regionCount, regions, VK_IMAGE_LAYOUT_UNDEFINED);
+	}
+
+	bool VulkanUploader::tryUploadImage(const void* data, VkDeviceSize size, VkImage dst, const VkImageSubresourceRange& subresourceRange, uint32_t regionCount, const VkBufferImageCopy* regions, VkImageLayout oldLayout) {
+		Staging staging;
+		if (!beginStaging(size, staging))
+			return false;
+		recordImageUpload(staging, data, size, dst, subresourceRange, regionCount, regions, oldLayout);
+		return true;
+	}
+
+	void VulkanUploader::recordImageUpload(Staging& staging, const void* data, VkDeviceSize size, VkImage dst, const VkImageSubresourceRange& subresourceRange, uint32_t regionCount, const VkBufferImageCopy* regions, VkImageLayout oldLayout) {
+		memcpy(staging.mapped, data, size);
+
+		std::vector<VkBufferImageCopy> stagedRegions(regions, regions + regionCount);
+		for (VkBufferImageCopy& region : stagedRegions)
+			region.bufferOffset += staging.offset;
+
+		const VkCommandBuffer commandBuffer = getCommandBuffer();
+
+		VkImageMemoryBarrier barrier = Initializers::imageMemoryBarrier();
+		barrier.image = dst;
+		barrier.subresourceRange = subresourceRange;
+		barrier.oldLayout = oldLayout;
+		barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.srcAccessMask = 0;
+		barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+		vkCmdCopyBufferToImage(commandBuffer, staging.buffer, dst, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, regionCount, stagedRegions.data());
+
+		// Shader stages don't exist on a transfer queue, the semaphore wait of the frame makes the image visible to them
+		barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+		barrier.dstAccessMask = 0;
+		vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+		endStaging(staging);
+	}
+
+	void VulkanUploader::copyBuffer(VkBuffer src, VkBuffer dst, uint32_t regionCount, const VkBufferCopy* regions) {
+		if (regionCount == 0) _UNLIKELY
+			return;
+		vkCmdCopyBuffer(getCommandBuffer(), src, dst, regionCount, regions);
+	}
+
+	void VulkanUploader::fillBuffer(VkBuffer dst, VkDeviceSize offset, VkDeviceSize size, uint32_t data) {
+		vkCmdFillBuffer(getCommandBuffer(), dst, offset, size, data);
+	}
+
+	uint64_t VulkanUploader::submit(bool graphicsWait) {
+		if (!recording.commandBuffer && recording.stagingBuffers.empty())
+			return submittedValue;
+
+		const VkCommandBuffer commandBuffer = getCommandBuffer();
+		VK_CHECK_RESULT(vkEndCommandBuffer(commandBuffer));
+
+		recording.value = ++submittedValue;
+
+		VkTimelineSemaphoreSubmitInfo timelineInfo{};
+		timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+		timelineInfo.signalSemaphoreValueCount = 1;
+		timelineInfo.pSignalSemaphoreValues = &recording.value;
+
+		VkSubmitInfo submitInfo = Initializers::submitInfo();
+		submitInfo.pNext = &timelineInfo;
+		submitInfo.commandBufferCount = 1;
+		submitInfo.pCommandBuffers = &commandBuffer;
+		submitInfo.signalSemaphoreCount = 1;
+		submitInfo.pSignalSemaphores = &semaphore;
+		VK_CHECK_RESULT(vkQueueSubmit(queue, 1, &submitInfo, VK_NULL_HANDLE));
+
+		if (graphicsWait)
+			waitOnGraphics(recording.value);
+
+		inFlight.push_back(std::move(recording));
+		recording = Batch();
+		return submittedValue;
+	}
+
+	void VulkanUploader::waitOnGraphics(uint64_t value) noexcept {
+		graphicsWaitValue = (std::max)(graphicsWaitValue, value);
+	}
+
+	bool VulkanUploader::isComplete(uint64_t value) const {
+		uint64_t completedValue;
+		VK_CHECK_RESULT(vkGetSemaphoreCounterValue(device->logicalDevice, semaphore, &completedValue));
+		return completedValue >= value;
+	}
+
+	void VulkanUploader::collect() {
+		uint64_t completedValue;
+		VK_CHECK_RESULT(vkGetSemaphoreCounterValue(device->logicalDevice, semaphore, &completedValue));
+
+		// Also with nothing in flight, the loader thread waits for ranges it released before their batch was submitted
+		stagingRing.recycle(completedValue);
+
+		// Batches complete in submission order
+		while (!inFlight.empty() && inFlight.front().value <= completedValue) {
+			Batch& batch = inFlight.front();
+			for (auto& [buffer, memory] : batch.stagingBuffers) {
+				vkDestroyBuffer(device->logicalDevice, buffer, nullptr);
+				device->freeMemory(memory);
+			}
+			freeCommandBuffers.push_back(batch.commandBuffer);
+			inFlight.pop_front();
+		}
+	}
+}
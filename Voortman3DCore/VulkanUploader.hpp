@@ -0,0 +1,182 @@
+/*
+* Vulkan upload queue
+*
+* Records copies into device local resources on the dedicated transfer queue family when the device has one. Copies are
+* batched per submit and completion is tracked with a timeline semaphore that the graphics queue waits on, so the CPU
+* never has to wait for an upload. Source data goes through one persistently mapped staging ring
+*/
+
+#pragma once
+#include "pch.hpp"
+#include "VulkanDevice.hpp"
+#include <deque>
+
+namespace Voortman3D {
+	/** @brief Range of the staging ring, writable through mapped until it is released */
+	struct StagingAllocation {
+		uint64_t id{ 0 };
+		VkDeviceSize offset{ 0 };
+		VkDeviceSize size{ 0 };
+		uint8_t* mapped{ nullptr };
+	};
+
+	/**
+	* @brief Persistently mapped staging buffer that hands out ranges in allocation order
+	* @note Thread safe, a range is recycled once it and every range allocated before it have been released and their upload has completed
+	*/
+	class StagingRing {
+	public:
+		// Offsets and sizes are kept at a multiple of this, which covers the texel size of every format used for image copies
+		static constexpr VkDeviceSize alignment = 16;
+
+		StagingRing(VulkanDevice* device, VkDeviceSize size);
+		~StagingRing();
+
+		_NODISCARD bool tryAllocate(VkDeviceSize size, StagingAllocation& allocation);
+
+		/** @brief Hand the range back, it is recycled once the timeline value is reached, 0 recycles it right away */
+		void release(const StagingAllocation& allocation, uint64_t uploadValue);
+
+		/** @brief Recycle the released ranges up to the completed timeline value */
+		void recycle(uint64_t completedValue);
+
+		/** @brief Block until ranges have been recycled or the timeout has passed */
+		void waitForSpace(std::chrono::milliseconds timeout);
+
+		_NODISCARD VkBuffer getBuffer() const noexcept { return buffer; }
+		_NODISCARD VkDeviceSize getSize() const noexcept { return size; }
+
+	private:
+		struct Range {
+			VkDeviceSize consumed{ 0 };	// Including the end of the buffer that was skipped to keep the range contiguous
+			uint64_t uploadValue{ 0 };
+			bool released{ false };
+		};
+
+		VulkanDevice* device;
+		VkBuffer buffer{ VK_NULL_HANDLE };
+		Allocation memory;
+		VkDeviceSize size;
+
+		std::mutex mutex;
+		std::condition_variable condition;
+		std::deque<Range> ranges;
+		uint64_t nextId{ 0 };
+		VkDeviceSize head{ 0 };
+		VkDeviceSize tail{ 0 };
+		VkDeviceSize used{ 0 };
+	};
+
+	/**
+	* @brief Batches buffer and image uploads on the transfer queue
+	* @note Not thread safe, all calls are made from the render thread except the staging functions marked otherwise
+	*/
+	class VulkanUploader {
+	public:
+		VulkanUploader(VulkanDevice* device, VkDeviceSize stagingSize);
+		~VulkanUploader();
+
+		/**
+		* Copy data into a buffer, larger uploads are split over several ranges of the staging ring
+		*
+		* @note Never waits for the GPU, chunks that find the ring full are staged in a buffer of their own that collect frees once their batch has completed
+		*/
+		void uploadBuffer(const void* data, VkDeviceSize size, VkBuffer dst, VkDeviceSize dstOffset = 0);
+
+		/**
+		* Copy data into an image
+		*
+		* @param regions Copy regions with bufferOffset relative to data
+		*
+		* @note The image is taken from an undefined layout and left in VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL. Like uploadBuffer it never
+		* waits, a full ring makes it stage the image in a buffer of its own
+		*/
+		void uploadImage(const void* data, VkDeviceSize size, VkImage dst, const VkImageSubresourceRange& subresourceRange, uint32_t regionCount, const VkBufferImageCopy* regions);
+
+		/**
+		* Copy data into an image through the staging ring only
+		*
+		* @param oldLayout Layout of the subresource range, images that may be sampled while their other levels are filled in keep those
+		* levels in VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL
+		*
+		* @return False when the ring is full, nothing is recorded then and the upload can be tried again after the next collect
+		*/
+		_NODISCARD bool tryUploadImage(const void* data, VkDeviceSize size, VkImage dst, const VkImageSubresourceRange& subresourceRange, uint32_t regionCount, const VkBufferImageCopy* regions, VkImageLayout oldLayout = VK_IMAGE_LAYOUT_UNDEFINED);
+
+		/** @brief Record a buffer copy into the current batch */
+		void copyBuffer(VkBuffer src, VkBuffer dst, uint32_t regionCount, const VkBufferCopy* regions);
+
+		/** @brief Record a fill of a buffer range with a repeated 32-bit value into the current batch */
+		void fillBuffer(VkBuffer dst, VkDeviceSize offset, VkDeviceSize size, uint32_t data);
+
+		/** @brief Allocate a range of the staging ring without blocking, thread safe */
+		_NODISCARD bool tryAllocateStaging(VkDeviceSize size, StagingAllocation& allocation) { return stagingRing.tryAllocate(size, allocation); }
+		/** @brief Wait for staging ranges to be recycled, thread safe */
+		void waitForStaging(std::chrono::milliseconds timeout) { stagingRing.waitForSpace(timeout); }
+		/** @brief Return a range that was never copied from, thread safe */
+		void freeStaging(const StagingAllocation& allocation) { stagingRing.release(allocation, 0); }
+		/** @brief Return a range once the copies reading it have been recorded into the current batch */
+		void releaseStaging(const StagingAllocation& allocation) { stagingRing.release(allocation, submittedValue + 1); }
+		_NODISCARD VkBuffer getStagingBuffer() const noexcept { return stagingRing.getBuffer(); }
+		/** @brief Largest range that is handed out at once, a quarter of the ring so several uploads can be in flight */
+		_NODISCARD VkDeviceSize getStagingChunkSize() const noexcept { return stagingRing.getSize() / 4; }
+
+		/**
+		* Submit the current batch
+		*
+		* @param graphicsWait Make the next frames wait for this batch, callers that poll isComplete before using the data can skip this
+		*
+		* @return Timeline value that is signaled once the batch has completed
+		*/
+		uint64_t submit(bool graphicsWait = true);
+
+		/** @brief Make the next frames wait for the given value, needed once before the graphics queue reads data of a polled batch */
+		void waitOnGraphics(uint64_t value) noexcept;
+
+		_NODISCARD bool isComplete(uint64_t value) const;
+
+		/** @brief Recycle the command buffers and staging ranges of completed batches, called once per frame */
+		void collect();
+
+		_NODISCARD VkSemaphore getSemaphore() const noexcept { return semaphore; }
+		_NODISCARD uint64_t getGraphicsWaitValue() const noexcept { return graphicsWaitValue; }
+
+	private:
+		struct Batch {
+			VkCommandBuffer commandBuffer{ VK_NULL_HANDLE };
+			uint64_t value{ 0 };
+			// Only used when an upload does not fit in the staging ring
+			std::vector<std::pair<VkBuffer, Allocation>> stagingBuffers;
+		};
+
+		/** @brief Source of a single upload, a ring range or a dedicated buffer when the ring cannot hold it */
+		struct Staging {
+			VkBuffer buffer{ VK_NULL_HANDLE };
+			VkDeviceSize offset{ 0 };
+			uint8_t* mapped{ nullptr };
+			StagingAllocation allocation;
+			bool dedicated{ false };
+		};
+
+		VulkanDevice* device;
+		VkQueue queue{ VK_NULL_HANDLE };
+		VkCommandPool commandPool{ VK_NULL_HANDLE };
+		VkSemaphore semaphore{ VK_NULL_HANDLE };
+		StagingRing stagingRing;
+
+		uint64_t submittedValue{ 0 };
+		uint64_t graphicsWaitValue{ 0 };
+
+		Batch recording;
+		std::deque<Batch> inFlight;
+		std::vector<VkCommandBuffer> freeCommandBuffers;
+
+		VkCommandBuffer getCommandBuffer();
+		/** @brief Take a range of the ring, false when it is full. Sizes above a chunk always get a dedicated buffer */
+		_NODISCARD bool beginStaging(VkDeviceSize size, Staging& staging);
+		/** @brief Buffer for a single upload, destroyed by collect once its batch has completed */
+		_NODISCARD Staging createDedicatedStaging(VkDeviceSize size);
+		void endStaging(Staging& staging);
+		void recordImageUpload(Staging& staging, const void* data, VkDeviceSize size, VkImage dst, const VkImageSubresourceRange& subresourceRange, uint32_t regionCount, const VkBufferImageCopy* regions, VkImageLayout oldLayout);
+	};
+}
@@ -0,0 +1,315 @@
+/*
+* glTF accessor decoding
+*
+* Decodes vertex attribute accessors of any layout (interleaved bufferViews with a byteStride, normalized
+* byte/short components and KHR_mesh_quantization) into the tightly packed float layout of vkglTF::Vertex
+*/
+
+#include "pch.hpp"
+#include "VulkanglTFAccessor.hpp"
+#include "BatchMath.hpp"
+
+#include <immintrin.h>
+#include <limits>
+#include <type_traits>
+
+// MSVC compiles AVX2 intrinsics without /arch:AVX2, other compilers have to enable them per function
+#if defined(__GNUC__) || defined(__clang__)
+#define ACCESSOR_AVX2 __attribute__((target("avx2,fma")))
+#else
+#define ACCESSOR_AVX2
+#endif
+
+namespace Voortman3D {
+	namespace {
+		template <typename T>
+		_NODISCARD inline T loadComponent(const uint8_t* p) noexcept {
+			// memcpy instead of a cast as components of interleaved views don't have to be aligned to their size
+			T value;
+			memcpy(&value, p, sizeof(T));
+			return value;
+		}
+
+		/*
+			Vec3 decode kernel for one component type
+
+			Elements are processed in blocks of four: the rows are loaded (SSE) or gathered (AVX2, when BatchMath
+			picked it at runtime), transposed to SoA, converted, normalized and transposed back before being
+			written into the vertex layout.
+			Normalized integers follow the glTF rules: unsigned c / max, signed max(c / max, -1)
+		*/
+		template <typename T, bool Normalized>
+		class Vec3Kernel {
+		public:
+			static constexpr bool isFloat = std::is_same_v<T, float>;
+			static constexpr bool scaled = Normalized && !isFloat;
+			static constexpr bool clampNegative = scaled && std::is_signed_v<T>;
+
+			static void decode(const vkglTF::AccessorView& view, float* dst, size_t dstStride, bool normalize, vkglTF::DecodedBounds* bounds) {
+				Vec3Kernel kernel(dst, dstStride, normalize);
+
+				size_t i = 0;
+				if (BatchMath::getInstructionSet() == BatchMath::InstructionSet::AVX2) {
+					i = kernel.gatherBlocks(view);
+				}
+				for (; i < view.count; i += 4) {
+					const uint32_t lanes = static_cast<uint32_t>(std::min<size_t>(4, view.count - i));
+					__m128 rows[4];
+					for (uint32_t lane = 0; lane < 4; lane++) {
+						// Unused lanes of the last block repeat the last element so the bounds stay valid
+						const size_t element = i + (std::min)(lane, lanes - 1);
+						rows[lane] = loadRow(view.data + element * view.stride, element + 1 < view.count);
+					}
+					_MM_TRANSPOSE4_PS(rows[0], rows[1], rows[2], rows[3]);
+					kernel.writeBlock(rows[0], rows[1], rows[2], i, lanes);
+				}
+
+				if (bounds) {
+					kernel.getBounds(*bounds);
+				}
+			}
+
+		private:
+			float* dst;
+			size_t dstStride;
+			bool normalize;
+
+			__m128 minX{ _mm_set1_ps(FLT_MAX) }, minY{ _mm_set1_ps(FLT_MAX) }, minZ{ _mm_set1_ps(FLT_MAX) };
+			__m128 maxX{ _mm_set1_ps(-FLT_MAX) }, maxY{ _mm_set1_ps(-FLT_MAX) }, maxZ{ _mm_set1_ps(-FLT_MAX) };
+
+			Vec3Kernel(float* dst, size_t dstStride, bool normalize) : dst(dst), dstStride(dstStride), normalize(normalize) {};
+
+			_NODISCARD static inline float scale() noexcept {
+				if constexpr (scaled) {
+					return 1.0f / static_cast<float>(std::numeric_limits<T>::max());
+				}
+				else {
+					return 1.0f;
+				}
+			}
+
+			// Loads x, y and z of one element in the lower three lanes, the fourth lane is undefined
+			_NODISCARD static inline __m128 loadRow(const uint8_t* p, bool hasSuccessor) noexcept {
+				if constexpr (isFloat) {
+					// A 16 byte load of a float3 only touches the next element, which must exist
+					if (hasSuccessor) _LIKELY {
+						return _mm_loadu_ps(reinterpret_cast<const float*>(p));
+					}
+					return _mm_setr_ps(loadComponent<float>(p), loadComponent<float>(p + 4), loadComponent<float>(p + 8), 0.0f);
+				}
+				else {
+					return _mm_cvtepi32_ps(_mm_setr_epi32(loadComponent<T>(p), loadComponent<T>(p + sizeof(T)), loadComponent<T>(p + 2 * sizeof(T)), 0));
+				}
+			}
+
+			// Sign or zero extends a component that was gathered as the low bytes of a 32 bit word
+			ACCESSOR_AVX2 _NODISCARD static inline __m256 gatherComponent(const uint8_t* p, __m256i offsets) noexcept {
+				if constexpr (isFloat) {
+					return _mm256_i32gather_ps(reinterpret_cast<const float*>(p), offsets, 1);
+				}
+				else {
+					__m256i raw = _mm256_i32gather_epi32(reinterpret_cast<const int*>(p), offsets, 1);
+					constexpr int shift = 32 - 8 * static_cast<int>(sizeof(T));
+					if constexpr (std::is_signed_v<T>) {
+						raw = _mm256_srai_epi32(_mm256_slli_epi32(raw, shift), shift);
+					}
+					else {
+						raw = _mm256_and_si256(raw, _mm256_set1_epi32(static_cast<int>(std::numeric_limits<T>::max())));
+					}
+					return _mm256_cvtepi32_ps(raw);
+				}
+			}
+
+			ACCESSOR_AVX2 inline void gatherBlock8(const uint8_t* p, size_t stride, size_t first) noexcept {
+				const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(static_cast<int>(stride)));
+				const __m256 x = gatherComponent(p, offsets);
+				const __m256 y = gatherComponent(p + sizeof(T), offsets);
+				const __m256 z = gatherComponent(p + 2 * sizeof(T), offsets);
+				writeBlock(_mm256_castps256_ps128(x), _mm256_castps256_ps128(y), _mm256_castps256_ps128(z), first, 4);
+				writeBlock(_mm256_extractf128_ps(x, 1), _mm256_extractf128_ps(y, 1), _mm256_extractf128_ps(z, 1), first + 4, 4);
+			}
+
+			// Returns the first element left for the SSE loop
+			ACCESSOR_AVX2 size_t gatherBlocks(const vkglTF::AccessorView& view) noexcept {
+				// Gathers read single components, so only full blocks with a successor element can use them
+				size_t i = 0;
+				for (; i + 8 < view.count; i += 8) {
+					gatherBlock8(view.data + i * view.stride, view.stride, i);
+				}
+				return i;
+			}
+
+			inline void writeBlock(__m128 x, __m128 y, __m128 z, size_t first, uint32_t lanes) noexcept {
+				if constexpr (scaled) {
+					const __m128 factor = _mm_set1_ps(scale());
+					x = _mm_mul_ps(x, factor);
+					y = _mm_mul_ps(y, factor);
+					z = _mm_mul_ps(z, factor);
+					if constexpr (clampNegative) {
+						const __m128 minusOne = _mm_set1_ps(-1.0f);
+						x = _mm_max_ps(x, minusOne);
+						y = _mm_max_ps(y, minusOne);
+						z = _mm_max_ps(z, minusOne);
+					}
+				}
+
+				if (normalize) {
+					const __m128 lengthSquared = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+					// Reciprocal square root estimate refined by one Newton-Raphson step (~22 bits)
+					__m128 inverseLength = _mm_rsqrt_ps(lengthSquared);
+					const __m128 halfLengthSquared = _mm_mul_ps(lengthSquared, _mm_set1_ps(0.5f));
+					inverseLength = _mm_mul_ps(inverseLength, _mm_sub_ps(_mm_set1_ps(1.5f), _mm_mul_ps(halfLengthSquared, _mm_mul_ps(inverseLength, inverseLength))));
+					// Zero length vectors (missing normals) stay zero instead of becoming NaN
+					inverseLength = _mm_and_ps(inverseLength, _mm_cmpgt_ps(lengthSquared, _mm_setzero_ps()));
+					x = _mm_mul_ps(x, inverseLength);
+					y = _mm_mul_ps(y, inverseLength);
+					z = _mm_mul_ps(z, inverseLength);
+				}
+
+				minX = _mm_min_ps(minX, x); minY = _mm_min_ps(minY, y); minZ = _mm_min_ps(minZ, z);
+				maxX = _mm_max_ps(maxX, x); maxY = _mm_max_ps(maxY, y); maxZ = _mm_max_ps(maxZ, z);
+
+				__m128 w = _mm_setzero_ps();
+				_MM_TRANSPOSE4_PS(x, y, z, w);
+				const std::array<__m128, 4> rows = { x, y, z, w };
+				for (uint32_t lane = 0; lane < lanes; lane++) {
+					// Exactly 12 bytes per row so the neighbouring vertex attributes are never touched
+					float* out = reinterpret_cast<float*>(reinterpret_cast<uint8_t*>(dst) + (first + lane) * dstStride);
+					_mm_storel_pi(reinterpret_cast<__m64*>(out), rows[lane]);
+					_mm_store_ss(out + 2, _mm_movehl_ps(rows[lane], rows[lane]));
+				}
+			}
+
+			_NODISCARD static inline float horizontalMin(__m128 v) noexcept {
+				v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+				v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+				return _mm_cvtss_f32(v);
+			}
+
+			_NODISCARD static inline float horizontalMax(__m128 v) noexcept {
+				v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+				v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+				return _mm_cvtss_f32(v);
+			}
+
+			void getBounds(vkglTF::DecodedBounds& bounds) const noexcept {
+				bounds.min = glm::vec3(horizontalMin(minX), horizontalMin(minY), horizontalMin(minZ));
+				bounds.max = glm::vec3(horizontalMax(maxX), horizontalMax(maxY), horizontalMax(maxZ));
+			}
+		};
+
+		template <typename T>
+		inline void decodeVec3Typed(const vkglTF::AccessorView& view, float* dst, size_t dstStride, bool normalize, vkglTF::DecodedBounds* bounds) {
+			if (view.normalized) {
+				Vec3Kernel<T, true>::decode(view, dst, dstStride, normalize, bounds);
+			}
+			else {
+				Vec3Kernel<T, false>::decode(view, dst, dstStride, normalize, bounds);
+			}
+		}
+
+		template <typename T>
+		inline void decodeVec2Typed(const vkglTF::AccessorView& view, float* dst, size_t dstStride) {
+			// Texture coordinates are small next to the positions, a scalar loop is enough for them
+			const float scale = std::is_same_v<T, float> || !view.normalized ? 1.0f : 1.0f / static_cast<float>(std::numeric_limits<T>::max());
+			for (size_t i = 0; i < view.count; i++) {
+				const uint8_t* src = view.data + i * view.stride;
+				float* out = reinterpret_cast<float*>(reinterpret_cast<uint8_t*>(dst) + i * dstStride);
+				for (uint32_t c = 0; c < 2; c++) {
+					const float value = static_cast<float>(loadComponent<T>(src + c * sizeof(T))) * scale;
+					out[c] = std::is_signed_v<T> && view.normalized ? (std::max)(value, -1.0f) : value;
+				}
+			}
+		}
+	}
+
+	bool vkglTF::getAccessorView(const tinygltf::Model& model, const tinygltf::Accessor& accessor, AccessorView& view) {
+		if (accessor.bufferView < 0 || accessor.bufferView >= static_cast<int>(model.bufferViews.size())) _UNLIKELY {
+			return false;
+		}
+		if (accessor.sparse.isSparse) _UNLIKELY {
+			std::cerr << "Sparse accessors are not supported, sparse values of accessor \"" << accessor.name << "\" are ignored\n";
+		}
+
+		const tinygltf::BufferView& bufferView = model.bufferViews[accessor.bufferView];
+		if (bufferView.buffer < 0 || bufferView.buffer >= static_cast<int>(model.buffers.size())) _UNLIKELY {
+			return false;
+		}
+		const tinygltf::Buffer& buffer = model.buffers[bufferView.buffer];
+
+		const int32_t componentSize = tinygltf::GetComponentSizeInBytes(static_cast<uint32_t>(accessor.componentType));
+		const int32_t componentCount = tinygltf::GetNumComponentsInType(static_cast<uint32_t>(accessor.type));
+		if (componentSize <= 0 || componentCount <= 0) _UNLIKELY {
+			return false;
+		}
+
+		const size_t elementSize = static_cast<size_t>(componentSize) * componentCount;
+		const size_t offset = accessor.byteOffset + bufferView.byteOffset;
+
+		view.stride = bufferView.byteStride != 0 ? bufferView.byteStride : elementSize;
+		view.count = accessor.count;
+		view.componentType = accessor.componentType;
+		view.componentCount = static_cast<uint32_t>(componentCount);
+		view.normalized = accessor.normalized;
+
+		// The last element has to fit inside the buffer, not the last full stride
+		if (view.count > 0 && offset + view.stride * (view.count - 1) + elementSize > buffer.data.size()) _UNLIKELY {
+			return false;
+		}
+
+		view.data = buffer.data.data() + offset;
+		return true;
+	}
+
+	bool vkglTF::decodeVec3(const AccessorView& view, float* dst, size_t dstStride, bool normalize, DecodedBounds* bounds) {
+		if (view.componentCount != 3) _UNLIKELY {
+			return false;
+		}
+
+		switch (view.componentType) {
+		case TINYGLTF_COMPONENT_TYPE_FLOAT: _LIKELY
+			decodeVec3Typed<float>(view, dst, dstStride, normalize, bounds);
+			return true;
+		case TINYGLTF_COMPONENT_TYPE_SHORT:
+			decodeVec3Typed<int16_t>(view, dst, dstStride, normalize, bounds);
+			return true;
+		case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+			decodeVec3Typed<uint16_t>(view, dst, dstStride, normalize, bounds);
+			return true;
+		case TINYGLTF_COMPONENT_TYPE_BYTE:
+			decodeVec3Typed<int8_t>(view, dst, dstStride, normalize, bounds);
+			return true;
+		case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+			decodeVec3Typed<uint8_t>(view, dst, dstStride, normalize, bounds);
+			return true;
+		default: _UNLIKELY
+			return false;
+		}
+	}
+
+	bool vkglTF::decodeVec2(const AccessorView& view, float* dst, size_t dstStride) {
+		if (view.componentCount != 2) _UNLIKELY {
+			return false;
+		}
+
+		switch (view.componentType) {
+		case TINYGLTF_COMPONENT_TYPE_FLOAT: _LIKELY
+			decodeVec2Typed<float>(view, dst, dstStride);
+			return true;
+		case TINYGLTF_COMPONENT_TYPE_SHORT:
+			decodeVec2Typed<int16_t>(view, dst, dstStride);
+			return true;
+		case TINYGLTF_COMPONENT_TYPE_UNSIGNED_SHORT:
+			decodeVec2Typed<uint16_t>(view, dst, dstStride);
+			return true;
+		case TINYGLTF_COMPONENT_TYPE_BYTE:
+			decodeVec2Typed<int8_t>(view, dst, dstStride);
+			return true;
+		case TINYGLTF_COMPONENT_TYPE_UNSIGNED_BYTE:
+			decodeVec2Typed<uint8_t>(view, dst, dstStride);
+			return true;
+		default: _UNLIKELY
+			return false;
+		}
+	}
+}
@@ -0,0 +1,60 @@
+/*
+* glTF accessor decoding
+*
+* Decodes vertex attribute accessors of any layout (interleaved bufferViews with a byteStride, normalized
+* byte/short components and KHR_mesh_quantization) into the tightly packed float layout of vkglTF::Vertex
+*/
+
+#pragma once
+#include "pch.hpp"
+
+#define TINYGLTF_NO_STB_IMAGE_WRITE
+#include "tiny_gltf.h"
+
+namespace Voortman3D {
+	namespace vkglTF {
+		/*
+			Raw view on the data of an accessor with the stride already resolved
+		*/
+		struct AccessorView {
+			const uint8_t* data{ nullptr };
+			size_t count{};
+			// Distance in bytes between two elements (bufferView.byteStride or the packed element size)
+			size_t stride{};
+			int componentType{};
+			uint32_t componentCount{};
+			bool normalized{};
+		};
+
+		/*
+			Bounding box that is gathered while decoding so we don't depend on accessor.min/max being present
+		*/
+		struct DecodedBounds {
+			glm::vec3 min = glm::vec3(FLT_MAX);
+			glm::vec3 max = glm::vec3(-FLT_MAX);
+		};
+
+		/** @brief Resolves the buffer, offsets and stride of an accessor, returns false if the accessor points outside its buffer */
+		_NODISCARD bool getAccessorView(const tinygltf::Model& model, const tinygltf::Accessor& accessor, AccessorView& view);
+
+		/**
+		* Decode a VEC3 accessor into a float3 destination with an arbitrary stride
+		*
+		* @param view Accessor to decode, float or (normalized) byte/short components are supported
+		* @param dst Pointer to the first float3 of the destination
+		* @param dstStride Distance in bytes between two float3 destinations (sizeof(Vertex))
+		* @param normalize Normalize every decoded vector, zero length vectors are written as zero
+		* @param bounds (Optional) Receives the bounding box of the decoded values
+		*
+		* @return False if the component type is not supported
+		*/
+		bool decodeVec3(const AccessorView& view, float* dst, size_t dstStride, bool normalize, DecodedBounds* bounds = nullptr);
+
+		/**
+		* Decode a VEC2 accessor such as texture coordinates into a float2 destination with an arbitrary stride
+		*
+		* @return False if the component type is not supported
+		*/
+		bool decodeVec2(const AccessorView& view, float* dst, size_t dstStride);
+	}
+}
@@ -0,0 +1,440 @@
+/*
+* glTF assemblies
+*
+* Every distinct part file is parsed once, concurrently on a thread pool. The parsed parts are appended into the
+* buffers of the assembly in manifest order and their nodes are instantiated once per placement, so instances of a
+* part share its meshes and end up in the same instance group. Mesh processing runs once on the merged buffers
+*/
+
+#include "pch.hpp"
+#include "VulkanglTFAssembly.hpp"
+#include "VulkanglTFModel.hpp"
+#include "Tools.hpp"
+// Bundled with tinygltf
+#include "json.hpp"
+#include <filesystem>
+#include <iostream>
+
+namespace Voortman3D {
+	namespace {
+		using Hierarchy = vkglTF::Model::Hierarchy;
+
+		/*
+			Node of the manifest, part indexes the distinct part paths
+		*/
+		struct AssemblyNode {
+			std::string name;
+			glm::mat4 matrix{ 1.0f };
+			uint32_t part{ Hierarchy::none };
+			std::vector<AssemblyNode> children;
+		};
+
+		/*
+			Part file as parsed on a worker, moved into the assembly afterwards
+		*/
+		struct Part {
+			// Null when the file could not be loaded or has the same contents as another part
+			std::unique_ptr<vkglTF::Model> model;
+			std::vector<uint32_t> indices;
+			std::vector<vkglTF::Vertex> vertices;
+			// Part that is loaded for this path, differs from its own index when another path has the same contents
+			uint32_t source{ Hierarchy::none };
+			// Meshes and materials of the part in the assembly
+			uint32_t meshBase{ 0 };
+			uint32_t meshCount{ 0 };
+			uint32_t materialBase{ 0 };
+			uint32_t materialCount{ 0 };
+		};
+
+		constexpr uint64_t fnvOffsetBasis = 14695981039346656037ull;
+		constexpr uint64_t fnvPrime = 1099511628211ull;
+
+		_NODISCARD uint64_t hashBytes(const void* data, size_t size, uint64_t hash) noexcept {
+			const uint8_t* bytes = static_cast<const uint8_t*>(data);
+			for (size_t i = 0; i < size; i++) {
+				hash = (hash ^ bytes[i]) * fnvPrime;
+			}
+			return hash;
+		}
+
+		_NODISCARD std::string lowerExtension(const std::string& filename) {
+			std::string extension = std::filesystem::path(filename).extension().string();
+			std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+			return extension;
+		}
+
+		/** @brief Reads count numbers of a node property, found stays false when the node doesn't have it */
+		bool readNumbers(const nlohmann::json& json, const char* key, float* values, size_t count, bool& found, std::string& error) {
+			const auto property = json.find(key);
+			found = property != json.end();
+			if (!found)
+				return true;
+
+			if (!property->is_array() || property->size() != count) _UNLIKELY {
+				error = std::string("\"") + key + "\" has to be an array of " + std::to_string(count) + " numbers";
+				return false;
+			}
+			for (size_t i = 0; i < count; i++) {
+				if (!(*property)[i].is_number()) _UNLIKELY {
+					error = std::string("\"") + key + "\" has to be an array of " + std::to_string(count) + " numbers";
+					return false;
+				}
+				values[i] = (*property)[i].get<float>();
+			}
+			return true;
+		}
+
+		bool readNode(const nlohmann::json& json, const std::filesystem::path& directory, std::vector<std::string>& partPaths, std::unordered_map<std::string, uint32_t>& partsByPath, AssemblyNode& node, std::string& error) {
+			if (!json.is_object()) _UNLIKELY {
+				error = "nodes have to be objects";
+				return false;
+			}
+
+			const auto name = json.find("name");
+			if (name != json.end() && name->is_string())
+				node.name = name->get<std::string>();
+
+			// Same precedence as glTF nodes, a matrix replaces translation, rotation and scale
+			float values[16];
+			bool found = false;
+			if (!readNumbers(json, "matrix", values, 16, found, error))
+				return false;
+			if (found) {
+				node.matrix = glm::make_mat4(values);
+			}
+			else {
+				if (!readNumbers(json, "translation", values, 3, found, error))
+					return false;
+				if (found)
+					node.matrix = glm::translate(node.matrix, glm::make_vec3(values));
+				if (!readNumbers(json, "rotation", values, 4, found, error))
+					return false;
+				if (found)
+					node.matrix = node.matrix * glm::mat4_cast(glm::make_quat(values));
+				if (!readNumbers(json, "scale", values, 3, found, error))
+					return false;
+				if (found)
+					node.matrix = glm::scale(node.matrix, glm::make_vec3(values));
+			}
+
+			const auto part = json.find("part");
+			if (part != json.end()) {
+				if (!part->is_string()) _UNLIKELY {
+					error = "\"part\" has to be a path";
+					return false;
+				}
+				// Paths are compared after resolving them, so different spellings of the same file load it once
+				std::filesystem::path partPath = std::filesystem::u8path(part->get<std::string>());
+				if (partPath.is_relative())
+					partPath = directory / partPath;
+				std::error_code errorCode;
+				std::filesystem::path canonicalPath = std::filesystem::weakly_canonical(partPath, errorCode);
+				if (errorCode)
+					canonicalPath = partPath.lexically_normal();
+
+				const auto inserted = partsByPath.try_emplace(canonicalPath.string(), static_cast<uint32_t>(partPaths.size()));
+				if (inserted.second)
+					partPaths.push_back(canonicalPath.string());
+				node.part = inserted.first->second;
+			}
+
+			const auto children = json.find("children");
+			if (children != json.end()) {
+				if (!children->is_array()) _UNLIKELY {
+					error = "\"children\" has to be an array of nodes";
+					return false;
+				}
+				node.children.resize(children->size());
+				for (size_t i = 0; i < children->size(); i++) {
+					if (!readNode((*children)[i], directory, partPaths, partsByPath, node.children[i], error))
+						return false;
+				}
+			}
+			return true;
+		}
+
+		/** @brief Reads the manifest into its root nodes and the distinct part paths they place, errors are reported on std::cerr */
+		bool readManifest(const std::string& filename, std::vector<AssemblyNode>& roots, std::vector<std::string>& partPaths) {
+			std::vector<unsigned char> manifestData;
+			if (!Tools::readFile(filename, manifestData)) _UNLIKELY {
+				std::cerr << "Could not open assembly manifest \"" + filename + "\"\n";
+				return false;
+			}
+
+			// Parsed without exceptions, errors are reported like those of glTF files
+			const nlohmann::json manifest = nlohmann::json::parse(manifestData.begin(), manifestData.end(), nullptr, false);
+			const auto manifestNodes = manifest.is_object() ? manifest.find("nodes") : manifest.end();
+			if (manifest.is_discarded() || !manifest.is_object() || manifestNodes == manifest.end() || !manifestNodes->is_array()) _UNLIKELY {
+				std::cerr << "Assembly manifest \"" + filename + "\" has no \"nodes\" array\n";
+				return false;
+			}
+
+			roots.resize(manifestNodes->size());
+			std::unordered_map<std::string, uint32_t> partsByPath;
+			const std::filesystem::path directory = std::filesystem::u8path(filename).parent_path();
+			for (size_t i = 0; i < roots.size(); i++) {
+				std::string error;
+				if (!readNode((*manifestNodes)[i], directory, partPaths, partsByPath, roots[i], error)) _UNLIKELY {
+					std::cerr << "Assembly manifest \"" + filename + "\" is invalid: " + error + "\n";
+					return false;
+				}
+			}
+			return true;
+		}
+
+		void flattenNode(const AssemblyNode& node, uint32_t parent, const std::vector<std::string>& partPaths, std::vector<vkglTF::ManifestNode>& nodes) {
+			const uint32_t index = static_cast<uint32_t>(nodes.size());
+			nodes.push_back({ node.name, node.matrix, node.part != Hierarchy::none ? partPaths[node.part] : std::string(), parent });
+			for (const AssemblyNode& child : node.children)
+				flattenNode(child, index, partPaths, nodes);
+		}
+
+		vkglTF::Node* addNode(vkglTF::Model& model, vkglTF::Node* parent, const std::string& name, const glm::mat4& matrix, uint32_t mesh, std::unordered_map<std::string, uint32_t>& nameIds) {
+			Hierarchy& hierarchy = model.hierarchy;
+			const uint32_t index = hierarchy.size();
+			hierarchy.parents.push_back(parent ? parent->index : Hierarchy::none);
+			hierarchy.localMatrices.push_back(matrix);
+			hierarchy.worldMatrices.push_back(glm::mat4(1.0f));
+			hierarchy.meshes.push_back(mesh);
+			hierarchy.subtreeEnds.push_back(index + 1);
+			hierarchy.dirty.push_back(0);
+
+			const auto nameId = nameIds.try_emplace(name, static_cast<uint32_t>(hierarchy.names.size()));
+			if (nameId.second)
+				hierarchy.names.push_back(name);
+			hierarchy.nameIds.push_back(nameId.first->second);
+
+			// Storage is reserved for the whole assembly, so the views never move
+			vkglTF::Node* node = &model.nodeStorage.emplace_back();
+			node->model = &model;
+			node->index = index;
+			node->parent = parent;
+			node->mesh = mesh != Hierarchy::none ? model.meshes[mesh] : nullptr;
+
+			if (parent)
+				parent->children.push_back(node);
+			else
+				model.nodes.push_back(node);
+			model.linearNodes.push_back(node);
+			return node;
+		}
+
+		/** @brief Number of nodes the manifest node and its subtree will have in the assembly */
+		_NODISCARD size_t countNodes(const AssemblyNode& node, const std::vector<Part>& parts) {
+			size_t count = 1;
+			if (node.part != Hierarchy::none && parts[node.part].source != Hierarchy::none && parts[parts[node.part].source].model)
+				count += parts[parts[node.part].source].model->hierarchy.size();
+			for (const AssemblyNode& child : node.children)
+				count += countNodes(child, parts);
+			return count;
+		}
+
+		/** @brief Adds the manifest node, the nodes of its part and its children in depth first order, returns the number of placed parts */
+		uint32_t instantiate(vkglTF::Model& model, const AssemblyNode& node, vkglTF::Node* parent, const std::vector<Part>& parts, std::unordered_map<std::string, uint32_t>& nameIds) {
+			uint32_t placedParts = 0;
+			vkglTF::Node* assemblyNode = addNode(model, parent, node.name, node.matrix, Hierarchy::none, nameIds);
+			model.manifestNodes.push_back(assemblyNode->index);
+
+			if (node.part != Hierarchy::none && parts[node.part].source != Hierarchy::none && parts[parts[node.part].source].model) {
+				const Part& part = parts[parts[node.part].source];
+				const Hierarchy& partHierarchy = part.model->hierarchy;
+				// The hierarchy of the part is already sorted depth first, so it is copied with its indices shifted
+				const uint32_t base = model.hierarchy.size();
+				model.sourceFiles[node.part].nodeBases.push_back(base);
+				for (uint32_t i = 0; i < partHierarchy.size(); i++) {
+					const uint32_t partParent = partHierarchy.parents[i];
+					const uint32_t mesh = partHierarchy.meshes[i];
+					addNode(model, partParent == Hierarchy::none ? assemblyNode : &model.nodeStorage[base + partParent], partHierarchy.names[partHierarchy.nameIds[i]],
+						partHierarchy.localMatrices[i], mesh == Hierarchy::none ? Hierarchy::none : part.meshBase + mesh, nameIds);
+					model.hierarchy.subtreeEnds[base + i] = base + partHierarchy.subtreeEnds[i];
+				}
+				placedParts++;
+			}
+
+			for (const AssemblyNode& child : node.children)
+				placedParts += instantiate(model, child, assemblyNode, parts, nameIds);
+			model.hierarchy.subtreeEnds[assemblyNode->index] = model.hierarchy.size();
+			return placedParts;
+		}
+	}
+
+	bool vkglTF::isAssemblyManifest(const std::string& filename) {
+		return lowerExtension(filename) == ".json";
+	}
+
+	bool vkglTF::readAssemblyManifest(const std::string& filename, std::vector<ManifestNode>& nodes) {
+		std::vector<AssemblyNode> roots;
+		std::vector<std::string> partPaths;
+		if (!readManifest(filename, roots, partPaths))
+			return false;
+
+		nodes.clear();
+		for (const AssemblyNode& root : roots)
+			flattenNode(root, UINT32_MAX, partPaths, nodes);
+		return true;
+	}
+
+	bool vkglTF::Model::loadAssembly(const std::string& filename, VulkanDevice* device, uint32_t fileLoadingFlags, float scale, std::vector<uint32_t>& indexBuffer, std::vector<Vertex>& vertexBuffer)
+	{
+#ifdef _DEBUG
+		const auto tStart = std::chrono::high_resolution_clock::now();
+#endif
+
+		this->device = device;
+		path = Tools::getDirectory(filename);
+
+		std::vector<AssemblyNode> roots;
+		std::vector<std::string> partPaths;
+		if (!readManifest(filename, roots, partPaths))
+			return false;
+
+		// A part is shared by all its instances, pre-transforming would bake the placement of one of them into all of them
+		fileLoadingFlags &= ~FileLoadingFlags::PreTransformVertices;
+
+		ThreadPool threadPool;
+		threadPool.setThreadCount((std::max)(1u, std::thread::hardware_concurrency()));
+
+		// Files with the same contents are parsed once, whichever path claims the contents first loads them
+		std::vector<Part> parts(partPaths.size());
+		std::mutex hashMutex;
+		std::unordered_map<uint64_t, uint32_t> partsByHash;
+		threadPool.parallelFor(parts.size(), [&](size_t i) {
+			Part& part = parts[i];
+			std::vector<unsigned char> data;
+			if (!Tools::readFile(partPaths[i], data)) _UNLIKELY {
+				std::cerr << "Could not open part file \"" + partPaths[i] + "\"\n";
+				return;
+			}
+
+			uint64_t hash = hashBytes(data.data(), data.size(), fnvOffsetBasis);
+			// External buffers of a .gltf are resolved next to it, so the same text only means the same part within one directory
+			if (lowerExtension(partPaths[i]) != ".glb") {
+				const std::string partDirectory = Tools::getDirectory(partPaths[i]);
+				hash = hashBytes(partDirectory.data(), partDirectory.size(), hash);
+			}
+			{
+				std::lock_guard<std::mutex> lock(hashMutex);
+				part.source = partsByHash.try_emplace(hash, static_cast<uint32_t>(i)).first->second;
+			}
+			if (part.source != i)
+				return;
+
+			// The pool is busy with the other parts, so a part decompresses on its own thread
+			ThreadPool partPool;
+			part.model = std::make_unique<Model>();
+			part.model->device = device;
+			part.model->path = Tools::getDirectory(partPaths[i]);
+			if (!part.model->parseGeometry(partPaths[i], data, fileLoadingFlags, scale, part.indices, part.vertices, partPool)) _UNLIKELY
+				part.model.reset();
+		});
+
+#ifdef _DEBUG
+		const auto tParsed = std::chrono::high_resolution_clock::now();
+#endif
+
+		// Appended in manifest order, so the result doesn't depend on which worker finished first
+		size_t nodeCount = 0;
+		for (const AssemblyNode& root : roots)
+			nodeCount += countNodes(root, parts);
+		size_t materialCount = 0;
+		for (uint32_t i = 0; i < static_cast<uint32_t>(parts.size()); i++) {
+			if (parts[i].source == i && parts[i].model)
+				materialCount += parts[i].model->materials.size();
+		}
+		// Primitives point into materials and nodes into nodeStorage, neither may grow after this
+		materials.reserve(materialCount);
+		nodeStorage.reserve(nodeCount);
+
+		uint32_t loadedParts = 0;
+		for (uint32_t i = 0; i < static_cast<uint32_t>(parts.size()); i++) {
+			Part& part = parts[i];
+			if (part.source != i || !part.model)
+				continue;
+			Model& partModel = *part.model;
+
+			const uint32_t vertexBase = static_cast<uint32_t>(vertexBuffer.size());
+			const uint32_t indexBase = static_cast<uint32_t>(indexBuffer.size());
+			vertexBuffer.insert(vertexBuffer.end(), part.vertices.begin(), part.vertices.end());
+			indexBuffer.reserve(indexBuffer.size() + part.indices.size());
+			for (uint32_t index : part.indices)
+				indexBuffer.push_back(index + vertexBase);
+			std::vector<Vertex>().swap(part.vertices);
+			std::vector<uint32_t>().swap(part.indices);
+
+			// Textures beyond the last slot of the texture array are left out, the same as within a single file
+			for (TextureSource& source : partModel.textureSources) {
+				Texture* texture = source.texture;
+				if (textures.size() + 1 < textureSlotCount) _LIKELY {
+					texture->index = static_cast<uint32_t>(textures.size()) + 1;
+					textures.push_back(texture);
+					textureSources.push_back(std::move(source));
+					continue;
+				}
+				std::cerr << "Texture \"" << source.name << "\" is left out, no more than " << textureSlotCount - 1 << " textures are supported\n";
+				for (Material& material : partModel.materials) {
+					if (material.baseColorTexture == texture)
+						material.baseColorTexture = nullptr;
+				}
+				delete texture;
+			}
+			partModel.textureSources.clear();
+			partModel.textures.clear();
+
+			const size_t materialBase = materials.size();
+			materials.insert(materials.end(), partModel.materials.begin(), partModel.materials.end());
+			part.materialBase = static_cast<uint32_t>(materialBase);
+			part.materialCount = static_cast<uint32_t>(partModel.materials.size());
+
+			part.meshBase = static_cast<uint32_t>(meshes.size());
+			part.meshCount = static_cast<uint32_t>(partModel.meshes.size());
+			for (Mesh* mesh : partModel.meshes) {
+				for (Primitive* primitive : mesh->primitives) {
+					primitive->firstIndex += indexBase;
+					primitive->firstVertex += vertexBase;
+					primitive->material = &materials[materialBase + (primitive->material - partModel.materials.data())];
+				}
+				meshes.push_back(mesh);
+			}
+			// The meshes belong to the assembly now
+			partModel.meshes.clear();
+			loadedParts++;
+		}
+
+		// Every path is watched on its own, a path with the contents of another one shares its meshes
+		sourceFiles.resize(parts.size());
+		for (uint32_t i = 0; i < static_cast<uint32_t>(parts.size()); i++) {
+			SourceFile& source = sourceFiles[i];
+			source.path = partPaths[i];
+			if (parts[i].source == Hierarchy::none || !parts[parts[i].source].model) {
+				source.exclusive = false;
+				continue;
+			}
+			const Part& loaded = parts[parts[i].source];
+			source.meshBase = loaded.meshBase;
+			source.meshCount = loaded.meshCount;
+			source.materialBase = loaded.materialBase;
+			source.materialCount = loaded.materialCount;
+			source.nodeCount = loaded.model->hierarchy.size();
+			if (parts[i].source != i) {
+				source.exclusive = false;
+				sourceFiles[parts[i].source].exclusive = false;
+			}
+		}
+
+		std::unordered_map<std::string, uint32_t> nameIds;
+		uint32_t placedParts = 0;
+		for (const AssemblyNode& root : roots)
+			placedParts += instantiate(*this, root, nullptr, parts, nameIds);
+		parts.clear();
+
+		processGeometry(fileLoadingFlags, indexBuffer, vertexBuffer, threadPool);
+
+#ifdef _DEBUG
+		const auto tEnd = std::chrono::high_resolution_clock::now();
+		std::cout << "Loaded assembly with " << placedParts << " placed parts from " << loadedParts << " part files (" << partPaths.size() << " paths): parsed in "
+			<< std::chrono::duration<double, std::milli>(tParsed - tStart).count() << " ms, processed in " << std::chrono::duration<double, std::milli>(tEnd - tParsed).count() << " ms" << std::endl;
+#endif
+
+		return !indexBuffer.empty() && !vertexBuffer.empty();
+	}
+}
@@ -0,0 +1,48 @@
+/*
+* glTF assemblies
+*
+* Machine models come out of CAD as one file per part plus the assembly that places them. A manifest describes that
+* assembly as a tree of named nodes, each of which may place a part file:
+*
+*	{
+*		"nodes": [
+*			{
+*				"name": "Frame",
+*				"part": "parts/frame.glb",
+*				"translation": [ 0.0, 0.0, 0.0 ],
+*				"rotation": [ 0.0, 0.0, 0.0, 1.0 ],
+*				"scale": [ 1.0, 1.0, 1.0 ],
+*				"children": [ ... ]
+*			}
+*		]
+*	}
+*
+* Transforms are written like those of glTF nodes, either as "matrix" or as translation, rotation and scale. Part paths
+* are relative to the manifest. All parts are appended into the vertex and index buffers of one Model, so an assembly is
+* drawn like any other model
+*/
+
+#pragma once
+#include "pch.hpp"
+
+namespace Voortman3D {
+	namespace vkglTF {
+		/** @brief Whether a file is an assembly manifest (.json) instead of a glTF file, see Model::loadAssembly */
+		_NODISCARD bool isAssemblyManifest(const std::string& filename);
+
+		/*
+			Node of a manifest as it is read, listed in depth first order like the manifest nodes of Model::manifestNodes
+		*/
+		struct ManifestNode {
+			std::string name;
+			glm::mat4 matrix{ 1.0f };
+			// Canonical path of the part file, empty when the node places none
+			std::string part;
+			// Position of the parent in the list, UINT32_MAX for roots
+			uint32_t parent{ UINT32_MAX };
+		};
+
+		/** @brief Reads the nodes of a manifest without loading its parts, errors are reported on std::cerr */
+		_NODISCARD bool readAssemblyManifest(const std::string& filename, std::vector<ManifestNode>& nodes);
+	}
+}
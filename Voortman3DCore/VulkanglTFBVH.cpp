@@ -0,0 +1,514 @@
+/*
+* glTF bounding volume hierarchy
+*
+* Keeps the world space box of every primitive of every node in a tree built with binned SAH, so the primitives outside
+* the view frustum are found without testing each of them. Moving nodes only refit the boxes above their primitives.
+* Every mesh keeps a tree over its triangles in object space as well, a ray walks the scene tree down to the nodes and
+* continues in the triangle trees of their meshes
+*/
+
+#include "pch.hpp"
+#include "VulkanglTFBVH.hpp"
+#include "VulkanglTFModel.hpp"
+#include <numeric>
+
+namespace Voortman3D {
+	namespace {
+		constexpr uint32_t noParent = UINT32_MAX;
+		constexpr uint32_t binCount = 16;
+		constexpr uint32_t maxLeafItems = 4;
+		// Ranges below this are built by a single thread, splitting them up further costs more than it saves
+		constexpr uint32_t minSubtreeItems = 1024;
+		constexpr uint32_t boundsChunkSize = 4096;
+
+		float surfaceArea(const glm::vec3& min, const glm::vec3& max) noexcept {
+			const glm::vec3 size = max - min;
+			return size.x * size.y + size.y * size.z + size.z * size.x;
+		}
+
+		/** @brief False when the box is outside one of the planes in mask, clears the planes the box is completely inside of */
+		bool classifyBox(const std::array<glm::vec4, 6>& planes, const glm::vec3& min, const glm::vec3& max, uint32_t& mask) noexcept {
+			const glm::vec3 center = (min + max) * 0.5f;
+			const glm::vec3 extent = (max - min) * 0.5f;
+			for (uint32_t i = 0; i < 6; i++) {
+				if (!(mask & (1u << i)))
+					continue;
+				const glm::vec3 normal = glm::vec3(planes[i]);
+				const float distance = glm::dot(normal, center) + planes[i].w;
+				const float radius = glm::dot(glm::abs(normal), extent);
+				if (distance + radius < 0.0f)
+					return false;
+				if (distance - radius >= 0.0f)
+					mask &= ~(1u << i);
+			}
+			return true;
+		}
+
+		struct BuildTask {
+			uint32_t node;
+			uint32_t first;
+			uint32_t count;
+		};
+
+		/*
+			Boxes and centroids a tree is built over, indexed by item
+		*/
+		struct BuildInput {
+			const glm::vec3* min;
+			const glm::vec3* max;
+			const glm::vec3* centroids;
+		};
+
+		/** @brief Sets the box of the task's node and either makes it a leaf or appends two children to out and their tasks to tasks */
+		void splitNode(std::vector<vkglTF::BVH::Node>& out, const BuildTask& task, std::vector<uint32_t>& items, const BuildInput& input, std::vector<BuildTask>& tasks) {
+			const auto begin = items.begin() + task.first;
+			const auto end = begin + task.count;
+
+			glm::vec3 min(FLT_MAX), max(-FLT_MAX), centroidMin(FLT_MAX), centroidMax(-FLT_MAX);
+			for (auto it = begin; it != end; ++it) {
+				min = (glm::min)(min, input.min[*it]);
+				max = (glm::max)(max, input.max[*it]);
+				centroidMin = (glm::min)(centroidMin, input.centroids[*it]);
+				centroidMax = (glm::max)(centroidMax, input.centroids[*it]);
+			}
+			out[task.node].min = min;
+			out[task.node].max = max;
+
+			// Binned SAH, a split costs one box test plus the items on both sides weighted by the area of their box
+			const float nodeArea = surfaceArea(min, max);
+			const float leafCost = static_cast<float>(task.count) * nodeArea;
+			float bestCost = FLT_MAX;
+			uint32_t bestAxis = 3, bestBin = 0;
+			for (uint32_t axis = 0; axis < 3 && task.count > 1; axis++) {
+				const float extent = centroidMax[axis] - centroidMin[axis];
+				if (extent <= 0.0f)
+					continue;
+
+				struct Bin {
+					glm::vec3 min{ FLT_MAX };
+					glm::vec3 max{ -FLT_MAX };
+					uint32_t count{};
+				} bins[binCount];
+				const float scale = binCount / extent;
+				for (auto it = begin; it != end; ++it) {
+					const uint32_t b = (std::min)(binCount - 1, static_cast<uint32_t>((input.centroids[*it][axis] - centroidMin[axis]) * scale));
+					bins[b].min = (glm::min)(bins[b].min, input.min[*it]);
+					bins[b].max = (glm::max)(bins[b].max, input.max[*it]);
+					bins[b].count++;
+				}
+
+				// Cost of everything left of each split from the front, then added to the right side from the back
+				float leftCosts[binCount - 1];
+				Bin left;
+				for (uint32_t b = 0; b < binCount - 1; b++) {
+					left.min = (glm::min)(left.min, bins[b].min);
+					left.max = (glm::max)(left.max, bins[b].max);
+					left.count += bins[b].count;
+					leftCosts[b] = left.count ? left.count * surfaceArea(left.min, left.max) : 0.0f;
+				}
+				Bin right;
+				for (uint32_t b = binCount - 1; b > 0; b--) {
+					right.min = (glm::min)(right.min, bins[b].min);
+					right.max = (glm::max)(right.max, bins[b].max);
+					right.count += bins[b].count;
+					const float cost = nodeArea + leftCosts[b - 1] + (right.count ? right.count * surfaceArea(right.min, right.max) : 0.0f);
+					if (cost < bestCost) {
+						bestCost = cost;
+						bestAxis = axis;
+						bestBin = b;
+					}
+				}
+			}
+
+			if (task.count <= 1 || (task.count <= maxLeafItems && bestCost >= leafCost)) {
+				out[task.node].first = task.first;
+				out[task.node].count = task.count;
+				return;
+			}
+
+			auto middle = begin;
+			if (bestAxis < 3) {
+				const float scale = binCount / (centroidMax[bestAxis] - centroidMin[bestAxis]);
+				middle = std::partition(begin, end, [&](uint32_t item) {
+					return (std::min)(binCount - 1, static_cast<uint32_t>((input.centroids[item][bestAxis] - centroidMin[bestAxis]) * scale)) < bestBin;
+				});
+			}
+			// Centroids on top of each other can't be binned, they are halved along the widest axis instead
+			if (middle == begin || middle == end) {
+				const glm::vec3 extent = centroidMax - centroidMin;
+				const uint32_t axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+				middle = begin + task.count / 2;
+				std::nth_element(begin, middle, end, [&](uint32_t a, uint32_t b) { return input.centroids[a][axis] < input.centroids[b][axis]; });
+			}
+
+			const uint32_t leftCount = static_cast<uint32_t>(middle - begin);
+			const uint32_t child = static_cast<uint32_t>(out.size());
+			out[task.node].first = child;
+			out[task.node].count = 0;
+			out.push_back({});
+			out.push_back({});
+			tasks.push_back({ child, task.first, leftCount });
+			tasks.push_back({ child + 1, task.first + leftCount, task.count - leftCount });
+		}
+
+		/**
+		* Builds a tree over all items into empty nodes and sorts items into leaf order
+		*
+		* @param threadPool When set, the top levels are split here until there is a subtree for every thread and the subtrees are built in parallel on their own item ranges
+		*/
+		void buildTree(std::vector<vkglTF::BVH::Node>& nodes, std::vector<uint32_t>& items, const BuildInput& input, ThreadPool* threadPool) {
+			const uint32_t itemCount = static_cast<uint32_t>(items.size());
+			nodes.reserve(itemCount * 2);
+			nodes.push_back({});
+			std::vector<BuildTask> tasks = { { 0, 0, itemCount } };
+			std::vector<BuildTask> subtrees;
+			const size_t subtreeTarget = threadPool ? (std::max)(threadPool->threads.size(), size_t(1)) * 4 : 1;
+			for (size_t i = 0; i < tasks.size(); i++) {
+				const BuildTask task = tasks[i];
+				if (task.count <= minSubtreeItems || subtrees.size() + tasks.size() - i >= subtreeTarget)
+					subtrees.push_back(task);
+				else
+					splitNode(nodes, task, items, input, tasks);
+			}
+
+			std::vector<std::vector<vkglTF::BVH::Node>> subtreeNodes(subtrees.size());
+			const auto buildSubtree = [&](size_t s) {
+				std::vector<vkglTF::BVH::Node>& local = subtreeNodes[s];
+				local.push_back({});
+				std::vector<BuildTask> stack = { { 0, subtrees[s].first, subtrees[s].count } };
+				while (!stack.empty()) {
+					const BuildTask task = stack.back();
+					stack.pop_back();
+					splitNode(local, task, items, input, stack);
+				}
+			};
+			if (threadPool)
+				threadPool->parallelFor(subtrees.size(), buildSubtree);
+			else
+				buildSubtree(0);
+
+			// The root of a subtree takes the place reserved for it, the rest is appended so children still come after their parents
+			for (size_t s = 0; s < subtrees.size(); s++) {
+				const uint32_t offset = static_cast<uint32_t>(nodes.size()) - 1;
+				std::vector<vkglTF::BVH::Node>& local = subtreeNodes[s];
+				for (vkglTF::BVH::Node& node : local) {
+					if (node.count == 0)
+						node.first += offset;
+				}
+				nodes[subtrees[s].node] = local[0];
+				nodes.insert(nodes.end(), local.begin() + 1, local.end());
+			}
+		}
+
+		/** @brief Distance at which the ray enters the box, FLT_MAX when it misses the box or enters it beyond maxDistance */
+		float intersectBox(const glm::vec3& origin, const glm::vec3& inverseDirection, const glm::vec3& min, const glm::vec3& max, float maxDistance) noexcept {
+			const glm::vec3 t0 = (min - origin) * inverseDirection;
+			const glm::vec3 t1 = (max - origin) * inverseDirection;
+			const glm::vec3 entries = (glm::min)(t0, t1);
+			const glm::vec3 exits = (glm::max)(t0, t1);
+			const float enter = (std::max)({ entries.x, entries.y, entries.z, 0.0f });
+			const float exit = (std::min)({ exits.x, exits.y, exits.z, maxDistance });
+			return enter <= exit ? enter : FLT_MAX;
+		}
+
+		/** @brief Möller-Trumbore from both sides, picking should not depend on the winding of a triangle */
+		bool intersectTriangle(const glm::vec3& origin, const glm::vec3& direction, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c, float& distance) noexcept {
+			const glm::vec3 edge1 = b - a;
+			const glm::vec3 edge2 = c - a;
+			const glm::vec3 p = glm::cross(direction, edge2);
+			const float determinant = glm::dot(edge1, p);
+			if (determinant == 0.0f)
+				return false;
+
+			const float inverse = 1.0f / determinant;
+			const glm::vec3 s = origin - a;
+			const float u = glm::dot(s, p) * inverse;
+			if (u < 0.0f || u > 1.0f)
+				return false;
+			const glm::vec3 q = glm::cross(s, edge1);
+			const float v = glm::dot(direction, q) * inverse;
+			if (v < 0.0f || u + v > 1.0f)
+				return false;
+			const float t = glm::dot(edge2, q) * inverse;
+			if (t < 0.0f || t >= distance)
+				return false;
+			distance = t;
+			return true;
+		}
+
+		/** @brief Calls leaf(first, count) for every leaf the ray reaches within distance, nearest box first so leaf can shorten the ray early */
+		template <typename LeafFunction>
+		void traverse(const std::vector<vkglTF::BVH::Node>& nodes, uint32_t root, const glm::vec3& origin, const glm::vec3& inverseDirection, float& distance, LeafFunction&& leaf) {
+			const float rootDistance = intersectBox(origin, inverseDirection, nodes[root].min, nodes[root].max, distance);
+			if (rootDistance == FLT_MAX)
+				return;
+
+			// Every entry keeps the distance its box was entered at, boxes behind a hit found in the meantime are dropped
+			std::vector<std::pair<uint32_t, float>> stack;
+			stack.reserve(64);
+			stack.push_back({ root, rootDistance });
+			while (!stack.empty()) {
+				const auto [index, enter] = stack.back();
+				stack.pop_back();
+				if (enter > distance)
+					continue;
+
+				const vkglTF::BVH::Node& node = nodes[index];
+				if (node.count > 0) {
+					leaf(node.first, node.count);
+					continue;
+				}
+
+				uint32_t nearChild = node.first, farChild = node.first + 1;
+				float nearDistance = intersectBox(origin, inverseDirection, nodes[nearChild].min, nodes[nearChild].max, distance);
+				float farDistance = intersectBox(origin, inverseDirection, nodes[farChild].min, nodes[farChild].max, distance);
+				if (farDistance < nearDistance) {
+					std::swap(nearChild, farChild);
+					std::swap(nearDistance, farDistance);
+				}
+				if (farDistance != FLT_MAX)
+					stack.push_back({ farChild, farDistance });
+				if (nearDistance != FLT_MAX)
+					stack.push_back({ nearChild, nearDistance });
+			}
+		}
+	}
+
+	void vkglTF::BVH::computeItemBounds(const Model& model, uint32_t firstItem, uint32_t endItem) {
+		for (uint32_t item = firstItem; item < endItem; item++) {
+			const uint32_t node = itemNodes[item];
+			const Primitive* primitive = model.meshes[model.hierarchy.meshes[node]]->primitives[item - itemOffsets[node]];
+			const glm::mat4& matrix = model.hierarchy.worldMatrices[node];
+
+			// Primitives without position bounds still get an item so the indices stay fixed, as a point at their node
+			if (primitive->dimensions.min.x > primitive->dimensions.max.x) _UNLIKELY {
+				itemMin[item] = itemMax[item] = glm::vec3(matrix[3]);
+				continue;
+			}
+
+			// Transformed as center and extent, which gives the exact box around the transformed box
+			const glm::vec3 center = glm::vec3(matrix * glm::vec4((primitive->dimensions.min + primitive->dimensions.max) * 0.5f, 1.0f));
+			const glm::vec3 extent = (primitive->dimensions.max - primitive->dimensions.min) * 0.5f;
+			const glm::vec3 worldExtent = glm::abs(glm::vec3(matrix[0])) * extent.x + glm::abs(glm::vec3(matrix[1])) * extent.y + glm::abs(glm::vec3(matrix[2])) * extent.z;
+			itemMin[item] = center - worldExtent;
+			itemMax[item] = center + worldExtent;
+		}
+	}
+
+	void vkglTF::BVH::build(const Model& model, ThreadPool& threadPool) {
+#ifdef _DEBUG
+		const auto start = std::chrono::high_resolution_clock::now();
+#endif
+
+		// Items follow the hierarchy, so the primitives of a subtree of nodes are a contiguous range of items
+		const Model::Hierarchy& hierarchy = model.hierarchy;
+		itemOffsets.resize(hierarchy.size() + 1);
+		itemNodes.clear();
+		for (uint32_t node = 0; node < hierarchy.size(); node++) {
+			itemOffsets[node] = static_cast<uint32_t>(itemNodes.size());
+			if (hierarchy.meshes[node] != Model::Hierarchy::none)
+				itemNodes.insert(itemNodes.end(), model.meshes[hierarchy.meshes[node]]->primitives.size(), node);
+		}
+		itemOffsets.back() = static_cast<uint32_t>(itemNodes.size());
+
+		const uint32_t itemCount = static_cast<uint32_t>(itemNodes.size());
+		itemMin.resize(itemCount);
+		itemMax.resize(itemCount);
+		itemLeaves.resize(itemCount);
+		nodes.clear();
+		parents.clear();
+		refitNodes.clear();
+		refitMarked.clear();
+		if (itemCount == 0)
+			return;
+
+		threadPool.parallelFor((itemCount + boundsChunkSize - 1) / boundsChunkSize, [&](size_t chunk) {
+			const uint32_t first = static_cast<uint32_t>(chunk) * boundsChunkSize;
+			computeItemBounds(model, first, (std::min)(itemCount, first + boundsChunkSize));
+		});
+
+		std::vector<glm::vec3> centroids(itemCount);
+		for (uint32_t item = 0; item < itemCount; item++)
+			centroids[item] = (itemMin[item] + itemMax[item]) * 0.5f;
+
+		items.resize(itemCount);
+		std::iota(items.begin(), items.end(), 0);
+		buildTree(nodes, items, { itemMin.data(), itemMax.data(), centroids.data() }, &threadPool);
+
+		parents.assign(nodes.size(), noParent);
+		for (uint32_t i = 0; i < nodes.size(); i++) {
+			if (nodes[i].count == 0) {
+				parents[nodes[i].first] = i;
+				parents[nodes[i].first + 1] = i;
+			}
+			else {
+				for (uint32_t k = nodes[i].first; k < nodes[i].first + nodes[i].count; k++)
+					itemLeaves[items[k]] = i;
+			}
+		}
+		refitMarked.assign(nodes.size(), 0);
+
+#ifdef _DEBUG
+		const auto end = std::chrono::high_resolution_clock::now();
+		std::cout << "Built BVH over " << itemCount << " primitives with " << nodes.size() << " nodes in "
+			<< std::chrono::duration<double, std::milli>(end - start).count() << " ms" << std::endl;
+#endif
+	}
+
+	void vkglTF::BVH::invalidate(const Model& model, uint32_t first, uint32_t end) {
+		if (nodes.empty())
+			return;
+
+		const uint32_t firstItem = itemOffsets[first];
+		const uint32_t endItem = itemOffsets[end];
+		computeItemBounds(model, firstItem, endItem);
+
+		// Walks up until a node that is already waiting, everything above it is marked as well
+		for (uint32_t item = firstItem; item < endItem; item++) {
+			for (uint32_t node = itemLeaves[item]; node != noParent && !refitMarked[node]; node = parents[node]) {
+				refitMarked[node] = 1;
+				refitNodes.push_back(node);
+			}
+		}
+	}
+
+	void vkglTF::BVH::refit() {
+		// Parents come before their children, so going backwards every box is refit after the boxes below it
+		std::sort(refitNodes.begin(), refitNodes.end(), std::greater<uint32_t>());
+		for (uint32_t index : refitNodes) {
+			Node& node = nodes[index];
+			refitMarked[index] = 0;
+			if (node.count > 0) {
+				node.min = glm::vec3(FLT_MAX);
+				node.max = glm::vec3(-FLT_MAX);
+				for (uint32_t k = node.first; k < node.first + node.count; k++) {
+					node.min = (glm::min)(node.min, itemMin[items[k]]);
+					node.max = (glm::max)(node.max, itemMax[items[k]]);
+				}
+			}
+			else {
+				node.min = (glm::min)(nodes[node.first].min, nodes[node.first + 1].min);
+				node.max = (glm::max)(nodes[node.first].max, nodes[node.first + 1].max);
+			}
+		}
+		refitNodes.clear();
+	}
+
+	uint32_t vkglTF::BVH::cull(const std::array<glm::vec4, 6>& planes, std::vector<uint8_t>& visible) const {
+		visible.assign(itemNodes.size(), 0);
+		if (nodes.empty())
+			return 0;
+
+		// Every entry carries the planes its box still straddles, subtrees completely inside are taken without further tests
+		uint32_t count = 0;
+		std::vector<std::pair<uint32_t, uint32_t>> stack;
+		stack.reserve(64);
+		stack.push_back({ 0, 0x3f });
+		while (!stack.empty()) {
+			auto [index, mask] = stack.back();
+			stack.pop_back();
+
+			const Node& node = nodes[index];
+			if (mask && !classifyBox(planes, node.min, node.max, mask))
+				continue;
+
+			if (node.count == 0) {
+				stack.push_back({ node.first + 1, mask });
+				stack.push_back({ node.first, mask });
+				continue;
+			}
+
+			for (uint32_t k = node.first; k < node.first + node.count; k++) {
+				const uint32_t item = items[k];
+				uint32_t itemMask = mask;
+				if (itemMask == 0 || classifyBox(planes, itemMin[item], itemMax[item], itemMask)) {
+					visible[item] = 1;
+					count++;
+				}
+			}
+		}
+		return count;
+	}
+
+	uint32_t vkglTF::BVH::raycast(const glm::vec3& origin, const glm::vec3& direction, float& distance, const std::function<bool(uint32_t item, float& distance)>& intersectItem) const {
+		uint32_t hit = noItem;
+		if (nodes.empty())
+			return hit;
+
+		const glm::vec3 inverseDirection = 1.0f / direction;
+		traverse(nodes, 0, origin, inverseDirection, distance, [&](uint32_t first, uint32_t count) {
+			for (uint32_t k = first; k < first + count; k++) {
+				// The box of the item is far cheaper than the item itself and already rejects most of the leaf
+				const uint32_t item = items[k];
+				if (intersectBox(origin, inverseDirection, itemMin[item], itemMax[item], distance) != FLT_MAX && intersectItem(item, distance))
+					hit = item;
+			}
+		});
+		return hit;
+	}
+
+	void vkglTF::MeshBVH::build(const Mesh& mesh, const std::vector<uint32_t>& indexBuffer, const std::vector<Vertex>& vertexBuffer, ThreadPool* threadPool) {
+		nodes.clear();
+		roots.clear();
+		positions.clear();
+		triangles.clear();
+
+		for (const Primitive* primitive : mesh.primitives) {
+			const uint32_t triangleCount = primitive->indexCount / 3;
+			if (triangleCount == 0) {
+				roots.push_back(noRoot);
+				continue;
+			}
+
+			// Indices are rebased onto the copied vertices of the mesh
+			const uint32_t vertexOffset = static_cast<uint32_t>(positions.size());
+			for (uint32_t v = 0; v < primitive->vertexCount; v++)
+				positions.push_back(vertexBuffer[primitive->firstVertex + v].pos);
+
+			std::vector<glm::uvec3> primitiveTriangles(triangleCount);
+			std::vector<glm::vec3> triangleMin(triangleCount), triangleMax(triangleCount), centroids(triangleCount);
+			for (uint32_t t = 0; t < triangleCount; t++) {
+				const uint32_t* index = &indexBuffer[primitive->firstIndex + t * 3];
+				const glm::uvec3 triangle = glm::uvec3(index[0], index[1], index[2]) - primitive->firstVertex + vertexOffset;
+				const glm::vec3& a = positions[triangle.x];
+				const glm::vec3& b = positions[triangle.y];
+				const glm::vec3& c = positions[triangle.z];
+				primitiveTriangles[t] = triangle;
+				triangleMin[t] = (glm::min)(a, (glm::min)(b, c));
+				triangleMax[t] = (glm::max)(a, (glm::max)(b, c));
+				centroids[t] = (a + b + c) / 3.0f;
+			}
+
+			std::vector<uint32_t> order(triangleCount);
+			std::iota(order.begin(), order.end(), 0);
+			std::vector<BVH::Node> tree;
+			buildTree(tree, order, { triangleMin.data(), triangleMax.data(), centroids.data() }, threadPool);
+
+			// Appended behind the trees of the earlier primitives, leaves index the triangles in leaf order
+			const uint32_t nodeOffset = static_cast<uint32_t>(nodes.size());
+			const uint32_t triangleOffset = static_cast<uint32_t>(triangles.size());
+			roots.push_back(nodeOffset);
+			for (BVH::Node& node : tree) {
+				node.first += node.count == 0 ? nodeOffset : triangleOffset;
+				nodes.push_back(node);
+			}
+			for (uint32_t t : order)
+				triangles.push_back(primitiveTriangles[t]);
+		}
+	}
+
+	bool vkglTF::MeshBVH::intersect(uint32_t primitive, const glm::vec3& origin, const glm::vec3& direction, float& distance) const {
+		if (primitive >= roots.size() || roots[primitive] == noRoot)
+			return false;
+
+		bool hit = false;
+		traverse(nodes, roots[primitive], origin, 1.0f / direction, distance, [&](uint32_t first, uint32_t count) {
+			for (uint32_t k = first; k < first + count; k++) {
+				const glm::uvec3& triangle = triangles[k];
+				if (intersectTriangle(origin, direction, positions[triangle.x], positions[triangle.y], positions[triangle.z], distance))
+					hit = true;
+			}
+		});
+		return hit;
+	}
+}
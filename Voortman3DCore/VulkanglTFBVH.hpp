@@ -0,0 +1,128 @@
+/*
+* glTF bounding volume hierarchy
+*
+* Keeps the world space box of every primitive of every node in a tree built with binned SAH, so the primitives outside
+* the view frustum are found without testing each of them. Moving nodes only refit the boxes above their primitives.
+* Every mesh keeps a tree over its triangles in object space as well, a ray walks the scene tree down to the nodes and
+* continues in the triangle trees of their meshes
+*/
+
+#pragma once
+#include "pch.hpp"
+#include "threadpool.hpp"
+
+namespace Voortman3D {
+	namespace vkglTF {
+		class Model;
+		struct Mesh;
+		struct Vertex;
+
+		class BVH {
+		public:
+			static constexpr uint32_t noItem = UINT32_MAX;
+
+			/*
+				Box of the tree, leaves hold count items starting at first, inner nodes have count 0 and their children at first and first + 1
+			*/
+			struct Node {
+				glm::vec3 min;
+				uint32_t first;
+				glm::vec3 max;
+				uint32_t count;
+			};
+
+			/** @brief Builds the tree over the primitives of all nodes of the model from their current world matrices */
+			void build(const Model& model, ThreadPool& threadPool);
+
+			/** @brief Recomputes the boxes of the primitives of hierarchy nodes [first, end), the tree above them follows on refit */
+			void invalidate(const Model& model, uint32_t first, uint32_t end);
+			/** @brief Grows and shrinks the boxes above the primitives that were invalidated since the last refit */
+			void refit();
+
+			/**
+			* Marks the items whose box intersects the frustum
+			*
+			* @param planes Frustum planes in the space of the world matrices, normals point inwards
+			* @param visible Resized to itemCount, 1 for every visible item
+			*
+			* @return Number of visible items
+			*/
+			uint32_t cull(const std::array<glm::vec4, 6>& planes, std::vector<uint8_t>& visible) const;
+
+			/**
+			* Walks the items whose box the ray hits, nearest box first
+			*
+			* @param origin Ray origin in the space of the world matrices
+			* @param direction Normalized ray direction
+			* @param distance Farthest distance to look at, lowered by intersectItem whenever it finds a closer hit
+			* @param intersectItem Tests the item itself, returns true after lowering distance to its hit
+			*
+			* @return The closest item that was hit or noItem
+			*/
+			uint32_t raycast(const glm::vec3& origin, const glm::vec3& direction, float& distance, const std::function<bool(uint32_t item, float& distance)>& intersectItem) const;
+
+			/** @brief Items are the primitives of the hierarchy nodes in order, primitive p of a node is item firstItem(node) + p */
+			_NODISCARD uint32_t firstItem(uint32_t node) const noexcept { return itemOffsets[node]; }
+			_NODISCARD size_t itemCount() const noexcept { return itemNodes.size(); }
+			_NODISCARD uint32_t itemNode(uint32_t item) const noexcept { return itemNodes[item]; }
+			/** @brief World space box of an item as of the last invalidate */
+			_NODISCARD const glm::vec3& itemMinimum(uint32_t item) const noexcept { return itemMin[item]; }
+			_NODISCARD const glm::vec3& itemMaximum(uint32_t item) const noexcept { return itemMax[item]; }
+			_NODISCARD size_t nodeCount() const noexcept { return nodes.size(); }
+			_NODISCARD bool empty() const noexcept { return nodes.empty(); }
+
+		private:
+			std::vector<Node> nodes;
+			// Parent of every tree node, parents always come before their children
+			std::vector<uint32_t> parents;
+
+			// Items in leaf order, every leaf and subtree covers a contiguous range
+			std::vector<uint32_t> items;
+			// Per hierarchy node plus one past the end
+			std::vector<uint32_t> itemOffsets;
+			std::vector<uint32_t> itemNodes;
+			std::vector<uint32_t> itemLeaves;
+			std::vector<glm::vec3> itemMin, itemMax;
+
+			// Tree nodes waiting for a refit, each listed once
+			std::vector<uint32_t> refitNodes;
+			std::vector<uint8_t> refitMarked;
+
+			void computeItemBounds(const Model& model, uint32_t firstItem, uint32_t endItem);
+		};
+
+		/*
+			Triangles of a mesh in one tree per primitive, in object space so every node using the mesh shares them
+		*/
+		class MeshBVH {
+		public:
+			/** @brief Builds the trees from the full detail indices, the top levels of large primitives are split up over the thread pool when there is one */
+			void build(const Mesh& mesh, const std::vector<uint32_t>& indexBuffer, const std::vector<Vertex>& vertexBuffer, ThreadPool* threadPool);
+
+			/**
+			* Finds the closest triangle of one primitive the ray hits
+			*
+			* @param primitive Index of the primitive in its mesh
+			* @param origin Ray origin in object space
+			* @param direction Ray direction in object space, distances are measured in multiples of its length
+			* @param distance Closest hit so far, lowered when a closer triangle is hit
+			*
+			* @return True when a triangle closer than distance was hit
+			*/
+			bool intersect(uint32_t primitive, const glm::vec3& origin, const glm::vec3& direction, float& distance) const;
+
+			_NODISCARD size_t triangleCount() const noexcept { return triangles.size(); }
+			_NODISCARD size_t nodeCount() const noexcept { return nodes.size(); }
+
+		private:
+			static constexpr uint32_t noRoot = UINT32_MAX;
+
+			std::vector<BVH::Node> nodes;
+			// Root node of the tree of every primitive, noRoot for primitives without triangles
+			std::vector<uint32_t> roots;
+			std::vector<glm::vec3> positions;
+			// In leaf order, indexing positions
+			std::vector<glm::uvec3> triangles;
+		};
+	}
+}
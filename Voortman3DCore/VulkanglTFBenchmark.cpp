@@ -0,0 +1,442 @@
+/*
+* glTF loading benchmark
+*
+* Times the phases of Model::loadFromFile one by one, on given files and on generated scenes from 1k nodes with 100k
+* triangles up to 1M nodes with 100M triangles, and writes the results as JSON so runs can be compared for regressions
+*/
+
+#include "pch.hpp"
+#include "VulkanglTFBenchmark.hpp"
+#include "VulkanUploader.hpp"
+#include "Tools.hpp"
+#include "json.hpp"
+#include <filesystem>
+#include <fstream>
+
+namespace Voortman3D {
+	namespace {
+		using Clock = std::chrono::high_resolution_clock;
+
+		enum Phase : uint32_t {
+			FileRead,
+			JsonParse,
+			Base64Decode,
+			GltfRead,
+			GeometryDecode,
+			Processing,
+			BufferCreation,
+			StagingCopy,
+			GpuUpload,
+			DescriptorSetup,
+			Total,
+			PhaseCount
+		};
+
+		constexpr const char* phaseNames[PhaseCount] = {
+			"fileRead", "jsonParse", "base64Decode", "gltfRead", "geometryDecode", "processing", "bufferCreation", "stagingCopy", "gpuUpload", "descriptorSetup", "total"
+		};
+
+		using Timings = std::array<double, PhaseCount>;
+
+		/*
+			Size of a model as it was decoded, before any processing adds levels or meshlets
+		*/
+		struct ModelInfo {
+			uint64_t fileBytes{ 0 };
+			uint64_t nodes{ 0 };
+			uint64_t meshes{ 0 };
+			uint64_t triangles{ 0 };
+			uint64_t vertices{ 0 };
+		};
+
+		// Distinct meshes of a generated scene, the other nodes instance them
+		constexpr uint32_t generatedMeshCount = 1000;
+		constexpr size_t embeddedBufferLimit = 256ull * 1024 * 1024;
+
+		_NODISCARD double elapsed(Clock::time_point start) noexcept {
+			return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+		}
+
+		_NODISCARD std::string encodeBase64(const uint8_t* data, size_t size) {
+			static constexpr char characters[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+			std::string encoded;
+			encoded.reserve((size + 2) / 3 * 4);
+			for (size_t i = 0; i < size; i += 3) {
+				const uint32_t remaining = static_cast<uint32_t>((std::min)(size - i, size_t(3)));
+				uint32_t triple = static_cast<uint32_t>(data[i]) << 16;
+				if (remaining > 1)
+					triple |= static_cast<uint32_t>(data[i + 1]) << 8;
+				if (remaining > 2)
+					triple |= data[i + 2];
+				encoded += characters[(triple >> 18) & 0x3F];
+				encoded += characters[(triple >> 12) & 0x3F];
+				encoded += remaining > 1 ? characters[(triple >> 6) & 0x3F] : '=';
+				encoded += remaining > 2 ? characters[triple & 0x3F] : '=';
+			}
+			return encoded;
+		}
+
+		/** @brief Submit the recorded copies and wait for them, which recycles the whole staging ring */
+		void flushUploads(VulkanDevice* device) {
+			VulkanUploader* uploader = device->uploader;
+			const uint64_t uploadValue = uploader->submit(false);
+			const VkSemaphore semaphore = uploader->getSemaphore();
+			VkSemaphoreWaitInfo waitInfo{};
+			waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+			waitInfo.semaphoreCount = 1;
+			waitInfo.pSemaphores = &semaphore;
+			waitInfo.pValues = &uploadValue;
+			VK_CHECK_RESULT(vkWaitSemaphores(device->logicalDevice, &waitInfo, UINT64_MAX));
+			uploader->collect();
+		}
+
+		/** @brief Stage data a chunk at a time like uploadBuffer does, with copying into the ring and waiting for the transfers timed apart */
+		void uploadBuffer(VulkanDevice* device, const void* data, VkDeviceSize size, VkBuffer buffer, Timings& timings) {
+			VulkanUploader* uploader = device->uploader;
+			const uint8_t* bytes = static_cast<const uint8_t*>(data);
+			for (VkDeviceSize offset = 0; offset < size;) {
+				const VkDeviceSize chunkSize = (std::min)(size - offset, uploader->getStagingChunkSize());
+				StagingAllocation allocation;
+				if (!uploader->tryAllocateStaging(chunkSize, allocation)) {
+					// The ring is full, it has room again once the copies recorded so far have completed
+					const Clock::time_point start = Clock::now();
+					flushUploads(device);
+					timings[GpuUpload] += elapsed(start);
+					continue;
+				}
+
+				const Clock::time_point start = Clock::now();
+				memcpy(allocation.mapped, bytes + offset, chunkSize);
+				timings[StagingCopy] += elapsed(start);
+
+				const VkBufferCopy region{ allocation.offset, offset, chunkSize };
+				uploader->copyBuffer(uploader->getStagingBuffer(), buffer, 1, &region);
+				uploader->releaseStaging(allocation);
+				offset += chunkSize;
+			}
+		}
+
+		/** @brief Load a file once the way loadFromFile does, with every phase timed on its own */
+		_NODISCARD bool measure(VulkanDevice* device, const std::string& filename, uint32_t fileLoadingFlags, Timings& timings, ModelInfo& info) {
+			timings.fill(0.0);
+
+			Clock::time_point start = Clock::now();
+			std::vector<unsigned char> data;
+			if (!Tools::readFile(filename, data)) _UNLIKELY {
+				std::cerr << "Could not open glTF file \"" + filename + "\"\n";
+				return false;
+			}
+			timings[FileRead] = elapsed(start);
+			info.fileBytes = data.size();
+
+			// Binary glTF starts with a 12 byte header followed by the length and type of the JSON chunk
+			std::string extension = std::filesystem::path(filename).extension().string();
+			std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+			const char* json = reinterpret_cast<const char*>(data.data());
+			size_t jsonSize = data.size();
+			if (extension == ".glb" && data.size() >= 20) {
+				uint32_t chunkLength;
+				memcpy(&chunkLength, data.data() + 12, sizeof(chunkLength));
+				json += 20;
+				jsonSize = (std::min)(static_cast<size_t>(chunkLength), data.size() - 20);
+			}
+
+			start = Clock::now();
+			const nlohmann::json document = nlohmann::json::parse(json, json + jsonSize, nullptr, false);
+			timings[JsonParse] = elapsed(start);
+			if (document.is_discarded()) _UNLIKELY {
+				std::cerr << "Could not parse the JSON of glTF file \"" + filename + "\"\n";
+				return false;
+			}
+
+			// Only buffers and images embedded as data URIs are base64 encoded
+			start = Clock::now();
+			for (const char* key : { "buffers", "images" }) {
+				const auto entries = document.find(key);
+				if (entries == document.end() || !entries->is_array())
+					continue;
+				for (const nlohmann::json& entry : *entries) {
+					const auto uri = entry.find("uri");
+					if (uri == entry.end() || !uri->is_string() || !tinygltf::IsDataURI(uri->get_ref<const std::string&>()))
+						continue;
+					std::vector<unsigned char> decoded;
+					std::string mimeType;
+					if (!tinygltf::DecodeDataURI(&decoded, mimeType, uri->get_ref<const std::string&>(), 0, false)) _UNLIKELY {
+						std::cerr << "Could not decode a data URI of glTF file \"" + filename + "\"\n";
+						return false;
+					}
+				}
+			}
+			timings[Base64Decode] = elapsed(start);
+
+			std::unique_ptr<vkglTF::Model> model = std::make_unique<vkglTF::Model>();
+			model->device = device;
+			model->path = Tools::getDirectory(filename);
+
+			ThreadPool threadPool;
+			threadPool.setThreadCount((std::max)(1u, std::thread::hardware_concurrency()));
+
+			start = Clock::now();
+			tinygltf::Model gltfModel;
+			if (!vkglTF::Model::readGltf(filename, data, gltfModel)) _UNLIKELY
+				return false;
+			timings[GltfRead] = elapsed(start);
+			std::vector<unsigned char>().swap(data);
+
+			std::vector<uint32_t> indexBuffer;
+			std::vector<vkglTF::Vertex> vertexBuffer;
+			start = Clock::now();
+			if (!model->decodeGeometry(filename, gltfModel, fileLoadingFlags, 1.0f, indexBuffer, vertexBuffer, threadPool)) _UNLIKELY
+				return false;
+			timings[GeometryDecode] = elapsed(start);
+			gltfModel = tinygltf::Model();
+
+			info.nodes = model->linearNodes.size();
+			info.meshes = model->meshes.size();
+			info.triangles = indexBuffer.size() / 3;
+			info.vertices = vertexBuffer.size();
+
+			start = Clock::now();
+			model->processGeometry(fileLoadingFlags, indexBuffer, vertexBuffer, threadPool);
+			if (indexBuffer.empty() || vertexBuffer.empty()) _UNLIKELY {
+				std::cerr << "glTF file \"" + filename + "\" has no geometry\n";
+				return false;
+			}
+			std::vector<uint32_t> wideIndexBuffer;
+			std::vector<uint16_t> shortIndexBuffer;
+			model->packIndices(indexBuffer, wideIndexBuffer, shortIndexBuffer);
+			timings[Processing] = elapsed(start);
+			std::vector<uint32_t>().swap(indexBuffer);
+
+			start = Clock::now();
+			model->createBuffers();
+			timings[BufferCreation] = elapsed(start);
+
+			uploadBuffer(device, vertexBuffer.data(), vertexBuffer.size() * sizeof(vkglTF::Vertex), model->vertices.buffer, timings);
+			uploadBuffer(device, wideIndexBuffer.data(), wideIndexBuffer.size() * sizeof(uint32_t), model->indices.buffer, timings);
+			uploadBuffer(device, shortIndexBuffer.data(), shortIndexBuffer.size() * sizeof(uint16_t), model->shortIndices.buffer, timings);
+			start = Clock::now();
+			flushUploads(device);
+			timings[GpuUpload] += elapsed(start);
+
+			start = Clock::now();
+			model->setupDescriptors();
+			timings[DescriptorSetup] = elapsed(start);
+
+			for (uint32_t phase = 0; phase < Total; phase++) {
+				if (phase != JsonParse && phase != Base64Decode)
+					timings[Total] += timings[phase];
+			}
+			return true;
+		}
+
+		/** @brief Load a file repetitions times and add its minimum and median timings to the results */
+		_NODISCARD bool benchmarkFile(VulkanDevice* device, const std::string& filename, const std::string& name, bool generated, const vkglTF::LoadingBenchmark::Options& options, nlohmann::json& results) {
+			std::vector<Timings> runs(options.repetitions);
+			ModelInfo info;
+			for (Timings& timings : runs) {
+				if (!measure(device, filename, options.fileLoadingFlags, timings, info)) _UNLIKELY
+					return false;
+			}
+
+			nlohmann::json phases;
+			std::vector<double> samples(runs.size());
+			for (uint32_t phase = 0; phase < PhaseCount; phase++) {
+				for (size_t i = 0; i < runs.size(); i++)
+					samples[i] = runs[i][phase];
+				std::sort(samples.begin(), samples.end());
+				phases[phaseNames[phase]] = { { "min", samples.front() }, { "median", samples[samples.size() / 2] } };
+			}
+
+			results.push_back({
+				{ "name", name },
+				{ "generated", generated },
+				{ "fileBytes", info.fileBytes },
+				{ "nodes", info.nodes },
+				{ "meshes", info.meshes },
+				{ "triangles", info.triangles },
+				{ "vertices", info.vertices },
+				{ "phases", phases }
+			});
+
+			std::cout << std::setw(24) << name << std::fixed << std::setprecision(2)
+				<< " | read " << phases["fileRead"]["median"].get<double>()
+				<< " | glTF " << phases["gltfRead"]["median"].get<double>()
+				<< " | decode " << phases["geometryDecode"]["median"].get<double>()
+				<< " | upload " << phases["stagingCopy"]["median"].get<double>() + phases["gpuUpload"]["median"].get<double>()
+				<< " | total " << phases["total"]["median"].get<double>() << " ms" << std::endl;
+			return true;
+		}
+	}
+
+	bool vkglTF::LoadingBenchmark::generateScene(const std::string& filename, uint32_t nodeCount, uint64_t triangleCount) {
+		nodeCount = (std::max)(nodeCount, 1u);
+		const uint32_t meshCount = (std::min)(nodeCount, generatedMeshCount);
+
+		// Every mesh is the same grid of quads, the last row only partly filled
+		const uint64_t quadCount = (std::max)(uint64_t(1), (triangleCount / meshCount + 1) / 2);
+		const uint32_t columns = static_cast<uint32_t>(std::ceil(std::sqrt(static_cast<double>(quadCount))));
+		const uint32_t rows = static_cast<uint32_t>((quadCount + columns - 1) / columns);
+		const uint32_t vertexCount = (rows + 1) * (columns + 1);
+		const uint64_t indexCount = quadCount * 6;
+
+		std::vector<glm::vec3> positions;
+		std::vector<glm::vec3> normals(vertexCount, glm::vec3(0.0f, 0.0f, 1.0f));
+		std::vector<glm::vec2> texcoords;
+		positions.reserve(vertexCount);
+		texcoords.reserve(vertexCount);
+		for (uint32_t y = 0; y <= rows; y++) {
+			for (uint32_t x = 0; x <= columns; x++) {
+				const glm::vec2 uv(static_cast<float>(x) / columns, static_cast<float>(y) / rows);
+				positions.push_back(glm::vec3(uv, 0.0f));
+				texcoords.push_back(uv);
+			}
+		}
+		std::vector<uint32_t> indices;
+		indices.reserve(indexCount);
+		for (uint64_t quad = 0; quad < quadCount; quad++) {
+			const uint32_t corner = static_cast<uint32_t>(quad / columns * (columns + 1) + quad % columns);
+			indices.insert(indices.end(), { corner, corner + 1, corner + columns + 2, corner, corner + columns + 2, corner + columns + 1 });
+		}
+
+		// One view per attribute holding that attribute of all meshes
+		const struct {
+			const void* data;
+			size_t size;
+		} blocks[] = {
+			{ positions.data(), positions.size() * sizeof(glm::vec3) },
+			{ normals.data(), normals.size() * sizeof(glm::vec3) },
+			{ texcoords.data(), texcoords.size() * sizeof(glm::vec2) },
+			{ indices.data(), indices.size() * sizeof(uint32_t) },
+		};
+		size_t bufferSize = 0;
+		for (const auto& block : blocks)
+			bufferSize += block.size * meshCount;
+
+		const std::filesystem::path scenePath(filename);
+		const bool embedded = bufferSize <= embeddedBufferLimit;
+		std::string uri;
+		if (embedded) {
+			std::vector<uint8_t> buffer;
+			buffer.reserve(bufferSize);
+			for (const auto& block : blocks) {
+				for (uint32_t mesh = 0; mesh < meshCount; mesh++)
+					buffer.insert(buffer.end(), static_cast<const uint8_t*>(block.data), static_cast<const uint8_t*>(block.data) + block.size);
+			}
+			uri = "data:application/octet-stream;base64," + encodeBase64(buffer.data(), buffer.size());
+		}
+		else {
+			std::filesystem::path binaryPath = scenePath;
+			binaryPath.replace_extension(".bin");
+			std::ofstream binary(binaryPath, std::ios::binary);
+			for (const auto& block : blocks) {
+				for (uint32_t mesh = 0; mesh < meshCount; mesh++)
+					binary.write(static_cast<const char*>(block.data), static_cast<std::streamsize>(block.size));
+			}
+			if (!binary) _UNLIKELY {
+				std::cerr << "Could not write \"" + binaryPath.string() + "\"\n";
+				return false;
+			}
+			uri = binaryPath.filename().string();
+		}
+
+		// Written by hand, a million nodes are too many for building a document first
+		std::string gltf;
+		gltf.reserve(uri.size() + size_t(nodeCount) * 96 + size_t(meshCount) * 256 + 1024);
+		gltf += "{\"asset\":{\"version\":\"2.0\",\"generator\":\"Voortman3D loading benchmark\"},\"scene\":0,\"scenes\":[{\"nodes\":[0]}],\"nodes\":[";
+		for (uint32_t node = 0; node < nodeCount; node++) {
+			if (node > 0)
+				gltf += ',';
+			gltf += "{\"mesh\":" + std::to_string(node % meshCount);
+			// Assemblies of eight parts side by side, the same shape the hierarchy of a machine has
+			if (node > 0)
+				gltf += ",\"translation\":[" + std::to_string((node - 1) % 8 * 1.25f) + ",1.25,0]";
+			if (uint64_t(node) * 8 + 1 < nodeCount) {
+				gltf += ",\"children\":[";
+				for (uint64_t child = uint64_t(node) * 8 + 1; child <= uint64_t(node) * 8 + 8 && child < nodeCount; child++) {
+					if (child > uint64_t(node) * 8 + 1)
+						gltf += ',';
+					gltf += std::to_string(child);
+				}
+				gltf += ']';
+			}
+			gltf += '}';
+		}
+		gltf += "],\"meshes\":[";
+		for (uint32_t mesh = 0; mesh < meshCount; mesh++) {
+			const std::string accessor = std::to_string(mesh * 4);
+			gltf += std::string(mesh > 0 ? "," : "") + "{\"primitives\":[{\"attributes\":{\"POSITION\":" + accessor + ",\"NORMAL\":" + std::to_string(mesh * 4 + 1)
+				+ ",\"TEXCOORD_0\":" + std::to_string(mesh * 4 + 2) + "},\"indices\":" + std::to_string(mesh * 4 + 3) + "}]}";
+		}
+		gltf += "],\"accessors\":[";
+		for (uint32_t mesh = 0; mesh < meshCount; mesh++) {
+			const auto offset = [&](uint32_t block) { return std::to_string(blocks[block].size * mesh); };
+			const std::string count = std::to_string(vertexCount);
+			gltf += std::string(mesh > 0 ? "," : "")
+				+ "{\"bufferView\":0,\"byteOffset\":" + offset(0) + ",\"componentType\":5126,\"count\":" + count + ",\"type\":\"VEC3\",\"min\":[0,0,0],\"max\":[1,1,0]},"
+				+ "{\"bufferView\":1,\"byteOffset\":" + offset(1) + ",\"componentType\":5126,\"count\":" + count + ",\"type\":\"VEC3\"},"
+				+ "{\"bufferView\":2,\"byteOffset\":" + offset(2) + ",\"componentType\":5126,\"count\":" + count + ",\"type\":\"VEC2\"},"
+				+ "{\"bufferView\":3,\"byteOffset\":" + offset(3) + ",\"componentType\":5125,\"count\":" + std::to_string(indexCount) + ",\"type\":\"SCALAR\"}";
+		}
+		gltf += "],\"bufferViews\":[";
+		size_t viewOffset = 0;
+		for (size_t block = 0; block < std::size(blocks); block++) {
+			const size_t viewSize = blocks[block].size * meshCount;
+			gltf += std::string(block > 0 ? "," : "") + "{\"buffer\":0,\"byteOffset\":" + std::to_string(viewOffset) + ",\"byteLength\":" + std::to_string(viewSize)
+				+ ",\"target\":" + (block == 3 ? "34963" : "34962") + "}";
+			viewOffset += viewSize;
+		}
+		gltf += "],\"buffers\":[{\"byteLength\":" + std::to_string(bufferSize) + ",\"uri\":\"" + uri + "\"}]}";
+
+		std::ofstream file(scenePath, std::ios::binary);
+		file.write(gltf.data(), static_cast<std::streamsize>(gltf.size()));
+		if (!file) _UNLIKELY {
+			std::cerr << "Could not write \"" + filename + "\"\n";
+			return false;
+		}
+		return true;
+	}
+
+	bool vkglTF::LoadingBenchmark::run(VulkanDevice* device, const Options& options) {
+		if (options.repetitions == 0) _UNLIKELY
+			return false;
+
+		nlohmann::json models = nlohmann::json::array();
+		bool succeeded = true;
+
+		std::cout << "Loading, median of " << options.repetitions << " runs" << std::endl;
+		for (const std::string& file : options.files) {
+			succeeded &= benchmarkFile(device, file, std::filesystem::path(file).filename().string(), false, options, models);
+		}
+
+		const std::filesystem::path directory = std::filesystem::temp_directory_path();
+		for (uint64_t nodes = 1000, triangles = 100000; nodes <= 1000000 && triangles <= options.maxTriangles; nodes *= 10, triangles *= 10) {
+			const std::string name = "generated-" + std::to_string(nodes) + "-" + std::to_string(triangles);
+			const std::filesystem::path scenePath = directory / (name + ".gltf");
+			if (!generateScene(scenePath.string(), static_cast<uint32_t>(nodes), triangles)) _UNLIKELY {
+				succeeded = false;
+				continue;
+			}
+			succeeded &= benchmarkFile(device, scenePath.string(), name, true, options, models);
+
+			std::error_code error;
+			std::filesystem::remove(scenePath, error);
+			std::filesystem::remove(std::filesystem::path(scenePath).replace_extension(".bin"), error);
+		}
+
+		const nlohmann::json results = {
+			{ "device", device->properties.deviceName },
+			{ "fileLoadingFlags", options.fileLoadingFlags },
+			{ "repetitions", options.repetitions },
+			{ "models", models }
+		};
+		std::ofstream output(options.output);
+		output << results.dump(1, '\t') << std::endl;
+		if (!output) _UNLIKELY {
+			std::cerr << "Could not write \"" + options.output + "\"\n";
+			return false;
+		}
+		std::cout << "Loading benchmark written to " << options.output << std::endl;
+		return succeeded;
+	}
+}
@@ -0,0 +1,68 @@
+/*
+* glTF loading benchmark
+*
+* Times the phases of Model::loadFromFile one by one, on given files and on generated scenes from 1k nodes with 100k
+* triangles up to 1M nodes with 100M triangles, and writes the results as JSON so runs can be compared for regressions:
+*
+*	{
+*		"device": "...",
+*		"fileLoadingFlags": 0,
+*		"repetitions": 3,
+*		"models": [
+*			{
+*				"name": "chinesedragon.gltf",
+*				"generated": false,
+*				"fileBytes": 2437061,
+*				"nodes": 2,
+*				"meshes": 2,
+*				"triangles": 100960,
+*				"vertices": 50559,
+*				"phases": {
+*					"fileRead": { "min": 0.9, "median": 1.1 },
+*					...
+*				}
+*			}
+*		]
+*	}
+*
+* Phases are fileRead, jsonParse, base64Decode, gltfRead, geometryDecode, processing, bufferCreation, stagingCopy,
+* gpuUpload and descriptorSetup, in milliseconds. The JSON parse and base64 decode are also timed on their own, gltfRead
+* covers tinygltf doing both again while building its model, so total leaves those two out
+*/
+
+#pragma once
+#include "pch.hpp"
+#include "VulkanglTFModel.hpp"
+
+namespace Voortman3D {
+	namespace vkglTF {
+		namespace LoadingBenchmark {
+			struct Options {
+				// Loaded as they are besides the generated scenes
+				std::vector<std::string> files;
+				// Generated scenes above this are skipped, the largest one needs several GB of memory on both sides
+				uint64_t maxTriangles{ 100000000 };
+				uint32_t repetitions{ 3 };
+				uint32_t fileLoadingFlags{ FileLoadingFlags::None };
+				std::string output{ "loading-benchmark.json" };
+			};
+
+			/**
+			* Write a glTF scene of nodeCount nodes in assemblies of eight with triangleCount triangles of geometry
+			*
+			* Nodes share up to a thousand distinct meshes like the repeated parts of a machine do. Buffers up to 256 MB are
+			* embedded as base64, larger ones go into a .bin file next to the scene
+			*
+			* @return False when a file could not be written, reported on std::cerr
+			*/
+			_NODISCARD bool generateScene(const std::string& filename, uint32_t nodeCount, uint64_t triangleCount);
+
+			/**
+			* Time the files and the generated scenes and write the results to options.output
+			*
+			* @note The descriptor set layouts and the default texture have to exist, like for loading any model
+			*/
+			_NODISCARD bool run(VulkanDevice* device, const Options& options);
+		}
+	}
+}
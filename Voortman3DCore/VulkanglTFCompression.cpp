@@ -0,0 +1,577 @@
+/*
+* glTF geometry decompression
+*
+* EXT_meshopt_compression decoders follow the bitstream described in the extension specification
+* https://github.com/KhronosGroup/glTF/tree/main/extensions/2.0/Vendor/EXT_meshopt_compression
+*/
+
+#include "pch.hpp"
+#include "VulkanglTFCompression.hpp"
+
+#include <cmath>
+
+namespace Voortman3D {
+	namespace {
+		/* meshopt vertex codec (mode ATTRIBUTES) */
+
+		constexpr uint8_t vertexHeader = 0xa0;
+		constexpr size_t vertexBlockSizeBytes = 8192;
+		constexpr size_t vertexBlockMaxSize = 256;
+		constexpr size_t byteGroupSize = 16;
+		// Largest encoded byte group: 4 bit selectors for 16 values followed by 16 escaped bytes
+		constexpr size_t byteGroupMaxSize = 24;
+		constexpr size_t tailMaxSize = 32;
+
+		_NODISCARD constexpr size_t getVertexBlockSize(size_t vertexSize) noexcept {
+			const size_t result = (vertexBlockSizeBytes / vertexSize) & ~(byteGroupSize - 1);
+			return result < vertexBlockMaxSize ? result : vertexBlockMaxSize;
+		}
+
+		_NODISCARD inline uint8_t unzigzag8(uint8_t v) noexcept {
+			return static_cast<uint8_t>(-(v & 1) ^ (v >> 1));
+		}
+
+		// Decodes 16 bytes that are stored with 0, 2, 4 or 8 bits each, the all ones value escapes to a full byte
+		const uint8_t* decodeBytesGroup(const uint8_t* data, uint8_t* buffer, int bitsLog2) noexcept {
+			switch (bitsLog2) {
+			case 0:
+				memset(buffer, 0, byteGroupSize);
+				return data;
+			case 1:
+			case 2: {
+				const int bits = 1 << bitsLog2;
+				const uint8_t escape = static_cast<uint8_t>((1 << bits) - 1);
+				const uint8_t* escaped = data + bits * 2;
+
+				for (size_t i = 0; i < byteGroupSize; i += 8 / bits) {
+					uint8_t byte = *data++;
+					for (int k = 0; k < 8 / bits; k++) {
+						const uint8_t encoded = byte >> (8 - bits);
+						byte = static_cast<uint8_t>(byte << bits);
+						*buffer++ = encoded == escape ? *escaped++ : encoded;
+					}
+				}
+				return escaped;
+			}
+			default:
+				memcpy(buffer, data, byteGroupSize);
+				return data + byteGroupSize;
+			}
+		}
+
+		const uint8_t* decodeBytes(const uint8_t* data, const uint8_t* dataEnd, uint8_t* buffer, size_t bufferSize) noexcept {
+			// Two header bits per group select the bit width of that group
+			const size_t headerSize = (bufferSize / byteGroupSize + 3) / 4;
+			if (static_cast<size_t>(dataEnd - data) < headerSize) _UNLIKELY
+				return nullptr;
+
+			const uint8_t* header = data;
+			data += headerSize;
+
+			for (size_t i = 0; i < bufferSize; i += byteGroupSize) {
+				if (static_cast<size_t>(dataEnd - data) < byteGroupMaxSize) _UNLIKELY
+					return nullptr;
+
+				const size_t headerOffset = i / byteGroupSize;
+				const int bitsLog2 = (header[headerOffset / 4] >> ((headerOffset % 4) * 2)) & 3;
+				data = decodeBytesGroup(data, buffer + i, bitsLog2);
+			}
+			return data;
+		}
+
+		const uint8_t* decodeVertexBlock(const uint8_t* data, const uint8_t* dataEnd, uint8_t* vertexData, size_t vertexCount, size_t vertexSize, uint8_t lastVertex[256]) noexcept {
+			std::array<uint8_t, vertexBlockMaxSize> buffer;
+			const size_t vertexCountAligned = (vertexCount + byteGroupSize - 1) & ~(byteGroupSize - 1);
+
+			// Every byte of the vertex is stored as its own stream of zigzag deltas to the previous vertex
+			for (size_t k = 0; k < vertexSize; k++) {
+				data = decodeBytes(data, dataEnd, buffer.data(), vertexCountAligned);
+				if (!data) _UNLIKELY
+					return nullptr;
+
+				uint8_t* output = vertexData + k;
+				uint8_t p = lastVertex[k];
+				for (size_t i = 0; i < vertexCount; i++) {
+					p = static_cast<uint8_t>(unzigzag8(buffer[i]) + p);
+					*output = p;
+					output += vertexSize;
+				}
+				lastVertex[k] = p;
+			}
+			return data;
+		}
+
+		_NODISCARD bool decodeVertexBuffer(uint8_t* destination, size_t vertexCount, size_t vertexSize, const uint8_t* data, size_t dataSize) noexcept {
+			if (vertexSize == 0 || vertexSize > 256 || vertexSize % 4 != 0) _UNLIKELY
+				return false;
+
+			const uint8_t* dataEnd = data + dataSize;
+			if (dataSize < 1 || (data[0] & 0xf0) != vertexHeader || (data[0] & 0x0f) > 0) _UNLIKELY
+				return false;
+			data++;
+
+			// The tail holds the first baseline vertex, it is padded so byte groups can always be read in one go
+			const size_t tailSize = vertexSize < tailMaxSize ? tailMaxSize : vertexSize;
+			if (static_cast<size_t>(dataEnd - data) < tailSize) _UNLIKELY
+				return false;
+
+			uint8_t lastVertex[256];
+			memcpy(lastVertex, dataEnd - vertexSize, vertexSize);
+
+			const size_t blockSize = getVertexBlockSize(vertexSize);
+			for (size_t offset = 0; offset < vertexCount; offset += blockSize) {
+				const size_t count = (std::min)(blockSize, vertexCount - offset);
+				data = decodeVertexBlock(data, dataEnd, destination + offset * vertexSize, count, vertexSize, lastVertex);
+				if (!data) _UNLIKELY
+					return false;
+			}
+
+			return static_cast<size_t>(dataEnd - data) == tailSize;
+		}
+
+		/* meshopt index codecs (modes TRIANGLES and INDICES) */
+
+		constexpr uint8_t indexHeader = 0xe0;
+		constexpr uint8_t sequenceHeader = 0xd0;
+
+		_NODISCARD inline uint32_t decodeVByte(const uint8_t*& data) noexcept {
+			const uint8_t lead = *data++;
+			if (lead < 128) _LIKELY
+				return lead;
+
+			// Remaining groups are little endian 7 bit values, at most 5 bytes in total
+			uint32_t result = lead & 127;
+			uint32_t shift = 7;
+			for (int i = 0; i < 4; i++) {
+				const uint8_t group = *data++;
+				result |= static_cast<uint32_t>(group & 127) << shift;
+				shift += 7;
+				if (group < 128)
+					break;
+			}
+			return result;
+		}
+
+		_NODISCARD inline uint32_t decodeIndex(const uint8_t*& data, uint32_t last) noexcept {
+			const uint32_t v = decodeVByte(data);
+			const uint32_t d = (v >> 1) ^ (0u - (v & 1));
+			return last + d;
+		}
+
+		inline void writeIndex(void* destination, size_t offset, size_t indexSize, uint32_t index) noexcept {
+			if (indexSize == 2)
+				static_cast<uint16_t*>(destination)[offset] = static_cast<uint16_t>(index);
+			else
+				static_cast<uint32_t*>(destination)[offset] = index;
+		}
+
+		inline void writeTriangle(void* destination, size_t offset, size_t indexSize, uint32_t a, uint32_t b, uint32_t c) noexcept {
+			writeIndex(destination, offset + 0, indexSize, a);
+			writeIndex(destination, offset + 1, indexSize, b);
+			writeIndex(destination, offset + 2, indexSize, c);
+		}
+
+		/*
+			Triangle decoder
+
+			Triangles are reconstructed from a 16 entry edge FIFO and a 16 entry vertex FIFO. Both FIFOs have to be
+			updated exactly like the encoder did, otherwise every following triangle decodes wrong
+		*/
+		class TriangleDecoder {
+		public:
+			TriangleDecoder() {
+				for (auto& edge : edgeFifo)
+					edge = { ~0u, ~0u };
+				vertexFifo.fill(~0u);
+			}
+
+			_NODISCARD bool decode(void* destination, size_t indexCount, size_t indexSize, const uint8_t* buffer, size_t bufferSize) noexcept {
+				if (indexCount % 3 != 0 || (indexSize != 2 && indexSize != 4)) _UNLIKELY
+					return false;
+				// Header, one code per triangle and the 16 byte codeaux table at the end
+				if (bufferSize < 1 + indexCount / 3 + 16) _UNLIKELY
+					return false;
+				if ((buffer[0] & 0xf0) != indexHeader) _UNLIKELY
+					return false;
+
+				const int version = buffer[0] & 0x0f;
+				if (version > 1) _UNLIKELY
+					return false;
+
+				// Version 1 uses fec 13 and 14 for indices one below and above the last free index
+				const int fecMax = version >= 1 ? 13 : 15;
+
+				const uint8_t* code = buffer + 1;
+				const uint8_t* data = code + indexCount / 3;
+				const uint8_t* dataSafeEnd = buffer + bufferSize - 16;
+				const uint8_t* codeauxTable = dataSafeEnd;
+
+				for (size_t i = 0; i < indexCount; i += 3) {
+					// A triangle reads at most 16 bytes of data, the codeaux table acts as padding
+					if (data > dataSafeEnd) _UNLIKELY
+						return false;
+
+					const uint8_t codeTri = *code++;
+
+					if (codeTri < 0xf0) _LIKELY {
+						// Triangle shares an edge with one of the last 16 triangles
+						const int fe = codeTri >> 4;
+						const uint32_t a = edgeFifo[(edgeOffset - 1 - fe) & 15][0];
+						const uint32_t b = edgeFifo[(edgeOffset - 1 - fe) & 15][1];
+						const int fec = codeTri & 15;
+
+						uint32_t c;
+						bool pushC = true;
+						if (fec < fecMax) {
+							c = fec == 0 ? next++ : vertexFifo[(vertexOffset - 1 - fec) & 15];
+							pushC = fec == 0;
+						}
+						else {
+							// 13 and 14 decode to -1 and +1
+							last = c = fec != 15 ? last + (fec - (fec ^ 3)) : decodeIndex(data, last);
+						}
+
+						writeTriangle(destination, i, indexSize, a, b, c);
+
+						pushVertex(c, pushC);
+						pushEdge(c, b);
+						pushEdge(a, c);
+					}
+					else if (codeTri < 0xfe) {
+						// Triangle without a shared edge, the low bits index the codeaux table
+						const uint8_t codeaux = codeauxTable[codeTri & 15];
+						const int feb = codeaux >> 4;
+						const int fec = codeaux & 15;
+
+						// Next is incremented for all three vertices before the FIFO is updated, matching the encoder
+						const uint32_t a = next++;
+						const uint32_t b = feb == 0 ? next++ : vertexFifo[(vertexOffset - feb) & 15];
+						const uint32_t c = fec == 0 ? next++ : vertexFifo[(vertexOffset - fec) & 15];
+
+						writeTriangle(destination, i, indexSize, a, b, c);
+
+						pushVertex(a, true);
+						pushVertex(b, feb == 0);
+						pushVertex(c, fec == 0);
+						pushEdge(b, a);
+						pushEdge(c, b);
+						pushEdge(a, c);
+					}
+					else {
+						// Same as above with the codeaux stored as a full byte, which allows free indices
+						const uint8_t codeaux = *data++;
+						const int fea = codeTri == 0xfe ? 0 : 15;
+						const int feb = codeaux >> 4;
+						const int fec = codeaux & 15;
+
+						// A zero codeaux that is not taken from the table restarts the vertex numbering
+						if (codeaux == 0)
+							next = 0;
+
+						uint32_t a = fea == 0 ? next++ : 0;
+						uint32_t b = feb == 0 ? next++ : vertexFifo[(vertexOffset - feb) & 15];
+						uint32_t c = fec == 0 ? next++ : vertexFifo[(vertexOffset - fec) & 15];
+
+						if (fea == 15)
+							last = a = decodeIndex(data, last);
+						if (feb == 15)
+							last = b = decodeIndex(data, last);
+						if (fec == 15)
+							last = c = decodeIndex(data, last);
+
+						writeTriangle(destination, i, indexSize, a, b, c);
+
+						pushVertex(a, true);
+						pushVertex(b, feb == 0 || feb == 15);
+						pushVertex(c, fec == 0 || fec == 15);
+						pushEdge(b, a);
+						pushEdge(c, b);
+						pushEdge(a, c);
+					}
+				}
+
+				// All data has to be consumed up to the codeaux table
+				return data == dataSafeEnd;
+			}
+
+		private:
+			std::array<std::array<uint32_t, 2>, 16> edgeFifo;
+			std::array<uint32_t, 16> vertexFifo;
+			size_t edgeOffset{};
+			size_t vertexOffset{};
+			uint32_t next{};
+			uint32_t last{};
+
+			inline void pushEdge(uint32_t a, uint32_t b) noexcept {
+				edgeFifo[edgeOffset] = { a, b };
+				edgeOffset = (edgeOffset + 1) & 15;
+			}
+
+			inline void pushVertex(uint32_t v, bool condition) noexcept {
+				vertexFifo[vertexOffset] = v;
+				vertexOffset = (vertexOffset + condition) & 15;
+			}
+		};
+
+		_NODISCARD bool decodeIndexSequence(void* destination, size_t indexCount, size_t indexSize, const uint8_t* buffer, size_t bufferSize) noexcept {
+			if (indexSize != 2 && indexSize != 4) _UNLIKELY
+				return false;
+			// Header, at least one byte per index and a 4 byte tail
+			if (bufferSize < 1 + indexCount + 4) _UNLIKELY
+				return false;
+			if ((buffer[0] & 0xf0) != sequenceHeader || (buffer[0] & 0x0f) > 1) _UNLIKELY
+				return false;
+
+			const uint8_t* data = buffer + 1;
+			const uint8_t* dataSafeEnd = buffer + bufferSize - 4;
+
+			// Indices are deltas to one of two baselines, the lowest bit selects which one
+			uint32_t last[2] = {};
+			for (size_t i = 0; i < indexCount; i++) {
+				if (data >= dataSafeEnd) _UNLIKELY
+					return false;
+
+				uint32_t v = decodeVByte(data);
+				const uint32_t current = v & 1;
+				v >>= 1;
+
+				const uint32_t d = (v >> 1) ^ (0u - (v & 1));
+				const uint32_t index = last[current] + d;
+				last[current] = index;
+
+				writeIndex(destination, i, indexSize, index);
+			}
+
+			return data == dataSafeEnd;
+		}
+
+		/* meshopt filters, applied in place after the vertex codec */
+
+		template <typename T>
+		void decodeFilterOct(T* data, size_t count) noexcept {
+			const float max = static_cast<float>((1 << (sizeof(T) * 8 - 1)) - 1);
+
+			for (size_t i = 0; i < count * 4; i += 4) {
+				// z is stored as the octahedral sum so it can be reconstructed at the bit count of x and y
+				float x = static_cast<float>(data[i + 0]);
+				float y = static_cast<float>(data[i + 1]);
+				const float z = static_cast<float>(data[i + 2]) - fabsf(x) - fabsf(y);
+
+				// Unfold the lower hemisphere
+				const float t = z >= 0.0f ? 0.0f : z;
+				x += x >= 0.0f ? t : -t;
+				y += y >= 0.0f ? t : -t;
+
+				const float s = max / sqrtf(x * x + y * y + z * z);
+
+				data[i + 0] = static_cast<T>(static_cast<int>(x * s + (x >= 0.0f ? 0.5f : -0.5f)));
+				data[i + 1] = static_cast<T>(static_cast<int>(y * s + (y >= 0.0f ? 0.5f : -0.5f)));
+				data[i + 2] = static_cast<T>(static_cast<int>(z * s + (z >= 0.0f ? 0.5f : -0.5f)));
+			}
+		}
+
+		void decodeFilterQuat(int16_t* data, size_t count) noexcept {
+			const float scale = 1.0f / sqrtf(2.0f);
+
+			for (size_t i = 0; i < count * 4; i += 4) {
+				// The scale of the three stored components is kept in the high bits of the fourth
+				const int sf = data[i + 3] | 3;
+				const float ss = scale / static_cast<float>(sf);
+
+				const float x = static_cast<float>(data[i + 0]) * ss;
+				const float y = static_cast<float>(data[i + 1]) * ss;
+				const float z = static_cast<float>(data[i + 2]) * ss;
+
+				// Clamp to avoid NaN from rounding errors
+				const float ww = 1.0f - x * x - y * y - z * z;
+				const float w = sqrtf(ww >= 0.0f ? ww : 0.0f);
+
+				const int16_t xf = static_cast<int16_t>(x * 32767.0f + (x >= 0.0f ? 0.5f : -0.5f));
+				const int16_t yf = static_cast<int16_t>(y * 32767.0f + (y >= 0.0f ? 0.5f : -0.5f));
+				const int16_t zf = static_cast<int16_t>(z * 32767.0f + (z >= 0.0f ? 0.5f : -0.5f));
+				const int16_t wf = static_cast<int16_t>(w * 32767.0f + 0.5f);
+
+				// The two low bits hold the index of the component that was dropped
+				const int qc = data[i + 3] & 3;
+				data[i + ((qc + 1) & 3)] = xf;
+				data[i + ((qc + 2) & 3)] = yf;
+				data[i + ((qc + 3) & 3)] = zf;
+				data[i + ((qc + 0) & 3)] = wf;
+			}
+		}
+
+		void decodeFilterExp(uint32_t* data, size_t count) noexcept {
+			for (size_t i = 0; i < count; i++) {
+				const uint32_t v = data[i];
+
+				// 24 bit signed mantissa and 8 bit signed exponent
+				const int32_t m = static_cast<int32_t>(v << 8) >> 8;
+				const int32_t e = static_cast<int32_t>(v) >> 24;
+
+				// ldexp(m, e) without the function call, 2^e is built directly from its exponent bits
+				float f;
+				const uint32_t exponentBits = static_cast<uint32_t>(e + 127) << 23;
+				memcpy(&f, &exponentBits, sizeof(f));
+				f *= static_cast<float>(m);
+				memcpy(&data[i], &f, sizeof(f));
+			}
+		}
+
+		/* Decode jobs */
+
+		struct DecodeJob {
+			std::string name;
+			// Compressed size, used to start the largest jobs first
+			size_t cost{};
+			std::function<bool()> decode;
+			bool result{};
+		};
+
+		_NODISCARD size_t getExtensionSize(const tinygltf::Value& extension, const char* key, size_t defaultValue = 0) {
+			if (!extension.Has(key) || !extension.Get(key).IsNumber())
+				return defaultValue;
+			return static_cast<size_t>(extension.Get(key).GetNumberAsDouble());
+		}
+
+		_NODISCARD std::string getExtensionString(const tinygltf::Value& extension, const char* key, const char* defaultValue) {
+			if (!extension.Has(key) || !extension.Get(key).IsString())
+				return defaultValue;
+			return extension.Get(key).Get<std::string>();
+		}
+
+		_NODISCARD bool addMeshoptJob(tinygltf::Model& model, int bufferViewIndex, std::vector<DecodeJob>& jobs) {
+			const tinygltf::BufferView& bufferView = model.bufferViews[bufferViewIndex];
+			const tinygltf::Value& extension = bufferView.extensions.at("EXT_meshopt_compression");
+
+			const size_t sourceIndex = getExtensionSize(extension, "buffer", SIZE_MAX);
+			const size_t byteOffset = getExtensionSize(extension, "byteOffset");
+			const size_t byteLength = getExtensionSize(extension, "byteLength");
+			const size_t byteStride = getExtensionSize(extension, "byteStride");
+			const size_t count = getExtensionSize(extension, "count");
+			const std::string mode = getExtensionString(extension, "mode", "");
+			const std::string filter = getExtensionString(extension, "filter", "NONE");
+
+			const std::string name = "meshopt bufferView " + std::to_string(bufferViewIndex);
+
+			// Decoded data is written into the (fallback) buffer of the bufferView itself
+			if (sourceIndex >= model.buffers.size() || bufferView.buffer < 0 || static_cast<size_t>(bufferView.buffer) == sourceIndex) _UNLIKELY {
+				std::cerr << name << " has an invalid source buffer\n";
+				return false;
+			}
+			if (byteOffset + byteLength > model.buffers[sourceIndex].data.size()) _UNLIKELY {
+				std::cerr << name << " points outside of its source buffer\n";
+				return false;
+			}
+			if (byteStride == 0 || count * byteStride > bufferView.byteLength || bufferView.byteOffset + count * byteStride > model.buffers[bufferView.buffer].data.size()) _UNLIKELY {
+				std::cerr << name << " does not fit inside its fallback buffer\n";
+				return false;
+			}
+
+			enum class Mode { Attributes, Triangles, Indices } decodeMode;
+			if (mode == "ATTRIBUTES")
+				decodeMode = Mode::Attributes;
+			else if (mode == "TRIANGLES")
+				decodeMode = Mode::Triangles;
+			else if (mode == "INDICES")
+				decodeMode = Mode::Indices;
+			else _UNLIKELY {
+				std::cerr << name << " uses unknown mode \"" << mode << "\"\n";
+				return false;
+			}
+
+			// Filters only exist for attributes and constrain the stride
+			const bool validFilter = filter == "NONE"
+				|| (filter == "OCTAHEDRAL" && decodeMode == Mode::Attributes && (byteStride == 4 || byteStride == 8))
+				|| (filter == "QUATERNION" && decodeMode == Mode::Attributes && byteStride == 8)
+				|| (filter == "EXPONENTIAL" && decodeMode == Mode::Attributes && byteStride % 4 == 0);
+			if (!validFilter) _UNLIKELY {
+				std::cerr << name << " uses unsupported filter \"" << filter << "\" for mode \"" << mode << "\"\n";
+				return false;
+			}
+
+			const size_t targetIndex = static_cast<size_t>(bufferView.buffer);
+			const size_t targetOffset = bufferView.byteOffset;
+
+			DecodeJob job{};
+			job.name = name;
+			job.cost = byteLength;
+			// Jobs only look up the buffers once all of them have been created
+			job.decode = [&model, sourceIndex, byteOffset, byteLength, byteStride, count, targetIndex, targetOffset, decodeMode, filter]() {
+				const uint8_t* source = model.buffers[sourceIndex].data.data() + byteOffset;
+				uint8_t* destination = model.buffers[targetIndex].data.data() + targetOffset;
+
+				switch (decodeMode) {
+				case Mode::Triangles: {
+					TriangleDecoder decoder;
+					return decoder.decode(destination, count, byteStride, source, byteLength);
+				}
+				case Mode::Indices:
+					return decodeIndexSequence(destination, count, byteStride, source, byteLength);
+				default:
+					break;
+				}
+
+				if (!decodeVertexBuffer(destination, count, byteStride, source, byteLength)) _UNLIKELY
+					return false;
+
+				if (filter == "OCTAHEDRAL") {
+					if (byteStride == 4)
+						decodeFilterOct(reinterpret_cast<int8_t*>(destination), count);
+					else
+						decodeFilterOct(reinterpret_cast<int16_t*>(destination), count);
+				}
+				else if (filter == "QUATERNION") {
+					decodeFilterQuat(reinterpret_cast<int16_t*>(destination), count);
+				}
+				else if (filter == "EXPONENTIAL") {
+					decodeFilterExp(reinterpret_cast<uint32_t*>(destination), count * (byteStride / 4));
+				}
+				return true;
+			};
+			jobs.push_back(std::move(job));
+			return true;
+		}
+	}
+
+	bool vkglTF::decompressModel(tinygltf::Model& model, ThreadPool& threadPool) {
+		std::vector<DecodeJob> jobs;
+
+		for (size_t i = 0; i < model.bufferViews.size(); i++) {
+			if (model.bufferViews[i].extensions.count("EXT_meshopt_compression") == 0) _LIKELY
+				continue;
+			if (!addMeshoptJob(model, static_cast<int>(i), jobs)) _UNLIKELY
+				return false;
+		}
+
+		for (tinygltf::Mesh& mesh : model.meshes) {
+			for (const tinygltf::Primitive& primitive : mesh.primitives) {
+				if (primitive.extensions.count("KHR_draco_mesh_compression") == 0) _LIKELY
+					continue;
+				// Draco is not decoded, optional Draco compression comes with uncompressed fallback accessors
+				if (std::find(model.extensionsRequired.begin(), model.extensionsRequired.end(), "KHR_draco_mesh_compression") != model.extensionsRequired.end()) _UNLIKELY {
+					std::cerr << "Mesh \"" << mesh.name << "\" requires KHR_draco_mesh_compression, which is not supported\n";
+					return false;
+				}
+			}
+		}
+
+		if (jobs.empty())
+			return true;
+
+		// Start with the largest jobs so a big one doesn't end up last on a single thread
+		std::sort(jobs.begin(), jobs.end(), [](const DecodeJob& a, const DecodeJob& b) { return a.cost > b.cost; });
+
+		threadPool.parallelFor(jobs.size(), [&jobs](size_t i) {
+			jobs[i].result = jobs[i].decode();
+		});
+
+		bool result = true;
+		for (const DecodeJob& job : jobs) {
+			if (!job.result) _UNLIKELY {
+				std::cerr << "Failed to decode " << job.name << "\n";
+				result = false;
+			}
+		}
+		return result;
+	}
+}
@@ -0,0 +1,29 @@
+/*
+* glTF geometry decompression
+*
+* Decodes EXT_meshopt_compression bufferViews in place so the loader can read them as regular accessors. Draco is
+* not decoded, KHR_draco_mesh_compression primitives are read through their uncompressed fallback accessors
+*/
+
+#pragma once
+#include "pch.hpp"
+#include "threadpool.hpp"
+
+#define TINYGLTF_NO_STB_IMAGE_WRITE
+#include "tiny_gltf.h"
+
+namespace Voortman3D {
+	namespace vkglTF {
+		/**
+		* Decompress all compressed geometry of a glTF model in place
+		*
+		* Every meshopt compressed bufferView is decoded as an independent job on the thread pool and written into its fallback buffer
+		*
+		* @param model Model as loaded by tinygltf
+		* @param threadPool Pool the decode jobs are distributed over
+		*
+		* @return False if compressed geometry could not be decoded or the file requires Draco
+		*/
+		_NODISCARD bool decompressModel(tinygltf::Model& model, ThreadPool& threadPool);
+	}
+}
@@ -0,0 +1,363 @@
+/*
+* glTF background loading
+*
+* Parses and processes a model on a worker thread and streams its geometry to the GPU in small batches. The worker fills
+* ranges of the staging ring of the uploader, the render thread submits the copies and nodes become resident once the
+* transfer queue has completed them. Textures are decoded after the geometry and stream in while the model is already shown
+*/
+
+#include "pch.hpp"
+#include "VulkanglTFLoader.hpp"
+#include "Tools.hpp"
+
+namespace Voortman3D {
+	vkglTF::ModelLoader::ModelLoader(VulkanDevice* device) : device(device), textureStreamer(device) {}
+
+	vkglTF::ModelLoader::~ModelLoader() {
+		cancelled = true;
+		if (worker.joinable())
+			worker.join();
+
+		// Ranges of submitted batches are recycled by the uploader, which outlives the loader
+		for (UploadBatch& batch : pendingBatches)
+			freeBatch(batch);
+
+		// Only when shutting down during a load, the copies still write into the model
+		if (!inFlightBatches.empty()) {
+			const VkSemaphore semaphore = device->uploader->getSemaphore();
+			VkSemaphoreWaitInfo waitInfo{};
+			waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+			waitInfo.semaphoreCount = 1;
+			waitInfo.pSemaphores = &semaphore;
+			waitInfo.pValues = &inFlightBatches.back().uploadValue;
+			VK_CHECK_RESULT(vkWaitSemaphores(device->logicalDevice, &waitInfo, UINT64_MAX));
+		}
+		textureStreamer.clear();
+
+		if (!modelTaken)
+			delete model;
+	}
+
+	bool vkglTF::ModelLoader::load(const std::string& filename, uint32_t fileLoadingFlags, float scale) {
+		if (busy())
+			return false;
+		if (worker.joinable())
+			worker.join();
+
+		if (!modelTaken)
+			delete model;
+		model = nullptr;
+		modelTaken = false;
+		allBatchesQueued = false;
+		allTexturesQueued = false;
+		cancelled = false;
+		totalBytes = 0;
+		residentBytes = 0;
+		submitTime = {};
+
+		state = State::Loading;
+		worker = std::thread(&ModelLoader::loadThread, this, filename, fileLoadingFlags, scale);
+		return true;
+	}
+
+	void vkglTF::ModelLoader::loadThread(std::string filename, uint32_t fileLoadingFlags, float scale) {
+		std::vector<uint32_t> indexBuffer;
+		std::vector<Vertex> vertexBuffer;
+
+		Model* newModel = new Model();
+		if (!newModel->loadGeometry(filename, device, fileLoadingFlags, scale, indexBuffer, vertexBuffer) || cancelled) _UNLIKELY {
+			delete newModel;
+			state = State::Failed;
+			return;
+		}
+
+		// Meshes shared by several nodes are uploaded once
+		VkDeviceSize modelBytes = 0;
+		for (const Mesh* mesh : newModel->meshes) {
+			for (const Primitive* primitive : mesh->primitives) {
+				const VkDeviceSize indexSize = primitive->shortIndices ? sizeof(uint16_t) : sizeof(uint32_t);
+				modelBytes += primitive->vertexCount * sizeof(Vertex) + primitive->indexCount * indexSize;
+				for (const Primitive::LOD& lod : primitive->lods)
+					modelBytes += lod.indexCount * indexSize;
+			}
+		}
+
+		// Geometry beyond the budget goes into the disk cache and is paged in by what the renderer sees, only the boxes standing in for it are uploaded here
+		std::vector<Vertex> proxyVertices;
+		std::vector<uint32_t> proxyIndices;
+		const VkDeviceSize budget = geometryBudget ? geometryBudget : GeometryResidency::defaultBudget(device);
+		if (modelBytes > budget) {
+			newModel->residency = new GeometryResidency(newModel);
+			if (!newModel->residency->build(indexBuffer, vertexBuffer, budget, proxyVertices, proxyIndices)) _UNLIKELY {
+				// Without a cache all of it is uploaded, which may still fit next to everything else
+				std::cerr << "Could not page the geometry of " << filename << ", uploading all of it" << std::endl;
+				delete newModel->residency;
+				newModel->residency = nullptr;
+			}
+			else {
+				std::vector<uint32_t>().swap(indexBuffer);
+				std::vector<Vertex>().swap(vertexBuffer);
+				vertexBuffer.swap(proxyVertices);
+				indexBuffer.swap(proxyIndices);
+				modelBytes = vertexBuffer.size() * sizeof(Vertex) + indexBuffer.size() * sizeof(uint32_t);
+			}
+		}
+
+		// Uploaded geometry goes into the pools of both index sizes, paged geometry keeps its 32-bit indices
+		std::vector<uint16_t> shortIndexBuffer;
+		if (!newModel->residency) {
+			std::vector<uint32_t> wideIndexBuffer;
+			newModel->packIndices(indexBuffer, wideIndexBuffer, shortIndexBuffer);
+			indexBuffer.swap(wideIndexBuffer);
+		}
+
+		// The buffers and descriptors exist before any node is drawn, only their contents arrive later
+		newModel->createBuffers();
+		newModel->setupDescriptors();
+
+		for (Node* node : newModel->linearNodes)
+			node->resident = false;
+
+		model = newModel;
+		totalBytes = modelBytes;
+		uploadStart = std::chrono::high_resolution_clock::now();
+		state = State::Uploading;
+
+		// Batches follow linearNodes and a node is only added once all of its data is staged, so the first batches already show part of the model.
+		// Batches complete in order, so a node whose mesh was staged by an earlier batch only has to wait for its own
+		const VkDeviceSize batchSize = device->uploader->getStagingChunkSize();
+		const uint8_t* vertexData = reinterpret_cast<const uint8_t*>(vertexBuffer.data());
+		const uint8_t* indexData = reinterpret_cast<const uint8_t*>(indexBuffer.data());
+		const uint8_t* shortIndexData = reinterpret_cast<const uint8_t*>(shortIndexBuffer.data());
+
+		std::vector<uint8_t> staged(newModel->meshes.size());
+		UploadBatch batch;
+		if (newModel->residency) {
+			// The boxes of all primitives fill the start of the pools, every node is shown once they have arrived
+			if (!stage(batch, vertexData, 0, vertexBuffer.size() * sizeof(Vertex), batch.vertexRegions) ||
+				!stage(batch, indexData, 0, indexBuffer.size() * sizeof(uint32_t), batch.indexRegions)) _UNLIKELY {
+				freeBatch(batch);
+				state = State::Cancelled;
+				return;
+			}
+			std::fill(staged.begin(), staged.end(), 1);
+		}
+		for (Node* node : newModel->linearNodes) {
+			if (!node->mesh)
+				continue;
+
+			uint8_t& meshStaged = staged[newModel->hierarchy.meshes[node->index]];
+			if (!meshStaged) {
+				for (const Primitive* primitive : node->mesh->primitives) {
+					// All levels of a primitive follow each other in its pool
+					uint32_t levelIndexCount = primitive->indexCount;
+					for (const Primitive::LOD& lod : primitive->lods)
+						levelIndexCount += lod.indexCount;
+
+					const VkDeviceSize vertexOffset = primitive->firstVertex * sizeof(Vertex);
+					const VkDeviceSize indexSize = primitive->shortIndices ? sizeof(uint16_t) : sizeof(uint32_t);
+					const VkDeviceSize indexOffset = primitive->poolFirstIndex * indexSize;
+					if (!stage(batch, vertexData + vertexOffset, vertexOffset, primitive->vertexCount * sizeof(Vertex), batch.vertexRegions) ||
+						!stage(batch, (primitive->shortIndices ? shortIndexData : indexData) + indexOffset, indexOffset, levelIndexCount * indexSize,
+							primitive->shortIndices ? batch.shortIndexRegions : batch.indexRegions)) _UNLIKELY {
+						freeBatch(batch);
+						state = State::Cancelled;
+						return;
+					}
+				}
+				meshStaged = 1;
+			}
+			batch.nodes.push_back(node);
+
+			if (batch.size >= batchSize)
+				queueBatch(batch);
+		}
+		if (!batch.nodes.empty())
+			queueBatch(batch);
+
+		// Release the CPU copy before reporting that everything is queued, update joins this thread right after
+		std::vector<uint32_t>().swap(indexBuffer);
+		std::vector<uint16_t>().swap(shortIndexBuffer);
+		std::vector<Vertex>().swap(vertexBuffer);
+
+		{
+			std::lock_guard<std::mutex> lock(batchMutex);
+			allBatchesQueued = true;
+		}
+
+		// Images are decoded in parallel and handed to the render thread as they finish, the first textures show while the rest still decode
+		if (!newModel->textureSources.empty()) {
+#ifdef _DEBUG
+			const auto decodeStart = std::chrono::high_resolution_clock::now();
+#endif
+			ThreadPool threadPool;
+			threadPool.setThreadCount((std::max)(1u, std::thread::hardware_concurrency()));
+
+			std::atomic<size_t> decodedCount{ 0 };
+			threadPool.parallelFor(newModel->textureSources.size(), [&](size_t i) {
+				textureStreamer.waitForSpace(cancelled);
+				if (cancelled)
+					return;
+
+				const Model::TextureSource& source = newModel->textureSources[i];
+				TextureLevels levels;
+				if (decodeTextureSource(device, source, levels)) {
+					textureStreamer.push(newModel, source.texture, std::move(levels));
+					decodedCount++;
+				}
+			});
+			std::vector<Model::TextureSource>().swap(newModel->textureSources);
+			if (cancelled) _UNLIKELY {
+				state = State::Cancelled;
+				return;
+			}
+
+#ifdef _DEBUG
+			const auto decodeEnd = std::chrono::high_resolution_clock::now();
+			std::cout << "Decoded " << decodedCount << " of " << newModel->textures.size() << " textures in "
+				<< std::chrono::duration<double, std::milli>(decodeEnd - decodeStart).count() << " ms" << std::endl;
+#endif
+		}
+
+		std::lock_guard<std::mutex> lock(batchMutex);
+		allTexturesQueued = true;
+	}
+
+	bool vkglTF::ModelLoader::stage(UploadBatch& batch, const void* data, VkDeviceSize dstOffset, VkDeviceSize size, std::vector<VkBufferCopy>& regions) {
+		VulkanUploader* uploader = device->uploader;
+		const uint8_t* src = static_cast<const uint8_t*>(data);
+
+		while (size > 0) {
+			if (batch.allocations.empty() || batch.allocationUsed == batch.allocations.back().size) {
+				StagingAllocation allocation;
+				while (!uploader->tryAllocateStaging(uploader->getStagingChunkSize(), allocation)) {
+					// The ring is full, hand over what is staged so far so its ranges come back once it has been uploaded
+					if (!batch.allocations.empty())
+						queueBatch(batch);
+					uploader->waitForStaging(stagingWaitTimeout);
+					if (cancelled)
+						return false;
+				}
+				batch.allocations.push_back(allocation);
+				batch.allocationUsed = 0;
+			}
+
+			// Regions are split where a range ends, a node only becomes resident once the batch holding its last region has completed
+			const StagingAllocation& allocation = batch.allocations.back();
+			const VkDeviceSize copySize = (std::min)(size, allocation.size - batch.allocationUsed);
+			memcpy(allocation.mapped + batch.allocationUsed, src, copySize);
+			regions.push_back({ allocation.offset + batch.allocationUsed, dstOffset, copySize });
+
+			batch.allocationUsed += copySize;
+			batch.size += copySize;
+			src += copySize;
+			dstOffset += copySize;
+			size -= copySize;
+		}
+		return true;
+	}
+
+	void vkglTF::ModelLoader::queueBatch(UploadBatch& batch) {
+		{
+			std::lock_guard<std::mutex> lock(batchMutex);
+			pendingBatches.push_back(std::move(batch));
+		}
+		batch = UploadBatch();
+	}
+
+	void vkglTF::ModelLoader::freeBatch(UploadBatch& batch) {
+		for (const StagingAllocation& allocation : batch.allocations)
+			device->uploader->freeStaging(allocation);
+		batch = UploadBatch();
+	}
+
+	uint32_t vkglTF::ModelLoader::update() {
+		VulkanUploader* uploader = device->uploader;
+		uint32_t updateFlags = 0;
+
+		// Batches complete in submission order
+		while (!inFlightBatches.empty() && uploader->isComplete(inFlightBatches.front().uploadValue)) {
+			const UploadBatch& batch = inFlightBatches.front();
+			// Completion is seen by the CPU, the frames still have to wait on the semaphore once to see the data
+			uploader->waitOnGraphics(batch.uploadValue);
+			for (Node* node : batch.nodes)
+				node->resident = true;
+			residentBytes += batch.size;
+			inFlightBatches.pop_front();
+			updateFlags |= UpdateFlags::NodesResident;
+		}
+
+		if ((state == State::Failed || state == State::Cancelled) && worker.joinable()) _UNLIKELY
+			worker.join();
+		if (state != State::Uploading)
+			return updateFlags;
+
+		std::deque<UploadBatch> batches;
+		bool finished;
+		{
+			std::lock_guard<std::mutex> lock(batchMutex);
+			batches.swap(pendingBatches);
+			finished = allBatchesQueued && allTexturesQueued;
+		}
+
+		if (!batches.empty()) {
+			const auto submitStart = std::chrono::high_resolution_clock::now();
+
+			// Everything that is queued goes out in one submit, the staging ranges are recycled by the uploader once it has completed
+			const VkBuffer stagingBuffer = uploader->getStagingBuffer();
+			for (UploadBatch& batch : batches) {
+				uploader->copyBuffer(stagingBuffer, model->vertices.buffer, static_cast<uint32_t>(batch.vertexRegions.size()), batch.vertexRegions.data());
+				uploader->copyBuffer(stagingBuffer, model->indices.buffer, static_cast<uint32_t>(batch.indexRegions.size()), batch.indexRegions.data());
+				uploader->copyBuffer(stagingBuffer, model->shortIndices.buffer, static_cast<uint32_t>(batch.shortIndexRegions.size()), batch.shortIndexRegions.data());
+				for (const StagingAllocation& allocation : batch.allocations)
+					uploader->releaseStaging(allocation);
+				batch.allocations.clear();
+			}
+			// Frames don't wait for it, the nodes are only drawn once the batch is seen to be complete
+			const uint64_t uploadValue = uploader->submit(false);
+			for (UploadBatch& batch : batches) {
+				batch.uploadValue = uploadValue;
+				inFlightBatches.push_back(std::move(batch));
+			}
+
+			submitTime += std::chrono::high_resolution_clock::now() - submitStart;
+		}
+		else {
+			// Textures only go up in frames without geometry, so they never hold up a node
+			const auto submitStart = std::chrono::high_resolution_clock::now();
+			if (textureStreamer.update(textureUploadBudget))
+				updateFlags |= UpdateFlags::TexturesChanged;
+			submitTime += std::chrono::high_resolution_clock::now() - submitStart;
+
+			if (finished && inFlightBatches.empty() && textureStreamer.idle()) {
+				worker.join();
+				state = State::Done;
+
+#ifdef _DEBUG
+				const std::chrono::duration<double> uploadTime = std::chrono::high_resolution_clock::now() - uploadStart;
+				const std::chrono::duration<double, std::milli> stallTime = submitTime;
+				const double megabytes = static_cast<double>(totalBytes) / (1024.0 * 1024.0);
+				std::cout << "Uploaded " << megabytes << " MB in " << uploadTime.count() * 1000.0 << " ms (" << megabytes / uploadTime.count() << " MB/s), render thread spent " << stallTime.count() << " ms submitting, " << device->allocator->getDeviceAllocationCount() << " device memory allocations" << std::endl;
+#endif
+			}
+		}
+		return updateFlags;
+	}
+
+	vkglTF::Model* vkglTF::ModelLoader::takeModel() noexcept {
+		const State current = state;
+		if (modelTaken || (current != State::Uploading && current != State::Done))
+			return nullptr;
+		modelTaken = true;
+		return model;
+	}
+
+	float vkglTF::ModelLoader::getProgress() const noexcept {
+		const State current = state;
+		if (current == State::Done)
+			return 1.0f;
+		if (current != State::Uploading || totalBytes == 0)
+			return 0.0f;
+		return static_cast<float>(residentBytes) / static_cast<float>(totalBytes);
+	}
+}
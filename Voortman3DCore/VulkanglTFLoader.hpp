@@ -0,0 +1,123 @@
+/*
+* glTF background loading
+*
+* Parses and processes a model on a worker thread and streams its geometry to the GPU in small batches. The worker fills
+* ranges of the staging ring of the uploader, the render thread submits the copies and nodes become resident once the
+* transfer queue has completed them. Textures are decoded after the geometry and stream in while the model is already shown
+*/
+
+#pragma once
+#include "pch.hpp"
+#include "VulkanglTFModel.hpp"
+#include "VulkanglTFTexture.hpp"
+#include "VulkanglTFResidency.hpp"
+#include "VulkanUploader.hpp"
+#include <atomic>
+#include <deque>
+
+namespace Voortman3D {
+	namespace vkglTF {
+		class ModelLoader {
+		public:
+			enum class State {
+				Idle,
+				Loading,	// Parsing and processing on the worker thread
+				Uploading,	// Model is available, its nodes become resident batch by batch and its textures level by level
+				Done,
+				Failed,
+				Cancelled	// The loader was destroyed before the worker finished staging and decoding
+			};
+
+			enum UpdateFlags {
+				NodesResident = 0x00000001,
+				// Texture descriptors of the model were written, command buffers that bind its node set have to be recorded again
+				TexturesChanged = 0x00000002
+			};
+
+			explicit ModelLoader(VulkanDevice* device);
+			~ModelLoader();
+
+			/**
+			* Start loading a model in the background
+			*
+			* @param filename glTF file or an assembly manifest, see VulkanglTFAssembly.hpp
+			*
+			* @return False if the previous load is still in progress
+			*/
+			bool load(const std::string& filename, uint32_t fileLoadingFlags = FileLoadingFlags::None, float scale = 1.0f);
+
+			/**
+			* Retire completed upload batches and submit the queued ones, call once per frame from the render thread
+			*
+			* @return UpdateFlags of what changed during this call
+			*/
+			_NODISCARD uint32_t update();
+
+			/**
+			* Take ownership of the loaded model, possible as soon as the state is Uploading
+			*
+			* @return The model or nullptr if there is none or it was already taken
+			*
+			* @note A model taken while uploading keeps being filled, keep calling update and don't delete it before the state is Done
+			*/
+			_NODISCARD Model* takeModel() noexcept;
+
+			/** @brief Device memory models may use for geometry before it is paged in on demand, 0 picks GeometryResidency::defaultBudget. Applies to the next load */
+			void setGeometryBudget(VkDeviceSize budget) noexcept { geometryBudget = budget; }
+
+			_NODISCARD State getState() const noexcept { return state; }
+			_NODISCARD bool busy() const noexcept { return state == State::Loading || state == State::Uploading; }
+			/** @brief Fraction of the geometry that is resident, 0 until the state is Uploading */
+			_NODISCARD float getProgress() const noexcept;
+
+		private:
+			struct UploadBatch {
+				std::vector<StagingAllocation> allocations;
+				VkDeviceSize allocationUsed{ 0 };	// Bytes filled in the last allocation
+				std::vector<VkBufferCopy> vertexRegions;
+				std::vector<VkBufferCopy> indexRegions;
+				std::vector<VkBufferCopy> shortIndexRegions;
+				std::vector<Node*> nodes;
+				VkDeviceSize size{ 0 };
+				uint64_t uploadValue{ 0 };
+			};
+
+			// How long the worker sleeps between checks for cancellation while the staging ring is full
+			static constexpr std::chrono::milliseconds stagingWaitTimeout{ 10 };
+			// Texture levels recorded per frame, so streaming never takes a frame much longer than the geometry batches do
+			static constexpr VkDeviceSize textureUploadBudget = 16ull * 1024 * 1024;
+
+			VulkanDevice* device;
+
+			std::thread worker;
+			std::atomic<State> state{ State::Idle };
+			std::atomic<bool> cancelled{ false };
+
+			Model* model{ nullptr };
+			bool modelTaken{ false };
+
+			std::mutex batchMutex;
+			std::deque<UploadBatch> pendingBatches;
+			bool allBatchesQueued{ false };
+			bool allTexturesQueued{ false };
+
+			TextureStreamer textureStreamer;
+
+			std::deque<UploadBatch> inFlightBatches;
+
+			VkDeviceSize geometryBudget{ 0 };
+
+			VkDeviceSize totalBytes{ 0 };
+			VkDeviceSize residentBytes{ 0 };
+
+			// Upload statistics of the current load, reported once it is done
+			std::chrono::high_resolution_clock::time_point uploadStart;
+			std::chrono::high_resolution_clock::duration submitTime{};
+
+			void loadThread(std::string filename, uint32_t fileLoadingFlags, float scale);
+			bool stage(UploadBatch& batch, const void* data, VkDeviceSize dstOffset, VkDeviceSize size, std::vector<VkBufferCopy>& regions);
+			void queueBatch(UploadBatch& batch);
+			void freeBatch(UploadBatch& batch);
+		};
+	}
+}
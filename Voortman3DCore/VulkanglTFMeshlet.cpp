@@ -0,0 +1,188 @@
+/*
+* glTF meshlets
+*
+* Splits primitives into small clusters of triangles with a bounding sphere and a normal cone, so clusters that are
+* outside the view frustum or face away from the camera can be skipped without looking at their triangles
+*/
+
+#include "pch.hpp"
+#include "VulkanglTFMeshlet.hpp"
+
+namespace Voortman3D {
+	namespace {
+		constexpr uint32_t invalidIndex = ~0u;
+
+		void computeMeshletBounds(vkglTF::Meshlet& meshlet, const std::vector<vkglTF::Vertex>& vertices, const std::vector<uint32_t>& meshletVertices, const std::vector<uint32_t>& meshletTriangles, const std::vector<glm::vec3>& normals, const glm::vec3& normalSum) {
+			glm::vec3 min(FLT_MAX), max(-FLT_MAX);
+			for (uint32_t v : meshletVertices) {
+				min = (glm::min)(min, vertices[v].pos);
+				max = (glm::max)(max, vertices[v].pos);
+			}
+			meshlet.center = (min + max) * 0.5f;
+			meshlet.radius = 0.0f;
+			for (uint32_t v : meshletVertices)
+				meshlet.radius = (std::max)(meshlet.radius, glm::distance(meshlet.center, vertices[v].pos));
+
+			// The cone spread is the largest angle between the average normal and any triangle normal
+			const float length = glm::length(normalSum);
+			meshlet.coneAxis = length > 0.0f ? normalSum / length : glm::vec3(0.0f, 0.0f, 1.0f);
+			float minDot = length > 0.0f ? 1.0f : -1.0f;
+			for (uint32_t triangle : meshletTriangles) {
+				if (normals[triangle] != glm::vec3(0.0f))
+					minDot = (std::min)(minDot, glm::dot(meshlet.coneAxis, normals[triangle]));
+			}
+			// Cones of 90 degrees or wider always contain a front facing triangle
+			meshlet.coneCutoff = minDot > 0.0f ? sqrtf(1.0f - minDot * minDot) : 1.0f;
+		}
+	}
+
+	std::vector<vkglTF::Meshlet> vkglTF::buildMeshlets(const std::vector<Vertex>& vertices, std::vector<uint32_t>& indices) {
+		std::vector<Meshlet> meshlets;
+		const size_t triangleCount = indices.size() / 3;
+		if (triangleCount == 0) _UNLIKELY
+			return meshlets;
+
+		// Vertex to triangle adjacency
+		std::vector<uint32_t> offsets(vertices.size() + 1, 0);
+		for (uint32_t index : indices)
+			offsets[index + 1]++;
+		for (size_t i = 1; i < offsets.size(); i++)
+			offsets[i] += offsets[i - 1];
+		std::vector<uint32_t> adjacency(triangleCount * 3);
+		{
+			std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+			for (size_t i = 0; i < triangleCount * 3; i++)
+				adjacency[fill[indices[i]]++] = static_cast<uint32_t>(i / 3);
+		}
+
+		std::vector<glm::vec3> normals(triangleCount);
+		for (size_t t = 0; t < triangleCount; t++) {
+			const glm::vec3& p0 = vertices[indices[t * 3 + 0]].pos;
+			const glm::vec3 normal = glm::cross(vertices[indices[t * 3 + 1]].pos - p0, vertices[indices[t * 3 + 2]].pos - p0);
+			const float length = glm::length(normal);
+			normals[t] = length > 0.0f ? normal / length : glm::vec3(0.0f);
+		}
+
+		std::vector<uint8_t> emitted(triangleCount, 0);
+		std::vector<uint8_t> inMeshlet(vertices.size(), 0);
+		std::vector<uint32_t> meshletVertices;
+		std::vector<uint32_t> meshletTriangles;
+		std::vector<uint32_t> candidates;
+		meshletVertices.reserve(maxMeshletVertices);
+		meshletTriangles.reserve(maxMeshletTriangles);
+
+		std::vector<uint32_t> result;
+		result.reserve(indices.size());
+
+		size_t seed = 0;
+		for (;;) {
+			// Every meshlet starts at the first remaining triangle, which keeps the existing cache friendly order
+			while (seed < triangleCount && emitted[seed])
+				seed++;
+			if (seed == triangleCount)
+				break;
+
+			glm::vec3 normalSum(0.0f);
+			uint32_t triangle = static_cast<uint32_t>(seed);
+			candidates.clear();
+
+			while (triangle != invalidIndex) {
+				emitted[triangle] = 1;
+				meshletTriangles.push_back(triangle);
+				normalSum += normals[triangle];
+				for (int k = 0; k < 3; k++) {
+					const uint32_t v = indices[triangle * 3 + k];
+					if (inMeshlet[v])
+						continue;
+					inMeshlet[v] = 1;
+					meshletVertices.push_back(v);
+					for (uint32_t a = offsets[v]; a < offsets[v + 1]; a++) {
+						if (!emitted[adjacency[a]])
+							candidates.push_back(adjacency[a]);
+					}
+				}
+				if (meshletTriangles.size() == maxMeshletTriangles)
+					break;
+
+				// Grow with the neighbour that adds the fewest vertices, ties go to the one that keeps the normal cone tight
+				const float axisLength = glm::length(normalSum);
+				const glm::vec3 axis = axisLength > 0.0f ? normalSum / axisLength : glm::vec3(0.0f);
+				triangle = invalidIndex;
+				uint32_t bestNewVertices = 4;
+				float bestDot = -FLT_MAX;
+				size_t write = 0;
+				for (uint32_t candidate : candidates) {
+					if (emitted[candidate])
+						continue;
+					candidates[write++] = candidate;
+
+					uint32_t newVertices = 0;
+					for (int k = 0; k < 3; k++)
+						newVertices += !inMeshlet[indices[candidate * 3 + k]];
+					if (meshletVertices.size() + newVertices > maxMeshletVertices)
+						continue;
+
+					const float d = glm::dot(normals[candidate], axis);
+					if (newVertices < bestNewVertices || (newVertices == bestNewVertices && d > bestDot)) {
+						triangle = candidate;
+						bestNewVertices = newVertices;
+						bestDot = d;
+					}
+				}
+				candidates.resize(write);
+			}
+
+			Meshlet meshlet{};
+			meshlet.firstIndex = static_cast<uint32_t>(result.size());
+			meshlet.indexCount = static_cast<uint32_t>(meshletTriangles.size() * 3);
+			for (uint32_t t : meshletTriangles) {
+				result.insert(result.end(), indices.begin() + t * 3, indices.begin() + t * 3 + 3);
+			}
+			computeMeshletBounds(meshlet, vertices, meshletVertices, meshletTriangles, normals, normalSum);
+			meshlets.push_back(meshlet);
+
+			for (uint32_t v : meshletVertices)
+				inMeshlet[v] = 0;
+			meshletVertices.clear();
+			meshletTriangles.clear();
+		}
+
+		indices.swap(result);
+		return meshlets;
+	}
+
+	std::array<glm::vec4, 6> vkglTF::extractFrustumPlanes(const glm::mat4& matrix) noexcept {
+		// Rows of the matrix, glm stores columns
+		const glm::vec4 row0(matrix[0][0], matrix[1][0], matrix[2][0], matrix[3][0]);
+		const glm::vec4 row1(matrix[0][1], matrix[1][1], matrix[2][1], matrix[3][1]);
+		const glm::vec4 row2(matrix[0][2], matrix[1][2], matrix[2][2], matrix[3][2]);
+		const glm::vec4 row3(matrix[0][3], matrix[1][3], matrix[2][3], matrix[3][3]);
+
+		// Depth runs from 0 to 1 (GLM_FORCE_DEPTH_ZERO_TO_ONE), so the near plane is the third row on its own
+		std::array<glm::vec4, 6> planes = {
+			row3 + row0,
+			row3 - row0,
+			row3 + row1,
+			row3 - row1,
+			row2,
+			row3 - row2
+		};
+		for (glm::vec4& plane : planes) {
+			const float length = glm::length(glm::vec3(plane));
+			if (length > 0.0f) _LIKELY
+				plane /= length;
+		}
+		return planes;
+	}
+
+	bool vkglTF::isMeshletVisible(const Meshlet& meshlet, const std::array<glm::vec4, 6>& planes, const glm::vec3& cameraPosition) noexcept {
+		for (const glm::vec4& plane : planes) {
+			if (glm::dot(glm::vec3(plane), meshlet.center) + plane.w < -meshlet.radius)
+				return false;
+		}
+
+		// Back facing when every point of the bounding sphere sees all normals of the cone from behind
+		const glm::vec3 view = meshlet.center - cameraPosition;
+		return glm::dot(view, meshlet.coneAxis) < meshlet.coneCutoff * glm::length(view) + meshlet.radius;
+	}
+}
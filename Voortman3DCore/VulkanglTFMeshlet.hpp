@@ -0,0 +1,42 @@
+/*
+* glTF meshlets
+*
+* Splits primitives into small clusters of triangles with a bounding sphere and a normal cone, so clusters that are
+* outside the view frustum or face away from the camera can be skipped without looking at their triangles
+*/
+
+#pragma once
+#include "pch.hpp"
+#include "VulkanglTFModel.hpp"
+
+namespace Voortman3D {
+	namespace vkglTF {
+		// Limits of a single meshlet, these also fit the output limits of mesh shaders on current hardware
+		constexpr uint32_t maxMeshletVertices = 64;
+		constexpr uint32_t maxMeshletTriangles = 124;
+
+		/**
+		* Build the meshlets of a single primitive
+		*
+		* @param vertices Vertices of the primitive
+		* @param indices Triangle list indexing into vertices, reordered so every meshlet is one contiguous range
+		*
+		* @return Meshlets covering all triangles, their firstIndex is relative to the start of indices
+		*/
+		_NODISCARD std::vector<Meshlet> buildMeshlets(const std::vector<Vertex>& vertices, std::vector<uint32_t>& indices);
+
+		/** @brief Extracts the left, right, bottom, top, near and far planes from a projection * view * model matrix, normals point inwards */
+		_NODISCARD std::array<glm::vec4, 6> extractFrustumPlanes(const glm::mat4& matrix) noexcept;
+
+		/**
+		* Test a meshlet against the view frustum and its normal cone against the camera position
+		*
+		* @param meshlet Meshlet to test
+		* @param planes Frustum planes in the object space of the meshlet
+		* @param cameraPosition Camera position in the object space of the meshlet
+		*
+		* @return False if no triangle of the meshlet can be visible
+		*/
+		_NODISCARD bool isMeshletVisible(const Meshlet& meshlet, const std::array<glm::vec4, 6>& planes, const glm::vec3& cameraPosition) noexcept;
+	}
+}
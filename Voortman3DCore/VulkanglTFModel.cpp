@@ -14,48 +14,82 @@
  */
 
 #include "Tools.hpp"
+// Declares tinygltf types only, so it has to be included before the implementation is requested
+#include "VulkanglTFAccessor.hpp"
+#include "VulkanglTFCompression.hpp"
 
 #define TINYGLTF_IMPLEMENTATION
 #define STB_IMAGE_IMPLEMENTATION
 #define TINYGLTF_NO_STB_IMAGE_WRITE
 
 #include "VulkanglTFModel.hpp"
+#include "VulkanglTFOptimizer.hpp"
+#include "VulkanglTFSimplifier.hpp"
+#include "VulkanglTFMeshlet.hpp"
+#include "VulkanglTFTexture.hpp"
+#include "VulkanglTFAssembly.hpp"
+#include "VulkanglTFResidency.hpp"
+#include "VulkanUploader.hpp"
+#include "BatchMath.hpp"
 #include <new>
+#include <map>
 #include <iostream>
 
 namespace Voortman3D {
 
-	VkDescriptorSetLayout vkglTF::descriptorSetLayoutImage = VK_NULL_HANDLE;
-	VkDescriptorSetLayout vkglTF::descriptorSetLayoutUbo = VK_NULL_HANDLE;
+	VkDescriptorSetLayout vkglTF::descriptorSetLayoutNodes = VK_NULL_HANDLE;
 	VkMemoryPropertyFlags vkglTF::memoryPropertyFlags = 0;
 
-	uint32_t vkglTF::descriptorBindingFlags = vkglTF::DescriptorBindingFlags::ImageBaseColor;
+	uint32_t vkglTF::textureSlotCount = vkglTF::maxTextures;
+	bool vkglTF::bindlessTextures = false;
 
-	/*
-		glTF material
-	*/
-	void vkglTF::Material::createDescriptorSet(VkDescriptorPool descriptorPool, VkDescriptorSetLayout descriptorSetLayout, uint32_t descriptorBindingFlags)
+	void vkglTF::enableBindlessTextures(uint32_t slotCount)
+	{
+		assert(descriptorSetLayoutNodes == VK_NULL_HANDLE);
+		bindlessTextures = true;
+		textureSlotCount = slotCount;
+	}
+
+	VkDescriptorPoolCreateFlags vkglTF::nodeDescriptorPoolFlags() noexcept
 	{
-		VkDescriptorSetAllocateInfo descriptorSetAllocInfo{};
-		descriptorSetAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-		descriptorSetAllocInfo.descriptorPool = descriptorPool;
-		descriptorSetAllocInfo.pSetLayouts = &descriptorSetLayout;
-		descriptorSetAllocInfo.descriptorSetCount = 1;
-		VK_CHECK_RESULT(vkAllocateDescriptorSets(device->logicalDevice, &descriptorSetAllocInfo, &descriptorSet));
-		std::vector<VkDescriptorImageInfo> imageDescriptors{};
-		std::vector<VkWriteDescriptorSet> writeDescriptorSets{};
-		if (descriptorBindingFlags & DescriptorBindingFlags::ImageBaseColor) {
-			imageDescriptors.push_back(baseColorTexture->descriptor);
-			VkWriteDescriptorSet writeDescriptorSet{};
-			writeDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			writeDescriptorSet.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-			writeDescriptorSet.descriptorCount = 1;
-			writeDescriptorSet.dstSet = descriptorSet;
-			writeDescriptorSet.dstBinding = static_cast<uint32_t>(writeDescriptorSets.size());
-			writeDescriptorSet.pImageInfo = &baseColorTexture->descriptor;
-			writeDescriptorSets.push_back(writeDescriptorSet);
-		}
-		vkUpdateDescriptorSets(device->logicalDevice, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
+		return bindlessTextures ? VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT : 0;
+	}
+
+	void vkglTF::createDescriptorSetLayouts(VkDevice device)
+	{
+		if (descriptorSetLayoutNodes == VK_NULL_HANDLE) {
+			std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings = {
+				Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 0),
+				Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 1),
+				Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT, 2),
+				// Indexed by the materials, so textures are bound once for the whole scene
+				Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, 3, textureSlotCount),
+			};
+			VkDescriptorSetLayoutCreateInfo descriptorLayoutCI{};
+			descriptorLayoutCI.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+			descriptorLayoutCI.bindingCount = static_cast<uint32_t>(setLayoutBindings.size());
+			descriptorLayoutCI.pBindings = setLayoutBindings.data();
+
+			// Slots stay empty until their texture arrives and arriving textures don't invalidate the recorded command buffers
+			const std::array<VkDescriptorBindingFlags, 4> bindingFlags = { 0, 0, 0, VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT };
+			VkDescriptorSetLayoutBindingFlagsCreateInfo bindingFlagsCI{};
+			bindingFlagsCI.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO;
+			bindingFlagsCI.bindingCount = static_cast<uint32_t>(bindingFlags.size());
+			bindingFlagsCI.pBindingFlags = bindingFlags.data();
+			if (bindlessTextures) {
+				descriptorLayoutCI.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT;
+				descriptorLayoutCI.pNext = &bindingFlagsCI;
+			}
+			VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device, &descriptorLayoutCI, nullptr, &descriptorSetLayoutNodes));
+		}
+	}
+
+	void vkglTF::destroyDescriptorSetLayouts(VkDevice device)
+	{
+		if (descriptorSetLayoutNodes != VK_NULL_HANDLE) _LIKELY {
+			vkDestroyDescriptorSetLayout(device, descriptorSetLayoutNodes, nullptr);
+			descriptorSetLayoutNodes = VK_NULL_HANDLE;
+		}
 	}
 
 	/*
@@ -69,61 +103,97 @@ namespace Voortman3D {
 		dimensions.radius = glm::distance(min, max) / 2.0f;
 	}
 
+	uint32_t vkglTF::Primitive::selectLOD(float errorScale, float maxError) const noexcept {
+		// Errors only grow with each level, so the first level that is too coarse ends the search
+		uint32_t level = 0;
+		while (level < lods.size() && lods[level].error * errorScale <= maxError)
+			level++;
+		return level;
+	}
+
 	/*
 		glTF mesh
 	*/
-	vkglTF::Mesh::Mesh(VulkanDevice* device, glm::mat4 matrix) {
+	vkglTF::Mesh::Mesh(VulkanDevice* device) {
 		this->device = device;
-		this->matrix = matrix;
-		VK_CHECK_RESULT(device->createBuffer(
-			VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-			sizeof(matrix),
-			&uniformBuffer.buffer,
-			&uniformBuffer.memory,
-			&matrix));
-		VK_CHECK_RESULT(vkMapMemory(device->logicalDevice, uniformBuffer.memory, 0, sizeof(matrix), 0, &uniformBuffer.mapped));
-		uniformBuffer.descriptor = { uniformBuffer.buffer, 0, sizeof(matrix) };
 	};
 
 	vkglTF::Mesh::~Mesh() {
-		vkDestroyBuffer(device->logicalDevice, uniformBuffer.buffer, nullptr);
-		vkFreeMemory(device->logicalDevice, uniformBuffer.memory, nullptr);
 		for (auto primitive : primitives)
 		{
 			delete primitive;
 		}
 	}
 
-	// Multiply yourself with your parent till there is no parent anymore
-	// This will result in the orientation matrix in the world where this node needs to be
-	glm::mat4 vkglTF::Node::getMatrix() {
-		// Use _LIKELY [[likely]] or _UNLIKELY [[unlikely]] as often as possible as it helps the compiler to optimize code
-		if (parent) _LIKELY // Most objects are going to have a parent
-			return this->matrix * parent->getMatrix();
+	void vkglTF::Node::Translate(glm::vec3 translation) {
+		glm::mat4& matrix = model->hierarchy.editLocalMatrix(index);
+		matrix = glm::translate(matrix, translation);
+	}
 
-		return this->matrix;
+	void vkglTF::Node::Rotate(glm::quat rotation) {
+		glm::mat4& matrix = model->hierarchy.editLocalMatrix(index);
+		matrix = matrix * glm::mat4_cast(rotation);
 	}
 
-	void vkglTF::Node::update() {
-		if (mesh) _LIKELY {
-			glm::mat4x4 matrix = getMatrix();
-			memcpy(mesh->uniformBuffer.mapped, &matrix, sizeof(glm::mat4));
-		}
+	void vkglTF::Node::Scale(glm::vec3 scale) {
+		glm::mat4& matrix = model->hierarchy.editLocalMatrix(index);
+		matrix = glm::scale(matrix, scale);
+	}
 
-		// Also update all children
-		for (auto& child : children) _LIKELY {
-			child->update();
-		}
+	const glm::mat4& vkglTF::Node::getMatrix() const {
+		return model->hierarchy.worldMatrices[index];
 	}
 
-	vkglTF::Node::~Node() {
-		if (mesh) _LIKELY {
-			delete mesh;
-		}
-		for (auto& child : children) _LIKELY {
-			delete child;
+	const glm::mat4& vkglTF::Node::getLocalMatrix() const {
+		return model->hierarchy.localMatrices[index];
+	}
+
+	void vkglTF::Node::setLocalMatrix(const glm::mat4& matrix) {
+		model->hierarchy.editLocalMatrix(index) = matrix;
+	}
+
+	const std::string& vkglTF::Node::getName() const {
+		return model->hierarchy.names[model->hierarchy.nameIds[index]];
+	}
+
+	void vkglTF::Model::updateWorldMatrixRange(uint32_t first, uint32_t end) {
+		// Parents come first, so the world matrix of the parent is always final by the time a child reads it
+		BatchMath::multiplyHierarchy(hierarchy.parents.data(), hierarchy.localMatrices.data(), hierarchy.worldMatrices.data(), first, end, Hierarchy::none);
+
+		if (nodeMatrices.mapped)
+			memcpy(nodeMatrices.mapped + first, hierarchy.worldMatrices.data() + first, (end - first) * sizeof(glm::mat4));
+	}
+
+	void vkglTF::Model::updateWorldMatrices() {
+		updateWorldMatrixRange(0, hierarchy.size());
+		bvh.invalidate(*this, 0, hierarchy.size());
+		bvh.refit();
+
+		for (uint32_t index : hierarchy.dirtyNodes)
+			hierarchy.dirty[index] = 0;
+		hierarchy.dirtyNodes.clear();
+	}
+
+	bool vkglTF::Model::updateDirtyWorldMatrices() {
+		if (hierarchy.dirtyNodes.empty()) _LIKELY
+			return false;
+
+		// Subtrees are nested or disjoint ranges, so after sorting a node inside the previous range is already covered by it
+		std::sort(hierarchy.dirtyNodes.begin(), hierarchy.dirtyNodes.end());
+
+		uint32_t end = 0;
+		for (uint32_t index : hierarchy.dirtyNodes) {
+			hierarchy.dirty[index] = 0;
+			if (index < end)
+				continue;
+
+			end = hierarchy.subtreeEnds[index];
+			updateWorldMatrixRange(index, end);
+			bvh.invalidate(*this, index, end);
 		}
+		hierarchy.dirtyNodes.clear();
+		bvh.refit();
+		return true;
 	}
 
 	/*
@@ -143,6 +213,8 @@ namespace Voortman3D {
 			return VkVertexInputAttributeDescription({ location, binding, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, pos) });
 		case VertexComponent::Normal: _LIKELY
 			return VkVertexInputAttributeDescription({ location, binding, VK_FORMAT_R32G32B32_SFLOAT, offsetof(Vertex, normal) });
+		case VertexComponent::UV:
+			return VkVertexInputAttributeDescription({ location, binding, VK_FORMAT_R32G32_SFLOAT, offsetof(Vertex, uv) });
 		default: _UNLIKELY
 			return VkVertexInputAttributeDescription({});
 		}
@@ -175,31 +247,56 @@ namespace Voortman3D {
 	*/
 	vkglTF::Model::~Model()
 	{
+		// Waits for the copies into the pools first
+		delete residency;
+
 		if (vertices.buffer)
 			vkDestroyBuffer(device->logicalDevice, vertices.buffer, nullptr);
 
-		if (vertices.memory)
-			vkFreeMemory(device->logicalDevice, vertices.memory, nullptr);
+		if (vertices.memory.memory)
+			device->freeMemory(vertices.memory);
 
 		if (indices.buffer)
 			vkDestroyBuffer(device->logicalDevice, indices.buffer, nullptr);
 
-		if (indices.memory)
-			vkFreeMemory(device->logicalDevice, indices.memory, nullptr);
+		if (indices.memory.memory)
+			device->freeMemory(indices.memory);
 
-		for (auto node : nodes) _LIKELY{
-			delete node;
-		}
+		if (shortIndices.buffer)
+			vkDestroyBuffer(device->logicalDevice, shortIndices.buffer, nullptr);
+
+		if (shortIndices.memory.memory)
+			device->freeMemory(shortIndices.memory);
+
+		if (nodeMatrices.buffer)
+			vkDestroyBuffer(device->logicalDevice, nodeMatrices.buffer, nullptr);
+
+		if (nodeMatrices.memory.memory)
+			device->freeMemory(nodeMatrices.memory);
+
+		if (instances.buffer)
+			vkDestroyBuffer(device->logicalDevice, instances.buffer, nullptr);
+
+		if (instances.memory.memory)
+			device->freeMemory(instances.memory);
 
-		if (descriptorSetLayoutUbo != VK_NULL_HANDLE) _LIKELY {
-			vkDestroyDescriptorSetLayout(device->logicalDevice, descriptorSetLayoutUbo, nullptr);
-			descriptorSetLayoutUbo = VK_NULL_HANDLE;
+		if (materialData.buffer)
+			vkDestroyBuffer(device->logicalDevice, materialData.buffer, nullptr);
+
+		if (materialData.memory.memory)
+			device->freeMemory(materialData.memory);
+
+		for (Mesh* mesh : meshes) _LIKELY {
+			delete mesh;
 		}
-		if (descriptorSetLayoutImage != VK_NULL_HANDLE) _LIKELY {
-			vkDestroyDescriptorSetLayout(device->logicalDevice, descriptorSetLayoutImage, nullptr);
-			descriptorSetLayoutImage = VK_NULL_HANDLE;
+
+		for (Texture* texture : textures) {
+			delete texture;
 		}
-		vkDestroyDescriptorPool(device->logicalDevice, descriptorPool, nullptr);
+
+		// The descriptor set layouts are global and shared with other models, see destroyDescriptorSetLayouts
+		if (descriptorPool)
+			vkDestroyDescriptorPool(device->logicalDevice, descriptorPool, nullptr);
 	}
 
 	template <typename T>
@@ -246,14 +343,32 @@ namespace Voortman3D {
 		}
 	}
 
-	void vkglTF::Model::loadNode(vkglTF::Node* parent, const tinygltf::Node& node, uint32_t nodeIndex, const tinygltf::Model& model, std::vector<uint32_t>& indexBuffer, std::vector<Vertex>& vertexBuffer, float globalscale)
+	void vkglTF::Model::loadNode(vkglTF::Node* parent, const tinygltf::Node& node, const tinygltf::Model& model, std::vector<uint32_t>& indexBuffer, std::vector<Vertex>& vertexBuffer, float globalscale, std::unordered_map<std::string, uint32_t>& nameIds, std::vector<uint32_t>& meshIndices)
 	{
-		vkglTF::Node* newNode = new Node;
+		// Storage is reserved for every node of the file and a valid file uses each node at most once, so the views never move
+		if (nodeStorage.size() == nodeStorage.capacity()) _UNLIKELY {
+			std::cerr << "Node \"" << node.name << "\" is used more than once in the scene and will be ignored\n";
+			return;
+		}
+
+		const uint32_t index = hierarchy.size();
+		hierarchy.parents.push_back(parent ? parent->index : Hierarchy::none);
+		hierarchy.localMatrices.push_back(glm::mat4(1.0f));
+		hierarchy.worldMatrices.push_back(glm::mat4(1.0f));
+		hierarchy.meshes.push_back(Hierarchy::none);
+		hierarchy.subtreeEnds.push_back(index + 1);
+		hierarchy.dirty.push_back(0);
+
+		const auto name = nameIds.try_emplace(node.name, static_cast<uint32_t>(hierarchy.names.size()));
+		if (name.second)
+			hierarchy.names.push_back(node.name);
+		hierarchy.nameIds.push_back(name.first->second);
 
-		newNode->index = nodeIndex;
+		vkglTF::Node* newNode = &nodeStorage.emplace_back();
+
+		newNode->model = this;
+		newNode->index = index;
 		newNode->parent = parent;
-		newNode->name = node.name;
-		newNode->matrix = glm::mat4(1.0f);
 
 		if (node.translation.size() == 3) {
 			newNode->Translate(glm::make_vec3(node.translation.data()));
@@ -269,20 +384,26 @@ namespace Voortman3D {
 		}
 
 		if (node.matrix.size() == 16) {
-			newNode->matrix = glm::make_mat4x4((float*)node.matrix.data()) * newNode->matrix;
+			newNode->setLocalMatrix(glm::make_mat4x4((float*)node.matrix.data()) * newNode->getLocalMatrix());
 		};
 
 		// Node with children
 		if (node.children.size() > 0) {
 			for (auto i = 0; i < node.children.size(); i++) {
-				loadNode(newNode, model.nodes[node.children[i]], node.children[i], model, indexBuffer, vertexBuffer, globalscale);
+				loadNode(newNode, model.nodes[node.children[i]], model, indexBuffer, vertexBuffer, globalscale, nameIds, meshIndices);
 			}
 		}
+		hierarchy.subtreeEnds[index] = hierarchy.size();
 
+		// Nodes that use the same glTF mesh share its geometry, meshIndices is left empty when every node needs its own copy
+		if (node.mesh > -1 && !meshIndices.empty() && meshIndices[node.mesh] != Hierarchy::none) {
+			hierarchy.meshes[index] = meshIndices[node.mesh];
+			newNode->mesh = meshes[meshIndices[node.mesh]];
+		}
 		// Node contains mesh data
-		if (node.mesh > -1) {
-			const tinygltf::Mesh mesh = model.meshes[node.mesh];
-			Mesh* newMesh = new Mesh(device, newNode->matrix);
+		else if (node.mesh > -1) {
+			const tinygltf::Mesh& mesh = model.meshes[node.mesh];
+			Mesh* newMesh = new Mesh(device);
 			newMesh->name = mesh.name;
 			for (size_t j = 0; j < mesh.primitives.size(); j++) {
 				const tinygltf::Primitive& primitive = mesh.primitives[j];
@@ -297,41 +418,51 @@ namespace Voortman3D {
 				glm::vec3 posMax{};
 				// Vertices
 				{
-					const float* bufferPos = nullptr;
-					const float* bufferNormals = nullptr;
-					const float* bufferColors = nullptr;
-					uint32_t numColorComponents;
-
 					// Position attribute is required
 					assert(primitive.attributes.find("POSITION") != primitive.attributes.end());
 
-					const tinygltf::Accessor& posAccessor = model.accessors[primitive.attributes.find("POSITION")->second];
-					const tinygltf::BufferView& posView = model.bufferViews[posAccessor.bufferView];
-					bufferPos = reinterpret_cast<const float*>(&(model.buffers[posView.buffer].data[posAccessor.byteOffset + posView.byteOffset]));
-					posMin = glm::vec3(posAccessor.minValues[0], posAccessor.minValues[1], posAccessor.minValues[2]);
-					posMax = glm::vec3(posAccessor.maxValues[0], posAccessor.maxValues[1], posAccessor.maxValues[2]);
+					AccessorView posView{};
+					if (!getAccessorView(model, model.accessors[primitive.attributes.find("POSITION")->second], posView)) _UNLIKELY {
+						std::cerr << "POSITION accessor of mesh \"" << mesh.name << "\" is invalid\n";
+						continue;
+					}
+
+					vertexCount = static_cast<uint32_t>(posView.count);
 
-					if (primitive.attributes.find("NORMAL") != primitive.attributes.end()) {
-						const tinygltf::Accessor& normAccessor = model.accessors[primitive.attributes.find("NORMAL")->second];
-						const tinygltf::BufferView& normView = model.bufferViews[normAccessor.bufferView];
-						bufferNormals = reinterpret_cast<const float*>(&(model.buffers[normView.buffer].data[normAccessor.byteOffset + normView.byteOffset]));
+					// Decode straight into the vertex buffer, vertices without a normal keep the zero initialized one
+					vertexBuffer.resize(vertexStart + vertexCount);
+					Vertex* primitiveVertices = vertexBuffer.data() + vertexStart;
+
+					// Bounds are taken from the decoded positions as accessor.min/max are optional and quantized for KHR_mesh_quantization
+					DecodedBounds bounds{};
+					if (!decodeVec3(posView, glm::value_ptr(primitiveVertices->pos), sizeof(Vertex), false, &bounds)) _UNLIKELY {
+						std::cerr << "POSITION component type " << posView.componentType << " not supported!" << std::endl;
+						vertexBuffer.resize(vertexStart);
+						continue;
 					}
-					if (primitive.attributes.find("COLOR_0") != primitive.attributes.end())
-					{
-						const tinygltf::Accessor& colorAccessor = model.accessors[primitive.attributes.find("COLOR_0")->second];
-						const tinygltf::BufferView& colorView = model.bufferViews[colorAccessor.bufferView];
-						// Color buffer are either of type vec3 or vec4
-						numColorComponents = colorAccessor.type == TINYGLTF_PARAMETER_TYPE_FLOAT_VEC3 ? 3 : 4;
-						bufferColors = reinterpret_cast<const float*>(&(model.buffers[colorView.buffer].data[colorAccessor.byteOffset + colorView.byteOffset]));
+					posMin = bounds.min;
+					posMax = bounds.max;
+
+					const auto normalAttribute = primitive.attributes.find("NORMAL");
+					if (normalAttribute != primitive.attributes.end()) {
+						AccessorView normalView{};
+						if (!getAccessorView(model, model.accessors[normalAttribute->second], normalView) || normalView.count != vertexCount) _UNLIKELY {
+							std::cerr << "NORMAL accessor of mesh \"" << mesh.name << "\" is invalid and will be ignored\n";
+						}
+						else if (!decodeVec3(normalView, glm::value_ptr(primitiveVertices->normal), sizeof(Vertex), true)) _UNLIKELY {
+							std::cerr << "NORMAL component type " << normalView.componentType << " not supported!" << std::endl;
+						}
 					}
 
-					vertexCount = static_cast<uint32_t>(posAccessor.count);
-
-					for (size_t v = 0; v < posAccessor.count; v++) {
-						Vertex vert{};
-						vert.pos = glm::vec4(glm::make_vec3(&bufferPos[v * 3]), 1.0f);
-						vert.normal = glm::normalize(glm::vec3(bufferNormals ? glm::make_vec3(&bufferNormals[v * 3]) : glm::vec3(0.0f)));
-						vertexBuffer.push_back(vert);
+					const auto uvAttribute = primitive.attributes.find("TEXCOORD_0");
+					if (uvAttribute != primitive.attributes.end()) {
+						AccessorView uvView{};
+						if (!getAccessorView(model, model.accessors[uvAttribute->second], uvView) || uvView.count != vertexCount) _UNLIKELY {
+							std::cerr << "TEXCOORD_0 accessor of mesh \"" << mesh.name << "\" is invalid and will be ignored\n";
+						}
+						else if (!decodeVec2(uvView, glm::value_ptr(primitiveVertices->uv), sizeof(Vertex))) _UNLIKELY {
+							std::cerr << "TEXCOORD_0 component type " << uvView.componentType << " not supported!" << std::endl;
+						}
 					}
 				}
 				// Indices
@@ -367,6 +498,10 @@ namespace Voortman3D {
 				newPrimitive->setDimensions(posMin, posMax);
 				newMesh->primitives.push_back(newPrimitive);
 			}
+			hierarchy.meshes[index] = static_cast<uint32_t>(meshes.size());
+			meshes.push_back(newMesh);
+			if (!meshIndices.empty())
+				meshIndices[node.mesh] = hierarchy.meshes[index];
 			newNode->mesh = newMesh;
 		}
 		if (parent) {
@@ -378,13 +513,100 @@ namespace Voortman3D {
 		linearNodes.push_back(newNode);
 	}
 
-	void vkglTF::Model::loadMaterials(tinygltf::Model& gltfModel)
+	void vkglTF::Model::createInstanceGroups()
 	{
+		instanceGroups.resize(meshes.size());
+		for (size_t i = 0; i < meshes.size(); i++) {
+			instanceGroups[i].mesh = meshes[i];
+		}
+		for (Node* node : linearNodes) {
+			if (node->mesh) {
+				instanceGroups[hierarchy.meshes[node->index]].nodes.push_back(node);
+			}
+		}
+
+		// Every node starts out drawn, ModelLoader and the renderer narrow the instances down from here
+		VkDeviceSize sharedBytes = 0, copiedBytes = 0;
+		size_t sharedDraws = 0, copiedDraws = 0, nodeCount = 0;
+		for (InstanceGroup& group : instanceGroups) {
+			group.firstInstance = instances.count;
+			group.instanceCount = static_cast<uint32_t>(group.nodes.size());
+			instances.count += group.instanceCount * static_cast<uint32_t>(group.mesh->primitives.size());
+			nodeCount += group.nodes.size();
+
+			for (const Primitive* primitive : group.mesh->primitives) {
+				const VkDeviceSize bytes = primitive->vertexCount * sizeof(Vertex) + primitive->indexCount * sizeof(uint32_t);
+				sharedBytes += bytes;
+				copiedBytes += bytes * group.nodes.size();
+				sharedDraws++;
+				copiedDraws += group.nodes.size();
+			}
+		}
+
+#ifdef _DEBUG
+		std::cout << "Shared " << meshes.size() << " meshes between " << nodeCount << " nodes: " << sharedBytes / (1024 * 1024) << " MB of geometry instead of "
+			<< copiedBytes / (1024 * 1024) << " MB, " << sharedDraws << " draws instead of " << copiedDraws << std::endl;
+#endif
+	}
+
+	void vkglTF::Model::loadMaterials(tinygltf::Model& gltfModel, bool loadImages)
+	{
+		// Materials that use the same images share one texture
+		std::map<std::pair<int, int>, Texture*> texturesByImages;
+		const auto getTexture = [&](int textureIndex, bool srgb) -> Texture* {
+			if (!loadImages || textureIndex < 0 || textureIndex >= static_cast<int>(gltfModel.textures.size()))
+				return nullptr;
+
+			// A KTX2 image of KHR_texture_basisu comes first, the plain source is what loaders without it would use
+			const tinygltf::Texture& texture = gltfModel.textures[textureIndex];
+			int image = texture.source;
+			int fallback = -1;
+			const auto basisu = texture.extensions.find("KHR_texture_basisu");
+			if (basisu != texture.extensions.end() && basisu->second.Has("source") && basisu->second.Get("source").IsInt()) {
+				fallback = image;
+				image = basisu->second.Get("source").Get<int>();
+			}
+			if (image < 0 || image >= static_cast<int>(gltfModel.images.size()))
+				return nullptr;
+
+			const auto found = texturesByImages.find({ image, fallback });
+			if (found != texturesByImages.end())
+				return found->second;
+
+			if (textures.size() + 1 >= textureSlotCount) _UNLIKELY {
+				std::cerr << "Texture \"" << texture.name << "\" is left out, no more than " << textureSlotCount - 1 << " textures are supported\n";
+				return nullptr;
+			}
+
+			Texture* newTexture = new Texture();
+			newTexture->index = static_cast<uint32_t>(textures.size()) + 1;
+			textures.push_back(newTexture);
+			texturesByImages[{ image, fallback }] = newTexture;
+
+			TextureSource& source = textureSources.emplace_back();
+			source.name = gltfModel.images[image].name.empty() ? gltfModel.images[image].uri : gltfModel.images[image].name;
+			source.encoded = gltfModel.images[image].image;
+			if (fallback >= 0 && fallback < static_cast<int>(gltfModel.images.size()))
+				source.fallback = gltfModel.images[fallback].image;
+			source.texture = newTexture;
+			source.srgb = srgb;
+			return newTexture;
+		};
+
 		for (tinygltf::Material& mat : gltfModel.materials) {
 			vkglTF::Material material(device);
 			if (mat.values.find("baseColorFactor") != mat.values.end()) {
 				material.baseColorFactor = glm::make_vec4(mat.values["baseColorFactor"].ColorFactor().data());
 			}
+			material.baseColorTexture = getTexture(mat.pbrMetallicRoughness.baseColorTexture.index, true);
+
+			if (mat.alphaMode == "MASK") {
+				material.alphaMode = Material::AlphaMode::Mask;
+				material.alphaCutoff = static_cast<float>(mat.alphaCutoff);
+			}
+			else if (mat.alphaMode == "BLEND") {
+				material.alphaMode = Material::AlphaMode::Blend;
+			}
 
 			materials.push_back(material);
 		}
@@ -392,49 +614,385 @@ namespace Voortman3D {
 		materials.push_back(Material(device));
 	}
 
-	void vkglTF::Model::loadFromFile(const std::string& filename, VulkanDevice* device, VkQueue transferQueue, uint32_t fileLoadingFlags, float scale)
+	void vkglTF::Model::optimizePrimitives(std::vector<uint32_t>& indexBuffer, std::vector<Vertex>& vertexBuffer, ThreadPool& threadPool)
 	{
-		tinygltf::Model gltfModel;
-		tinygltf::TinyGLTF gltfContext;
+		// Meshes are shared between nodes, so they are processed once each
+		std::vector<Primitive*> primitives;
+		for (Mesh* mesh : meshes) {
+			primitives.insert(primitives.end(), mesh->primitives.begin(), mesh->primitives.end());
+		}
+		// Restore load order so the buffers can be rebuilt front to back
+		std::sort(primitives.begin(), primitives.end(), [](const Primitive* a, const Primitive* b) { return a->firstIndex < b->firstIndex; });
+
+		struct OptimizedPrimitive {
+			std::vector<Vertex> vertices;
+			std::vector<uint32_t> indices;
+			VertexCacheStatistics before;
+			VertexCacheStatistics after;
+			bool optimized{ false };
+		};
+		std::vector<OptimizedPrimitive> results(primitives.size());
+
+		// Every primitive only reads its own ranges of the shared buffers, so they can all be optimized at the same time
+		threadPool.parallelFor(primitives.size(), [&](size_t i) {
+			const Primitive* primitive = primitives[i];
+			OptimizedPrimitive& result = results[i];
+			if (primitive->indexCount % 3 != 0) _UNLIKELY
+				return;
+
+			result.indices.assign(indexBuffer.begin() + primitive->firstIndex, indexBuffer.begin() + primitive->firstIndex + primitive->indexCount);
+			for (uint32_t& index : result.indices) {
+				index -= primitive->firstVertex;
+				if (index >= primitive->vertexCount) _UNLIKELY
+					return;
+			}
+			result.vertices.assign(vertexBuffer.begin() + primitive->firstVertex, vertexBuffer.begin() + primitive->firstVertex + primitive->vertexCount);
+
+			result.before = analyzeVertexCache(result.indices.data(), result.indices.size(), result.vertices.size());
+			optimizePrimitive(result.vertices, result.indices);
+			result.after = analyzeVertexCache(result.indices.data(), result.indices.size(), result.vertices.size());
+			result.optimized = true;
+		});
+
+		std::vector<Vertex> optimizedVertices;
+		std::vector<uint32_t> optimizedIndices;
+		optimizedVertices.reserve(vertexBuffer.size());
+		optimizedIndices.reserve(indexBuffer.size());
+
+		VertexCacheStatistics before{}, after{};
+		for (size_t i = 0; i < primitives.size(); i++) {
+			Primitive* primitive = primitives[i];
+			OptimizedPrimitive& result = results[i];
+			const uint32_t firstVertex = static_cast<uint32_t>(optimizedVertices.size());
+			const uint32_t firstIndex = static_cast<uint32_t>(optimizedIndices.size());
+
+			if (result.optimized) _LIKELY {
+				optimizedVertices.insert(optimizedVertices.end(), result.vertices.begin(), result.vertices.end());
+				for (uint32_t index : result.indices) {
+					optimizedIndices.push_back(index + firstVertex);
+				}
+				before += result.before;
+				after += result.after;
+			}
+			else {
+				// Primitives that could not be optimized are moved as they are
+				optimizedVertices.insert(optimizedVertices.end(), vertexBuffer.begin() + primitive->firstVertex, vertexBuffer.begin() + primitive->firstVertex + primitive->vertexCount);
+				for (uint32_t j = 0; j < primitive->indexCount; j++) {
+					optimizedIndices.push_back(indexBuffer[primitive->firstIndex + j] - primitive->firstVertex + firstVertex);
+				}
+			}
 
-		size_t pos = filename.find_last_of('/');
-		path = filename.substr(0, pos);
+			primitive->firstVertex = firstVertex;
+			primitive->vertexCount = static_cast<uint32_t>(optimizedVertices.size()) - firstVertex;
+			primitive->firstIndex = firstIndex;
+			primitive->indexCount = static_cast<uint32_t>(optimizedIndices.size()) - firstIndex;
+		}
 
-		std::string error, warning;
+		vertexBuffer.swap(optimizedVertices);
+		indexBuffer.swap(optimizedIndices);
 
-		this->device = device;
+#ifdef _DEBUG
+		std::cout << "Optimized " << primitives.size() << " primitives: " << before.vertexCount << " -> " << after.vertexCount << " vertices, "
+			<< std::fixed << std::setprecision(3) << "ACMR " << before.acmr() << " -> " << after.acmr() << ", ATVR " << before.atvr() << " -> " << after.atvr() << std::defaultfloat << std::endl;
+#endif
+	}
 
-		bool fileLoaded = gltfContext.LoadASCIIFromFile(&gltfModel, &error, &warning, filename);
+	void vkglTF::Model::generateLODs(std::vector<uint32_t>& indexBuffer, const std::vector<Vertex>& vertexBuffer, ThreadPool& threadPool)
+	{
+		// Levels stop once a primitive is this small or a level removes less than a quarter of the triangles
+		constexpr size_t maxLODs = 8;
+		constexpr size_t minLODTriangles = 32;
+
+		// Meshes are shared between nodes, so they are processed once each
+		std::vector<Primitive*> primitives;
+		for (Mesh* mesh : meshes) {
+			primitives.insert(primitives.end(), mesh->primitives.begin(), mesh->primitives.end());
+		}
 
-		std::vector<uint32_t> indexBuffer;
-		std::vector<Vertex> vertexBuffer;
+		struct LODChain {
+			std::vector<std::vector<uint32_t>> levels;
+			std::vector<float> errors;
+		};
+		std::vector<LODChain> chains(primitives.size());
+
+		threadPool.parallelFor(primitives.size(), [&](size_t i) {
+			const Primitive* primitive = primitives[i];
+			LODChain& chain = chains[i];
+			if (primitive->indexCount % 3 != 0 || primitive->indexCount / 3 < minLODTriangles * 2) _UNLIKELY
+				return;
+
+			std::vector<uint32_t> current(indexBuffer.begin() + primitive->firstIndex, indexBuffer.begin() + primitive->firstIndex + primitive->indexCount);
+			for (uint32_t& index : current) {
+				index -= primitive->firstVertex;
+				if (index >= primitive->vertexCount) _UNLIKELY
+					return;
+			}
+			const std::vector<Vertex> vertices(vertexBuffer.begin() + primitive->firstVertex, vertexBuffer.begin() + primitive->firstVertex + primitive->vertexCount);
+
+			// Each level is simplified from the previous one, so the errors add up to a bound on the distance to full detail
+			float error = 0.0f;
+			while (chain.levels.size() < maxLODs && current.size() / 3 >= minLODTriangles * 2) {
+				float levelError = 0.0f;
+				std::vector<uint32_t> simplified = simplifyPrimitive(vertices, current, current.size() / 6 * 3, primitive->dimensions.radius, &levelError);
+				if (simplified.empty() || simplified.size() * 4 > current.size() * 3)
+					break;
+
+				error += levelError;
+				optimizeVertexCache(simplified, vertices.size());
+				chain.levels.push_back(simplified);
+				chain.errors.push_back(error);
+				current.swap(simplified);
+			}
+		});
+
+		size_t levelCount = 0, fullTriangles = 0, coarsestTriangles = 0;
+		for (size_t i = 0; i < primitives.size(); i++) {
+			Primitive* primitive = primitives[i];
+			const LODChain& chain = chains[i];
+
+			// Levels are appended behind all full detail ranges and keep pointing at the vertices of their primitive
+			primitive->lods.clear();
+			primitive->lod = 0;
+			for (size_t level = 0; level < chain.levels.size(); level++) {
+				const uint32_t firstIndex = static_cast<uint32_t>(indexBuffer.size());
+				for (uint32_t index : chain.levels[level]) {
+					indexBuffer.push_back(index + primitive->firstVertex);
+				}
+				primitive->lods.push_back({ firstIndex, static_cast<uint32_t>(chain.levels[level].size()), chain.errors[level] });
+			}
 
-		if (fileLoaded) {
-			loadMaterials(gltfModel);
-			const tinygltf::Scene& scene = gltfModel.scenes[gltfModel.defaultScene > -1 ? gltfModel.defaultScene : 0];
-			for (size_t i = 0; i < scene.nodes.size(); i++) {
-				const tinygltf::Node node = gltfModel.nodes[scene.nodes[i]];
-				loadNode(nullptr, node, scene.nodes[i], gltfModel, indexBuffer, vertexBuffer, scale);
+			levelCount += primitive->lods.size();
+			fullTriangles += primitive->indexCount / 3;
+			coarsestTriangles += (primitive->lods.empty() ? primitive->indexCount : primitive->lods.back().indexCount) / 3;
+		}
+
+#ifdef _DEBUG
+		std::cout << "Generated " << levelCount << " LODs for " << primitives.size() << " primitives: " << fullTriangles << " -> " << coarsestTriangles << " triangles at the coarsest level" << std::endl;
+#endif
+	}
+
+	void vkglTF::Model::generateMeshlets(std::vector<uint32_t>& indexBuffer, const std::vector<Vertex>& vertexBuffer, ThreadPool& threadPool)
+	{
+		// Meshes are shared between nodes, so they are processed once each
+		std::vector<Primitive*> primitives;
+		for (Mesh* mesh : meshes) {
+			primitives.insert(primitives.end(), mesh->primitives.begin(), mesh->primitives.end());
+		}
+
+		std::vector<std::vector<Meshlet>> results(primitives.size());
+
+		// Triangles are only reordered within the index range of their own primitive, so every primitive can be split independently
+		threadPool.parallelFor(primitives.size(), [&](size_t i) {
+			const Primitive* primitive = primitives[i];
+			if (primitive->indexCount % 3 != 0) _UNLIKELY
+				return;
+
+			std::vector<uint32_t> indices(indexBuffer.begin() + primitive->firstIndex, indexBuffer.begin() + primitive->firstIndex + primitive->indexCount);
+			for (uint32_t& index : indices) {
+				index -= primitive->firstVertex;
+				if (index >= primitive->vertexCount) _UNLIKELY
+					return;
 			}
+			const std::vector<Vertex> vertices(vertexBuffer.begin() + primitive->firstVertex, vertexBuffer.begin() + primitive->firstVertex + primitive->vertexCount);
 
-			for (auto node : linearNodes) {
-				// Initial pose
-				if (node->mesh) {
-					node->update();
-				}
+			results[i] = buildMeshlets(vertices, indices);
+			for (size_t j = 0; j < indices.size(); j++) {
+				indexBuffer[primitive->firstIndex + j] = indices[j] + primitive->firstVertex;
+			}
+			for (Meshlet& meshlet : results[i]) {
+				meshlet.firstIndex += primitive->firstIndex;
 			}
+		});
+
+		meshlets.clear();
+		for (size_t i = 0; i < primitives.size(); i++) {
+			primitives[i]->firstMeshlet = static_cast<uint32_t>(meshlets.size());
+			primitives[i]->meshletCount = static_cast<uint32_t>(results[i].size());
+			meshlets.insert(meshlets.end(), results[i].begin(), results[i].end());
 		}
-		else {
+
+#ifdef _DEBUG
+		std::cout << "Generated " << meshlets.size() << " meshlets for " << primitives.size() << " primitives" << std::endl;
+#endif
+	}
+
+	void vkglTF::Model::buildMeshBVHs(const std::vector<uint32_t>& indexBuffer, const std::vector<Vertex>& vertexBuffer, ThreadPool& threadPool)
+	{
+		constexpr uint32_t parallelMeshBVHTriangles = 65536;
+#ifdef _DEBUG
+		const auto start = std::chrono::high_resolution_clock::now();
+#endif
+
+		// Small meshes are spread over the pool a whole mesh at a time, large ones split their own top levels over it
+		meshBVHs.resize(meshes.size());
+		std::vector<uint32_t> small, large;
+		for (uint32_t i = 0; i < meshes.size(); i++) {
+			uint32_t indexCount = 0;
+			for (const Primitive* primitive : meshes[i]->primitives)
+				indexCount += primitive->indexCount;
+			(indexCount / 3 >= parallelMeshBVHTriangles ? large : small).push_back(i);
+		}
+		threadPool.parallelFor(small.size(), [&](size_t i) {
+			meshBVHs[small[i]].build(*meshes[small[i]], indexBuffer, vertexBuffer, nullptr);
+		});
+		for (uint32_t i : large)
+			meshBVHs[i].build(*meshes[i], indexBuffer, vertexBuffer, &threadPool);
+
+#ifdef _DEBUG
+		size_t triangleCount = 0;
+		for (const MeshBVH& meshBVH : meshBVHs)
+			triangleCount += meshBVH.triangleCount();
+		const auto end = std::chrono::high_resolution_clock::now();
+		std::cout << "Built triangle BVHs of " << meshes.size() << " meshes over " << triangleCount << " triangles in "
+			<< std::chrono::duration<double, std::milli>(end - start).count() << " ms" << std::endl;
+#endif
+	}
+
+	vkglTF::Model::PickResult vkglTF::Model::pick(const glm::vec3& origin, const glm::vec3& direction, const std::vector<uint8_t>& pickableNodes) const
+	{
+		PickResult result{};
+		const glm::vec3 rayDirection = glm::normalize(direction);
+		float distance = FLT_MAX;
+		const uint32_t item = bvh.raycast(origin, rayDirection, distance, [&](uint32_t item, float& itemDistance) {
+			const uint32_t node = bvh.itemNode(item);
+			const uint32_t mesh = hierarchy.meshes[node];
+			if (!nodeStorage[node].resident || (!pickableNodes.empty() && !pickableNodes[node]) || mesh >= meshBVHs.size())
+				return false;
+
+			// The direction is not normalized again, so the distance along the ray stays a distance in world space
+			const glm::mat4 inverse = glm::inverse(hierarchy.worldMatrices[node]);
+			const glm::vec3 objectOrigin = glm::vec3(inverse * glm::vec4(origin, 1.0f));
+			const glm::vec3 objectDirection = glm::mat3(inverse) * rayDirection;
+			return meshBVHs[mesh].intersect(item - bvh.firstItem(node), objectOrigin, objectDirection, itemDistance);
+		});
+
+		if (item != BVH::noItem) {
+			result.node = bvh.itemNode(item);
+			result.distance = distance;
+			result.point = origin + rayDirection * distance;
+		}
+		return result;
+	}
+
+	bool vkglTF::Model::loadGeometry(const std::string& filename, VulkanDevice* device, uint32_t fileLoadingFlags, float scale, std::vector<uint32_t>& indexBuffer, std::vector<Vertex>& vertexBuffer)
+	{
+		if (isAssemblyManifest(filename))
+			return loadAssembly(filename, device, fileLoadingFlags, scale, indexBuffer, vertexBuffer);
+
+		this->device = device;
+		path = Tools::getDirectory(filename);
+
+		std::vector<unsigned char> data;
+		if (!Tools::readFile(filename, data)) _UNLIKELY {
+			std::cerr << "Could not open glTF file \"" + filename + "\"\n";
+			return false;
+		}
+
+		ThreadPool threadPool;
+		threadPool.setThreadCount((std::max)(1u, std::thread::hardware_concurrency()));
+
+		if (!parseGeometry(filename, data, fileLoadingFlags, scale, indexBuffer, vertexBuffer, threadPool)) _UNLIKELY
+			return false;
+		std::vector<unsigned char>().swap(data);
+
+		processGeometry(fileLoadingFlags, indexBuffer, vertexBuffer, threadPool);
+
+		// The whole file is one source, placed once at the root of the hierarchy
+		SourceFile source;
+		source.path = filename;
+		source.meshCount = static_cast<uint32_t>(meshes.size());
+		source.materialCount = static_cast<uint32_t>(materials.size());
+		source.nodeBases.push_back(0);
+		source.nodeCount = hierarchy.size();
+		sourceFiles.push_back(std::move(source));
+
+		return !indexBuffer.empty() && !vertexBuffer.empty();
+	}
+
+	bool vkglTF::Model::parseGeometry(const std::string& filename, const std::vector<unsigned char>& data, uint32_t fileLoadingFlags, float scale, std::vector<uint32_t>& indexBuffer, std::vector<Vertex>& vertexBuffer, ThreadPool& threadPool)
+	{
+		tinygltf::Model gltfModel;
+		return readGltf(filename, data, gltfModel) && decodeGeometry(filename, gltfModel, fileLoadingFlags, scale, indexBuffer, vertexBuffer, threadPool);
+	}
+
+	bool vkglTF::Model::readGltf(const std::string& filename, const std::vector<unsigned char>& data, tinygltf::Model& gltfModel)
+	{
+		tinygltf::TinyGLTF gltfContext;
+		std::string error, warning;
+
+		// Compressed exports are usually written as binary glTF
+		std::string extension = filename.substr(filename.find_last_of('.') + 1);
+		std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+		// Images stay encoded, they are decoded on worker threads once the geometry is on its way
+		gltfContext.SetImageLoader([](tinygltf::Image* image, const int, std::string*, std::string*, int, int, const unsigned char* bytes, int size, void*) {
+			image->image.assign(bytes, bytes + size);
+			image->as_is = true;
+			return true;
+		}, nullptr);
+		// External buffers and images are resolved next to the file
+		const std::string baseDirectory = Tools::getDirectory(filename);
+		const bool fileLoaded = extension == "glb" ?
+			gltfContext.LoadBinaryFromMemory(&gltfModel, &error, &warning, data.data(), static_cast<unsigned int>(data.size()), baseDirectory) :
+			gltfContext.LoadASCIIFromString(&gltfModel, &error, &warning, reinterpret_cast<const char*>(data.data()), static_cast<unsigned int>(data.size()), baseDirectory);
+		if (!fileLoaded) _UNLIKELY {
 			std::cerr << "Could not load glTF file \"" + filename + "\": " + error + "\n";
-			return;
+			return false;
 		}
+		return true;
+	}
+
+	bool vkglTF::Model::decodeGeometry(const std::string& filename, tinygltf::Model& gltfModel, uint32_t fileLoadingFlags, float scale, std::vector<uint32_t>& indexBuffer, std::vector<Vertex>& vertexBuffer, ThreadPool& threadPool)
+	{
+		// Decode meshopt compressed geometry up front, the rest of the loader only sees plain accessors
+		if (!decompressModel(gltfModel, threadPool)) _UNLIKELY {
+			std::cerr << "Could not decompress glTF file \"" + filename + "\"\n";
+			return false;
+		}
+
+		loadMaterials(gltfModel, !(fileLoadingFlags & FileLoadingFlags::DontLoadImages));
+		const tinygltf::Scene& scene = gltfModel.scenes[gltfModel.defaultScene > -1 ? gltfModel.defaultScene : 0];
+		nodeStorage.reserve(gltfModel.nodes.size());
+		std::unordered_map<std::string, uint32_t> nameIds;
+		// Pre-transformed vertices differ per node, so then every node decodes its own copy of the mesh
+		std::vector<uint32_t> meshIndices;
+		if (!(fileLoadingFlags & FileLoadingFlags::PreTransformVertices))
+			meshIndices.resize(gltfModel.meshes.size(), Hierarchy::none);
+		for (size_t i = 0; i < scene.nodes.size(); i++) {
+			const tinygltf::Node& node = gltfModel.nodes[scene.nodes[i]];
+			loadNode(nullptr, node, gltfModel, indexBuffer, vertexBuffer, scale, nameIds, meshIndices);
+		}
+		return true;
+	}
+
+	void vkglTF::Model::processGeometry(uint32_t fileLoadingFlags, std::vector<uint32_t>& indexBuffer, std::vector<Vertex>& vertexBuffer, ThreadPool& threadPool)
+	{
+		updateWorldMatrices();
+		createInstanceGroups();
+
+		if (fileLoadingFlags & FileLoadingFlags::OptimizeMeshes) {
+			optimizePrimitives(indexBuffer, vertexBuffer, threadPool);
+		}
+
+		// After optimizing, so the levels are built from the welded and compacted primitives
+		if (fileLoadingFlags & FileLoadingFlags::GenerateLODs) {
+			generateLODs(indexBuffer, vertexBuffer, threadPool);
+		}
+
+		if (fileLoadingFlags & FileLoadingFlags::GenerateMeshlets) {
+			generateMeshlets(indexBuffer, vertexBuffer, threadPool);
+		}
+
+		bvh.build(*this, threadPool);
 
 		// Pre-Calculations for requested features
 		if ((fileLoadingFlags & FileLoadingFlags::PreTransformVertices) || (fileLoadingFlags & FileLoadingFlags::PreMultiplyVertexColors) || (fileLoadingFlags & FileLoadingFlags::FlipY)) {
 			const bool preTransform = fileLoadingFlags & FileLoadingFlags::PreTransformVertices;
 			const bool flipY = fileLoadingFlags & FileLoadingFlags::FlipY;
+			// Shared meshes must only be flipped once, pre-transformed nodes never share theirs
+			std::vector<uint8_t> processed(meshes.size());
 			for (Node* node : linearNodes) {
-				if (node->mesh) {
+				if (node->mesh && !processed[hierarchy.meshes[node->index]]) {
+					processed[hierarchy.meshes[node->index]] = 1;
 					const glm::mat4 localMatrix = node->getMatrix();
 					for (Primitive* primitive : node->mesh->primitives) {
 						for (uint32_t i = 0; i < primitive->vertexCount; i++) {
@@ -455,210 +1013,351 @@ namespace Voortman3D {
 			}
 		}
 
-		size_t vertexBufferSize = vertexBuffer.size() * sizeof(Vertex);
-		size_t indexBufferSize = indexBuffer.size() * sizeof(uint32_t);
-		indices.count = static_cast<uint32_t>(indexBuffer.size());
+		// From the vertices as they are drawn, so after flipping
+		buildMeshBVHs(indexBuffer, vertexBuffer, threadPool);
+
+		// Last, the levels and meshlets have to be final before they are placed in the pools
+		layoutIndices(indexBuffer, threadPool);
 		vertices.count = static_cast<uint32_t>(vertexBuffer.size());
 
-		assert((vertexBufferSize > 0) && (indexBufferSize > 0));
+		if (fileLoadingFlags & FileLoadingFlags::HashMeshes) {
+			hashMeshes(indexBuffer, vertexBuffer, threadPool);
+		}
 
-		struct StagingBuffer {
-			VkBuffer buffer;
-			VkDeviceMemory memory;
-		} vertexStaging, indexStaging;
+		getSceneDimensions();
+	}
 
-		// Create staging buffers
-		// Vertex data
-		VK_CHECK_RESULT(device->createBuffer(
-			VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-			vertexBufferSize,
-			&vertexStaging.buffer,
-			&vertexStaging.memory,
-			vertexBuffer.data()));
-		// Index data
-		VK_CHECK_RESULT(device->createBuffer(
-			VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-			indexBufferSize,
-			&indexStaging.buffer,
-			&indexStaging.memory,
-			indexBuffer.data()));
+	void vkglTF::Model::layoutIndices(const std::vector<uint32_t>& indexBuffer, ThreadPool& threadPool)
+	{
+		std::vector<Primitive*> primitives;
+		for (Mesh* mesh : meshes)
+			primitives.insert(primitives.end(), mesh->primitives.begin(), mesh->primitives.end());
+
+		// Every level has to stay within the vertices of the primitive, an index outside of them is kept at 32 bits as it was loaded
+		threadPool.parallelFor(primitives.size(), [&](size_t i) {
+			Primitive* primitive = primitives[i];
+			const auto inRange = [&](uint32_t firstIndex, uint32_t indexCount) {
+				return std::all_of(indexBuffer.begin() + firstIndex, indexBuffer.begin() + firstIndex + indexCount, [&](uint32_t index) {
+					return index >= primitive->firstVertex && index - primitive->firstVertex <= UINT16_MAX;
+				});
+			};
+			primitive->shortIndices = primitive->vertexCount <= UINT16_MAX + 1u && inRange(primitive->firstIndex, primitive->indexCount);
+			for (const Primitive::LOD& lod : primitive->lods)
+				primitive->shortIndices = primitive->shortIndices && inRange(lod.firstIndex, lod.indexCount);
+		});
+
+		// The full detail level is followed by its LODs, so a primitive is one range in its pool
+		uint32_t wideCount = 0, shortCount = 0;
+		for (Primitive* primitive : primitives) {
+			uint32_t& count = primitive->shortIndices ? shortCount : wideCount;
+			primitive->poolFirstIndex = count;
+			count += primitive->indexCount;
+			for (Primitive::LOD& lod : primitive->lods) {
+				lod.poolFirstIndex = count;
+				count += lod.indexCount;
+			}
+		}
+		indices.count = static_cast<int>(wideCount);
+		shortIndices.count = static_cast<int>(shortCount);
 
-		// Create device local buffers
-		// Vertex buffer
+#ifdef _DEBUG
+		if (shortCount > 0) {
+			std::cout << "16-bit indices for " << shortCount << " of " << shortCount + wideCount << " indices, saving "
+				<< shortCount * sizeof(uint16_t) / 1024 << " KB" << std::endl;
+		}
+#endif
+	}
+
+	void vkglTF::Model::hashMeshes(const std::vector<uint32_t>& indexBuffer, const std::vector<Vertex>& vertexBuffer, ThreadPool& threadPool)
+	{
+		// FNV-1a over words instead of bytes, with the high half folded in so the words don't only reach the low bits
+		meshHashes.resize(meshes.size());
+		threadPool.parallelFor(meshes.size(), [&](size_t m) {
+			uint64_t hash = 14695981039346656037ull;
+			const auto mix = [&hash](uint32_t word) {
+				hash = (hash ^ word) * 1099511628211ull;
+				hash ^= hash >> 32;
+			};
+			for (const Primitive* primitive : meshes[m]->primitives) {
+				mix(primitive->vertexCount);
+				mix(primitive->indexCount);
+				static_assert(sizeof(Vertex) % sizeof(uint32_t) == 0);
+				const uint8_t* vertexBytes = reinterpret_cast<const uint8_t*>(vertexBuffer.data() + primitive->firstVertex);
+				for (size_t i = 0; i < primitive->vertexCount * sizeof(Vertex); i += sizeof(uint32_t)) {
+					uint32_t word;
+					memcpy(&word, vertexBytes + i, sizeof(word));
+					mix(word);
+				}
+				for (uint32_t i = 0; i < primitive->indexCount; i++)
+					mix(indexBuffer[primitive->firstIndex + i] - primitive->firstVertex);
+			}
+			meshHashes[m] = hash;
+		});
+	}
+
+	void vkglTF::Model::packIndices(const std::vector<uint32_t>& indexBuffer, std::vector<uint32_t>& wideIndexBuffer, std::vector<uint16_t>& shortIndexBuffer) const
+	{
+		wideIndexBuffer.resize(indices.count);
+		shortIndexBuffer.resize(shortIndices.count);
+		for (const Mesh* mesh : meshes) {
+			for (const Primitive* primitive : mesh->primitives) {
+				const auto packLevel = [&](uint32_t firstIndex, uint32_t indexCount, uint32_t poolFirstIndex) {
+					const auto first = indexBuffer.begin() + firstIndex;
+					if (primitive->shortIndices) {
+						std::transform(first, first + indexCount, shortIndexBuffer.begin() + poolFirstIndex, [&](uint32_t index) {
+							return static_cast<uint16_t>(index - primitive->firstVertex);
+						});
+					}
+					else {
+						std::copy(first, first + indexCount, wideIndexBuffer.begin() + poolFirstIndex);
+					}
+				};
+				packLevel(primitive->firstIndex, primitive->indexCount, primitive->poolFirstIndex);
+				for (const Primitive::LOD& lod : primitive->lods)
+					packLevel(lod.firstIndex, lod.indexCount, lod.poolFirstIndex);
+			}
+		}
+	}
+
+	void vkglTF::Model::createBuffers()
+	{
+		// Usable as copy destination only, the data is uploaded by either loadFromFile or a ModelLoader
 		VK_CHECK_RESULT(device->createBuffer(
 			VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | memoryPropertyFlags,
 			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-			vertexBufferSize,
+			vertices.count * sizeof(Vertex),
 			&vertices.buffer,
 			&vertices.memory));
-		// Index buffer
 		VK_CHECK_RESULT(device->createBuffer(
 			VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | memoryPropertyFlags,
 			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
-			indexBufferSize,
+			(std::max)(indices.count, 1) * sizeof(uint32_t),
 			&indices.buffer,
 			&indices.memory));
+		if (shortIndices.count > 0) {
+			VK_CHECK_RESULT(device->createBuffer(
+				VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | memoryPropertyFlags,
+				VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+				shortIndices.count * sizeof(uint16_t),
+				&shortIndices.buffer,
+				&shortIndices.memory));
+		}
 
-		// Copy from staging buffers
-		VkCommandBuffer copyCmd = device->createCommandBuffer(VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-
-		VkBufferCopy copyRegion = {};
+		// Host visible and written in place, frames are waited on before the next one changes a matrix
+		nodeMatrices.count = hierarchy.size();
+		VK_CHECK_RESULT(device->createBuffer(
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			(std::max)(nodeMatrices.count, 1u) * sizeof(glm::mat4),
+			&nodeMatrices.buffer,
+			&nodeMatrices.memory));
+		nodeMatrices.mapped = reinterpret_cast<glm::mat4*>(nodeMatrices.memory.mapped);
 
-		copyRegion.size = vertexBufferSize;
-		vkCmdCopyBuffer(copyCmd, vertexStaging.buffer, vertices.buffer, 1, &copyRegion);
+		// Initial pose
+		updateWorldMatrices();
 
-		copyRegion.size = indexBufferSize;
-		vkCmdCopyBuffer(copyCmd, indexStaging.buffer, indices.buffer, 1, &copyRegion);
+		// Host visible like the matrices, the renderer rewrites the instances whenever the drawn nodes change
+		VK_CHECK_RESULT(device->createBuffer(
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			(std::max)(instances.count, 1u) * sizeof(Instance),
+			&instances.buffer,
+			&instances.memory));
+		instances.mapped = reinterpret_cast<Instance*>(instances.memory.mapped);
+		for (const InstanceGroup& group : instanceGroups) {
+			Instance* instance = instances.mapped + group.firstInstance;
+			for (const Primitive* primitive : group.mesh->primitives) {
+				const uint32_t material = static_cast<uint32_t>(primitive->material - materials.data());
+				for (const Node* node : group.nodes) {
+					*instance++ = { node->index, material };
+				}
+			}
+		}
 
-		device->flushCommandBuffer(copyCmd, transferQueue, true);
+		VK_CHECK_RESULT(device->createBuffer(
+			VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+			materials.size() * sizeof(MaterialParameters),
+			&materialData.buffer,
+			&materialData.memory));
+		materialData.mapped = reinterpret_cast<MaterialParameters*>(materialData.memory.mapped);
+		updateMaterialData();
+	}
 
-		vkDestroyBuffer(device->logicalDevice, vertexStaging.buffer, nullptr);
-		vkFreeMemory(device->logicalDevice, vertexStaging.memory, nullptr);
-		vkDestroyBuffer(device->logicalDevice, indexStaging.buffer, nullptr);
-		vkFreeMemory(device->logicalDevice, indexStaging.memory, nullptr);
+	void vkglTF::Model::updateMaterialData()
+	{
+		for (uint32_t i = 0; i < static_cast<uint32_t>(materials.size()); i++) {
+			updateMaterial(i);
+		}
+	}
 
-		getSceneDimensions();
+	void vkglTF::Model::updateMaterial(uint32_t index)
+	{
+		const Material& material = materials[index];
+		const Texture* texture = material.baseColorTexture;
+		const bool resident = texture && texture->residentLevel < texture->mipLevels;
+
+		// Frames wait for the queue to go idle, so the mapped buffer is never read while it is written
+		MaterialParameters& parameters = materialData.mapped[index];
+		parameters.baseColorFactor = material.baseColorFactor;
+		parameters.baseColorTexture = resident ? texture->index : 0;
+		parameters.minLod = resident ? static_cast<float>(texture->residentLevel) : 0.0f;
+		// Without a transparent pass blended materials are cut off at half coverage, which keeps decals and labels readable
+		switch (material.alphaMode) {
+		case Material::AlphaMode::Mask:
+			parameters.alphaCutoff = material.alphaCutoff;
+			break;
+		case Material::AlphaMode::Blend:
+			parameters.alphaCutoff = 0.5f;
+			break;
+		default: _LIKELY
+			parameters.alphaCutoff = 0.0f;
+			break;
+		}
+		parameters.padding = 0;
+	}
 
-		// Setup descriptors
-		uint32_t uboCount{ 0 };
-		uint32_t imageCount{ 0 };
-		for (auto node : linearNodes) {
-			if (node->mesh) {
-				uboCount++;
+	void vkglTF::Model::writeTextureDescriptors(VkDescriptorSet descriptorSet)
+	{
+		// Partially bound slots may stay empty, materials only index slots of resident textures
+		if (bindlessTextures) {
+			for (const Texture* texture : textures) {
+				if (texture->residentLevel < texture->mipLevels)
+					writeTextureDescriptor(descriptorSet, *texture);
 			}
+			return;
 		}
-		for (const auto& material : materials) {
-			if (material.baseColorTexture != nullptr) {
-				imageCount++;
-			}
+
+		assert(defaultTexture);
+		std::vector<VkDescriptorImageInfo> imageInfos(textureSlotCount, defaultTexture->descriptor);
+		for (const Texture* texture : textures) {
+			if (texture->residentLevel < texture->mipLevels)
+				imageInfos[texture->index] = texture->descriptor;
 		}
-		std::vector<VkDescriptorPoolSize> poolSizes = {
-			{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, uboCount },
-		};
-		if (imageCount > 0) {
-			if (descriptorBindingFlags & DescriptorBindingFlags::ImageBaseColor) {
-				poolSizes.push_back({ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, imageCount });
-			}
-			if (descriptorBindingFlags & DescriptorBindingFlags::ImageNormalMap) {
-				poolSizes.push_back({ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, imageCount });
+
+		const VkWriteDescriptorSet writeDescriptorSet = Initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 3, imageInfos.data(), textureSlotCount);
+		vkUpdateDescriptorSets(device->logicalDevice, 1, &writeDescriptorSet, 0, nullptr);
+	}
+
+	void vkglTF::Model::writeTextureDescriptor(VkDescriptorSet descriptorSet, const Texture& texture)
+	{
+		VkWriteDescriptorSet writeDescriptorSet = Initializers::writeDescriptorSet(descriptorSet, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 3, &texture.descriptor);
+		writeDescriptorSet.dstArrayElement = texture.index;
+		vkUpdateDescriptorSets(device->logicalDevice, 1, &writeDescriptorSet, 0, nullptr);
+	}
+
+	void vkglTF::Model::loadFromFile(const std::string& filename, VulkanDevice* device, uint32_t fileLoadingFlags, float scale)
+	{
+		std::vector<uint32_t> indexBuffer;
+		std::vector<Vertex> vertexBuffer;
+		if (!loadGeometry(filename, device, fileLoadingFlags, scale, indexBuffer, vertexBuffer)) _UNLIKELY
+			return;
+
+		std::vector<uint32_t> wideIndexBuffer;
+		std::vector<uint16_t> shortIndexBuffer;
+		packIndices(indexBuffer, wideIndexBuffer, shortIndexBuffer);
+		std::vector<uint32_t>().swap(indexBuffer);
+
+		// Create device local buffers
+		createBuffers();
+
+		// Staged through the ring of the uploader, frames submitted after this wait for the copies instead of the CPU
+		device->uploader->uploadBuffer(vertexBuffer.data(), vertexBuffer.size() * sizeof(Vertex), vertices.buffer);
+		if (!wideIndexBuffer.empty())
+			device->uploader->uploadBuffer(wideIndexBuffer.data(), wideIndexBuffer.size() * sizeof(uint32_t), indices.buffer);
+		if (!shortIndexBuffer.empty())
+			device->uploader->uploadBuffer(shortIndexBuffer.data(), shortIndexBuffer.size() * sizeof(uint16_t), shortIndices.buffer);
+		device->uploader->submit();
+
+		setupDescriptors();
+
+		// Decoded a pool at a time, so no more than one image per thread waits for its upload
+		if (!textureSources.empty()) {
+			ThreadPool threadPool;
+			threadPool.setThreadCount((std::max)(1u, std::thread::hardware_concurrency()));
+			TextureStreamer streamer(device);
+			for (size_t first = 0; first < textureSources.size(); first += threadPool.threads.size()) {
+				threadPool.parallelFor((std::min)(threadPool.threads.size(), textureSources.size() - first), [&](size_t i) {
+					TextureLevels levels;
+					if (decodeTextureSource(device, textureSources[first + i], levels))
+						streamer.push(this, textureSources[first + i].texture, std::move(levels));
+				});
+				streamer.flush();
 			}
+			textureSources.clear();
 		}
+	}
+
+	void vkglTF::Model::setupDescriptors()
+	{
+		const std::vector<VkDescriptorPoolSize> poolSizes = {
+			{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3 },
+			{ VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, textureSlotCount },
+		};
 		VkDescriptorPoolCreateInfo descriptorPoolCI{};
 		descriptorPoolCI.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+		descriptorPoolCI.flags = nodeDescriptorPoolFlags();
 		descriptorPoolCI.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
 		descriptorPoolCI.pPoolSizes = poolSizes.data();
-		descriptorPoolCI.maxSets = uboCount + imageCount;
+		descriptorPoolCI.maxSets = 1;
 		VK_CHECK_RESULT(vkCreateDescriptorPool(device->logicalDevice, &descriptorPoolCI, nullptr, &descriptorPool));
 
-		// Descriptors for per-node uniform buffers
-		{
-			// Layout is global, so only create if it hasn't already been created before
-			if (descriptorSetLayoutUbo == VK_NULL_HANDLE) {
-				std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings = {
-					Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_VERTEX_BIT, 0),
-				};
-				VkDescriptorSetLayoutCreateInfo descriptorLayoutCI{};
-				descriptorLayoutCI.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-				descriptorLayoutCI.bindingCount = static_cast<uint32_t>(setLayoutBindings.size());
-				descriptorLayoutCI.pBindings = setLayoutBindings.data();
-				VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device->logicalDevice, &descriptorLayoutCI, nullptr, &descriptorSetLayoutUbo));
-			}
-			for (auto node : nodes) {
-				prepareNodeDescriptor(node, descriptorSetLayoutUbo);
-			}
-		}
+		// Layouts are global, so they are only created if they haven't already been created before
+		createDescriptorSetLayouts(device->logicalDevice);
 
-		// Descriptors for per-material images
+		// One descriptor set for the matrices of all nodes, the instances, the materials and their textures
 		{
-			// Layout is global, so only create if it hasn't already been created before
-			if (descriptorSetLayoutImage == VK_NULL_HANDLE) {
-				std::vector<VkDescriptorSetLayoutBinding> setLayoutBindings{};
-				if (descriptorBindingFlags & DescriptorBindingFlags::ImageBaseColor) {
-					setLayoutBindings.push_back(Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, static_cast<uint32_t>(setLayoutBindings.size())));
-				}
-				if (descriptorBindingFlags & DescriptorBindingFlags::ImageNormalMap) {
-					setLayoutBindings.push_back(Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_FRAGMENT_BIT, static_cast<uint32_t>(setLayoutBindings.size())));
-				}
-				VkDescriptorSetLayoutCreateInfo descriptorLayoutCI{};
-				descriptorLayoutCI.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
-				descriptorLayoutCI.bindingCount = static_cast<uint32_t>(setLayoutBindings.size());
-				descriptorLayoutCI.pBindings = setLayoutBindings.data();
-				VK_CHECK_RESULT(vkCreateDescriptorSetLayout(device->logicalDevice, &descriptorLayoutCI, nullptr, &descriptorSetLayoutImage));
-			}
-			for (auto& material : materials) {
-				if (material.baseColorTexture != nullptr) {
-					material.createDescriptorSet(descriptorPool, vkglTF::descriptorSetLayoutImage, descriptorBindingFlags);
-				}
-			}
+			VkDescriptorSetAllocateInfo descriptorSetAllocInfo{};
+			descriptorSetAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+			descriptorSetAllocInfo.descriptorPool = descriptorPool;
+			descriptorSetAllocInfo.pSetLayouts = &descriptorSetLayoutNodes;
+			descriptorSetAllocInfo.descriptorSetCount = 1;
+			VK_CHECK_RESULT(vkAllocateDescriptorSets(device->logicalDevice, &descriptorSetAllocInfo, &nodeMatrices.descriptorSet));
+
+			const VkDescriptorBufferInfo matricesInfo = { nodeMatrices.buffer, 0, VK_WHOLE_SIZE };
+			const VkDescriptorBufferInfo instancesInfo = { instances.buffer, 0, VK_WHOLE_SIZE };
+			const VkDescriptorBufferInfo materialsInfo = { materialData.buffer, 0, VK_WHOLE_SIZE };
+			const std::array<VkWriteDescriptorSet, 3> writeDescriptorSets = {
+				Initializers::writeDescriptorSet(nodeMatrices.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 0, &matricesInfo),
+				Initializers::writeDescriptorSet(nodeMatrices.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, &instancesInfo),
+				Initializers::writeDescriptorSet(nodeMatrices.descriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2, &materialsInfo)
+			};
+
+			vkUpdateDescriptorSets(device->logicalDevice, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, nullptr);
 		}
+
+		// Without bindless textures every slot starts out with the default texture, the streamer writes the textures as their first levels arrive
+		writeTextureDescriptors(nodeMatrices.descriptorSet);
 	}
 
 	void vkglTF::Texture::destroy()
 	{
+		// Textures that never got their image have no device
 		if (device)
 		{
 			vkDestroyImageView(device->logicalDevice, view, nullptr);
 			vkDestroyImage(device->logicalDevice, image, nullptr);
-			vkFreeMemory(device->logicalDevice, deviceMemory, nullptr);
+			device->freeMemory(deviceMemory);
 			vkDestroySampler(device->logicalDevice, sampler, nullptr);
+			device = nullptr;
 		}
 	}
 
 
-	void vkglTF::Model::bindBuffers(VkCommandBuffer commandBuffer)
-	{
-		const VkDeviceSize offsets[1] = { 0 };
-		vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vertices.buffer, offsets);
-		vkCmdBindIndexBuffer(commandBuffer, indices.buffer, 0, VK_INDEX_TYPE_UINT32);
-		buffersBound = true;
-	}
-
-	void vkglTF::Model::drawNode(Node* node, VkCommandBuffer commandBuffer, uint32_t renderFlags, VkPipelineLayout pipelineLayout, uint32_t bindImageSet)
-	{
-		if (node->mesh) {
-			for (Primitive* primitive : node->mesh->primitives) {
-				if (renderFlags & RenderFlags::BindImages) {
-					vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipelineLayout, bindImageSet, 1, &primitive->material->descriptorSet, 0, nullptr);
-				}
-				vkCmdDrawIndexed(commandBuffer, primitive->indexCount, 1, primitive->firstIndex, 0, 0);
-			}
-		}
-		for (const auto& child : node->children) {
-			drawNode(child, commandBuffer, renderFlags, pipelineLayout, bindImageSet);
-		}
-	}
-
-	void vkglTF::Model::draw(VkCommandBuffer commandBuffer, uint32_t renderFlags, VkPipelineLayout pipelineLayout, uint32_t bindImageSet)
-	{
-		if (!buffersBound) {
-			const VkDeviceSize offsets[1] = { 0 };
-			vkCmdBindVertexBuffers(commandBuffer, 0, 1, &vertices.buffer, offsets);
-			vkCmdBindIndexBuffer(commandBuffer, indices.buffer, 0, VK_INDEX_TYPE_UINT32);
-		}
-		for (auto& node : nodes) {
-			drawNode(node, commandBuffer, renderFlags, pipelineLayout, bindImageSet);
-		}
-	}
-
 	void vkglTF::Model::getNodeDimensions(Node* node, glm::vec3& min, glm::vec3& max)
 	{
-		if (node->mesh) {
-			for (Primitive* primitive : node->mesh->primitives) {
-				glm::vec4 locMin = glm::vec4(primitive->dimensions.min, 1.0f) * node->getMatrix();
-				glm::vec4 locMax = glm::vec4(primitive->dimensions.max, 1.0f) * node->getMatrix();
-				if (locMin.x < min.x) { min.x = locMin.x; }
-				if (locMin.y < min.y) { min.y = locMin.y; }
-				if (locMin.z < min.z) { min.z = locMin.z; }
-				if (locMax.x > max.x) { max.x = locMax.x; }
-				if (locMax.y > max.y) { max.y = locMax.y; }
-				if (locMax.z > max.z) { max.z = locMax.z; }
+		// The subtree is a contiguous range of the hierarchy, so the boxes of all its primitives go through one batch
+		BatchMath::BoundsSoA bounds;
+		std::vector<const glm::mat4*> matrices;
+		for (uint32_t i = node->index; i < hierarchy.subtreeEnds[node->index]; i++) {
+			if (hierarchy.meshes[i] == Hierarchy::none)
+				continue;
+			for (const Primitive* primitive : meshes[hierarchy.meshes[i]]->primitives) {
+				bounds.push_back(primitive->dimensions.min, primitive->dimensions.max);
+				matrices.push_back(&hierarchy.worldMatrices[i]);
 			}
 		}
-		for (auto child : node->children) {
-			getNodeDimensions(child, min, max);
-		}
+		BatchMath::mergeTransformedBounds(matrices.data(), bounds, min, max);
 	}
 
 	void vkglTF::Model::getSceneDimensions()
@@ -691,37 +1390,7 @@ namespace Voortman3D {
 	}
 
 	vkglTF::Node* vkglTF::Model::nodeFromIndex(uint32_t index) {
-		Node* nodeFound = nullptr;
-		for (auto& node : nodes) {
-			nodeFound = findNode(node, index);
-			if (nodeFound) {
-				break;
-			}
-		}
-		return nodeFound;
-	}
-
-	void vkglTF::Model::prepareNodeDescriptor(vkglTF::Node* node, VkDescriptorSetLayout descriptorSetLayout) {
-		if (node->mesh) {
-			VkDescriptorSetAllocateInfo descriptorSetAllocInfo{};
-			descriptorSetAllocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-			descriptorSetAllocInfo.descriptorPool = descriptorPool;
-			descriptorSetAllocInfo.pSetLayouts = &descriptorSetLayout;
-			descriptorSetAllocInfo.descriptorSetCount = 1;
-			VK_CHECK_RESULT(vkAllocateDescriptorSets(device->logicalDevice, &descriptorSetAllocInfo, &node->mesh->uniformBuffer.descriptorSet));
-
-			VkWriteDescriptorSet writeDescriptorSet{};
-			writeDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-			writeDescriptorSet.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-			writeDescriptorSet.descriptorCount = 1;
-			writeDescriptorSet.dstSet = node->mesh->uniformBuffer.descriptorSet;
-			writeDescriptorSet.dstBinding = 0;
-			writeDescriptorSet.pBufferInfo = &node->mesh->uniformBuffer.descriptor;
-
-			vkUpdateDescriptorSets(device->logicalDevice, 1, &writeDescriptorSet, 0, nullptr);
-		}
-		for (auto& child : node->children) {
-			prepareNodeDescriptor(child, descriptorSetLayout);
-		}
+		// Views are stored in hierarchy order
+		return index < nodeStorage.size() ? &nodeStorage[index] : nullptr;
 	}
 }
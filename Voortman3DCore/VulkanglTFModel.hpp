@@ -13,6 +13,9 @@
 
 #include "VulkanDevice.hpp"
 #include "Initializers.inl"
+#include "threadpool.hpp"
+#include "VulkanglTFBVH.hpp"
+#include <unordered_map>
 
 #define TINYGLTF_NO_STB_IMAGE_WRITE
 #include "tiny_gltf.h"
@@ -21,30 +24,47 @@ namespace Voortman3D {
 
 	namespace vkglTF
 	{
-		enum DescriptorBindingFlags {
-			ImageBaseColor = 0x00000001,
-			ImageNormalMap = 0x00000002
-		};
-
-		extern VkDescriptorSetLayout descriptorSetLayoutImage;
-		extern VkDescriptorSetLayout descriptorSetLayoutUbo;
+		extern VkDescriptorSetLayout descriptorSetLayoutNodes;
 		extern VkMemoryPropertyFlags memoryPropertyFlags;
-		extern uint32_t descriptorBindingFlags;
+
+		// Size of the texture array in the node set without descriptor indexing, slot 0 is the default texture
+		constexpr uint32_t maxTextures = 64;
+		// Size of the texture array with descriptor indexing, the device limit may lower it
+		constexpr uint32_t maxBindlessTextures = 4096;
+
+		// Slots of the texture array in the node set, textures beyond the last slot are left out
+		extern uint32_t textureSlotCount;
+		// The texture array is partially bound and written while recorded command buffers bind it
+		extern bool bindlessTextures;
+
+		/** @brief Use descriptor indexing for the texture array of the node set, must be called before the layouts are created */
+		void enableBindlessTextures(uint32_t slotCount);
+		/** @brief Pools that hold node sets need this when the texture array is updated after bind */
+		_NODISCARD VkDescriptorPoolCreateFlags nodeDescriptorPoolFlags() noexcept;
+
+		/** @brief Creates the global descriptor set layouts if they don't exist yet, must happen before models are loaded on other threads */
+		void createDescriptorSetLayouts(VkDevice device);
+		/** @brief Destroys the global descriptor set layouts once no model uses them anymore */
+		void destroyDescriptorSetLayouts(VkDevice device);
 
 		struct Node;
+		class GeometryResidency;
 
 		struct Texture {
 			VulkanDevice* device = nullptr;
 			VkImage image{};
 			VkImageLayout imageLayout{};
-			VkDeviceMemory deviceMemory;
+			Allocation deviceMemory;
 			VkImageView view;
 			uint32_t width, height{};
 			uint32_t mipLevels{};
 			uint32_t layerCount{};
 			VkDescriptorImageInfo descriptor;
 			VkSampler sampler{VK_NULL_HANDLE};
+			// Slot in the texture array of the node set
 			uint32_t index{};
+			// Finest level that has been uploaded, mipLevels while nothing can be sampled yet
+			uint32_t residentLevel{};
 			void destroy();
 
 			~Texture() { destroy(); }
@@ -53,18 +73,30 @@ namespace Voortman3D {
 			glTF material class
 		*/
 		struct Material {
+			enum class AlphaMode { Opaque, Mask, Blend };
+
 			VulkanDevice* device{ nullptr };
-			float alphaCutoff{ 1.0f };
+			AlphaMode alphaMode{ AlphaMode::Opaque };
+			float alphaCutoff{ 0.5f };
 			glm::vec4 baseColorFactor = glm::vec4(1.0f);
+			// Owned by the model, textures are shared between materials
 			vkglTF::Texture* baseColorTexture{ nullptr };
 
-			VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
-
 			Material(VulkanDevice* device) : device(device) {};
+		};
 
-			~Material() { delete baseColorTexture; }
-
-			void createDescriptorSet(VkDescriptorPool descriptorPool, VkDescriptorSetLayout descriptorSetLayout, uint32_t descriptorBindingFlags);
+		/*
+			glTF meshlet, a small cluster of triangles of a primitive with bounds for culling
+		*/
+		struct Meshlet {
+			uint32_t firstIndex;
+			uint32_t indexCount;
+			// Bounding sphere in object space
+			glm::vec3 center;
+			float radius;
+			// All triangle normals lie within the cone, the cutoff is the sine of its spread and 1 when the cone can never be culled
+			glm::vec3 coneAxis;
+			float coneCutoff;
 		};
 
 		/*
@@ -85,7 +117,39 @@ namespace Voortman3D {
 				float radius{};
 			} dimensions{};
 
+			/*
+				Simplified level of detail, indexes into the same vertices as the full detail primitive
+			*/
+			struct LOD {
+				uint32_t firstIndex;
+				uint32_t indexCount;
+				// Largest distance between this level and the full detail surface, in object space
+				float error;
+				// First index in the index pool of the primitive on the GPU
+				uint32_t poolFirstIndex{};
+			};
+			// Coarser levels with increasing error, the full detail level is firstIndex and indexCount
+			std::vector<LOD> lods;
+			// Level that is drawn, 0 is full detail and level n is lods[n - 1]
+			uint32_t lod{};
+
+			// Range in Model::meshlets that covers the full detail level, empty when no meshlets were generated
+			uint32_t firstMeshlet{};
+			uint32_t meshletCount{};
+
+			// Stored in Model::shortIndices relative to firstVertex when all of its vertices fit 16 bits, otherwise in Model::indices.
+			// firstIndex keeps pointing into the CPU side index buffer, poolFirstIndex is where the full detail level went on the GPU
+			bool shortIndices{ false };
+			uint32_t poolFirstIndex{};
+
+			/** @brief First index of a level in the index pool of the primitive, level 0 is full detail */
+			_NODISCARD uint32_t levelPoolFirstIndex(uint32_t level) const noexcept { return level > 0 ? lods[level - 1].poolFirstIndex : poolFirstIndex; }
+			/** @brief Vertex offset of draws from the index pool, 16-bit indices are relative to the first vertex */
+			_NODISCARD int32_t poolVertexOffset() const noexcept { return shortIndices ? static_cast<int32_t>(firstVertex) : 0; }
+
 			void setDimensions(glm::vec3 min, glm::vec3 max);
+			/** @brief Returns the coarsest level whose error stays within maxError after scaling by errorScale */
+			_NODISCARD uint32_t selectLOD(float errorScale, float maxError) const noexcept;
 			Primitive(uint32_t firstIndex, uint32_t indexCount, Material* material) : firstIndex(firstIndex), indexCount(indexCount), material(material) {};
 		};
 
@@ -98,61 +162,50 @@ namespace Voortman3D {
 			std::vector<Primitive*> primitives;
 			std::string name;
 
-			struct UniformBuffer {
-				VkBuffer buffer;
-				VkDeviceMemory memory;
-				VkDescriptorBufferInfo descriptor;
-				VkDescriptorSet descriptorSet = VK_NULL_HANDLE;
-				void* mapped;
-			} uniformBuffer;
-
-			glm::mat4 matrix;
-
-			Mesh(VulkanDevice* device, glm::mat4 matrix);
+			Mesh(VulkanDevice* device);
 			~Mesh();
 		};
 
+		class Model;
+
 		/*
-			glTF node
+			glTF node, a view on one entry of Model::hierarchy
 		*/
 		struct Node {
+			Model* model{ nullptr };
+			// Position in Model::hierarchy, parents always have a lower index than their children
+			uint32_t index{};
 			// Parent is standard nullptr
 			Node* parent{ nullptr };
-			uint32_t index;
 			std::vector<Node*> children;
-			
-			// Orientation matrix of node
-			glm::mat4 matrix = glm::mat4(1.0f);
-			std::string name;
-			Mesh* mesh{nullptr};
-
-			inline void Translate(glm::vec3 translation) {
-				matrix = glm::translate(matrix, translation);
-			}
 
-			inline void Rotate(glm::quat rotation) {
-				matrix = matrix * glm::mat4_cast(rotation);
-			}
-
-			inline void Scale(glm::vec3 scale) {
-				matrix = glm::scale(matrix, scale);
-			}
-
-			_NODISCARD inline glm::mat4 getMatrix();
-			void update();
-			~Node();
+			Mesh* mesh{nullptr};
+			// False while the geometry of the node is still being uploaded by a ModelLoader
+			bool resident{ true };
+
+			void Translate(glm::vec3 translation);
+			void Rotate(glm::quat rotation);
+			void Scale(glm::vec3 scale);
+
+			/** @brief World matrix as of the last update of the model, see Model::updateDirtyWorldMatrices */
+			_NODISCARD const glm::mat4& getMatrix() const;
+			_NODISCARD const glm::mat4& getLocalMatrix() const;
+			void setLocalMatrix(const glm::mat4& matrix);
+			_NODISCARD const std::string& getName() const;
 		};
 
 		/*
 			glTF default vertex layout with easy Vulkan mapping functions
 		*/
-		enum class VertexComponent { Position, Normal};
+		enum class VertexComponent { Position, Normal, UV };
 
 		// GLTF supports more but these are the only things we use...
 		struct Vertex {
 			// Vertex colors are not used only basematerial color is used
 			glm::vec3 pos;
 			glm::vec3 normal;
+			// TEXCOORD_0, the base color texture is the only one that is sampled
+			glm::vec2 uv;
 
 			static VkVertexInputBindingDescription vertexInputBindingDescription;
 			static std::vector<VkVertexInputAttributeDescription> vertexInputAttributeDescriptions;
@@ -171,14 +224,12 @@ namespace Voortman3D {
 			PreTransformVertices = 0x00000001,
 			PreMultiplyVertexColors = 0x00000002,
 			FlipY = 0x00000004,
-			DontLoadImages = 0x00000008
-		};
-
-		enum RenderFlags {
-			BindImages = 0x00000001,
-			RenderOpaqueNodes = 0x00000002,
-			RenderAlphaMaskedNodes = 0x00000004,
-			RenderAlphaBlendedNodes = 0x00000008
+			DontLoadImages = 0x00000008,
+			OptimizeMeshes = 0x00000010,
+			GenerateLODs = 0x00000020,
+			GenerateMeshlets = 0x00000040,
+			// Keeps a content hash of every mesh, so a ModelReloader can tell which meshes changed
+			HashMeshes = 0x00000080
 		};
 
 		/*
@@ -192,19 +243,172 @@ namespace Voortman3D {
 			struct Vertices {
 				int count;
 				VkBuffer buffer;
-				VkDeviceMemory memory;
+				Allocation memory;
 			} vertices{};
 
 			struct Indices {
 				int count;
 				VkBuffer buffer;
-				VkDeviceMemory memory;
+				Allocation memory;
 			} indices{};
 
+			// 16-bit indices of the primitives with up to 65536 vertices, half the memory and index fetch bandwidth of indices
+			Indices shortIndices{};
+
+			/*
+				Node hierarchy as parallel arrays indexed by Node::index, sorted so that parents come before their children
+			*/
+			struct Hierarchy {
+				static constexpr uint32_t none = UINT32_MAX;
+
+				std::vector<uint32_t> parents;
+				std::vector<glm::mat4> localMatrices;
+				std::vector<glm::mat4> worldMatrices;
+				// Index into Model::meshes or none
+				std::vector<uint32_t> meshes;
+				// Index into names, nodes with the same name share one entry
+				std::vector<uint32_t> nameIds;
+				std::vector<std::string> names;
+				// One past the last descendant, the subtree of a node is the contiguous range [index, subtreeEnd)
+				std::vector<uint32_t> subtreeEnds;
+
+				// Nodes whose local matrix changed since the last update, each listed once
+				std::vector<uint32_t> dirtyNodes;
+				std::vector<uint8_t> dirty;
+
+				_NODISCARD uint32_t size() const noexcept { return static_cast<uint32_t>(parents.size()); }
+
+				/** @brief Local matrix for writing, marks the subtree of the node for the next update */
+				glm::mat4& editLocalMatrix(uint32_t index) {
+					if (!dirty[index]) {
+						dirty[index] = 1;
+						dirtyNodes.push_back(index);
+					}
+					return localMatrices[index];
+				}
+			} hierarchy;
+
+			std::vector<Mesh*> meshes;
+
+			// Views on the hierarchy, nodes and linearNodes point into this
+			std::vector<Node> nodeStorage;
 			std::vector<Node*> nodes;
 			std::vector<Node*> linearNodes; // just all the nodes listed in one big vector
 
 			std::vector<Material> materials;
+			std::vector<Meshlet> meshlets;
+
+			// One per image used as a texture, the slot of textures[i] is i + 1
+			std::vector<Texture*> textures;
+
+			/*
+				Encoded image of a texture, decoded and streamed in after the geometry
+			*/
+			struct TextureSource {
+				std::string name;
+				std::vector<unsigned char> encoded;
+				// PNG or JPEG next to a KTX2 image, used when that one can't be decoded
+				std::vector<unsigned char> fallback;
+				Texture* texture{ nullptr };
+				bool srgb{ true };
+			};
+			// Emptied once the textures are decoded
+			std::vector<TextureSource> textureSources;
+
+			// World space boxes of all primitives for frustum culling, refit whenever world matrices change
+			BVH bvh;
+			// Triangles of every mesh in object space for picking, indexed like meshes
+			std::vector<MeshBVH> meshBVHs;
+
+			/*
+				File that meshes of the model were read from, the glTF file itself or a part of an assembly
+			*/
+			struct SourceFile {
+				std::string path;
+				uint32_t meshBase{ 0 };
+				uint32_t meshCount{ 0 };
+				uint32_t materialBase{ 0 };
+				uint32_t materialCount{ 0 };
+				// First hierarchy node of every placement of the file, node i of the file is at nodeBase + i
+				std::vector<uint32_t> nodeBases;
+				uint32_t nodeCount{ 0 };
+				// False when the file failed to load or another path with the same contents shares its meshes
+				bool exclusive{ true };
+			};
+			// Files to watch for changes, see VulkanglTFReload.hpp
+			std::vector<SourceFile> sourceFiles;
+			// Hierarchy node of every node of the assembly manifest in depth first order, empty for a single glTF file
+			std::vector<uint32_t> manifestNodes;
+			// Content hash of the processed geometry of every mesh, only with FileLoadingFlags::HashMeshes
+			std::vector<uint64_t> meshHashes;
+
+			/*
+				Closest node a ray hits, node is Hierarchy::none when it hits nothing
+			*/
+			struct PickResult {
+				uint32_t node{ Hierarchy::none };
+				// In the space of the world matrices
+				glm::vec3 point{};
+				float distance{ FLT_MAX };
+			};
+
+			/** @brief World matrix of every node indexed by Node::index, bound once per frame and selected per draw by the vertex shader */
+			struct NodeMatrices {
+				VkBuffer buffer{ VK_NULL_HANDLE };
+				Allocation memory;
+				glm::mat4* mapped{ nullptr };
+				uint32_t count{ 0 };
+				VkDescriptorSet descriptorSet{ VK_NULL_HANDLE };
+			} nodeMatrices;
+
+			/*
+				Nodes that share a mesh, every primitive of the mesh is drawn once for all of them
+			*/
+			struct InstanceGroup {
+				Mesh* mesh{ nullptr };
+				// The first instanceCount nodes are the ones that are drawn, in the same order as their instances
+				std::vector<Node*> nodes;
+				// Instances of primitive p start at firstInstance + p * nodes.size()
+				uint32_t firstInstance{ 0 };
+				uint32_t instanceCount{ 0 };
+			};
+			// One group per mesh, indexed like meshes
+			std::vector<InstanceGroup> instanceGroups;
+
+			/*
+				Per draw data, read by the vertex shader through gl_InstanceIndex so whole scenes go out in a few indirect draws
+			*/
+			struct Instance {
+				uint32_t node;
+				uint32_t material;
+			};
+			struct Instances {
+				VkBuffer buffer{ VK_NULL_HANDLE };
+				Allocation memory;
+				Instance* mapped{ nullptr };
+				uint32_t count{ 0 };
+			} instances;
+
+			/*
+				Material parameters as read by the shaders, indexed like materials
+			*/
+			struct MaterialParameters {
+				glm::vec4 baseColorFactor;
+				// Slot in the texture array, 0 until the texture has its first levels
+				uint32_t baseColorTexture;
+				// 0 draws every fragment
+				float alphaCutoff;
+				// Finest level that may be sampled while the texture streams in
+				float minLod;
+				uint32_t padding;
+			};
+			/** @brief Host visible and written in place, editing a material or sharpening a texture is a write of one entry */
+			struct MaterialData {
+				VkBuffer buffer{ VK_NULL_HANDLE };
+				Allocation memory;
+				MaterialParameters* mapped{ nullptr };
+			} materialData;
+
 			struct Dimensions {
 				glm::vec3 min = glm::vec3(FLT_MAX);
 				glm::vec3 max = glm::vec3(-FLT_MAX);
@@ -213,18 +417,73 @@ namespace Voortman3D {
 				float radius;
 			} dimensions{};
 
-			bool buffersBound = false;
 			std::string path;
 
+			// Set when the geometry is paged in on demand, vertices and indices are then its pools, see VulkanglTFResidency.hpp
+			GeometryResidency* residency{ nullptr };
+
 			~Model();
-			void loadNode(vkglTF::Node* parent, const tinygltf::Node& node, uint32_t nodeIndex, const tinygltf::Model& model, std::vector<uint32_t>& indexBuffer, std::vector<Vertex>& vertexBuffer, float globalscale);
-			void loadMaterials(tinygltf::Model& gltfModel);
-			void loadFromFile(const std::string& filename, VulkanDevice* device, VkQueue transferQueue, uint32_t fileLoadingFlags = vkglTF::FileLoadingFlags::None, float scale = 1.0f);
-			void bindBuffers(VkCommandBuffer commandBuffer);
-			void drawNode(Node* node, VkCommandBuffer commandBuffer, uint32_t renderFlags = 0, VkPipelineLayout pipelineLayout = VK_NULL_HANDLE, uint32_t bindImageSet = 1);
-			void draw(VkCommandBuffer commandBuffer, uint32_t renderFlags = 0, VkPipelineLayout pipelineLayout = VK_NULL_HANDLE, uint32_t bindImageSet = 1);
+			void loadNode(vkglTF::Node* parent, const tinygltf::Node& node, const tinygltf::Model& model, std::vector<uint32_t>& indexBuffer, std::vector<Vertex>& vertexBuffer, float globalscale, std::unordered_map<std::string, uint32_t>& nameIds, std::vector<uint32_t>& meshIndices);
+			/** @brief Groups the nodes by mesh and reports how much geometry and how many draws sharing saves */
+			void createInstanceGroups();
+			/** @brief Reads the materials and collects the images of their textures, no image is decoded yet */
+			void loadMaterials(tinygltf::Model& gltfModel, bool loadImages);
+			void optimizePrimitives(std::vector<uint32_t>& indexBuffer, std::vector<Vertex>& vertexBuffer, ThreadPool& threadPool);
+			void generateLODs(std::vector<uint32_t>& indexBuffer, const std::vector<Vertex>& vertexBuffer, ThreadPool& threadPool);
+			void generateMeshlets(std::vector<uint32_t>& indexBuffer, const std::vector<Vertex>& vertexBuffer, ThreadPool& threadPool);
+			void buildMeshBVHs(const std::vector<uint32_t>& indexBuffer, const std::vector<Vertex>& vertexBuffer, ThreadPool& threadPool);
+			/** @brief Parses and processes the file into CPU side buffers, touches no queue so it can run on any thread */
+			_NODISCARD bool loadGeometry(const std::string& filename, VulkanDevice* device, uint32_t fileLoadingFlags, float scale, std::vector<uint32_t>& indexBuffer, std::vector<Vertex>& vertexBuffer);
+			/** @brief Reads the hierarchy, materials and geometry of the glTF file in data, nothing is processed yet */
+			_NODISCARD bool parseGeometry(const std::string& filename, const std::vector<unsigned char>& data, uint32_t fileLoadingFlags, float scale, std::vector<uint32_t>& indexBuffer, std::vector<Vertex>& vertexBuffer, ThreadPool& threadPool);
+			/** @brief First half of parseGeometry, parses the JSON and decodes the buffers of the glTF file in data into gltfModel */
+			_NODISCARD static bool readGltf(const std::string& filename, const std::vector<unsigned char>& data, tinygltf::Model& gltfModel);
+			/** @brief Second half of parseGeometry, decompresses the buffers and decodes the materials, hierarchy and geometry of gltfModel */
+			_NODISCARD bool decodeGeometry(const std::string& filename, tinygltf::Model& gltfModel, uint32_t fileLoadingFlags, float scale, std::vector<uint32_t>& indexBuffer, std::vector<Vertex>& vertexBuffer, ThreadPool& threadPool);
+			/** @brief Everything that follows parsing: instance groups, the requested mesh processing and the BVHs */
+			void processGeometry(uint32_t fileLoadingFlags, std::vector<uint32_t>& indexBuffer, std::vector<Vertex>& vertexBuffer, ThreadPool& threadPool);
+			/** @brief Picks the index size of every primitive and places its levels in the 16 or 32-bit pool, sets the count of both */
+			void layoutIndices(const std::vector<uint32_t>& indexBuffer, ThreadPool& threadPool);
+			/** @brief Fills meshHashes from the vertices and full detail indices of every primitive, relative to its first vertex so where a mesh sits in the buffers doesn't matter */
+			void hashMeshes(const std::vector<uint32_t>& indexBuffer, const std::vector<Vertex>& vertexBuffer, ThreadPool& threadPool);
+			/** @brief Splits the CPU side index buffer into the contents of both pools as layoutIndices placed them */
+			void packIndices(const std::vector<uint32_t>& indexBuffer, std::vector<uint32_t>& wideIndexBuffer, std::vector<uint16_t>& shortIndexBuffer) const;
+			/**
+			* Loads the part files of an assembly manifest concurrently and appends them into the buffers of this model
+			*
+			* Parts are shared by all their instances, files with the same path or the same contents are parsed once. See VulkanglTFAssembly.hpp for the manifest
+			*/
+			_NODISCARD bool loadAssembly(const std::string& filename, VulkanDevice* device, uint32_t fileLoadingFlags, float scale, std::vector<uint32_t>& indexBuffer, std::vector<Vertex>& vertexBuffer);
+			void createBuffers();
+			void setupDescriptors();
+			/** @brief Writes the parameters of all materials with the levels of their textures that are resident */
+			void updateMaterialData();
+			/** @brief Writes the parameters of one material, visible to the next frame without recording command buffers again */
+			void updateMaterial(uint32_t index);
+			/** @brief Writes the texture array of a set with the node set layout, without bindless textures the slots that have no resident texture get the default texture */
+			void writeTextureDescriptors(VkDescriptorSet descriptorSet);
+			/** @brief Writes the slot of one resident texture */
+			void writeTextureDescriptor(VkDescriptorSet descriptorSet, const Texture& texture);
+			void loadFromFile(const std::string& filename, VulkanDevice* device, uint32_t fileLoadingFlags = vkglTF::FileLoadingFlags::None, float scale = 1.0f);
 			void getNodeDimensions(Node* node, glm::vec3& min, glm::vec3& max);
 			void getSceneDimensions();
+			/** @brief Recompute all world matrices in one pass over the hierarchy and write them to nodeMatrices */
+			void updateWorldMatrices();
+			/**
+			* Recompute and write only the subtrees of nodes whose local matrix changed, called once per frame
+			*
+			* @return True when any world matrix changed
+			*/
+			bool updateDirtyWorldMatrices();
+
+			/**
+			* Casts a ray through the scene BVH and the triangle BVHs of the meshes it reaches
+			*
+			* @param origin Ray origin in the space of the world matrices
+			* @param direction Ray direction in the space of the world matrices, does not need to be normalized
+			* @param pickableNodes Indexed by Node::index, nodes set to 0 are passed through, empty to pick from all nodes
+			*/
+			_NODISCARD PickResult pick(const glm::vec3& origin, const glm::vec3& direction, const std::vector<uint8_t>& pickableNodes = {}) const;
 
 			template <typename T>
 			void CopyToIndexBuffer(std::vector<uint32_t>& indexBuffer,
@@ -236,7 +495,8 @@ namespace Voortman3D {
 			_NODISCARD Node* findNode(Node* parent, uint32_t index);
 			_NODISCARD Node* nodeFromIndex(uint32_t index);
 
-			void prepareNodeDescriptor(vkglTF::Node* node, VkDescriptorSetLayout descriptorSetLayout);
+		private:
+			void updateWorldMatrixRange(uint32_t first, uint32_t end);
 		};
 	}
 }
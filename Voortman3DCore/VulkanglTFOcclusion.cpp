@@ -0,0 +1,487 @@
+/*
+* glTF occlusion culling
+*
+* Every frame clears the counters, then occlusion.comp runs four passes: 0 and 1 write the early draws from the
+* candidates that were visible last frame, 2 and 3 test all candidates against the pyramid, update their visibility
+* and write the late draws from the ones that were not drawn early. depthpyramid.comp reduces the depth of the early
+* pass one level per dispatch
+*/
+
+#include "pch.hpp"
+#include "VulkanglTFOcclusion.hpp"
+#include "VulkanUploader.hpp"
+#include "Tools.hpp"
+
+namespace Voortman3D {
+	namespace vkglTF {
+		namespace {
+			void computeBarrier(const VkCommandBuffer commandBuffer, const VkAccessFlags srcAccessMask, const VkPipelineStageFlags srcStageMask, const VkAccessFlags dstAccessMask, const VkPipelineStageFlags dstStageMask) {
+				VkMemoryBarrier barrier = Initializers::memoryBarrier();
+				barrier.srcAccessMask = srcAccessMask;
+				barrier.dstAccessMask = dstAccessMask;
+				vkCmdPipelineBarrier(commandBuffer, srcStageMask, dstStageMask, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+			}
+		}
+
+		bool OcclusionCulling::isSupported(VkPhysicalDevice physicalDevice, const VkPhysicalDeviceFeatures& enabledFeatures, VkFormat depthFormat) {
+			VkFormatProperties formatProperties{};
+			vkGetPhysicalDeviceFormatProperties(physicalDevice, depthFormat, &formatProperties);
+			return enabledFeatures.drawIndirectFirstInstance && (formatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT);
+		}
+
+		OcclusionCulling::OcclusionCulling(VulkanDevice* device, VkPipelineCache pipelineCache, const Shaders& shaders) : device(device) {
+			const VkDevice logicalDevice = device->logicalDevice;
+
+			VK_CHECK_RESULT(device->createBuffer(
+				VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+				VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+				&params,
+				sizeof(Params)));
+			VK_CHECK_RESULT(params.map());
+
+			// Both the depth buffer and the pyramid are read with texelFetch, so no filtering is involved
+			VkSamplerCreateInfo samplerCI = Initializers::samplerCreateInfo();
+			samplerCI.magFilter = VK_FILTER_NEAREST;
+			samplerCI.minFilter = VK_FILTER_NEAREST;
+			samplerCI.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+			samplerCI.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+			samplerCI.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+			samplerCI.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+			samplerCI.maxLod = VK_LOD_CLAMP_NONE;
+			VK_CHECK_RESULT(vkCreateSampler(logicalDevice, &samplerCI, nullptr, &sampler));
+
+			static constexpr std::array<VkDescriptorSetLayoutBinding, 11> cullBindings = {
+				Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 0),
+				Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 1),
+				Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2),
+				Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 3),
+				Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 4),
+				Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 5),
+				Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 6),
+				Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 7),
+				Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 8),
+				Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 9),
+				Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 10)
+			};
+			constexpr VkDescriptorSetLayoutCreateInfo cullLayoutCI = Initializers::descriptorLayoutCI(cullBindings);
+			VK_CHECK_RESULT(vkCreateDescriptorSetLayout(logicalDevice, &cullLayoutCI, nullptr, &cullSetLayout));
+
+			static constexpr std::array<VkDescriptorSetLayoutBinding, 3> pyramidBindings = {
+				Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, VK_SHADER_STAGE_COMPUTE_BIT, 0),
+				Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 1),
+				Initializers::descriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 2)
+			};
+			constexpr VkDescriptorSetLayoutCreateInfo pyramidLayoutCI = Initializers::descriptorLayoutCI(pyramidBindings);
+			VK_CHECK_RESULT(vkCreateDescriptorSetLayout(logicalDevice, &pyramidLayoutCI, nullptr, &pyramidSetLayout));
+
+			// Culling, drawing with the culled instances and one set per pyramid level, all of them rewritten together
+			const std::array<VkDescriptorPoolSize, 4> poolSizes = {
+				Initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1),
+				Initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 12),
+				Initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1 + maxPyramidLevels + textureSlotCount),
+				Initializers::descriptorPoolSize(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 2 * maxPyramidLevels)
+			};
+			VkDescriptorPoolCreateInfo descriptorPoolCI = Initializers::descriptorPoolCreateInfo(poolSizes, 2 + maxPyramidLevels);
+			// The draw set is a node set
+			descriptorPoolCI.flags = nodeDescriptorPoolFlags();
+			VK_CHECK_RESULT(vkCreateDescriptorPool(logicalDevice, &descriptorPoolCI, nullptr, &descriptorPool));
+
+			// The pass of the culling shader and the level of the pyramid are the only things that change between dispatches
+			const VkPushConstantRange cullPushConstants = Initializers::pushConstantRange(VK_SHADER_STAGE_COMPUTE_BIT, sizeof(uint32_t), 0);
+			VkPipelineLayoutCreateInfo pipelineLayoutCI = Initializers::pipelineLayoutCreateInfo(&cullSetLayout, 1);
+			pipelineLayoutCI.pushConstantRangeCount = 1;
+			pipelineLayoutCI.pPushConstantRanges = &cullPushConstants;
+			VK_CHECK_RESULT(vkCreatePipelineLayout(logicalDevice, &pipelineLayoutCI, nullptr, &cullPipelineLayout));
+
+			const VkPushConstantRange pyramidPushConstants = Initializers::pushConstantRange(VK_SHADER_STAGE_COMPUTE_BIT, sizeof(glm::uvec2) + sizeof(uint32_t), 0);
+			pipelineLayoutCI = Initializers::pipelineLayoutCreateInfo(&pyramidSetLayout, 1);
+			pipelineLayoutCI.pushConstantRangeCount = 1;
+			pipelineLayoutCI.pPushConstantRanges = &pyramidPushConstants;
+			VK_CHECK_RESULT(vkCreatePipelineLayout(logicalDevice, &pipelineLayoutCI, nullptr, &pyramidPipelineLayout));
+
+			VkComputePipelineCreateInfo pipelineCI = Initializers::computePipelineCreateInfo(cullPipelineLayout);
+			pipelineCI.stage = shaders.cull;
+			VK_CHECK_RESULT(vkCreateComputePipelines(logicalDevice, pipelineCache, 1, &pipelineCI, nullptr, &cullPipeline));
+
+			pipelineCI = Initializers::computePipelineCreateInfo(pyramidPipelineLayout);
+			pipelineCI.stage = shaders.pyramid;
+			VK_CHECK_RESULT(vkCreateComputePipelines(logicalDevice, pipelineCache, 1, &pipelineCI, nullptr, &pyramidPipeline));
+		}
+
+		OcclusionCulling::~OcclusionCulling() {
+			const VkDevice logicalDevice = device->logicalDevice;
+
+			destroyBuffers();
+			destroyPyramid();
+			params.destroy();
+
+			if (cullPipeline)
+				vkDestroyPipeline(logicalDevice, cullPipeline, nullptr);
+
+			if (pyramidPipeline)
+				vkDestroyPipeline(logicalDevice, pyramidPipeline, nullptr);
+
+			if (cullPipelineLayout)
+				vkDestroyPipelineLayout(logicalDevice, cullPipelineLayout, nullptr);
+
+			if (pyramidPipelineLayout)
+				vkDestroyPipelineLayout(logicalDevice, pyramidPipelineLayout, nullptr);
+
+			if (cullSetLayout)
+				vkDestroyDescriptorSetLayout(logicalDevice, cullSetLayout, nullptr);
+
+			if (pyramidSetLayout)
+				vkDestroyDescriptorSetLayout(logicalDevice, pyramidSetLayout, nullptr);
+
+			if (descriptorPool)
+				vkDestroyDescriptorPool(logicalDevice, descriptorPool, nullptr);
+
+			if (sampler)
+				vkDestroySampler(logicalDevice, sampler, nullptr);
+		}
+
+		void OcclusionCulling::prepareBuffers(Model* model, const Buffer& drawBuffer, uint32_t maxDrawCount, uint32_t maxShortDrawCount) {
+			this->model = model;
+			this->maxDrawCount = maxDrawCount;
+			this->maxShortDrawCount = maxShortDrawCount;
+			drawBufferInfo = drawBuffer.descriptor;
+
+			// Every instance is a candidate at most once and every primitive of a group gets its own range
+			maxCandidateCount = (std::max)(model->instances.count, 1u);
+			maxRangeCount = 0;
+			for (const Model::InstanceGroup& group : model->instanceGroups) {
+				maxRangeCount += static_cast<uint32_t>(group.mesh->primitives.size());
+			}
+
+			constexpr VkMemoryPropertyFlags hostVisible = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+			VK_CHECK_RESULT(device->createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, hostVisible, &candidates, sizeof(Candidate) * maxCandidateCount));
+			VK_CHECK_RESULT(candidates.map());
+			VK_CHECK_RESULT(device->createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, hostVisible, &ranges, sizeof(uint32_t) * maxRangeCount));
+			VK_CHECK_RESULT(ranges.map());
+			VK_CHECK_RESULT(device->createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, hostVisible, &drawRanges, sizeof(uint32_t) * maxDrawCount));
+			VK_CHECK_RESULT(drawRanges.map());
+
+			VK_CHECK_RESULT(device->createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &visibility, sizeof(uint32_t) * model->bvh.itemCount()));
+			VK_CHECK_RESULT(device->createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &counters, sizeof(glm::uvec2) * maxRangeCount));
+			VK_CHECK_RESULT(device->createBuffer(VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &instances, sizeof(Model::Instance) * maxCandidateCount));
+
+			for (Buffer* draws : { &earlyDraws, &lateDraws }) {
+				VK_CHECK_RESULT(device->createBuffer(VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, hostVisible, draws, sizeof(VkDrawIndexedIndirectCommand) * maxDrawCount));
+				VK_CHECK_RESULT(draws->map());
+				memset(draws->mapped, 0, sizeof(VkDrawIndexedIndirectCommand) * maxDrawCount);
+			}
+
+			// Nothing counts as visible before the first frame, so everything in view is tested against the pyramid of an empty frame.
+			// The first frame waits for the fill on the timeline semaphore of the uploader instead of the CPU waiting for the queue
+			device->uploader->fillBuffer(visibility.buffer, 0, VK_WHOLE_SIZE, 0);
+			device->uploader->submit();
+
+			candidateCount = 0;
+			rangeCount = 0;
+			lastShortDrawCount = 0;
+			lastWideDrawCount = 0;
+			lastTriangles = 0;
+			descriptorsDirty = true;
+		}
+
+		void OcclusionCulling::destroyBuffers() {
+			candidates.destroy();
+			ranges.destroy();
+			drawRanges.destroy();
+			visibility.destroy();
+			counters.destroy();
+			instances.destroy();
+			earlyDraws.destroy();
+			lateDraws.destroy();
+			model = nullptr;
+			descriptorsDirty = true;
+		}
+
+		void OcclusionCulling::preparePyramid(VkImage depthImage, VkFormat depthFormat, uint32_t width, uint32_t height) {
+			if (pyramid)
+				return;
+
+			const VkDevice logicalDevice = device->logicalDevice;
+			this->depthImage = depthImage;
+			this->depthFormat = depthFormat;
+			this->width = width;
+			this->height = height;
+
+			// Every level halves the one before it down to a single texel, odd sizes round down and fold their remainder into the last texel
+			glm::uvec2 size((std::max)(width / 2, 1u), (std::max)(height / 2, 1u));
+			levelSizes.push_back(size);
+			while ((size.x > 1 || size.y > 1) && levelSizes.size() < maxPyramidLevels) {
+				size = (glm::max)(size / 2u, glm::uvec2(1));
+				levelSizes.push_back(size);
+			}
+			const uint32_t levelCount = static_cast<uint32_t>(levelSizes.size());
+
+			VkImageCreateInfo imageCI = Initializers::imageCreateInfo();
+			imageCI.imageType = VK_IMAGE_TYPE_2D;
+			imageCI.format = VK_FORMAT_R32_SFLOAT;
+			imageCI.extent = { levelSizes[0].x, levelSizes[0].y, 1 };
+			imageCI.mipLevels = levelCount;
+			imageCI.arrayLayers = 1;
+			imageCI.samples = VK_SAMPLE_COUNT_1_BIT;
+			imageCI.tiling = VK_IMAGE_TILING_OPTIMAL;
+			imageCI.usage = VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT;
+			imageCI.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+			VK_CHECK_RESULT(vkCreateImage(logicalDevice, &imageCI, nullptr, &pyramid));
+			VK_CHECK_RESULT(device->allocateImageMemory(pyramid, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &pyramidMemory));
+
+			// All levels for the occlusion test, one view per level for building it
+			VkImageViewCreateInfo viewCI = Initializers::imageViewCreateInfo();
+			viewCI.viewType = VK_IMAGE_VIEW_TYPE_2D;
+			viewCI.format = VK_FORMAT_R32_SFLOAT;
+			viewCI.image = pyramid;
+			viewCI.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, levelCount, 0, 1 };
+			VK_CHECK_RESULT(vkCreateImageView(logicalDevice, &viewCI, nullptr, &pyramidView));
+
+			levelViews.resize(levelCount);
+			for (uint32_t level = 0; level < levelCount; level++) {
+				viewCI.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, level, 1, 0, 1 };
+				VK_CHECK_RESULT(vkCreateImageView(logicalDevice, &viewCI, nullptr, &levelViews[level]));
+			}
+
+			// An attachment view also holds the stencil aspect, which can't be sampled together with the depth
+			viewCI.format = depthFormat;
+			viewCI.image = depthImage;
+			viewCI.subresourceRange = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1 };
+			VK_CHECK_RESULT(vkCreateImageView(logicalDevice, &viewCI, nullptr, &depthView));
+
+			// The layout is set by every frame before the pyramid is built, see record
+			descriptorsDirty = true;
+		}
+
+		void OcclusionCulling::destroyPyramid() {
+			const VkDevice logicalDevice = device->logicalDevice;
+
+			for (VkImageView view : levelViews) {
+				vkDestroyImageView(logicalDevice, view, nullptr);
+			}
+			levelViews.clear();
+			levelSizes.clear();
+
+			if (pyramidView) {
+				vkDestroyImageView(logicalDevice, pyramidView, nullptr);
+				pyramidView = VK_NULL_HANDLE;
+			}
+			if (depthView) {
+				vkDestroyImageView(logicalDevice, depthView, nullptr);
+				depthView = VK_NULL_HANDLE;
+			}
+			if (pyramid) {
+				vkDestroyImage(logicalDevice, pyramid, nullptr);
+				device->freeMemory(pyramidMemory);
+				pyramid = VK_NULL_HANDLE;
+			}
+			depthImage = VK_NULL_HANDLE;
+			descriptorsDirty = true;
+		}
+
+		void OcclusionCulling::updateDescriptors() {
+			if (!descriptorsDirty)
+				return;
+
+			const VkDevice logicalDevice = device->logicalDevice;
+
+			// Buffers and pyramid are recreated at different times, all sets are simply allocated again
+			VK_CHECK_RESULT(vkResetDescriptorPool(logicalDevice, descriptorPool, 0));
+
+			VkDescriptorSetAllocateInfo allocateInfo = Initializers::descriptorSetAllocateInfo(descriptorPool, &cullSetLayout, 1);
+			VK_CHECK_RESULT(vkAllocateDescriptorSets(logicalDevice, &allocateInfo, &cullSet));
+			allocateInfo = Initializers::descriptorSetAllocateInfo(descriptorPool, &descriptorSetLayoutNodes, 1);
+			VK_CHECK_RESULT(vkAllocateDescriptorSets(logicalDevice, &allocateInfo, &drawSet));
+
+			const uint32_t levelCount = static_cast<uint32_t>(levelSizes.size());
+			const std::vector<VkDescriptorSetLayout> pyramidLayouts(levelCount, pyramidSetLayout);
+			pyramidSets.resize(levelCount);
+			allocateInfo = Initializers::descriptorSetAllocateInfo(descriptorPool, pyramidLayouts.data(), levelCount);
+			VK_CHECK_RESULT(vkAllocateDescriptorSets(logicalDevice, &allocateInfo, pyramidSets.data()));
+
+			const VkDescriptorImageInfo pyramidInfo = Initializers::descriptorImageInfo(sampler, pyramidView, VK_IMAGE_LAYOUT_GENERAL);
+			const std::array<VkWriteDescriptorSet, 11> cullWrites = {
+				Initializers::writeDescriptorSet(cullSet, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 0, &params.descriptor),
+				Initializers::writeDescriptorSet(cullSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, &candidates.descriptor),
+				Initializers::writeDescriptorSet(cullSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2, &visibility.descriptor),
+				Initializers::writeDescriptorSet(cullSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3, &counters.descriptor),
+				Initializers::writeDescriptorSet(cullSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 4, &ranges.descriptor),
+				Initializers::writeDescriptorSet(cullSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 5, &instances.descriptor),
+				Initializers::writeDescriptorSet(cullSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 6, &drawBufferInfo),
+				Initializers::writeDescriptorSet(cullSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 7, &drawRanges.descriptor),
+				Initializers::writeDescriptorSet(cullSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 8, &earlyDraws.descriptor),
+				Initializers::writeDescriptorSet(cullSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 9, &lateDraws.descriptor),
+				Initializers::writeDescriptorSet(cullSet, VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 10, &pyramidInfo)
+			};
+			vkUpdateDescriptorSets(logicalDevice, static_cast<uint32_t>(cullWrites.size()), cullWrites.data(), 0, nullptr);
+
+			// Same matrices and materials as the node set of the model, only the instances come from the occlusion pass
+			const VkDescriptorBufferInfo matricesInfo = { model->nodeMatrices.buffer, 0, VK_WHOLE_SIZE };
+			const VkDescriptorBufferInfo materialsInfo = { model->materialData.buffer, 0, VK_WHOLE_SIZE };
+			const std::array<VkWriteDescriptorSet, 3> drawWrites = {
+				Initializers::writeDescriptorSet(drawSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 0, &matricesInfo),
+				Initializers::writeDescriptorSet(drawSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1, &instances.descriptor),
+				Initializers::writeDescriptorSet(drawSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2, &materialsInfo)
+			};
+			vkUpdateDescriptorSets(logicalDevice, static_cast<uint32_t>(drawWrites.size()), drawWrites.data(), 0, nullptr);
+			model->writeTextureDescriptors(drawSet);
+
+			// The first level reads the depth buffer, the source binding only matters from the second level on
+			const VkDescriptorImageInfo depthInfo = Initializers::descriptorImageInfo(sampler, depthView, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL);
+			for (uint32_t level = 0; level < levelCount; level++) {
+				const VkDescriptorImageInfo srcInfo = Initializers::descriptorImageInfo(VK_NULL_HANDLE, levelViews[level > 0 ? level - 1 : 0], VK_IMAGE_LAYOUT_GENERAL);
+				const VkDescriptorImageInfo dstInfo = Initializers::descriptorImageInfo(VK_NULL_HANDLE, levelViews[level], VK_IMAGE_LAYOUT_GENERAL);
+				const std::array<VkWriteDescriptorSet, 3> pyramidWrites = {
+					Initializers::writeDescriptorSet(pyramidSets[level], VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 0, &depthInfo),
+					Initializers::writeDescriptorSet(pyramidSets[level], VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, &srcInfo),
+					Initializers::writeDescriptorSet(pyramidSets[level], VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 2, &dstInfo)
+				};
+				vkUpdateDescriptorSets(logicalDevice, static_cast<uint32_t>(pyramidWrites.size()), pyramidWrites.data(), 0, nullptr);
+			}
+
+			descriptorsDirty = false;
+		}
+
+		void OcclusionCulling::updateTextureDescriptors() {
+			// Sets that are still to be written get the textures then
+			if (!descriptorsDirty && drawSet)
+				model->writeTextureDescriptors(drawSet);
+		}
+
+		void OcclusionCulling::beginFrame() noexcept {
+			candidateCount = 0;
+			rangeCount = 0;
+		}
+
+		uint32_t OcclusionCulling::addRange(uint32_t firstInstance) noexcept {
+			static_cast<uint32_t*>(ranges.mapped)[rangeCount] = firstInstance;
+			return rangeCount++;
+		}
+
+		void OcclusionCulling::addCandidate(uint32_t range, uint32_t node, uint32_t item, uint32_t material) noexcept {
+			static_cast<Candidate*>(candidates.mapped)[candidateCount++] = { model->bvh.itemMinimum(item), node, model->bvh.itemMaximum(item), material, range, item };
+		}
+
+		void OcclusionCulling::endFrame(const glm::mat4& viewProjection, uint32_t shortDrawCount, uint32_t wideDrawCount, size_t triangles) noexcept {
+			Params* paramData = static_cast<Params*>(params.mapped);
+			paramData->viewProjection = viewProjection;
+			paramData->screenSize = glm::uvec2(width, height);
+			paramData->candidateCount = candidateCount;
+			paramData->shortDrawCount = shortDrawCount;
+			paramData->levelCount = static_cast<uint32_t>(levelSizes.size());
+			paramData->firstWideDraw = maxShortDrawCount;
+			paramData->wideDrawCount = wideDrawCount;
+
+			lastShortDrawCount = shortDrawCount;
+			lastWideDrawCount = wideDrawCount;
+			lastTriangles = triangles;
+		}
+
+		size_t OcclusionCulling::getDrawnTriangles() const noexcept {
+			size_t triangles = 0;
+			for (const Buffer* buffer : { &earlyDraws, &lateDraws }) {
+				const VkDrawIndexedIndirectCommand* commands = static_cast<const VkDrawIndexedIndirectCommand*>(buffer->mapped);
+				for (uint32_t i = 0; i < lastShortDrawCount; i++) {
+					triangles += static_cast<size_t>(commands[i].indexCount / 3) * commands[i].instanceCount;
+				}
+				for (uint32_t i = maxShortDrawCount; i < maxShortDrawCount + lastWideDrawCount; i++) {
+					triangles += static_cast<size_t>(commands[i].indexCount / 3) * commands[i].instanceCount;
+				}
+			}
+			return triangles;
+		}
+
+		float OcclusionCulling::getCulledRatio() const noexcept {
+			return lastTriangles ? 1.0f - static_cast<float>(getDrawnTriangles()) / lastTriangles : 0.0f;
+		}
+
+		void OcclusionCulling::record(const VkCommandBuffer commandBuffer, VkRenderPassBeginInfo renderPassBeginInfo, VkRenderPass lateRenderPass, const DrawFunction& drawScene) {
+			const VkViewport viewport = Initializers::viewport(static_cast<float>(width), static_cast<float>(height), 0.0f, 1.0f);
+			const VkRect2D scissor = Initializers::rect2D(width, height, 0, 0);
+			const uint32_t candidateGroups = (maxCandidateCount + 63) / 64;
+			const uint32_t drawGroups = (maxDrawCount + 63) / 64;
+			constexpr VkAccessFlags drawAccess = VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT;
+			constexpr VkPipelineStageFlags drawStages = VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT;
+
+			// Counters start empty every frame, the early instances are the ones that were visible at the end of the last frame
+			vkCmdFillBuffer(commandBuffer, counters.buffer, 0, VK_WHOLE_SIZE, 0);
+			computeBarrier(commandBuffer, VK_ACCESS_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipeline);
+			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipelineLayout, 0, 1, &cullSet, 0, nullptr);
+			uint32_t pass = 0;
+			vkCmdPushConstants(commandBuffer, cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(uint32_t), &pass);
+			vkCmdDispatch(commandBuffer, candidateGroups, 1, 1);
+			computeBarrier(commandBuffer, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+			pass = 1;
+			vkCmdPushConstants(commandBuffer, cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(uint32_t), &pass);
+			vkCmdDispatch(commandBuffer, drawGroups, 1, 1);
+			computeBarrier(commandBuffer, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, drawAccess, drawStages);
+
+			// Early pass
+			vkCmdBeginRenderPass(commandBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+			vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+			vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+			drawScene(commandBuffer, earlyDraws, false);
+			vkCmdEndRenderPass(commandBuffer);
+
+			// Reduce the depth of the early pass, every level takes the farthest depth of the 2x2 texels below it
+			VkImageSubresourceRange depthRange = { VK_IMAGE_ASPECT_DEPTH_BIT, 0, 1, 0, 1 };
+			if (Tools::formatHasStencil(depthFormat))
+				depthRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
+			Tools::insertImageMemoryBarrier(commandBuffer, depthImage,
+				VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT,
+				VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL,
+				VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, depthRange);
+
+			// Every level is written before it is read, so the pyramid of the last frame is discarded. Written as storage image and read
+			// as sampled image, so it stays in the general layout for the rest of the frame
+			Tools::insertImageMemoryBarrier(commandBuffer, pyramid,
+				0, VK_ACCESS_SHADER_WRITE_BIT,
+				VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL,
+				VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, { VK_IMAGE_ASPECT_COLOR_BIT, 0, static_cast<uint32_t>(levelSizes.size()), 0, 1 });
+
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pyramidPipeline);
+			for (uint32_t level = 0; level < levelSizes.size(); level++) {
+				const struct {
+					glm::uvec2 srcSize;
+					uint32_t level;
+				} constants = { level > 0 ? levelSizes[level - 1] : glm::uvec2(width, height), level };
+				const glm::uvec2& size = levelSizes[level];
+
+				vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pyramidPipelineLayout, 0, 1, &pyramidSets[level], 0, nullptr);
+				vkCmdPushConstants(commandBuffer, pyramidPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(constants), &constants);
+				vkCmdDispatch(commandBuffer, (size.x + 7) / 8, (size.y + 7) / 8, 1);
+				computeBarrier(commandBuffer, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+			}
+
+			Tools::insertImageMemoryBarrier(commandBuffer, depthImage,
+				VK_ACCESS_SHADER_READ_BIT, VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+				VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL,
+				VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, depthRange);
+
+			// Test every candidate against the pyramid, the ones that came out from behind the early instances form the late draws
+			vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipeline);
+			vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, cullPipelineLayout, 0, 1, &cullSet, 0, nullptr);
+			pass = 2;
+			vkCmdPushConstants(commandBuffer, cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(uint32_t), &pass);
+			vkCmdDispatch(commandBuffer, candidateGroups, 1, 1);
+			computeBarrier(commandBuffer, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+			pass = 3;
+			vkCmdPushConstants(commandBuffer, cullPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(uint32_t), &pass);
+			vkCmdDispatch(commandBuffer, drawGroups, 1, 1);
+			computeBarrier(commandBuffer, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, drawAccess, drawStages);
+
+			// Late pass, drawn on top of the early one
+			renderPassBeginInfo.renderPass = lateRenderPass;
+			vkCmdBeginRenderPass(commandBuffer, &renderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+			vkCmdSetViewport(commandBuffer, 0, 1, &viewport);
+			vkCmdSetScissor(commandBuffer, 0, 1, &scissor);
+			drawScene(commandBuffer, lateDraws, true);
+			vkCmdEndRenderPass(commandBuffer);
+
+			// The draws are read back on the host once the frame has finished, see getDrawnTriangles
+			computeBarrier(commandBuffer, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_HOST_READ_BIT, VK_PIPELINE_STAGE_HOST_BIT);
+		}
+	}
+}
@@ -0,0 +1,175 @@
+/*
+* glTF occlusion culling
+*
+* Two phase occlusion culling of the instances of a model: the instances that were visible last frame are drawn first,
+* their depth is reduced to a pyramid and the remaining instances are tested against it on the GPU before the ones that
+* became visible are drawn. The host writes the draws of the frame as usual and adds the instances that survived the
+* frustum as candidates, the GPU writes the instances of the early and the late draws from those
+*/
+
+#pragma once
+#include "pch.hpp"
+#include "VulkanglTFModel.hpp"
+#include <functional>
+
+namespace Voortman3D {
+	namespace vkglTF {
+		class OcclusionCulling {
+		public:
+			// Enough for the half resolution depth pyramid of any target up to 65536 pixels wide
+			static constexpr uint32_t maxPyramidLevels = 16;
+
+			// Layouts shared with occlusion.comp
+			struct Candidate {
+				glm::vec3 boxMin;
+				uint32_t node;
+				glm::vec3 boxMax;
+				uint32_t material;
+				uint32_t range;
+				uint32_t item;
+				uint32_t padding[2];
+			};
+			struct Params {
+				glm::mat4 viewProjection;
+				glm::uvec2 screenSize;
+				uint32_t candidateCount;
+				uint32_t shortDrawCount;
+				uint32_t levelCount;
+				uint32_t firstWideDraw;
+				uint32_t wideDrawCount;
+			};
+
+			/*
+				Stages of occlusion.comp and depthpyramid.comp, their modules are owned by the caller
+			*/
+			struct Shaders {
+				VkPipelineShaderStageCreateInfo cull;
+				VkPipelineShaderStageCreateInfo pyramid;
+			};
+
+			/**
+			* Records the scene into the render pass that is active, once with the early and once with the late draws
+			*
+			* @param draws Indirect draws laid out like the draw buffer, bound to the instances of getDrawSet
+			*/
+			using DrawFunction = std::function<void(const VkCommandBuffer commandBuffer, const Buffer& draws, bool late)>;
+
+			/** @brief The draws find their instances through their first instance and the pyramid is built by sampling the depth buffer */
+			_NODISCARD static bool isSupported(VkPhysicalDevice physicalDevice, const VkPhysicalDeviceFeatures& enabledFeatures, VkFormat depthFormat);
+
+			OcclusionCulling(VulkanDevice* device, VkPipelineCache pipelineCache, const Shaders& shaders);
+			OcclusionCulling(const OcclusionCulling&) = delete;
+			OcclusionCulling& operator=(const OcclusionCulling&) = delete;
+			/** @brief The GPU has to be done with the passes */
+			~OcclusionCulling();
+
+			/**
+			* Create the buffers for the instances of a model, nothing counts as visible before the first frame
+			*
+			* @param drawBuffer Draws the host writes every frame, 16-bit index draws first and the 32-bit ones from maxShortDrawCount
+			*
+			* @note The visibility is cleared through the uploader, the first frame has to wait on its timeline semaphore
+			*/
+			void prepareBuffers(Model* model, const Buffer& drawBuffer, uint32_t maxDrawCount, uint32_t maxShortDrawCount);
+			void destroyBuffers();
+			_NODISCARD bool hasBuffers() const noexcept { return candidates.buffer != VK_NULL_HANDLE; }
+
+			/**
+			* Create the pyramid for a depth buffer, does nothing while one exists
+			*
+			* @param depthImage Sampled for the first level, so it needs VK_IMAGE_USAGE_SAMPLED_BIT
+			*/
+			void preparePyramid(VkImage depthImage, VkFormat depthFormat, uint32_t width, uint32_t height);
+			void destroyPyramid();
+
+			/** @brief Write the descriptor sets again after the buffers or the pyramid were recreated, or after invalidateDescriptors */
+			void updateDescriptors();
+			/** @brief Allocate the sets again on the next updateDescriptors, for sets that are bound in recorded command buffers */
+			void invalidateDescriptors() noexcept { descriptorsDirty = true; }
+			/** @brief Write the textures of the model into the draw set in place, which needs update after bind textures */
+			void updateTextureDescriptors();
+			/** @brief Node set of the model with the instances written by the GPU, for drawing the early and the late draws */
+			_NODISCARD VkDescriptorSet getDrawSet() const noexcept { return drawSet; }
+
+			/** @brief Start writing the candidates of a frame, the last frame has to be finished */
+			void beginFrame() noexcept;
+			/** @brief Add a range of instances starting at firstInstance, the candidates and draws added to it share their instances */
+			_NODISCARD uint32_t addRange(uint32_t firstInstance) noexcept;
+			void addCandidate(uint32_t range, uint32_t node, uint32_t item, uint32_t material) noexcept;
+			/** @brief Let a draw of the draw buffer draw the instances of a range */
+			void setDrawRange(uint32_t draw, uint32_t range) noexcept { static_cast<uint32_t*>(drawRanges.mapped)[draw] = range; }
+			/**
+			* @param viewProjection Same space as the BVH boxes of the candidates
+			* @param triangles Triangles of the draws the host wrote, before occlusion culling
+			*/
+			void endFrame(const glm::mat4& viewProjection, uint32_t shortDrawCount, uint32_t wideDrawCount, size_t triangles) noexcept;
+
+			/** @brief Triangles the early and the late draws of the last finished frame drew */
+			_NODISCARD size_t getDrawnTriangles() const noexcept;
+			/** @brief Share of the triangles of the last finished frame that occlusion culling left out */
+			_NODISCARD float getCulledRatio() const noexcept;
+
+			/**
+			* Record a frame: cull against the visibility of the last frame, draw the early instances, build the pyramid,
+			* cull the rest against it and draw the ones that became visible
+			*
+			* @param renderPassBeginInfo Begins the early pass, which clears the targets
+			* @param lateRenderPass Same attachments as the early pass, keeps what it drew
+			*/
+			void record(const VkCommandBuffer commandBuffer, VkRenderPassBeginInfo renderPassBeginInfo, VkRenderPass lateRenderPass, const DrawFunction& drawScene);
+
+		private:
+			VulkanDevice* device;
+			Model* model{};
+
+			Buffer params{};
+			// Written on the host every frame, a range holds the instances of one primitive of an instance group
+			Buffer candidates{};
+			Buffer ranges{};
+			Buffer drawRanges{};
+			// Only touched by the GPU, visibility persists over frames and is indexed by BVH item
+			Buffer visibility{};
+			Buffer counters{};
+			Buffer instances{};
+			// Host visible so the triangles that were actually drawn can be counted once the frame has finished
+			Buffer earlyDraws{};
+			Buffer lateDraws{};
+			VkDescriptorBufferInfo drawBufferInfo{};
+			uint32_t maxCandidateCount{};
+			uint32_t maxRangeCount{};
+			uint32_t maxDrawCount{};
+			uint32_t maxShortDrawCount{};
+			uint32_t candidateCount{};
+			uint32_t rangeCount{};
+			uint32_t lastShortDrawCount{};
+			uint32_t lastWideDrawCount{};
+			size_t lastTriangles{};
+
+			// Farthest depth of the early pass per texel, level 0 has half the resolution of the depth buffer
+			VkImage pyramid{ VK_NULL_HANDLE };
+			Allocation pyramidMemory{};
+			VkImageView pyramidView{ VK_NULL_HANDLE };
+			std::vector<VkImageView> levelViews;
+			std::vector<glm::uvec2> levelSizes;
+			// Depth aspect only view of the depth buffer the pyramid was created for
+			VkImage depthImage{ VK_NULL_HANDLE };
+			VkImageView depthView{ VK_NULL_HANDLE };
+			VkFormat depthFormat{ VK_FORMAT_UNDEFINED };
+			uint32_t width{}, height{};
+			VkSampler sampler{ VK_NULL_HANDLE };
+
+			VkDescriptorPool descriptorPool{ VK_NULL_HANDLE };
+			VkDescriptorSetLayout cullSetLayout{ VK_NULL_HANDLE };
+			VkDescriptorSetLayout pyramidSetLayout{ VK_NULL_HANDLE };
+			VkDescriptorSet cullSet{ VK_NULL_HANDLE };
+			VkDescriptorSet drawSet{ VK_NULL_HANDLE };
+			std::vector<VkDescriptorSet> pyramidSets;
+			bool descriptorsDirty{ true };
+
+			VkPipelineLayout cullPipelineLayout{ VK_NULL_HANDLE };
+			VkPipelineLayout pyramidPipelineLayout{ VK_NULL_HANDLE };
+			VkPipeline cullPipeline{ VK_NULL_HANDLE };
+			VkPipeline pyramidPipeline{ VK_NULL_HANDLE };
+		};
+	}
+}
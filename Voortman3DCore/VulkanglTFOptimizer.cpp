@@ -0,0 +1,362 @@
+/*
+* glTF mesh optimization
+*
+* Load time optimization of primitives: exact vertex welding, vertex cache ordering (Tipsify), overdraw ordering
+* and vertex fetch remapping. Based on "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw" (Sander et al. 2007)
+*/
+
+#include "pch.hpp"
+#include "VulkanglTFOptimizer.hpp"
+
+namespace Voortman3D {
+	namespace {
+		constexpr uint32_t invalidIndex = ~0u;
+		// Matches the post-transform cache size most desktop GPUs behave like
+		constexpr uint32_t cacheSize = 16;
+		// Clusters may get up to 5% worse ACMR in exchange for better overdraw ordering
+		constexpr float overdrawThreshold = 1.05f;
+
+		_NODISCARD inline uint32_t hashVertex(const vkglTF::Vertex& vertex) noexcept {
+			// Exact welding, so hashing the bit patterns is enough
+			uint32_t words[sizeof(vkglTF::Vertex) / sizeof(uint32_t)];
+			memcpy(words, &vertex, sizeof(words));
+
+			uint32_t h = 2166136261u;
+			for (uint32_t word : words) {
+				word *= 0x5bd1e995u;
+				word ^= word >> 24;
+				h = (h * 0x5bd1e995u) ^ (word * 0x5bd1e995u);
+			}
+			return h ^ (h >> 13);
+		}
+
+		// Merges bitwise identical vertices, indices are remapped to the first occurrence
+		void weldVertices(std::vector<vkglTF::Vertex>& vertices, std::vector<uint32_t>& indices) {
+			size_t tableSize = 16;
+			while (tableSize < vertices.size() * 2)
+				tableSize *= 2;
+			const size_t mask = tableSize - 1;
+
+			std::vector<uint32_t> table(tableSize, invalidIndex);
+			std::vector<uint32_t> remap(vertices.size());
+			uint32_t uniqueCount = 0;
+
+			for (uint32_t v = 0; v < vertices.size(); v++) {
+				size_t bucket = hashVertex(vertices[v]) & mask;
+				// Linear probing, the table is at most half full
+				while (table[bucket] != invalidIndex && memcmp(&vertices[table[bucket]], &vertices[v], sizeof(vkglTF::Vertex)) != 0)
+					bucket = (bucket + 1) & mask;
+
+				if (table[bucket] == invalidIndex) {
+					// Compacting in place is safe as the unique index never passes the source index
+					table[bucket] = uniqueCount;
+					vertices[uniqueCount] = vertices[v];
+					remap[v] = uniqueCount++;
+				}
+				else {
+					remap[v] = table[bucket];
+				}
+			}
+
+			vertices.resize(uniqueCount);
+			for (uint32_t& index : indices)
+				index = remap[index];
+		}
+
+		void removeDegenerateTriangles(std::vector<uint32_t>& indices) {
+			size_t write = 0;
+			for (size_t i = 0; i < indices.size(); i += 3) {
+				const uint32_t a = indices[i + 0], b = indices[i + 1], c = indices[i + 2];
+				if (a == b || b == c || c == a)
+					continue;
+				indices[write++] = a;
+				indices[write++] = b;
+				indices[write++] = c;
+			}
+			indices.resize(write);
+		}
+
+		// Returns the number of cache misses of the triangle, timestamps older than cacheSize entries are out of the FIFO
+		inline uint32_t updateCache(const uint32_t* triangle, std::vector<uint32_t>& cacheTimestamps, uint32_t& timestamp) noexcept {
+			uint32_t misses = 0;
+			for (int k = 0; k < 3; k++) {
+				if (timestamp - cacheTimestamps[triangle[k]] > cacheSize) {
+					cacheTimestamps[triangle[k]] = timestamp++;
+					misses++;
+				}
+			}
+			return misses;
+		}
+
+		/*
+			Tipsify
+
+			Fans around the current vertex emitting all its remaining triangles, then continues with the vertex that
+			is most likely still in the cache. When no such vertex exists the most recent dead end is used
+		*/
+		void tipsify(std::vector<uint32_t>& indices, size_t vertexCount) {
+			const size_t triangleCount = indices.size() / 3;
+
+			// Vertex to triangle adjacency
+			std::vector<uint32_t> live(vertexCount, 0);
+			for (uint32_t index : indices)
+				live[index]++;
+
+			std::vector<uint32_t> offsets(vertexCount + 1, 0);
+			for (size_t v = 0; v < vertexCount; v++)
+				offsets[v + 1] = offsets[v] + live[v];
+
+			std::vector<uint32_t> adjacency(indices.size());
+			{
+				std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+				for (size_t i = 0; i < indices.size(); i++)
+					adjacency[fill[indices[i]]++] = static_cast<uint32_t>(i / 3);
+			}
+
+			std::vector<uint32_t> cacheTimestamps(vertexCount, 0);
+			std::vector<bool> emitted(triangleCount, false);
+			std::vector<uint32_t> deadEnd;
+			deadEnd.reserve(indices.size());
+			std::vector<uint32_t> candidates;
+			candidates.reserve(64);
+
+			std::vector<uint32_t> result;
+			result.reserve(indices.size());
+
+			uint32_t timestamp = cacheSize + 1;
+			size_t cursor = 0;
+
+			auto nextLiveVertex = [&]() -> uint32_t {
+				while (cursor < vertexCount) {
+					if (live[cursor] > 0)
+						return static_cast<uint32_t>(cursor);
+					cursor++;
+				}
+				return invalidIndex;
+			};
+
+			uint32_t fanning = nextLiveVertex();
+			while (fanning != invalidIndex) {
+				candidates.clear();
+
+				for (uint32_t a = offsets[fanning]; a < offsets[fanning + 1]; a++) {
+					const uint32_t triangle = adjacency[a];
+					if (emitted[triangle])
+						continue;
+
+					for (int k = 0; k < 3; k++) {
+						const uint32_t v = indices[triangle * 3 + k];
+						result.push_back(v);
+						deadEnd.push_back(v);
+						candidates.push_back(v);
+						live[v]--;
+						if (timestamp - cacheTimestamps[v] > cacheSize)
+							cacheTimestamps[v] = timestamp++;
+					}
+					emitted[triangle] = true;
+				}
+
+				// Prefer the candidate that is oldest in the cache while its remaining triangles still fit
+				uint32_t best = invalidIndex;
+				int bestPriority = -1;
+				for (uint32_t v : candidates) {
+					if (live[v] == 0)
+						continue;
+					int priority = 0;
+					if (timestamp - cacheTimestamps[v] + 2 * live[v] <= cacheSize)
+						priority = static_cast<int>(timestamp - cacheTimestamps[v]);
+					if (priority > bestPriority) {
+						bestPriority = priority;
+						best = v;
+					}
+				}
+
+				if (best == invalidIndex) {
+					while (!deadEnd.empty()) {
+						const uint32_t v = deadEnd.back();
+						deadEnd.pop_back();
+						if (live[v] > 0) {
+							best = v;
+							break;
+						}
+					}
+				}
+				fanning = best != invalidIndex ? best : nextLiveVertex();
+			}
+
+			indices.swap(result);
+		}
+
+		// A triangle that misses the cache with all three vertices starts a new, mostly disjoint, patch
+		std::vector<uint32_t> generateHardBoundaries(const std::vector<uint32_t>& indices, size_t vertexCount) {
+			std::vector<uint32_t> cacheTimestamps(vertexCount, 0);
+			uint32_t timestamp = cacheSize + 1;
+
+			std::vector<uint32_t> boundaries;
+			for (size_t i = 0; i < indices.size() / 3; i++) {
+				const uint32_t misses = updateCache(&indices[i * 3], cacheTimestamps, timestamp);
+				if (i == 0 || misses == 3)
+					boundaries.push_back(static_cast<uint32_t>(i));
+			}
+			return boundaries;
+		}
+
+		// Splits hard clusters further as soon as their running ACMR gets close enough to the ACMR of the whole cluster
+		std::vector<uint32_t> generateSoftBoundaries(const std::vector<uint32_t>& indices, size_t vertexCount, const std::vector<uint32_t>& hardBoundaries) {
+			std::vector<uint32_t> cacheTimestamps(vertexCount, 0);
+			uint32_t timestamp = 0;
+			const size_t triangleCount = indices.size() / 3;
+
+			std::vector<uint32_t> boundaries;
+			for (size_t c = 0; c < hardBoundaries.size(); c++) {
+				const size_t start = hardBoundaries[c];
+				const size_t end = c + 1 < hardBoundaries.size() ? hardBoundaries[c + 1] : triangleCount;
+
+				// Flushing the cache is done by moving the timestamp past all entries
+				timestamp += cacheSize + 1;
+				uint32_t clusterMisses = 0;
+				for (size_t i = start; i < end; i++)
+					clusterMisses += updateCache(&indices[i * 3], cacheTimestamps, timestamp);
+				const float clusterThreshold = overdrawThreshold * static_cast<float>(clusterMisses) / static_cast<float>(end - start);
+
+				const size_t firstBoundary = boundaries.size();
+				boundaries.push_back(static_cast<uint32_t>(start));
+
+				timestamp += cacheSize + 1;
+				uint32_t runningMisses = 0;
+				uint32_t runningTriangles = 0;
+				for (size_t i = start; i < end; i++) {
+					runningMisses += updateCache(&indices[i * 3], cacheTimestamps, timestamp);
+					runningTriangles++;
+
+					if (static_cast<float>(runningMisses) / static_cast<float>(runningTriangles) <= clusterThreshold) {
+						boundaries.push_back(static_cast<uint32_t>(i + 1));
+						timestamp += cacheSize + 1;
+						runningMisses = 0;
+						runningTriangles = 0;
+					}
+				}
+
+				// The last split can be empty, or a small remainder with a bad ACMR that is better off merged with its predecessor
+				if (boundaries.back() == end || (runningTriangles > 0 && boundaries.size() - firstBoundary > 1))
+					boundaries.pop_back();
+			}
+			return boundaries;
+		}
+
+		/*
+			Overdraw ordering
+
+			The cache optimized triangle order is split in clusters, which are then sorted so clusters facing away from the
+			center of the primitive come first. Those are the most likely to occlude the rest
+		*/
+		void optimizeOverdraw(std::vector<uint32_t>& indices, const std::vector<vkglTF::Vertex>& vertices) {
+			const size_t triangleCount = indices.size() / 3;
+			if (triangleCount < 2)
+				return;
+
+			const std::vector<uint32_t> hardBoundaries = generateHardBoundaries(indices, vertices.size());
+			const std::vector<uint32_t> clusters = generateSoftBoundaries(indices, vertices.size(), hardBoundaries);
+			if (clusters.size() < 2)
+				return;
+
+			glm::vec3 meshCentroid(0.0f);
+			for (const vkglTF::Vertex& vertex : vertices)
+				meshCentroid += vertex.pos;
+			meshCentroid /= static_cast<float>(vertices.size());
+
+			std::vector<float> sortKeys(clusters.size());
+			for (size_t c = 0; c < clusters.size(); c++) {
+				const size_t start = clusters[c];
+				const size_t end = c + 1 < clusters.size() ? clusters[c + 1] : triangleCount;
+
+				glm::vec3 centroid(0.0f);
+				glm::vec3 normal(0.0f);
+				float area = 0.0f;
+				for (size_t i = start; i < end; i++) {
+					const glm::vec3& p0 = vertices[indices[i * 3 + 0]].pos;
+					const glm::vec3& p1 = vertices[indices[i * 3 + 1]].pos;
+					const glm::vec3& p2 = vertices[indices[i * 3 + 2]].pos;
+
+					// Area weighted, the length of the cross product is twice the area in both sums
+					const glm::vec3 n = glm::cross(p1 - p0, p2 - p0);
+					const float triangleArea = glm::length(n);
+					centroid += (p0 + p1 + p2) * (triangleArea / 3.0f);
+					normal += n;
+					area += triangleArea;
+				}
+
+				if (area > 0.0f)
+					centroid /= area;
+				const float normalLength = glm::length(normal);
+				sortKeys[c] = normalLength > 0.0f ? glm::dot(centroid - meshCentroid, normal) / normalLength : 0.0f;
+			}
+
+			std::vector<uint32_t> order(clusters.size());
+			for (uint32_t c = 0; c < order.size(); c++)
+				order[c] = c;
+			std::stable_sort(order.begin(), order.end(), [&sortKeys](uint32_t a, uint32_t b) { return sortKeys[a] > sortKeys[b]; });
+
+			std::vector<uint32_t> result;
+			result.reserve(indices.size());
+			for (uint32_t c : order) {
+				const size_t start = clusters[c];
+				const size_t end = c + 1 < clusters.size() ? clusters[c + 1] : triangleCount;
+				result.insert(result.end(), indices.begin() + start * 3, indices.begin() + end * 3);
+			}
+			indices.swap(result);
+		}
+
+		// Reorders vertices in the order they are first referenced, so vertex fetches walk through memory linearly
+		void optimizeVertexFetch(std::vector<vkglTF::Vertex>& vertices, std::vector<uint32_t>& indices) {
+			std::vector<uint32_t> remap(vertices.size(), invalidIndex);
+			uint32_t next = 0;
+			for (uint32_t& index : indices) {
+				if (remap[index] == invalidIndex)
+					remap[index] = next++;
+				index = remap[index];
+			}
+
+			// Vertices that are not referenced anymore are dropped
+			std::vector<vkglTF::Vertex> result(next);
+			for (size_t v = 0; v < vertices.size(); v++) {
+				if (remap[v] != invalidIndex)
+					result[remap[v]] = vertices[v];
+			}
+			vertices.swap(result);
+		}
+	}
+
+	vkglTF::VertexCacheStatistics vkglTF::analyzeVertexCache(const uint32_t* indices, size_t indexCount, size_t vertexCount, uint32_t fifoSize) {
+		VertexCacheStatistics statistics{};
+		statistics.vertexCount = vertexCount;
+		statistics.triangleCount = indexCount / 3;
+
+		std::vector<uint32_t> cacheTimestamps(vertexCount, 0);
+		uint32_t timestamp = fifoSize + 1;
+		for (size_t i = 0; i < indexCount; i++) {
+			if (timestamp - cacheTimestamps[indices[i]] > fifoSize) {
+				cacheTimestamps[indices[i]] = timestamp++;
+				statistics.cacheMisses++;
+			}
+		}
+		return statistics;
+	}
+
+	void vkglTF::optimizeVertexCache(std::vector<uint32_t>& indices, size_t vertexCount) {
+		tipsify(indices, vertexCount);
+	}
+
+	void vkglTF::optimizePrimitive(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices) {
+		weldVertices(vertices, indices);
+		removeDegenerateTriangles(indices);
+		if (indices.empty()) _UNLIKELY {
+			vertices.clear();
+			return;
+		}
+
+		tipsify(indices, vertices.size());
+		optimizeOverdraw(indices, vertices);
+		optimizeVertexFetch(vertices, indices);
+	}
+}
@@ -0,0 +1,51 @@
+/*
+* glTF mesh optimization
+*
+* Load time optimization of primitives: exact vertex welding, vertex cache ordering (Tipsify), overdraw ordering
+* and vertex fetch remapping. Based on "Fast Triangle Reordering for Vertex Locality and Reduced Overdraw" (Sander et al. 2007)
+*/
+
+#pragma once
+#include "pch.hpp"
+#include "VulkanglTFModel.hpp"
+
+namespace Voortman3D {
+	namespace vkglTF {
+		/*
+			Post-transform vertex cache statistics of a triangle list
+		*/
+		struct VertexCacheStatistics {
+			size_t vertexCount{};
+			size_t triangleCount{};
+			size_t cacheMisses{};
+
+			// Average cache miss ratio, transformed vertices per triangle (0.5 is the best possible)
+			_NODISCARD float acmr() const noexcept { return triangleCount ? static_cast<float>(cacheMisses) / triangleCount : 0.0f; }
+			// Average transform to vertex ratio, 1.0 means every vertex is transformed exactly once
+			_NODISCARD float atvr() const noexcept { return vertexCount ? static_cast<float>(cacheMisses) / vertexCount : 0.0f; }
+
+			VertexCacheStatistics& operator+=(const VertexCacheStatistics& other) noexcept {
+				vertexCount += other.vertexCount;
+				triangleCount += other.triangleCount;
+				cacheMisses += other.cacheMisses;
+				return *this;
+			}
+		};
+
+		/** @brief Simulates a FIFO post-transform cache of cacheSize entries over a triangle list */
+		_NODISCARD VertexCacheStatistics analyzeVertexCache(const uint32_t* indices, size_t indexCount, size_t vertexCount, uint32_t cacheSize = 16);
+
+		/** @brief Reorders a triangle list for post-transform cache locality, vertices are left untouched */
+		void optimizeVertexCache(std::vector<uint32_t>& indices, size_t vertexCount);
+
+		/**
+		* Optimize a single primitive in place
+		*
+		* @param vertices Vertices of the primitive, duplicates are welded and the rest is reordered in first use order
+		* @param indices Triangle list indexing into vertices, reordered for vertex cache locality and then overdraw
+		*
+		* @note Degenerate triangles are removed, so both vectors can shrink
+		*/
+		void optimizePrimitive(std::vector<Vertex>& vertices, std::vector<uint32_t>& indices);
+	}
+}
@@ -0,0 +1,413 @@
+/*
+* glTF hot reload
+*
+* A worker thread polls the write times of the watched files. A changed file is diffed against what was loaded from it
+* into a patch, which the render thread applies between frames. Only the worker touches the state the diffs compare
+* against, so nothing of the model has to be locked while a file is parsed
+*/
+
+#include "pch.hpp"
+#include "VulkanglTFReload.hpp"
+#include "VulkanUploader.hpp"
+#include "Tools.hpp"
+#include <iostream>
+
+namespace Voortman3D {
+	vkglTF::ModelReloader::ModelReloader(VulkanDevice* device) : device(device) {}
+
+	vkglTF::ModelReloader::~ModelReloader()
+	{
+		stop();
+	}
+
+	bool vkglTF::ModelReloader::watch(Model* model, const std::string& filename, uint32_t fileLoadingFlags, float scale)
+	{
+		stop();
+		if (!(fileLoadingFlags & FileLoadingFlags::HashMeshes) || model->meshHashes.size() != model->meshes.size()) _UNLIKELY
+			return false;
+
+		this->model = model;
+		this->fileLoadingFlags = fileLoadingFlags;
+		this->scale = scale;
+		paged = model->residency != nullptr;
+
+		files.clear();
+		manifest.clear();
+		manifestPath.clear();
+		if (isAssemblyManifest(filename)) {
+			manifestPath = filename;
+			// Parts are shared by their placements, loadAssembly never pre-transforms them either
+			this->fileLoadingFlags &= ~FileLoadingFlags::PreTransformVertices;
+			files.push_back({ filename, none });
+			if (!readAssemblyManifest(filename, manifest)) _UNLIKELY
+				manifest.clear();
+		}
+		for (uint32_t i = 0; i < model->sourceFiles.size(); i++)
+			files.push_back({ model->sourceFiles[i].path, i });
+		for (WatchedFile& file : files) {
+			// A file that is missing now counts as changed once it appears
+			std::error_code error;
+			file.loadedTime = std::filesystem::last_write_time(std::filesystem::u8path(file.path), error);
+			file.seenTime = file.loadedTime;
+		}
+
+		slots.assign(model->meshes.size(), {});
+		for (size_t m = 0; m < model->meshes.size(); m++) {
+			for (const Primitive* primitive : model->meshes[m]->primitives) {
+				PrimitiveSlot slot{};
+				slot.firstIndex = primitive->firstIndex;
+				slot.firstVertex = primitive->firstVertex;
+				slot.vertexCapacity = primitive->vertexCount;
+				slot.indexCapacity = primitive->indexCount;
+				for (const Primitive::LOD& lod : primitive->lods)
+					slot.indexCapacity += lod.indexCount;
+				slot.shortIndices = primitive->shortIndices;
+				slot.poolFirstIndex = primitive->poolFirstIndex;
+				slot.firstMeshlet = primitive->firstMeshlet;
+				slot.meshletCapacity = primitive->meshletCount;
+				slot.material = static_cast<uint32_t>(primitive->material - model->materials.data());
+				slots[m].push_back(slot);
+			}
+		}
+		meshHashes = model->meshHashes;
+		fileMaterials = model->materials;
+		fileMatrices = model->hierarchy.localMatrices;
+		meshletEnd = static_cast<uint32_t>(model->meshlets.size());
+
+		worker = std::thread(&ModelReloader::watchThread, this);
+		return true;
+	}
+
+	void vkglTF::ModelReloader::stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			cancelled = true;
+		}
+		condition.notify_all();
+		// A file that is being parsed finishes first
+		if (worker.joinable())
+			worker.join();
+		cancelled = false;
+		patch.reset();
+		model = nullptr;
+	}
+
+	uint32_t vkglTF::ModelReloader::update()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (!patch)
+			return 0;
+
+		// The worker diffs against the slots the patch was built for, so it waits until the patch is applied
+		const std::unique_ptr<Patch> ready = std::move(patch);
+		if (ready->reloadRequired) {
+			lock.unlock();
+#ifdef _DEBUG
+			for (const std::string& file : ready->files)
+				std::cout << "\"" + file + "\" changed in a way that doesn't fit the loaded model, loading it again" << std::endl;
+#endif
+			stop();
+			return ReloadRequired;
+		}
+
+		apply(*ready);
+		return ready->meshes.empty() ? 0 : GeometryChanged;
+	}
+
+	void vkglTF::ModelReloader::watchThread()
+	{
+		ThreadPool threadPool;
+		threadPool.setThreadCount((std::max)(1u, std::thread::hardware_concurrency()));
+
+		std::unique_lock<std::mutex> lock(mutex);
+		while (!cancelled) {
+			condition.wait_for(lock, pollInterval, [this] { return cancelled.load(); });
+			if (cancelled || patch)
+				continue;
+			lock.unlock();
+
+			std::unique_ptr<Patch> result;
+			const std::vector<uint32_t> changed = pollFiles();
+			if (!changed.empty()) {
+				const auto tStart = std::chrono::high_resolution_clock::now();
+				result = std::make_unique<Patch>();
+				for (uint32_t file : changed) {
+					result->files.push_back(files[file].path);
+					const bool applies = files[file].source == none ? diffManifest(*result) : diffSource(files[file].source, *result, threadPool);
+					if (!applies) {
+						result->reloadRequired = true;
+						break;
+					}
+				}
+				result->diffTime = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - tStart).count();
+				// Saved without changes, or the file failed to read and the model stays as it is
+				if (!result->reloadRequired && result->meshes.empty() && result->transforms.empty() && result->materials.empty())
+					result.reset();
+			}
+
+			lock.lock();
+			patch = std::move(result);
+		}
+	}
+
+	std::vector<uint32_t> vkglTF::ModelReloader::pollFiles()
+	{
+		std::vector<uint32_t> changed;
+		for (uint32_t i = 0; i < files.size(); i++) {
+			WatchedFile& file = files[i];
+			std::error_code error;
+			const std::filesystem::file_time_type time = std::filesystem::last_write_time(std::filesystem::u8path(file.path), error);
+			// Exporters often replace the file, it can be missing for a moment
+			if (error)
+				continue;
+			if (time != file.loadedTime && time == file.seenTime) {
+				file.loadedTime = time;
+				changed.push_back(i);
+			}
+			file.seenTime = time;
+		}
+		return changed;
+	}
+
+	bool vkglTF::ModelReloader::diffManifest(Patch& patch)
+	{
+		std::vector<ManifestNode> nodes;
+		// A manifest that doesn't read keeps the assembly as it is, the reader reports why
+		if (!readAssemblyManifest(manifestPath, nodes)) _UNLIKELY
+			return true;
+
+		// Read only, the manifest nodes of a model never change after loading
+		if (nodes.size() != manifest.size() || nodes.size() != model->manifestNodes.size())
+			return false;
+		for (size_t i = 0; i < nodes.size(); i++) {
+			if (nodes[i].name != manifest[i].name || nodes[i].part != manifest[i].part || nodes[i].parent != manifest[i].parent)
+				return false;
+		}
+
+		for (size_t i = 0; i < nodes.size(); i++) {
+			if (nodes[i].matrix != manifest[i].matrix)
+				patch.transforms.push_back({ model->manifestNodes[i], nodes[i].matrix });
+		}
+		manifest.swap(nodes);
+		return true;
+	}
+
+	bool vkglTF::ModelReloader::diffSource(uint32_t sourceIndex, Patch& patch, ThreadPool& threadPool)
+	{
+		// Read only, like the hierarchy structure and the primitive counts
+		const Model::SourceFile& source = model->sourceFiles[sourceIndex];
+		// Meshes that are shared with another path, or pages of geometry that are not resident, can't be patched in place
+		if (!source.exclusive || paged || source.nodeBases.empty())
+			return false;
+
+		std::vector<unsigned char> data;
+		if (!Tools::readFile(source.path, data)) _UNLIKELY {
+			std::cerr << "Could not open \"" + source.path + "\" to reload it\n";
+			return true;
+		}
+
+		// Processed on its own like a part of an assembly, images stay as they are
+		Model part;
+		part.device = device;
+		part.path = Tools::getDirectory(source.path);
+		std::vector<uint32_t> indexBuffer;
+		std::vector<Vertex> vertexBuffer;
+		const uint32_t flags = fileLoadingFlags | FileLoadingFlags::DontLoadImages | FileLoadingFlags::HashMeshes;
+		if (!part.parseGeometry(source.path, data, flags, scale, indexBuffer, vertexBuffer, threadPool)) _UNLIKELY
+			return true;
+		std::vector<unsigned char>().swap(data);
+		part.processGeometry(flags, indexBuffer, vertexBuffer, threadPool);
+
+		const Model::Hierarchy& hierarchy = model->hierarchy;
+		if (part.meshes.size() != source.meshCount || part.materials.size() != source.materialCount || part.hierarchy.size() != source.nodeCount)
+			return false;
+		const uint32_t base = source.nodeBases[0];
+		for (uint32_t i = 0; i < source.nodeCount; i++) {
+			const uint32_t parent = part.hierarchy.parents[i];
+			const uint32_t mesh = part.hierarchy.meshes[i];
+			const uint32_t loadedParent = hierarchy.parents[base + i];
+			// Roots of a part hang below the manifest node that places it
+			const bool parentMatches = parent == Model::Hierarchy::none ? loadedParent == Model::Hierarchy::none || loadedParent < base : loadedParent == base + parent;
+			const bool meshMatches = mesh == Model::Hierarchy::none ? hierarchy.meshes[base + i] == Model::Hierarchy::none : hierarchy.meshes[base + i] == source.meshBase + mesh;
+			if (!parentMatches || !meshMatches)
+				return false;
+		}
+		for (uint32_t j = 0; j < source.meshCount; j++) {
+			if (part.meshes[j]->primitives.size() != slots[source.meshBase + j].size())
+				return false;
+		}
+
+		std::vector<MeshUpdate> meshUpdates;
+		for (uint32_t j = 0; j < source.meshCount; j++) {
+			const uint32_t mesh = source.meshBase + j;
+			const Mesh* partMesh = part.meshes[j];
+			std::vector<PrimitiveSlot>& meshSlots = slots[mesh];
+
+			bool materialsMatch = true;
+			for (size_t p = 0; p < partMesh->primitives.size(); p++)
+				materialsMatch &= meshSlots[p].material == source.materialBase + static_cast<uint32_t>(partMesh->primitives[p]->material - part.materials.data());
+			if (part.meshHashes[j] == meshHashes[mesh] && materialsMatch)
+				continue;
+
+			MeshUpdate& meshUpdate = meshUpdates.emplace_back();
+			meshUpdate.mesh = mesh;
+			for (uint32_t p = 0; p < partMesh->primitives.size(); p++) {
+				const Primitive* primitive = partMesh->primitives[p];
+				PrimitiveSlot& slot = meshSlots[p];
+
+				uint32_t indexCount = primitive->indexCount;
+				for (const Primitive::LOD& lod : primitive->lods)
+					indexCount += lod.indexCount;
+				// A primitive that grew, or no longer fits 16-bit indices, needs new ranges in the buffers
+				if (primitive->vertexCount > slot.vertexCapacity || indexCount > slot.indexCapacity || (slot.shortIndices && !primitive->shortIndices))
+					return false;
+
+				PrimitiveUpdate& update = meshUpdate.primitives.emplace_back();
+				update.primitive = p;
+				update.indexCount = primitive->indexCount;
+				update.vertexCount = primitive->vertexCount;
+				update.dimensions = primitive->dimensions;
+				update.material = source.materialBase + static_cast<uint32_t>(primitive->material - part.materials.data());
+				update.vertices.assign(vertexBuffer.begin() + primitive->firstVertex, vertexBuffer.begin() + primitive->firstVertex + primitive->vertexCount);
+
+				// Levels follow each other in the pool like layoutIndices placed them, in the index size of the slot
+				const auto packLevel = [&](uint32_t firstIndex, uint32_t count) {
+					for (uint32_t i = firstIndex; i < firstIndex + count; i++) {
+						const uint32_t index = indexBuffer[i] - primitive->firstVertex;
+						if (slot.shortIndices)
+							update.shortIndices.push_back(static_cast<uint16_t>(index));
+						else
+							update.indices.push_back(slot.firstVertex + index);
+					}
+				};
+				packLevel(primitive->firstIndex, primitive->indexCount);
+				uint32_t poolFirstIndex = slot.poolFirstIndex + primitive->indexCount;
+				update.lods = primitive->lods;
+				for (Primitive::LOD& lod : update.lods) {
+					packLevel(lod.firstIndex, lod.indexCount);
+					// The CPU side index buffer is gone after loading, its offsets are only read relative to the full detail level
+					lod.firstIndex = slot.firstIndex + (lod.firstIndex - primitive->firstIndex);
+					lod.poolFirstIndex = poolFirstIndex;
+					poolFirstIndex += lod.indexCount;
+				}
+
+				update.meshlets.assign(part.meshlets.begin() + primitive->firstMeshlet, part.meshlets.begin() + primitive->firstMeshlet + primitive->meshletCount);
+				for (Meshlet& meshlet : update.meshlets)
+					meshlet.firstIndex = slot.firstIndex + (meshlet.firstIndex - primitive->firstIndex);
+				if (primitive->meshletCount > slot.meshletCapacity) {
+					slot.firstMeshlet = meshletEnd;
+					slot.meshletCapacity = primitive->meshletCount;
+					meshletEnd += primitive->meshletCount;
+				}
+				update.firstMeshlet = slot.firstMeshlet;
+				slot.material = update.material;
+			}
+			meshUpdate.bvh = std::move(part.meshBVHs[j]);
+			meshHashes[mesh] = part.meshHashes[j];
+		}
+
+		for (uint32_t k = 0; k < source.materialCount; k++) {
+			const Material& material = part.materials[k];
+			Material& fileMaterial = fileMaterials[source.materialBase + k];
+			if (material.alphaMode == fileMaterial.alphaMode && material.alphaCutoff == fileMaterial.alphaCutoff && material.baseColorFactor == fileMaterial.baseColorFactor)
+				continue;
+			fileMaterial.alphaMode = material.alphaMode;
+			fileMaterial.alphaCutoff = material.alphaCutoff;
+			fileMaterial.baseColorFactor = material.baseColorFactor;
+			patch.materials.push_back({ source.materialBase + k, fileMaterial });
+		}
+
+		for (uint32_t i = 0; i < source.nodeCount; i++) {
+			const glm::mat4& matrix = part.hierarchy.localMatrices[i];
+			if (matrix == fileMatrices[base + i])
+				continue;
+			for (uint32_t placement : source.nodeBases) {
+				fileMatrices[placement + i] = matrix;
+				patch.transforms.push_back({ placement + i, matrix });
+			}
+		}
+
+		patch.meshes.insert(patch.meshes.end(), std::make_move_iterator(meshUpdates.begin()), std::make_move_iterator(meshUpdates.end()));
+		return true;
+	}
+
+	void vkglTF::ModelReloader::apply(Patch& patch)
+	{
+#ifdef _DEBUG
+		const auto tStart = std::chrono::high_resolution_clock::now();
+#endif
+
+		VulkanUploader* uploader = device->uploader;
+		std::vector<uint8_t> changedMeshes(model->meshes.size());
+		VkDeviceSize uploadedBytes = 0;
+		for (MeshUpdate& meshUpdate : patch.meshes) {
+			Mesh* mesh = model->meshes[meshUpdate.mesh];
+			for (PrimitiveUpdate& update : meshUpdate.primitives) {
+				Primitive* primitive = mesh->primitives[update.primitive];
+				// No frame is in flight here, the copies finish before the next frame reads the ranges
+				const VkDeviceSize vertexBytes = update.vertices.size() * sizeof(Vertex);
+				uploader->uploadBuffer(update.vertices.data(), vertexBytes, model->vertices.buffer, primitive->firstVertex * sizeof(Vertex));
+				if (primitive->shortIndices) {
+					const VkDeviceSize indexBytes = update.shortIndices.size() * sizeof(uint16_t);
+					uploader->uploadBuffer(update.shortIndices.data(), indexBytes, model->shortIndices.buffer, primitive->poolFirstIndex * sizeof(uint16_t));
+					uploadedBytes += indexBytes;
+				}
+				else {
+					const VkDeviceSize indexBytes = update.indices.size() * sizeof(uint32_t);
+					uploader->uploadBuffer(update.indices.data(), indexBytes, model->indices.buffer, primitive->poolFirstIndex * sizeof(uint32_t));
+					uploadedBytes += indexBytes;
+				}
+				uploadedBytes += vertexBytes;
+
+				primitive->indexCount = update.indexCount;
+				primitive->vertexCount = update.vertexCount;
+				primitive->dimensions = update.dimensions;
+				primitive->lods = std::move(update.lods);
+				primitive->lod = 0;
+				primitive->firstMeshlet = update.firstMeshlet;
+				primitive->meshletCount = static_cast<uint32_t>(update.meshlets.size());
+				if (model->meshlets.size() < update.firstMeshlet + update.meshlets.size())
+					model->meshlets.resize(update.firstMeshlet + update.meshlets.size());
+				std::copy(update.meshlets.begin(), update.meshlets.end(), model->meshlets.begin() + update.firstMeshlet);
+				primitive->material = &model->materials[update.material];
+			}
+			model->meshBVHs[meshUpdate.mesh] = std::move(meshUpdate.bvh);
+			changedMeshes[meshUpdate.mesh] = 1;
+		}
+
+		if (!patch.meshes.empty()) {
+			uploader->submit();
+			// The nodes drawing a changed mesh didn't move, only the boxes of their primitives changed
+			const Model::Hierarchy& hierarchy = model->hierarchy;
+			for (uint32_t i = 0; i < hierarchy.size(); i++) {
+				if (hierarchy.meshes[i] != Model::Hierarchy::none && changedMeshes[hierarchy.meshes[i]])
+					model->bvh.invalidate(*model, i, i + 1);
+			}
+			model->bvh.refit();
+		}
+
+		// World matrices and the boxes follow with the next Model::updateDirtyWorldMatrices
+		for (const auto& [node, matrix] : patch.transforms)
+			model->hierarchy.editLocalMatrix(node) = matrix;
+
+		for (const auto& [index, fileMaterial] : patch.materials) {
+			Material& material = model->materials[index];
+			material.alphaMode = fileMaterial.alphaMode;
+			material.alphaCutoff = fileMaterial.alphaCutoff;
+			material.baseColorFactor = fileMaterial.baseColorFactor;
+			model->updateMaterial(index);
+		}
+		model->getSceneDimensions();
+
+#ifdef _DEBUG
+		const auto tApplied = std::chrono::high_resolution_clock::now();
+		std::cout << "Reloaded";
+		for (const std::string& file : patch.files)
+			std::cout << " \"" + file + "\"";
+		std::cout << ": " << patch.meshes.size() << " meshes (" << uploadedBytes / 1024 << " KB), " << patch.transforms.size() << " transforms and "
+			<< patch.materials.size() << " materials, diffed in " << patch.diffTime << " ms and applied in "
+			<< std::chrono::duration<double, std::milli>(tApplied - tStart).count() << " ms" << std::endl;
+#endif
+	}
+}
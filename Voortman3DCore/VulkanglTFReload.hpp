@@ -0,0 +1,148 @@
+/*
+* glTF hot reload
+*
+* Watches the file of a model, or the manifest and every part of an assembly, and applies changes to the model that is
+* on screen instead of loading it again. A changed part is parsed and processed on its own in the background and its
+* meshes are compared by content hash with the ones that were loaded, only the meshes that differ are uploaded again
+* into the ranges they already occupy. Node transforms and material parameters that changed are written in place as well.
+*
+* Changes that don't fit the current buffers, like a mesh that grew or a part with a different node structure, ask for a
+* full reload of the file instead
+*/
+
+#pragma once
+#include "pch.hpp"
+#include "VulkanglTFModel.hpp"
+#include "VulkanglTFAssembly.hpp"
+#include <atomic>
+#include <filesystem>
+
+namespace Voortman3D {
+	namespace vkglTF {
+		class ModelReloader {
+		public:
+			enum UpdateFlags {
+				// Geometry changed in place, draws sized by meshlet counts have to be prepared again. Transforms and materials apply on their own
+				GeometryChanged = 0x00000001,
+				// The change doesn't fit the loaded model, the file has to be loaded again and watching stops until then
+				ReloadRequired = 0x00000002
+			};
+
+			explicit ModelReloader(VulkanDevice* device);
+			~ModelReloader();
+
+			/**
+			* Start watching the files a model was loaded from, stops watching the previous model
+			*
+			* @param filename The glTF file or assembly manifest that was loaded
+			* @param fileLoadingFlags Flags the model was loaded with, changed parts are processed with the same ones
+			*
+			* @return False when the model was loaded without FileLoadingFlags::HashMeshes, nothing is watched then
+			*/
+			bool watch(Model* model, const std::string& filename, uint32_t fileLoadingFlags, float scale = 1.0f);
+
+			/** @brief Stop watching, has to happen before the watched model is deleted */
+			void stop();
+
+			/**
+			* Apply the changes found since the last call, call once per frame from the render thread while no frame uses the model
+			*
+			* @return UpdateFlags of what changed
+			*
+			* @note The model must not be uploading anymore, a ModelLoader writes into the same buffers
+			*/
+			_NODISCARD uint32_t update();
+
+		private:
+			/** @brief Range a primitive was given at load, changed geometry has to fit into it */
+			struct PrimitiveSlot {
+				uint32_t firstIndex;
+				uint32_t firstVertex;
+				uint32_t vertexCapacity;
+				// Full detail level and all of its LODs
+				uint32_t indexCapacity;
+				bool shortIndices;
+				uint32_t poolFirstIndex;
+				uint32_t firstMeshlet;
+				uint32_t meshletCapacity;
+				uint32_t material;
+			};
+
+			/** @brief New contents of a primitive, already rebased to its slot */
+			struct PrimitiveUpdate {
+				uint32_t primitive;
+				uint32_t indexCount;
+				uint32_t vertexCount;
+				Primitive::Dimensions dimensions;
+				std::vector<Primitive::LOD> lods;
+				uint32_t firstMeshlet;
+				std::vector<Meshlet> meshlets;
+				uint32_t material;
+				std::vector<Vertex> vertices;
+				// All levels in the index size of the slot
+				std::vector<uint32_t> indices;
+				std::vector<uint16_t> shortIndices;
+			};
+
+			struct MeshUpdate {
+				uint32_t mesh;
+				std::vector<PrimitiveUpdate> primitives;
+				MeshBVH bvh;
+			};
+
+			/** @brief Everything the worker found in one round of changed files, applied at once by update */
+			struct Patch {
+				bool reloadRequired{ false };
+				std::vector<std::string> files;
+				std::vector<MeshUpdate> meshes;
+				std::vector<std::pair<uint32_t, glm::mat4>> transforms;
+				std::vector<std::pair<uint32_t, Material>> materials;
+				double diffTime{ 0.0 };
+			};
+
+			struct WatchedFile {
+				std::string path;
+				// Index into Model::sourceFiles, none for the manifest
+				uint32_t source;
+				std::filesystem::file_time_type loadedTime;
+				// Seen on the last poll, a file counts as changed once its time stops moving so half written files are skipped
+				std::filesystem::file_time_type seenTime;
+			};
+
+			static constexpr uint32_t none = UINT32_MAX;
+			static constexpr std::chrono::milliseconds pollInterval{ 250 };
+
+			VulkanDevice* device;
+			Model* model{ nullptr };
+			std::string manifestPath;
+			uint32_t fileLoadingFlags{ FileLoadingFlags::None };
+			float scale{ 1.0f };
+			bool paged{ false };
+
+			// Only touched by the worker, and by update while the worker waits for it to take the patch
+			std::vector<WatchedFile> files;
+			std::vector<ManifestNode> manifest;
+			std::vector<std::vector<PrimitiveSlot>> slots;
+			std::vector<uint64_t> meshHashes;
+			// As they are in the files, the viewer may edit the ones of the model
+			std::vector<Material> fileMaterials;
+			std::vector<glm::mat4> fileMatrices;
+			uint32_t meshletEnd{ 0 };
+
+			std::thread worker;
+			std::atomic<bool> cancelled{ false };
+			std::mutex mutex;
+			std::condition_variable condition;
+			std::unique_ptr<Patch> patch;
+
+			void watchThread();
+			/** @brief Files whose write time changed and stayed the same since the previous poll */
+			_NODISCARD std::vector<uint32_t> pollFiles();
+			/** @brief Adds the changed transforms of the manifest to the patch, false when its nodes changed otherwise */
+			_NODISCARD bool diffManifest(Patch& patch);
+			/** @brief Parses the source file again and adds what changed to the patch, false when that doesn't fit the model */
+			_NODISCARD bool diffSource(uint32_t sourceIndex, Patch& patch, ThreadPool& threadPool);
+			void apply(Patch& patch);
+		};
+	}
+}
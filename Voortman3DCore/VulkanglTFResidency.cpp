@@ -0,0 +1,491 @@
+/*
+* glTF geometry residency
+*
+* Models whose geometry does not fit the memory budget keep it in a memory mapped cache file and page meshes into fixed
+* size vertex and index pools on demand. The renderer requests the meshes it sees with their size on screen, the largest
+* ones are uploaded first and the least recently used ones make room for them. A mesh that is not resident is drawn as
+* the bounding boxes of its primitives, which always stay resident
+*/
+
+#include "pch.hpp"
+#include "VulkanglTFResidency.hpp"
+#include "Tools.hpp"
+#include <filesystem>
+#include <iostream>
+
+namespace Voortman3D {
+	namespace {
+		// Corners of every face of the unit box and the normal of the face, in the winding of the model pipeline
+		constexpr glm::vec3 proxyNormals[6] = {
+			{ 1.0f, 0.0f, 0.0f }, { -1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, { 0.0f, -1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f }, { 0.0f, 0.0f, -1.0f }
+		};
+		constexpr glm::vec3 proxyCorners[6][4] = {
+			{ { 1, 0, 0 }, { 1, 1, 0 }, { 1, 1, 1 }, { 1, 0, 1 } },
+			{ { 0, 0, 0 }, { 0, 0, 1 }, { 0, 1, 1 }, { 0, 1, 0 } },
+			{ { 0, 1, 0 }, { 0, 1, 1 }, { 1, 1, 1 }, { 1, 1, 0 } },
+			{ { 0, 0, 0 }, { 1, 0, 0 }, { 1, 0, 1 }, { 0, 0, 1 } },
+			{ { 0, 0, 1 }, { 1, 0, 1 }, { 1, 1, 1 }, { 0, 1, 1 } },
+			{ { 0, 0, 0 }, { 0, 1, 0 }, { 1, 1, 0 }, { 1, 0, 0 } }
+		};
+
+		void appendProxy(const vkglTF::Primitive& primitive, std::vector<vkglTF::Vertex>& vertices, std::vector<uint32_t>& indices) {
+			// Primitives without vertices never got bounds, their box collapses to a point
+			const bool empty = primitive.dimensions.min.x > primitive.dimensions.max.x;
+			const glm::vec3 min = empty ? glm::vec3(0.0f) : primitive.dimensions.min;
+			const glm::vec3 size = empty ? glm::vec3(0.0f) : primitive.dimensions.max - primitive.dimensions.min;
+
+			for (uint32_t face = 0; face < 6; face++) {
+				const uint32_t first = face * 4;
+				for (uint32_t corner = 0; corner < 4; corner++)
+					vertices.push_back({ min + proxyCorners[face][corner] * size, proxyNormals[face], glm::vec2(0.0f) });
+				for (const uint32_t index : { 0u, 1u, 2u, 0u, 2u, 3u })
+					indices.push_back(first + index);
+			}
+		}
+	}
+
+	vkglTF::GeometryCache::~GeometryCache() {
+		if (mapped)
+			UnmapViewOfFile(mapped);
+		if (mapping)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+	}
+
+	bool vkglTF::GeometryCache::create(VkDeviceSize size) {
+		static std::atomic<uint32_t> fileCount{ 0 };
+
+		std::error_code error;
+		const std::filesystem::path directory = std::filesystem::temp_directory_path(error);
+		if (error) _UNLIKELY {
+			std::cerr << "Could not find the temporary directory for the geometry cache : " << error.message() << std::endl;
+			return false;
+		}
+
+		// Deleted by the OS once the handle is closed, also when the application does not get to close it
+		const std::filesystem::path path = directory / ("Voortman3D-" + std::to_string(GetCurrentProcessId()) + "-" + std::to_string(fileCount++) + ".geometry");
+		file = CreateFileW(path.wstring().c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+		if (file == INVALID_HANDLE_VALUE) _UNLIKELY {
+			std::cerr << "Could not create the geometry cache " << path.string() << " : error " << GetLastError() << std::endl;
+			return false;
+		}
+
+		// Mapping a range larger than the file grows it
+		mapping = CreateFileMappingW(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(size >> 32), static_cast<DWORD>(size & 0xFFFFFFFF), nullptr);
+		if (!mapping) _UNLIKELY {
+			std::cerr << "Could not map " << size << " bytes of geometry cache : error " << GetLastError() << std::endl;
+			return false;
+		}
+		mapped = static_cast<uint8_t*>(MapViewOfFile(mapping, FILE_MAP_READ | FILE_MAP_WRITE, 0, 0, 0));
+		if (!mapped) _UNLIKELY {
+			std::cerr << "Could not map " << size << " bytes of geometry cache : error " << GetLastError() << std::endl;
+			return false;
+		}
+		mappedSize = size;
+		return true;
+	}
+
+	vkglTF::PageAllocator::PageAllocator(uint32_t pageCount) : freePageCount(pageCount) {
+		if (pageCount > 0)
+			freeRuns.emplace(0, pageCount);
+	}
+
+	bool vkglTF::PageAllocator::allocate(uint32_t count, uint32_t& first) {
+		if (count == 0) {
+			first = 0;
+			return true;
+		}
+		for (auto run = freeRuns.begin(); run != freeRuns.end(); ++run) {
+			if (run->second < count)
+				continue;
+
+			first = run->first;
+			const uint32_t remaining = run->second - count;
+			freeRuns.erase(run);
+			if (remaining > 0)
+				freeRuns.emplace(first + count, remaining);
+			freePageCount -= count;
+			return true;
+		}
+		return false;
+	}
+
+	void vkglTF::PageAllocator::free(uint32_t first, uint32_t count) {
+		if (count == 0)
+			return;
+		freePageCount += count;
+
+		auto run = freeRuns.emplace(first, count).first;
+		auto next = std::next(run);
+		if (next != freeRuns.end() && run->first + run->second == next->first) {
+			run->second += next->second;
+			freeRuns.erase(next);
+		}
+		if (run != freeRuns.begin()) {
+			auto previous = std::prev(run);
+			if (previous->first + previous->second == run->first) {
+				previous->second += run->second;
+				freeRuns.erase(run);
+			}
+		}
+	}
+
+	vkglTF::GeometryResidency::GeometryResidency(Model* model) : model(model), device(model->device) {}
+
+	vkglTF::GeometryResidency::~GeometryResidency() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			cancelled = true;
+		}
+		condition.notify_all();
+		if (worker.joinable())
+			worker.join();
+
+		// Staged but never submitted
+		for (Upload& upload : staged)
+			freeUpload(upload);
+
+		// The pools are destroyed right after this, so copies into them have to be done
+		if (!inFlight.empty()) {
+			const VkSemaphore semaphore = device->uploader->getSemaphore();
+			VkSemaphoreWaitInfo waitInfo{};
+			waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+			waitInfo.semaphoreCount = 1;
+			waitInfo.pSemaphores = &semaphore;
+			waitInfo.pValues = &inFlight.back().uploadValue;
+			VK_CHECK_RESULT(vkWaitSemaphores(device->logicalDevice, &waitInfo, UINT64_MAX));
+		}
+	}
+
+	VkDeviceSize vkglTF::GeometryResidency::defaultBudget(const VulkanDevice* device) noexcept {
+		VkDeviceSize heapSize = 0;
+		for (uint32_t i = 0; i < device->memoryProperties.memoryHeapCount; i++) {
+			if (device->memoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT)
+				heapSize = (std::max)(heapSize, device->memoryProperties.memoryHeaps[i].size);
+		}
+		return heapSize / 2;
+	}
+
+	bool vkglTF::GeometryResidency::build(const std::vector<uint32_t>& indexBuffer, const std::vector<Vertex>& vertexBuffer, VkDeviceSize budget, std::vector<Vertex>& proxyVertices, std::vector<uint32_t>& proxyIndices) {
+#ifdef _DEBUG
+		const auto start = std::chrono::high_resolution_clock::now();
+#endif
+
+		// Pages follow the order of the meshes, every page holds the vertices of its primitives followed by all of their levels
+		meshPages.resize(model->meshes.size());
+		VkDeviceSize totalVertexBytes = 0, totalIndexBytes = 0;
+		VkDeviceSize largestVertexBytes = 0, largestIndexBytes = 0;
+		for (size_t m = 0; m < model->meshes.size(); m++) {
+			MeshPage& page = meshPages[m];
+			page.cacheOffset = totalVertexBytes + totalIndexBytes;
+			page.firstPrimitive = static_cast<uint32_t>(primitivePages.size());
+
+			uint32_t vertexCount = 0, indexCount = 0;
+			for (const Primitive* primitive : model->meshes[m]->primitives) {
+				primitivePages.push_back({ vertexCount, primitive->firstVertex, 0 });
+				vertexCount += primitive->vertexCount;
+			}
+			for (size_t p = 0; p < model->meshes[m]->primitives.size(); p++) {
+				const Primitive* primitive = model->meshes[m]->primitives[p];
+				primitivePages[page.firstPrimitive + p].firstLevel = static_cast<uint32_t>(levelOffsets.size());
+				levelOffsets.push_back(indexCount);
+				indexCount += primitive->indexCount;
+				for (const Primitive::LOD& lod : primitive->lods) {
+					levelOffsets.push_back(indexCount);
+					indexCount += lod.indexCount;
+				}
+			}
+
+			page.vertexBytes = vertexCount * sizeof(Vertex);
+			page.indexBytes = indexCount * sizeof(uint32_t);
+			totalVertexBytes += page.vertexBytes;
+			totalIndexBytes += page.indexBytes;
+			largestVertexBytes = (std::max)(largestVertexBytes, page.vertexBytes);
+			largestIndexBytes = (std::max)(largestIndexBytes, page.indexBytes);
+
+			// Nothing to page in
+			if (page.vertexBytes == 0 && page.indexBytes == 0)
+				page.state = PageState::Resident;
+		}
+
+		cachedBytes = totalVertexBytes + totalIndexBytes;
+		if (cachedBytes == 0 || !cache.create(cachedBytes)) _UNLIKELY
+			return false;
+
+		// Written once, afterwards the pages are only read by the worker
+		for (size_t m = 0; m < model->meshes.size(); m++) {
+			const MeshPage& page = meshPages[m];
+			Vertex* vertices = reinterpret_cast<Vertex*>(cache.data() + page.cacheOffset);
+			uint32_t* indices = reinterpret_cast<uint32_t*>(cache.data() + page.cacheOffset + page.vertexBytes);
+			for (const Primitive* primitive : model->meshes[m]->primitives) {
+				memcpy(vertices, vertexBuffer.data() + primitive->firstVertex, primitive->vertexCount * sizeof(Vertex));
+				vertices += primitive->vertexCount;
+			}
+			for (const Primitive* primitive : model->meshes[m]->primitives) {
+				memcpy(indices, indexBuffer.data() + primitive->firstIndex, primitive->indexCount * sizeof(uint32_t));
+				indices += primitive->indexCount;
+				for (const Primitive::LOD& lod : primitive->lods) {
+					memcpy(indices, indexBuffer.data() + lod.firstIndex, lod.indexCount * sizeof(uint32_t));
+					indices += lod.indexCount;
+				}
+			}
+		}
+
+		// One box per primitive in the order of primitivePages, so a proxy is found by the position of its primitive
+		proxyVertices.clear();
+		proxyIndices.clear();
+		proxyVertices.reserve(primitivePages.size() * proxyVertexCount);
+		proxyIndices.reserve(primitivePages.size() * proxyIndexCount);
+		for (const Mesh* mesh : model->meshes) {
+			for (const Primitive* primitive : mesh->primitives)
+				appendProxy(*primitive, proxyVertices, proxyIndices);
+		}
+		proxyVertexPages = pageCount(proxyVertices.size() * sizeof(Vertex));
+		proxyIndexPages = pageCount(proxyIndices.size() * sizeof(uint32_t));
+
+		// The budget is split like the geometry is, and every pool holds at least its largest mesh so every mesh can be shown
+		const double vertexShare = static_cast<double>(totalVertexBytes) / static_cast<double>(cachedBytes);
+		const uint32_t vertexBudgetPages = (std::max)(pageCount(static_cast<VkDeviceSize>(budget * vertexShare)), pageCount(largestVertexBytes));
+		const uint32_t indexBudgetPages = (std::max)(pageCount(static_cast<VkDeviceSize>(budget * (1.0 - vertexShare))), pageCount(largestIndexBytes));
+		const uint32_t vertexPoolPages = proxyVertexPages + vertexBudgetPages;
+		const uint32_t indexPoolPages = proxyIndexPages + indexBudgetPages;
+
+		vertexPages = std::make_unique<PageAllocator>(vertexPoolPages);
+		indexPages = std::make_unique<PageAllocator>(indexPoolPages);
+		uint32_t first;
+		if (!vertexPages->allocate(proxyVertexPages, first) || !indexPages->allocate(proxyIndexPages, first)) _UNLIKELY
+			return false;
+
+		// createBuffers sizes the buffers of the model by these, which become the pools
+		model->vertices.count = static_cast<int>(vertexPoolPages * (pageSize / sizeof(Vertex)));
+		model->indices.count = static_cast<int>(indexPoolPages * (pageSize / sizeof(uint32_t)));
+		// Pages are copied as they are in the cache, so every primitive keeps its 32-bit indices
+		model->shortIndices.count = 0;
+		for (Mesh* mesh : model->meshes) {
+			for (Primitive* primitive : mesh->primitives)
+				primitive->shortIndices = false;
+		}
+
+		worker = std::thread(&GeometryResidency::workerThread, this);
+
+#ifdef _DEBUG
+		const double megabyte = 1024.0 * 1024.0;
+		std::cout << "Paging " << cachedBytes / megabyte << " MB of geometry through " << (vertexBudgetPages + indexBudgetPages) * pageSize / megabyte
+			<< " MB of pools, " << primitivePages.size() << " boxes take " << (proxyVertexPages + proxyIndexPages) * pageSize / megabyte << " MB, cache written in "
+			<< std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count() << " ms" << std::endl;
+#endif
+		return true;
+	}
+
+	void vkglTF::GeometryResidency::request(uint32_t mesh, float priority) {
+		MeshPage& page = meshPages[mesh];
+		if (page.lastUsed != frame) {
+			page.lastUsed = frame;
+			page.priority = priority;
+			if (page.state == PageState::Absent)
+				requests.push_back(mesh);
+		}
+		else {
+			page.priority = (std::max)(page.priority, priority);
+		}
+
+		// Meshes without geometry are resident from the start and never in the list
+		if (page.state == PageState::Resident && page.vertexBytes + page.indexBytes > 0)
+			lru.splice(lru.begin(), lru, page.lruEntry);
+	}
+
+	void vkglTF::GeometryResidency::update() {
+		VulkanUploader* uploader = device->uploader;
+
+		// Uploads complete in submission order
+		while (!inFlight.empty() && uploader->isComplete(inFlight.front().uploadValue)) {
+			const Upload& upload = inFlight.front();
+			if (upload.last) {
+				// Completion is seen by the CPU, the frames still have to wait on the semaphore once to see the data
+				uploader->waitOnGraphics(upload.uploadValue);
+				MeshPage& page = meshPages[upload.mesh];
+				page.state = PageState::Resident;
+				lru.push_front(upload.mesh);
+				page.lruEntry = lru.begin();
+				residentBytes += page.vertexBytes + page.indexBytes;
+				loadingCount--;
+			}
+			inFlight.pop_front();
+		}
+
+		// The meshes that cover the most pixels first, what does not fit in this frame is requested again next frame
+		std::sort(requests.begin(), requests.end(), [this](uint32_t a, uint32_t b) { return meshPages[a].priority > meshPages[b].priority; });
+		VkDeviceSize scheduledBytes = 0;
+		std::vector<Job> newJobs;
+		for (const uint32_t mesh : requests) {
+			if (scheduledBytes >= uploadBudget)
+				break;
+			MeshPage& page = meshPages[mesh];
+			if (page.state != PageState::Absent || !allocatePages(page))
+				continue;
+
+			page.state = PageState::Loading;
+			loadingCount++;
+			scheduledBytes += page.vertexBytes + page.indexBytes;
+			newJobs.push_back({ mesh, cache.data() + page.cacheOffset, page.vertexBytes, page.indexBytes, page.firstVertexPage * pageSize, page.firstIndexPage * pageSize });
+		}
+		requests.clear();
+
+		if (!newJobs.empty()) {
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				jobs.insert(jobs.end(), newJobs.begin(), newJobs.end());
+			}
+			condition.notify_one();
+		}
+
+		std::deque<Upload> uploads;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			uploads.swap(staged);
+		}
+		if (!uploads.empty()) {
+			// Everything the worker staged goes out in one submit, frames don't wait for it as the meshes are drawn as boxes until it completes
+			const VkBuffer stagingBuffer = uploader->getStagingBuffer();
+			for (Upload& upload : uploads) {
+				uploader->copyBuffer(stagingBuffer, model->vertices.buffer, static_cast<uint32_t>(upload.vertexRegions.size()), upload.vertexRegions.data());
+				uploader->copyBuffer(stagingBuffer, model->indices.buffer, static_cast<uint32_t>(upload.indexRegions.size()), upload.indexRegions.data());
+				for (const StagingAllocation& allocation : upload.allocations)
+					uploader->releaseStaging(allocation);
+				upload.allocations.clear();
+			}
+			const uint64_t uploadValue = uploader->submit(false);
+			for (Upload& upload : uploads) {
+				upload.uploadValue = uploadValue;
+				inFlight.push_back(std::move(upload));
+			}
+		}
+
+		frame++;
+	}
+
+	vkglTF::GeometryResidency::DrawRange vkglTF::GeometryResidency::primitiveRange(uint32_t mesh, uint32_t primitive, uint32_t lod) const noexcept {
+		const MeshPage& page = meshPages[mesh];
+		const PrimitivePage& primitivePage = primitivePages[page.firstPrimitive + primitive];
+
+		// The indices still count from the first vertex of the primitive in the model, the vertex offset moves them to its page
+		const uint32_t firstIndex = static_cast<uint32_t>(page.firstIndexPage * (pageSize / sizeof(uint32_t))) + levelOffsets[primitivePage.firstLevel + lod];
+		const int64_t firstVertex = static_cast<int64_t>(page.firstVertexPage * (pageSize / sizeof(Vertex))) + primitivePage.vertexOffset;
+		return { firstIndex, static_cast<int32_t>(firstVertex - primitivePage.firstVertex) };
+	}
+
+	vkglTF::GeometryResidency::DrawRange vkglTF::GeometryResidency::proxyRange(uint32_t mesh, uint32_t primitive) const noexcept {
+		const uint32_t proxy = meshPages[mesh].firstPrimitive + primitive;
+		return { proxy * proxyIndexCount, static_cast<int32_t>(proxy * proxyVertexCount) };
+	}
+
+	bool vkglTF::GeometryResidency::allocatePages(MeshPage& page) {
+		const uint32_t vertexCount = pageCount(page.vertexBytes);
+		const uint32_t indexCount = pageCount(page.indexBytes);
+
+		for (;;) {
+			uint32_t firstVertexPage, firstIndexPage;
+			if (vertexPages->allocate(vertexCount, firstVertexPage)) {
+				if (indexPages->allocate(indexCount, firstIndexPage)) {
+					page.firstVertexPage = firstVertexPage;
+					page.firstIndexPage = firstIndexPage;
+					return true;
+				}
+				vertexPages->free(firstVertexPage, vertexCount);
+			}
+
+			// Least recently used first, meshes that are drawn this frame stay
+			if (lru.empty() || meshPages[lru.back()].lastUsed == frame)
+				return false;
+			evict(lru.back());
+		}
+	}
+
+	void vkglTF::GeometryResidency::evict(uint32_t mesh) {
+		// Frames are waited on before the next one is recorded, so nothing reads the pages anymore
+		MeshPage& page = meshPages[mesh];
+		vertexPages->free(page.firstVertexPage, pageCount(page.vertexBytes));
+		indexPages->free(page.firstIndexPage, pageCount(page.indexBytes));
+		lru.erase(page.lruEntry);
+		page.lruEntry = {};
+		page.state = PageState::Absent;
+		residentBytes -= page.vertexBytes + page.indexBytes;
+	}
+
+	void vkglTF::GeometryResidency::workerThread() {
+		for (;;) {
+			Job job;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				condition.wait(lock, [this] { return cancelled || !jobs.empty(); });
+				if (cancelled)
+					return;
+				job = jobs.front();
+				jobs.pop_front();
+			}
+
+			// Reading the mapping is where the cache is paged in from disk, which is why this runs here and not on the render thread
+			Upload upload;
+			upload.mesh = job.mesh;
+			VkDeviceSize remaining = job.vertexBytes + job.indexBytes;
+			if (!stage(upload, job.source, job.vertexOffset, job.vertexBytes, upload.vertexRegions, remaining) ||
+				!stage(upload, job.source + job.vertexBytes, job.indexOffset, job.indexBytes, upload.indexRegions, remaining)) _UNLIKELY {
+				freeUpload(upload);
+				return;
+			}
+			upload.last = true;
+			queueUpload(upload);
+		}
+	}
+
+	bool vkglTF::GeometryResidency::stage(Upload& upload, const uint8_t* data, VkDeviceSize dstOffset, VkDeviceSize size, std::vector<VkBufferCopy>& regions, VkDeviceSize& remaining) {
+		VulkanUploader* uploader = device->uploader;
+
+		while (size > 0) {
+			if (upload.allocations.empty() || upload.allocationUsed == upload.allocations.back().size) {
+				// Only what is left of the page, so small meshes don't take a whole chunk of the ring each
+				StagingAllocation allocation;
+				const VkDeviceSize allocationSize = (std::min)(uploader->getStagingChunkSize(), (remaining + StagingRing::alignment - 1) & ~(StagingRing::alignment - 1));
+				while (!uploader->tryAllocateStaging(allocationSize, allocation)) {
+					// The ring is full, hand over what is staged so far so its ranges come back once it has been uploaded
+					if (!upload.allocations.empty())
+						queueUpload(upload);
+					uploader->waitForStaging(stagingWaitTimeout);
+					if (cancelled)
+						return false;
+				}
+				upload.allocations.push_back(allocation);
+				upload.allocationUsed = 0;
+			}
+
+			const StagingAllocation& allocation = upload.allocations.back();
+			const VkDeviceSize copySize = (std::min)(size, allocation.size - upload.allocationUsed);
+			memcpy(allocation.mapped + upload.allocationUsed, data, copySize);
+			regions.push_back({ allocation.offset + upload.allocationUsed, dstOffset, copySize });
+
+			upload.allocationUsed += copySize;
+			remaining -= copySize;
+			data += copySize;
+			dstOffset += copySize;
+			size -= copySize;
+		}
+		return true;
+	}
+
+	void vkglTF::GeometryResidency::queueUpload(Upload& upload) {
+		const uint32_t mesh = upload.mesh;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			staged.push_back(std::move(upload));
+		}
+		upload = Upload();
+		upload.mesh = mesh;
+	}
+
+	void vkglTF::GeometryResidency::freeUpload(Upload& upload) {
+		for (const StagingAllocation& allocation : upload.allocations)
+			device->uploader->freeStaging(allocation);
+		upload = Upload();
+	}
+}
@@ -0,0 +1,210 @@
+/*
+* glTF geometry residency
+*
+* Models whose geometry does not fit the memory budget keep it in a memory mapped cache file and page meshes into fixed
+* size vertex and index pools on demand. The renderer requests the meshes it sees with their size on screen, the largest
+* ones are uploaded first and the least recently used ones make room for them. A mesh that is not resident is drawn as
+* the bounding boxes of its primitives, which always stay resident
+*/
+
+#pragma once
+#include "pch.hpp"
+#include "VulkanglTFModel.hpp"
+#include "VulkanUploader.hpp"
+#include <atomic>
+#include <deque>
+#include <list>
+#include <map>
+
+namespace Voortman3D {
+	namespace vkglTF {
+		/*
+			Temporary file mapped into memory, the OS pages it in and out so the CPU side never holds the whole model either
+		*/
+		class GeometryCache {
+		public:
+			GeometryCache() = default;
+			GeometryCache(const GeometryCache&) = delete;
+			GeometryCache& operator=(const GeometryCache&) = delete;
+			/** @brief Unmaps and closes the file, which deletes it */
+			~GeometryCache();
+
+			/** @brief Create and map a file of size bytes in the temporary directory, errors are reported on std::cerr */
+			_NODISCARD bool create(VkDeviceSize size);
+
+			_NODISCARD uint8_t* data() const noexcept { return mapped; }
+			_NODISCARD VkDeviceSize size() const noexcept { return mappedSize; }
+
+		private:
+			HANDLE file{ INVALID_HANDLE_VALUE };
+			HANDLE mapping{ nullptr };
+			uint8_t* mapped{ nullptr };
+			VkDeviceSize mappedSize{ 0 };
+		};
+
+		/*
+			Runs of fixed size pages, first fit with neighbouring free runs merged again
+		*/
+		class PageAllocator {
+		public:
+			explicit PageAllocator(uint32_t pageCount);
+
+			_NODISCARD bool allocate(uint32_t count, uint32_t& first);
+			void free(uint32_t first, uint32_t count);
+
+			_NODISCARD uint32_t getFreePageCount() const noexcept { return freePageCount; }
+
+		private:
+			// First page of every free run with its length
+			std::map<uint32_t, uint32_t> freeRuns;
+			uint32_t freePageCount;
+		};
+
+		class GeometryResidency {
+		public:
+			// Granularity of both pools, small enough that the many tiny parts of a machine don't waste most of their pages
+			static constexpr VkDeviceSize pageSize = 4096;
+			// Vertex pages are addressed in whole vertices, so none may straddle two pages
+			static_assert(pageSize % sizeof(Vertex) == 0);
+			// Proxy of a primitive, a box with its own vertices per face so it is lit like the part it stands in for
+			static constexpr uint32_t proxyVertexCount = 24;
+			static constexpr uint32_t proxyIndexCount = 36;
+
+			/** @brief Where a level of a primitive is in the pools, ready for an indexed draw */
+			struct DrawRange {
+				uint32_t firstIndex;
+				int32_t vertexOffset;
+			};
+
+			explicit GeometryResidency(Model* model);
+			/** @brief Stops the worker and waits for the uploads in flight, before the pools are destroyed */
+			~GeometryResidency();
+
+			/**
+			* Write the geometry of the model into the disk cache and size the pools of the model for the budget
+			*
+			* @param budget Bytes of the vertex and index pools together, the boxes come on top of it
+			* @param proxyVertices Receives the box vertices, uploaded like regular geometry to the start of the vertex pool
+			* @param proxyIndices Receives the box indices for the start of the index pool
+			*
+			* @note Runs on the loader thread before the buffers of the model are created, which get the size of the pools
+			*/
+			_NODISCARD bool build(const std::vector<uint32_t>& indexBuffer, const std::vector<Vertex>& vertexBuffer, VkDeviceSize budget, std::vector<Vertex>& proxyVertices, std::vector<uint32_t>& proxyIndices);
+
+			/** @brief Default budget, half of the largest device local heap so textures and attachments keep the other half */
+			_NODISCARD static VkDeviceSize defaultBudget(const VulkanDevice* device) noexcept;
+
+			/**
+			* Mark a mesh as seen this frame, called from the render thread before update
+			*
+			* @param priority Larger is uploaded first, the size in pixels the mesh covers on screen
+			*/
+			void request(uint32_t mesh, float priority);
+
+			/** @brief Retire completed uploads, evict and schedule the requested meshes and submit what the worker has staged, once per frame */
+			void update();
+
+			_NODISCARD bool isResident(uint32_t mesh) const noexcept { return meshPages[mesh].state == PageState::Resident; }
+			/** @brief Level of a primitive of a resident mesh, lod 0 is the full detail level and meshlets are offset from its first index */
+			_NODISCARD DrawRange primitiveRange(uint32_t mesh, uint32_t primitive, uint32_t lod) const noexcept;
+			/** @brief Box of a primitive, drawn with proxyIndexCount indices */
+			_NODISCARD DrawRange proxyRange(uint32_t mesh, uint32_t primitive) const noexcept;
+
+			_NODISCARD VkDeviceSize getResidentBytes() const noexcept { return residentBytes; }
+			_NODISCARD VkDeviceSize getCachedBytes() const noexcept { return cachedBytes; }
+			_NODISCARD uint32_t getLoadingCount() const noexcept { return loadingCount; }
+
+		private:
+			enum class PageState { Absent, Loading, Resident };
+
+			struct MeshPage {
+				// Vertices of every primitive followed by their indices, in the cache and in the pools
+				VkDeviceSize cacheOffset{ 0 };
+				VkDeviceSize vertexBytes{ 0 };
+				VkDeviceSize indexBytes{ 0 };
+				uint32_t firstPrimitive{ 0 };
+				uint32_t firstVertexPage{ 0 };
+				uint32_t firstIndexPage{ 0 };
+				PageState state{ PageState::Absent };
+				uint64_t lastUsed{ 0 };
+				float priority{ 0.0f };
+				std::list<uint32_t>::iterator lruEntry;
+			};
+
+			/** @brief Position of a primitive within the page of its mesh */
+			struct PrimitivePage {
+				uint32_t vertexOffset;
+				uint32_t firstVertex;
+				// Full detail level followed by the LODs
+				uint32_t firstLevel;
+			};
+
+			/** @brief Mesh page to copy from the cache into the pages that were allocated for it */
+			struct Job {
+				uint32_t mesh;
+				const uint8_t* source;
+				VkDeviceSize vertexBytes;
+				VkDeviceSize indexBytes;
+				VkDeviceSize vertexOffset;
+				VkDeviceSize indexOffset;
+			};
+
+			/** @brief Part of a job staged by the worker and submitted by the render thread, pages larger than the staging ring take several */
+			struct Upload {
+				uint32_t mesh{ 0 };
+				std::vector<StagingAllocation> allocations;
+				VkDeviceSize allocationUsed{ 0 };	// Bytes filled in the last allocation
+				std::vector<VkBufferCopy> vertexRegions;
+				std::vector<VkBufferCopy> indexRegions;
+				// The mesh becomes resident once its last part has completed
+				bool last{ false };
+				uint64_t uploadValue{ 0 };
+			};
+
+			// Bytes scheduled per frame, so one frame never queues more than the staging ring moves in a few frames
+			static constexpr VkDeviceSize uploadBudget = 32ull * 1024 * 1024;
+			static constexpr std::chrono::milliseconds stagingWaitTimeout{ 10 };
+
+			Model* model;
+			VulkanDevice* device;
+			GeometryCache cache;
+
+			std::vector<MeshPage> meshPages;
+			std::vector<PrimitivePage> primitivePages;
+			// Index offset within the page of every level of every primitive
+			std::vector<uint32_t> levelOffsets;
+
+			// Resident meshes, most recently used first
+			std::list<uint32_t> lru;
+			std::unique_ptr<PageAllocator> vertexPages;
+			std::unique_ptr<PageAllocator> indexPages;
+			uint32_t proxyVertexPages{ 0 };
+			uint32_t proxyIndexPages{ 0 };
+
+			uint64_t frame{ 1 };
+			std::vector<uint32_t> requests;
+
+			std::thread worker;
+			std::atomic<bool> cancelled{ false };
+			std::mutex mutex;
+			std::condition_variable condition;
+			std::deque<Job> jobs;
+			std::deque<Upload> staged;
+
+			std::deque<Upload> inFlight;
+			VkDeviceSize residentBytes{ 0 };
+			VkDeviceSize cachedBytes{ 0 };
+			uint32_t loadingCount{ 0 };
+
+			_NODISCARD uint32_t pageCount(VkDeviceSize bytes) const noexcept { return static_cast<uint32_t>((bytes + pageSize - 1) / pageSize); }
+			/** @brief Allocate the pages of a mesh, evicting meshes that were not used this frame until they fit */
+			bool allocatePages(MeshPage& page);
+			void evict(uint32_t mesh);
+			void workerThread();
+			/** @brief Copy size bytes into the staging ring, remaining counts the bytes of the job that are still to be staged */
+			bool stage(Upload& upload, const uint8_t* data, VkDeviceSize dstOffset, VkDeviceSize size, std::vector<VkBufferCopy>& regions, VkDeviceSize& remaining);
+			void queueUpload(Upload& upload);
+			void freeUpload(Upload& upload);
+		};
+	}
+}
@@ -0,0 +1,389 @@
+/*
+* glTF mesh simplification
+*
+* Quadric error edge collapse simplification used to build level of detail chains. Vertices are only ever collapsed onto
+* other existing vertices, so every level indexes into the same vertex buffer as the full detail primitive.
+* Based on "Surface Simplification Using Quadric Error Metrics" (Garland and Heckbert 1997)
+*/
+
+#include "pch.hpp"
+#include "VulkanglTFSimplifier.hpp"
+
+namespace Voortman3D {
+	namespace {
+		constexpr uint32_t invalidIndex = ~0u;
+		// Open edges get an extra plane perpendicular to the surface, weighted up so outlines stay in place
+		constexpr float borderWeight = 10.0f;
+		// Collapses that turn a neighbouring triangle by more than ~84 degrees are rejected as flips
+		constexpr float flipThreshold = 0.1f;
+
+		enum class VertexKind : uint8_t {
+			Manifold, // Closed fan of triangles, can collapse onto any neighbour
+			Border,   // On a single open edge loop, can only collapse along it
+			Locked    // Normal seams, corners of open edge loops and non manifold vertices
+		};
+
+		/*
+			Symmetric 4x4 error matrix, stored as the 3x3 part, the linear part and the constant
+		*/
+		struct Quadric {
+			float a00{}, a11{}, a22{};
+			float a10{}, a20{}, a21{};
+			float b0{}, b1{}, b2{};
+			float c{};
+			float weight{};
+
+			Quadric& operator+=(const Quadric& other) noexcept {
+				a00 += other.a00; a11 += other.a11; a22 += other.a22;
+				a10 += other.a10; a20 += other.a20; a21 += other.a21;
+				b0 += other.b0; b1 += other.b1; b2 += other.b2;
+				c += other.c;
+				weight += other.weight;
+				return *this;
+			}
+		};
+
+		// Squared distance to the plane n.p + d = 0
+		_NODISCARD Quadric planeQuadric(const glm::vec3& n, float d, float weight) noexcept {
+			Quadric q;
+			q.a00 = weight * n.x * n.x;
+			q.a11 = weight * n.y * n.y;
+			q.a22 = weight * n.z * n.z;
+			q.a10 = weight * n.y * n.x;
+			q.a20 = weight * n.z * n.x;
+			q.a21 = weight * n.z * n.y;
+			q.b0 = weight * n.x * d;
+			q.b1 = weight * n.y * d;
+			q.b2 = weight * n.z * d;
+			q.c = weight * d * d;
+			q.weight = weight;
+			return q;
+		}
+
+		// Weighted mean squared distance of p to all planes of the quadric
+		_NODISCARD float quadricError(const Quadric& q, const glm::vec3& p) noexcept {
+			float r = q.c;
+			r += p.x * (q.a00 * p.x + 2.0f * (q.a10 * p.y + q.a20 * p.z + q.b0));
+			r += p.y * (q.a11 * p.y + 2.0f * (q.a21 * p.z + q.b1));
+			r += p.z * (q.a22 * p.z + 2.0f * q.b2);
+			return q.weight > 0.0f ? fabsf(r) / q.weight : 0.0f;
+		}
+
+		// Maps every vertex to the first vertex with the same leading keySize bytes
+		std::vector<uint32_t> remapDuplicates(const std::vector<vkglTF::Vertex>& vertices, size_t keySize) {
+			size_t tableSize = 16;
+			while (tableSize < vertices.size() * 2)
+				tableSize *= 2;
+			const size_t mask = tableSize - 1;
+
+			std::vector<uint32_t> table(tableSize, invalidIndex);
+			std::vector<uint32_t> remap(vertices.size());
+
+			for (uint32_t i = 0; i < vertices.size(); i++) {
+				const char* key = reinterpret_cast<const char*>(&vertices[i]);
+
+				// Bitwise comparison, so hashing the bit patterns is enough
+				uint32_t h = 2166136261u;
+				for (size_t offset = 0; offset < keySize; offset += sizeof(uint32_t)) {
+					uint32_t word;
+					memcpy(&word, key + offset, sizeof(word));
+					word *= 0x5bd1e995u;
+					word ^= word >> 24;
+					h = (h * 0x5bd1e995u) ^ (word * 0x5bd1e995u);
+				}
+				h ^= h >> 13;
+
+				size_t slot = h & mask;
+				for (size_t probe = 1; ; probe++) {
+					const uint32_t entry = table[slot];
+					if (entry == invalidIndex) {
+						table[slot] = i;
+						remap[i] = i;
+						break;
+					}
+					if (memcmp(&vertices[entry], key, keySize) == 0) {
+						remap[i] = entry;
+						break;
+					}
+					slot = (slot + probe) & mask;
+				}
+			}
+			return remap;
+		}
+
+		/*
+			Triangles around every position, rebuilt after each collapse pass
+		*/
+		struct TriangleAdjacency {
+			std::vector<uint32_t> offsets;
+			std::vector<uint32_t> triangles;
+
+			void build(const std::vector<uint32_t>& indices, const std::vector<uint32_t>& position) {
+				offsets.assign(position.size() + 1, 0);
+				for (uint32_t index : indices)
+					offsets[position[index] + 1]++;
+				for (size_t i = 1; i < offsets.size(); i++)
+					offsets[i] += offsets[i - 1];
+
+				triangles.resize(indices.size());
+				std::vector<uint32_t> fill(offsets.begin(), offsets.end() - 1);
+				for (size_t i = 0; i < indices.size(); i++)
+					triangles[fill[position[indices[i]]]++] = static_cast<uint32_t>(i / 3);
+			}
+		};
+
+		// Whether any triangle has the directed edge a -> b, a and b are positions
+		_NODISCARD bool hasEdge(const TriangleAdjacency& adjacency, const std::vector<uint32_t>& indices, const std::vector<uint32_t>& position, uint32_t a, uint32_t b) noexcept {
+			for (uint32_t i = adjacency.offsets[a]; i < adjacency.offsets[a + 1]; i++) {
+				const uint32_t* triangle = &indices[adjacency.triangles[i] * 3];
+				for (int k = 0; k < 3; k++) {
+					if (position[triangle[k]] == a && position[triangle[(k + 1) % 3]] == b)
+						return true;
+				}
+			}
+			return false;
+		}
+
+		struct Collapse {
+			uint32_t from;
+			uint32_t to;
+			float error;
+		};
+	}
+
+	std::vector<uint32_t> vkglTF::simplifyPrimitive(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices, size_t targetIndexCount, float targetError, float* resultError) {
+		if (resultError)
+			*resultError = 0.0f;
+
+		// Identical vertices are treated as one, vertices that only share a position are wedges of a normal seam
+		const std::vector<uint32_t> attribute = remapDuplicates(vertices, sizeof(Vertex));
+		const std::vector<uint32_t> position = remapDuplicates(vertices, sizeof(glm::vec3));
+
+		std::vector<uint32_t> result(indices.size());
+		for (size_t i = 0; i < indices.size(); i++)
+			result[i] = attribute[indices[i]];
+
+		if (result.size() <= targetIndexCount) _UNLIKELY
+			return result;
+
+		// Ring of distinct vertices per position, the first occurrence of a position is part of its own ring
+		std::vector<uint32_t> wedge(vertices.size());
+		for (uint32_t i = 0; i < vertices.size(); i++)
+			wedge[i] = i;
+		for (uint32_t i = 0; i < vertices.size(); i++) {
+			if (attribute[i] == i && position[i] != i) {
+				wedge[i] = wedge[position[i]];
+				wedge[position[i]] = i;
+			}
+		}
+
+		// Errors are computed in a unit cube so the quadrics stay well conditioned in float
+		glm::vec3 min(FLT_MAX), max(-FLT_MAX);
+		for (uint32_t index : result) {
+			min = (glm::min)(min, vertices[index].pos);
+			max = (glm::max)(max, vertices[index].pos);
+		}
+		const float extent = (std::max)({ max.x - min.x, max.y - min.y, max.z - min.z });
+		if (extent <= 0.0f) _UNLIKELY
+			return result;
+
+		std::vector<glm::vec3> positions(vertices.size());
+		for (size_t i = 0; i < vertices.size(); i++)
+			positions[i] = (vertices[i].pos - min) / extent;
+
+		TriangleAdjacency adjacency;
+		adjacency.build(result, position);
+
+		// Classify positions by the open edges around them
+		std::vector<VertexKind> kinds(vertices.size(), VertexKind::Locked);
+		for (uint32_t v = 0; v < vertices.size(); v++) {
+			if (position[v] != v || adjacency.offsets[v] == adjacency.offsets[v + 1])
+				continue;
+			if (wedge[v] != v) {
+				kinds[v] = VertexKind::Locked;
+				continue;
+			}
+
+			uint32_t openOut = 0, openIn = 0;
+			for (uint32_t i = adjacency.offsets[v]; i < adjacency.offsets[v + 1]; i++) {
+				const uint32_t* triangle = &result[adjacency.triangles[i] * 3];
+				for (int k = 0; k < 3; k++) {
+					if (position[triangle[k]] != v)
+						continue;
+					const uint32_t next = position[triangle[(k + 1) % 3]];
+					const uint32_t prev = position[triangle[(k + 2) % 3]];
+					openOut += !hasEdge(adjacency, result, position, next, v);
+					openIn += !hasEdge(adjacency, result, position, v, prev);
+				}
+			}
+
+			if (openOut == 0 && openIn == 0)
+				kinds[v] = VertexKind::Manifold;
+			else if (openOut == 1 && openIn == 1)
+				kinds[v] = VertexKind::Border;
+		}
+
+		// Area weighted triangle planes plus perpendicular planes along open edges
+		std::vector<Quadric> quadrics(vertices.size());
+		for (size_t t = 0; t < result.size() / 3; t++) {
+			const uint32_t* triangle = &result[t * 3];
+			const glm::vec3& p0 = positions[triangle[0]];
+			const glm::vec3 normal = glm::cross(positions[triangle[1]] - p0, positions[triangle[2]] - p0);
+			const float length = glm::length(normal);
+			if (length == 0.0f) _UNLIKELY
+				continue;
+
+			const glm::vec3 n = normal / length;
+			const Quadric q = planeQuadric(n, -glm::dot(n, p0), length * 0.5f);
+			for (int k = 0; k < 3; k++)
+				quadrics[position[triangle[k]]] += q;
+
+			for (int k = 0; k < 3; k++) {
+				const uint32_t a = position[triangle[k]];
+				const uint32_t b = position[triangle[(k + 1) % 3]];
+				if (hasEdge(adjacency, result, position, b, a))
+					continue;
+
+				const glm::vec3 edge = positions[b] - positions[a];
+				const glm::vec3 perpendicular = glm::cross(edge, n);
+				const float edgeLength = glm::length(perpendicular);
+				if (edgeLength == 0.0f) _UNLIKELY
+					continue;
+
+				const glm::vec3 en = perpendicular / edgeLength;
+				const Quadric eq = planeQuadric(en, -glm::dot(en, positions[a]), glm::dot(edge, edge) * borderWeight);
+				quadrics[a] += eq;
+				quadrics[b] += eq;
+			}
+		}
+
+		const float errorLimit = (targetError / extent) * (targetError / extent);
+		float maxError = 0.0f;
+
+		std::vector<Collapse> candidates;
+		std::vector<uint8_t> locked(vertices.size());
+		std::vector<uint32_t> collapseRemap(vertices.size());
+
+		// Every pass collapses a set of independent edges in order of increasing error
+		while (result.size() > targetIndexCount) {
+			candidates.clear();
+			for (size_t i = 0; i < result.size(); i++) {
+				const uint32_t a = position[result[i]];
+				const uint32_t b = position[result[i - i % 3 + (i + 1) % 3]];
+				const bool open = !hasEdge(adjacency, result, position, b, a);
+				// Shared edges show up once in both directions, open edges only once
+				if (!open && a > b)
+					continue;
+
+				Collapse best{ invalidIndex, invalidIndex, FLT_MAX };
+				for (int direction = 0; direction < 2; direction++) {
+					const uint32_t from = direction ? b : a;
+					const uint32_t to = direction ? a : b;
+					const bool allowed = kinds[from] == VertexKind::Manifold || (kinds[from] == VertexKind::Border && open && kinds[to] != VertexKind::Manifold);
+					if (!allowed)
+						continue;
+
+					const float error = quadricError(quadrics[from], positions[to]);
+					if (error < best.error)
+						best = { from, to, error };
+				}
+				if (best.from != invalidIndex)
+					candidates.push_back(best);
+			}
+			if (candidates.empty())
+				break;
+
+			std::sort(candidates.begin(), candidates.end(), [](const Collapse& a, const Collapse& b) { return a.error < b.error; });
+
+			// A manifold collapse removes two triangles, stop the pass once that would reach the target
+			const size_t collapseGoal = (result.size() - targetIndexCount) / 6 + 1;
+			size_t collapses = 0;
+
+			std::fill(locked.begin(), locked.end(), uint8_t(0));
+			for (uint32_t i = 0; i < collapseRemap.size(); i++)
+				collapseRemap[i] = i;
+
+			for (const Collapse& collapse : candidates) {
+				if (collapse.error > errorLimit)
+					break;
+				if (locked[collapse.from] || locked[collapse.to])
+					continue;
+
+				// Reject the collapse if any remaining triangle around the removed vertex would flip or become degenerate
+				bool flips = false;
+				for (uint32_t i = adjacency.offsets[collapse.from]; i < adjacency.offsets[collapse.from + 1] && !flips; i++) {
+					const uint32_t* triangle = &result[adjacency.triangles[i] * 3];
+					glm::vec3 p[3];
+					bool removed = false;
+					for (int k = 0; k < 3; k++) {
+						removed |= position[triangle[k]] == collapse.to;
+						p[k] = positions[triangle[k]];
+					}
+					if (removed)
+						continue;
+
+					const glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+					if (before == glm::vec3(0.0f)) _UNLIKELY
+						continue;
+					for (int k = 0; k < 3; k++) {
+						if (position[triangle[k]] == collapse.from)
+							p[k] = positions[collapse.to];
+					}
+					const glm::vec3 after = glm::cross(p[1] - p[0], p[2] - p[0]);
+					flips = glm::dot(before, after) <= flipThreshold * glm::length(before) * glm::length(after);
+				}
+				if (flips)
+					continue;
+
+				// The triangles around the removed vertex change, so nothing touching them may collapse in this pass
+				for (uint32_t i = adjacency.offsets[collapse.from]; i < adjacency.offsets[collapse.from + 1]; i++) {
+					const uint32_t* triangle = &result[adjacency.triangles[i] * 3];
+					for (int k = 0; k < 3; k++)
+						locked[position[triangle[k]]] = 1;
+				}
+
+				// Collapsed vertices never sit on a seam, pick the wedge of the target that matches their normal best
+				uint32_t target = collapse.to;
+				float bestDot = -FLT_MAX;
+				uint32_t w = collapse.to;
+				do {
+					const float d = glm::dot(vertices[w].normal, vertices[collapse.from].normal);
+					if (d > bestDot) {
+						bestDot = d;
+						target = w;
+					}
+					w = wedge[w];
+				} while (w != collapse.to);
+
+				collapseRemap[collapse.from] = target;
+				quadrics[collapse.to] += quadrics[collapse.from];
+				maxError = (std::max)(maxError, collapse.error);
+
+				if (++collapses >= collapseGoal)
+					break;
+			}
+			if (collapses == 0)
+				break;
+
+			// Apply the pass and drop the triangles that collapsed
+			size_t write = 0;
+			for (size_t i = 0; i < result.size(); i += 3) {
+				const uint32_t a = collapseRemap[result[i + 0]];
+				const uint32_t b = collapseRemap[result[i + 1]];
+				const uint32_t c = collapseRemap[result[i + 2]];
+				if (position[a] == position[b] || position[b] == position[c] || position[c] == position[a])
+					continue;
+				result[write++] = a;
+				result[write++] = b;
+				result[write++] = c;
+			}
+			result.resize(write);
+			adjacency.build(result, position);
+		}
+
+		if (resultError)
+			*resultError = sqrtf(maxError) * extent;
+
+		return result;
+	}
+}
@@ -0,0 +1,30 @@
+/*
+* glTF mesh simplification
+*
+* Quadric error edge collapse simplification used to build level of detail chains. Vertices are only ever collapsed onto
+* other existing vertices, so every level indexes into the same vertex buffer as the full detail primitive.
+* Based on "Surface Simplification Using Quadric Error Metrics" (Garland and Heckbert 1997)
+*/
+
+#pragma once
+#include "pch.hpp"
+#include "VulkanglTFModel.hpp"
+
+namespace Voortman3D {
+	namespace vkglTF {
+		/**
+		* Simplify the triangle list of a single primitive
+		*
+		* @param vertices Vertices of the primitive, they are only read so the result can share them
+		* @param indices Triangle list indexing into vertices
+		* @param targetIndexCount Index count to stop at
+		* @param targetError Largest distance the surface is allowed to move, in the same units as the vertex positions
+		* @param resultError Optional, receives the distance the surface moved to reach the result
+		*
+		* @return Simplified triangle list, stays above targetIndexCount when the error limit or the topology prevents further collapses
+		*
+		* @note Open borders are only collapsed along themselves and normal seams are kept, so the outline and shading of the primitive hold up
+		*/
+		_NODISCARD std::vector<uint32_t> simplifyPrimitive(const std::vector<Vertex>& vertices, const std::vector<uint32_t>& indices, size_t targetIndexCount, float targetError, float* resultError = nullptr);
+	}
+}
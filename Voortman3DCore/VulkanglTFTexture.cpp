@@ -0,0 +1,508 @@
+/*
+* glTF textures
+*
+* Images are kept encoded while the file is parsed and decoded on worker threads afterwards. KTX2 files keep the block
+* format and levels they were baked with, PNG and JPEG are decoded to RGBA8 and get their mip chain generated. The levels
+* are streamed to the GPU smallest first, so a texture shows a blurred version right away and sharpens over a few frames
+* instead of holding up the model
+*
+* There is no Basis Universal transcoder: KTX2 files have to be baked to a BC or ETC2 format the device can sample and
+* without supercompression. Other KTX2 images fall back to the PNG or JPEG of KHR_texture_basisu, or are left out
+*/
+
+#include "pch.hpp"
+#include "VulkanglTFTexture.hpp"
+#include "VulkanUploader.hpp"
+#include "Initializers.inl"
+#include "Tools.hpp"
+
+// The implementation is compiled together with tinygltf in VulkanglTFModel.cpp
+#include "stb_image.h"
+
+namespace Voortman3D {
+	namespace {
+		constexpr uint8_t ktx2Identifier[12] = { 0xAB, 'K', 'T', 'X', ' ', '2', '0', 0xBB, '\r', '\n', 0x1A, '\n' };
+
+		// Identifier, nine header fields and the offsets of the data format descriptor, key/value and supercompression data
+		constexpr size_t ktx2HeaderSize = 80;
+		constexpr size_t ktx2LevelIndexSize = 24;
+
+		template <typename T>
+		_NODISCARD inline T readValue(const uint8_t* p) noexcept {
+			T value;
+			memcpy(&value, p, sizeof(T));
+			return value;
+		}
+
+		_NODISCARD inline VkDeviceSize alignLevel(VkDeviceSize offset) noexcept {
+			return (offset + StagingRing::alignment - 1) & ~(StagingRing::alignment - 1);
+		}
+
+		_NODISCARD inline bool isKTX2(const std::vector<unsigned char>& encoded) noexcept {
+			return encoded.size() >= ktx2HeaderSize && memcmp(encoded.data(), ktx2Identifier, sizeof(ktx2Identifier)) == 0;
+		}
+
+		bool decodeKTX2(const std::vector<unsigned char>& encoded, const std::function<bool(VkFormat)>& isFormatSupported, vkglTF::TextureLevels& levels, std::string& error) {
+			const uint8_t* header = encoded.data() + sizeof(ktx2Identifier);
+			const uint32_t format = readValue<uint32_t>(header);
+			const uint32_t width = readValue<uint32_t>(header + 8);
+			const uint32_t height = readValue<uint32_t>(header + 12);
+			const uint32_t depth = readValue<uint32_t>(header + 16);
+			const uint32_t layerCount = readValue<uint32_t>(header + 20);
+			const uint32_t faceCount = readValue<uint32_t>(header + 24);
+			const uint32_t levelCount = readValue<uint32_t>(header + 28);
+			const uint32_t supercompression = readValue<uint32_t>(header + 32);
+
+			// Basis Universal data has no Vulkan format of its own and would have to be transcoded, which isn't supported
+			if (format == VK_FORMAT_UNDEFINED || supercompression != 0) {
+				error = "KTX2 image is Basis Universal or supercompressed (scheme " + std::to_string(supercompression) + "), only KTX2 baked to a block format without supercompression is supported";
+				return false;
+			}
+			if (width == 0 || height == 0 || depth > 1 || layerCount > 1 || faceCount != 1) {
+				error = "KTX2 image is not a single 2D image";
+				return false;
+			}
+			if (!isFormatSupported(static_cast<VkFormat>(format))) {
+				error = "KTX2 format " + std::to_string(format) + " can't be sampled by this device";
+				return false;
+			}
+
+			// A level count of 0 asks the loader to generate the chain, which is only done for RGBA8
+			const uint32_t storedLevels = (std::max)(levelCount, 1u);
+			if (encoded.size() < ktx2HeaderSize + storedLevels * ktx2LevelIndexSize || storedLevels > 32) {
+				error = "KTX2 level index is truncated";
+				return false;
+			}
+
+			levels.format = static_cast<VkFormat>(format);
+			levels.width = width;
+			levels.height = height;
+			levels.offsets.assign(1, 0);
+			levels.data.clear();
+
+			// The file stores the smallest level first, the index lists them from level 0
+			const uint8_t* levelIndex = encoded.data() + ktx2HeaderSize;
+			for (uint32_t level = 0; level < storedLevels; level++) {
+				const uint64_t offset = readValue<uint64_t>(levelIndex + level * ktx2LevelIndexSize);
+				const uint64_t length = readValue<uint64_t>(levelIndex + level * ktx2LevelIndexSize + 8);
+				if (length == 0 || offset > encoded.size() || length > encoded.size() - offset) {
+					error = "KTX2 level " + std::to_string(level) + " lies outside the file";
+					return false;
+				}
+
+				const VkDeviceSize start = alignLevel(levels.data.size());
+				levels.data.resize(static_cast<size_t>(start + length));
+				memcpy(levels.data.data() + start, encoded.data() + offset, static_cast<size_t>(length));
+				levels.offsets.back() = start;
+				levels.offsets.push_back(start + length);
+			}
+
+			if (levelCount == 0 && (levels.format == VK_FORMAT_R8G8B8A8_SRGB || levels.format == VK_FORMAT_R8G8B8A8_UNORM))
+				vkglTF::generateMipChain(levels);
+			return true;
+		}
+
+		/*
+			Conversion tables for filtering sRGB texels in linear space, linear values are looked up in 4096 steps
+		*/
+		struct SRGBTables {
+			std::array<float, 256> toLinear;
+			std::array<uint8_t, 4096> fromLinear;
+
+			SRGBTables() {
+				for (uint32_t i = 0; i < toLinear.size(); i++) {
+					const float c = static_cast<float>(i) / 255.0f;
+					toLinear[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+				}
+				for (uint32_t i = 0; i < fromLinear.size(); i++) {
+					const float c = static_cast<float>(i) / static_cast<float>(fromLinear.size() - 1);
+					const float s = c <= 0.0031308f ? c * 12.92f : 1.055f * std::pow(c, 1.0f / 2.4f) - 0.055f;
+					fromLinear[i] = static_cast<uint8_t>(std::lround(std::clamp(s, 0.0f, 1.0f) * 255.0f));
+				}
+			}
+		};
+
+		const SRGBTables& getSRGBTables() {
+			static const SRGBTables tables;
+			return tables;
+		}
+	}
+
+	bool vkglTF::decodeTexture(const std::vector<unsigned char>& encoded, bool srgb, const std::function<bool(VkFormat)>& isFormatSupported, TextureLevels& levels, std::string& error) {
+		if (encoded.empty()) _UNLIKELY {
+			error = "image has no data";
+			return false;
+		}
+		if (isKTX2(encoded))
+			return decodeKTX2(encoded, isFormatSupported, levels, error);
+
+		int width, height, components;
+		stbi_uc* pixels = stbi_load_from_memory(encoded.data(), static_cast<int>(encoded.size()), &width, &height, &components, STBI_rgb_alpha);
+		if (!pixels) _UNLIKELY {
+			error = stbi_failure_reason();
+			return false;
+		}
+
+		levels.format = srgb ? VK_FORMAT_R8G8B8A8_SRGB : VK_FORMAT_R8G8B8A8_UNORM;
+		levels.width = static_cast<uint32_t>(width);
+		levels.height = static_cast<uint32_t>(height);
+		levels.data.assign(pixels, pixels + static_cast<size_t>(width) * height * 4);
+		levels.offsets = { 0, levels.data.size() };
+		stbi_image_free(pixels);
+
+		generateMipChain(levels);
+		return true;
+	}
+
+	bool vkglTF::decodeTextureSource(VulkanDevice* device, const Model::TextureSource& source, TextureLevels& levels) {
+		const auto isFormatSupported = [device](VkFormat format) {
+			constexpr VkFormatFeatureFlags required = VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+			VkFormatProperties formatProperties{};
+			vkGetPhysicalDeviceFormatProperties(device->physicalDevice, format, &formatProperties);
+			return (formatProperties.optimalTilingFeatures & required) == required;
+		};
+
+		std::string error;
+		if (decodeTexture(source.encoded, source.srgb, isFormatSupported, levels, error)) _LIKELY
+			return true;
+
+		// KHR_texture_basisu keeps a PNG or JPEG next to the KTX2 image for loaders that can't use it
+		std::string fallbackError;
+		if (!source.fallback.empty() && decodeTexture(source.fallback, source.srgb, isFormatSupported, levels, fallbackError))
+			return true;
+
+		std::cerr << "Image \"" << source.name << "\" could not be decoded and is left out: " << error;
+		if (!fallbackError.empty())
+			std::cerr << ", fallback image: " << fallbackError;
+		std::cerr << "\n";
+		return false;
+	}
+
+	void vkglTF::generateMipChain(TextureLevels& levels) {
+		const bool srgb = levels.format == VK_FORMAT_R8G8B8A8_SRGB;
+		const SRGBTables& tables = getSRGBTables();
+		const uint32_t levelCount = static_cast<uint32_t>(std::floor(std::log2((std::max)(levels.width, levels.height)))) + 1;
+
+		// Level 0 stays where it is, the others are appended behind it
+		levels.offsets.resize(2);
+		for (uint32_t level = 1; level < levelCount; level++) {
+			const uint32_t srcWidth = levels.levelWidth(level - 1);
+			const uint32_t srcHeight = levels.levelHeight(level - 1);
+			const uint32_t dstWidth = levels.levelWidth(level);
+			const uint32_t dstHeight = levels.levelHeight(level);
+
+			const VkDeviceSize srcOffset = levels.offsets[level - 1];
+			const VkDeviceSize dstOffset = alignLevel(levels.offsets[level]);
+			levels.data.resize(static_cast<size_t>(dstOffset) + static_cast<size_t>(dstWidth) * dstHeight * 4);
+			levels.offsets.back() = dstOffset;
+			levels.offsets.push_back(levels.data.size());
+
+			const uint8_t* src = levels.data.data() + srcOffset;
+			uint8_t* dst = levels.data.data() + dstOffset;
+			for (uint32_t y = 0; y < dstHeight; y++) {
+				// A side of 1 is not halved any further, its texels are sampled twice
+				const uint32_t y0 = (std::min)(y * 2, srcHeight - 1);
+				const uint32_t y1 = (std::min)(y * 2 + 1, srcHeight - 1);
+				for (uint32_t x = 0; x < dstWidth; x++) {
+					const uint32_t x0 = (std::min)(x * 2, srcWidth - 1);
+					const uint32_t x1 = (std::min)(x * 2 + 1, srcWidth - 1);
+					const uint8_t* texels[4] = {
+						src + (static_cast<size_t>(y0) * srcWidth + x0) * 4,
+						src + (static_cast<size_t>(y0) * srcWidth + x1) * 4,
+						src + (static_cast<size_t>(y1) * srcWidth + x0) * 4,
+						src + (static_cast<size_t>(y1) * srcWidth + x1) * 4
+					};
+
+					uint8_t* out = dst + (static_cast<size_t>(y) * dstWidth + x) * 4;
+					for (uint32_t c = 0; c < 4; c++) {
+						// Averaging sRGB values directly darkens every level, alpha is linear in either format
+						if (srgb && c < 3) {
+							const float sum = tables.toLinear[texels[0][c]] + tables.toLinear[texels[1][c]] + tables.toLinear[texels[2][c]] + tables.toLinear[texels[3][c]];
+							out[c] = tables.fromLinear[static_cast<size_t>(sum * 0.25f * static_cast<float>(tables.fromLinear.size() - 1) + 0.5f)];
+						}
+						else {
+							out[c] = static_cast<uint8_t>((texels[0][c] + texels[1][c] + texels[2][c] + texels[3][c] + 2) / 4);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	/*
+		Default texture
+	*/
+	vkglTF::Texture* vkglTF::defaultTexture = nullptr;
+
+	void vkglTF::createDefaultTexture(VulkanDevice* device) {
+		if (defaultTexture)
+			return;
+
+		TextureStreamer streamer(device);
+		Texture* texture = new Texture();
+		TextureLevels levels;
+		levels.format = VK_FORMAT_R8G8B8A8_UNORM;
+		levels.width = levels.height = 1;
+		levels.data.assign(4, 0xFF);
+		levels.offsets = { 0, 4 };
+		streamer.push(nullptr, texture, std::move(levels));
+		streamer.flush();
+		defaultTexture = texture;
+	}
+
+	void vkglTF::destroyDefaultTexture() {
+		delete defaultTexture;
+		defaultTexture = nullptr;
+	}
+
+	/*
+		Texture streaming
+	*/
+	vkglTF::TextureStreamer::~TextureStreamer() {
+		clear();
+	}
+
+	void vkglTF::TextureStreamer::push(Model* model, Texture* texture, TextureLevels&& levels) {
+		Entry entry;
+		entry.model = model;
+		entry.texture = texture;
+		entry.levels = std::move(levels);
+		entry.nextLevel = entry.levels.levelCount();
+
+		std::lock_guard<std::mutex> lock(mutex);
+		queuedBytes += entry.levels.data.size();
+		incoming.push_back(std::move(entry));
+	}
+
+	void vkglTF::TextureStreamer::waitForSpace(const std::atomic<bool>& cancelled) {
+		std::unique_lock<std::mutex> lock(mutex);
+		while (queuedBytes > maxQueuedBytes && !cancelled)
+			condition.wait_for(lock, spaceWaitTimeout);
+	}
+
+	bool vkglTF::TextureStreamer::idle() {
+		std::lock_guard<std::mutex> lock(mutex);
+		return incoming.empty() && entries.empty();
+	}
+
+	void vkglTF::TextureStreamer::createImage(Entry& entry) {
+		Texture* texture = entry.texture;
+		const TextureLevels& levels = entry.levels;
+
+		VkImageCreateInfo imageCI = Initializers::imageCreateInfo();
+		imageCI.imageType = VK_IMAGE_TYPE_2D;
+		imageCI.format = levels.format;
+		imageCI.extent = { levels.width, levels.height, 1 };
+		imageCI.mipLevels = levels.levelCount();
+		imageCI.arrayLayers = 1;
+		imageCI.samples = VK_SAMPLE_COUNT_1_BIT;
+		imageCI.tiling = VK_IMAGE_TILING_OPTIMAL;
+		imageCI.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+		imageCI.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+		device->setUploadSharingMode(imageCI);
+		VK_CHECK_RESULT(vkCreateImage(device->logicalDevice, &imageCI, nullptr, &texture->image));
+		VK_CHECK_RESULT(device->allocateImageMemory(texture->image, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &texture->deviceMemory));
+
+		VkImageViewCreateInfo viewCI = Initializers::imageViewCreateInfo();
+		viewCI.image = texture->image;
+		viewCI.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		viewCI.format = levels.format;
+		viewCI.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, imageCI.mipLevels, 0, 1 };
+		VK_CHECK_RESULT(vkCreateImageView(device->logicalDevice, &viewCI, nullptr, &texture->view));
+
+		VkSamplerCreateInfo samplerCI = Initializers::samplerCreateInfo();
+		samplerCI.magFilter = VK_FILTER_LINEAR;
+		samplerCI.minFilter = VK_FILTER_LINEAR;
+		samplerCI.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+		samplerCI.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+		samplerCI.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+		samplerCI.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+		samplerCI.maxLod = static_cast<float>(imageCI.mipLevels);
+		if (device->enabledFeatures.samplerAnisotropy) {
+			samplerCI.anisotropyEnable = VK_TRUE;
+			samplerCI.maxAnisotropy = (std::min)(8.0f, device->properties.limits.maxSamplerAnisotropy);
+		}
+		VK_CHECK_RESULT(vkCreateSampler(device->logicalDevice, &samplerCI, nullptr, &texture->sampler));
+
+		texture->device = device;
+		texture->width = levels.width;
+		texture->height = levels.height;
+		texture->mipLevels = imageCI.mipLevels;
+		texture->layerCount = 1;
+		texture->imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+		texture->descriptor = Initializers::descriptorImageInfo(texture->sampler, texture->view, texture->imageLayout);
+		// Nothing may be sampled until the first step has completed
+		texture->residentLevel = texture->mipLevels;
+	}
+
+	VkDeviceSize vkglTF::TextureStreamer::stepSize(const Entry& entry) const noexcept {
+		const TextureLevels& levels = entry.levels;
+		const uint32_t levelCount = levels.levelCount();
+		if (entry.nextLevel < levelCount)
+			return levels.levelSize(entry.nextLevel - 1);
+
+		// The first step takes every level up to tailSize at once, or the smallest level when even that one is larger
+		uint32_t first = levelCount - 1;
+		while (first > 0 && (std::max)(levels.levelWidth(first - 1), levels.levelHeight(first - 1)) <= tailSize)
+			first--;
+		return levels.offsets[levelCount] - levels.offsets[first];
+	}
+
+	bool vkglTF::TextureStreamer::recordStep(Entry& entry) {
+		const TextureLevels& levels = entry.levels;
+		const uint32_t levelCount = levels.levelCount();
+		const bool firstStep = entry.nextLevel == levelCount;
+
+		uint32_t first = entry.nextLevel - 1;
+		VkImageSubresourceRange range = { VK_IMAGE_ASPECT_COLOR_BIT, first, 1, 0, 1 };
+		if (firstStep) {
+			// A first step that found the staging ring full already has its image
+			if (!entry.texture->image)
+				createImage(entry);
+			while (first > 0 && (std::max)(levels.levelWidth(first - 1), levels.levelHeight(first - 1)) <= tailSize)
+				first--;
+			// Every level leaves the undefined layout now, the view covers all of them while it is sampled. The ones that are still
+			// missing are never read thanks to the minimum level of detail and later steps take them from the shader read layout
+			range.baseMipLevel = 0;
+			range.levelCount = levelCount;
+		}
+		const uint32_t end = firstStep ? levelCount : first + 1;
+
+		std::vector<VkBufferImageCopy> regions;
+		for (uint32_t level = first; level < end; level++) {
+			VkBufferImageCopy region{};
+			region.bufferOffset = levels.offsets[level] - levels.offsets[first];
+			region.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, level, 0, 1 };
+			region.imageExtent = { levels.levelWidth(level), levels.levelHeight(level), 1 };
+			regions.push_back(region);
+		}
+
+		if (!device->uploader->tryUploadImage(levels.data.data() + levels.offsets[first], levels.offsets[end] - levels.offsets[first], entry.texture->image, range, static_cast<uint32_t>(regions.size()), regions.data(), firstStep ? VK_IMAGE_LAYOUT_UNDEFINED : VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL))
+			return false;
+		entry.nextLevel = first;
+		entry.inFlight = true;
+		return true;
+	}
+
+	bool vkglTF::TextureStreamer::retireStep(Entry& entry) {
+		Texture* texture = entry.texture;
+		const bool firstStep = texture->residentLevel == texture->mipLevels;
+		texture->residentLevel = entry.nextLevel;
+		entry.inFlight = false;
+
+		if (!entry.model)
+			return false;
+
+		// Only the entries of the materials that sample the texture are rewritten
+		Model* model = entry.model;
+		for (uint32_t i = 0; i < static_cast<uint32_t>(model->materials.size()); i++) {
+			if (model->materials[i].baseColorTexture == texture)
+				model->updateMaterial(i);
+		}
+		// Until then the slot is empty or holds the default texture, later steps only lower the minimum level of detail of the materials
+		if (firstStep)
+			model->writeTextureDescriptor(model->nodeMatrices.descriptorSet, *texture);
+		return firstStep;
+	}
+
+	bool vkglTF::TextureStreamer::update(VkDeviceSize budget) {
+		VulkanUploader* uploader = device->uploader;
+		bool descriptorsWritten = false;
+
+		// Completion is seen by the CPU, the frames still have to wait on the semaphore once to see the data
+		for (Entry& entry : entries) {
+			if (entry.inFlight && uploader->isComplete(entry.uploadValue)) {
+				uploader->waitOnGraphics(entry.uploadValue);
+				descriptorsWritten |= retireStep(entry);
+			}
+		}
+
+		VkDeviceSize releasedBytes = 0;
+		entries.erase(std::remove_if(entries.begin(), entries.end(), [&releasedBytes](const Entry& entry) {
+			const bool finished = entry.nextLevel == 0 && !entry.inFlight;
+			if (finished)
+				releasedBytes += entry.levels.data.size();
+			return finished;
+		}), entries.end());
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			queuedBytes -= releasedBytes;
+			while (!incoming.empty()) {
+				entries.push_back(std::move(incoming.front()));
+				incoming.pop_front();
+			}
+		}
+		if (releasedBytes > 0)
+			condition.notify_all();
+
+		// Always the smallest step of all textures, so every texture is visible before any of them gets sharper.
+		// Each texture has at most one step in flight, its next level can only be sampled once the coarser ones are there
+		std::vector<Entry*> recorded;
+		VkDeviceSize recordedBytes = 0;
+		while (recordedBytes < budget) {
+			Entry* next = nullptr;
+			VkDeviceSize nextSize = 0;
+			for (Entry& entry : entries) {
+				if (entry.inFlight || entry.nextLevel == 0)
+					continue;
+				const VkDeviceSize size = stepSize(entry);
+				if (!next || size < nextSize) {
+					next = &entry;
+					nextSize = size;
+				}
+			}
+			// A full staging ring leaves the rest for the frames after its ranges have been recycled
+			if (!next || !recordStep(*next))
+				break;
+			recorded.push_back(next);
+			recordedBytes += nextSize;
+		}
+
+		if (!recorded.empty()) {
+			// Frames don't wait for it, a level is only sampled once its step is seen to be complete
+			const uint64_t uploadValue = uploader->submit(false);
+			for (Entry* entry : recorded)
+				entry->uploadValue = uploadValue;
+		}
+		return descriptorsWritten;
+	}
+
+	void vkglTF::TextureStreamer::waitForUploads() {
+		uint64_t value = 0;
+		for (const Entry& entry : entries) {
+			if (entry.inFlight)
+				value = (std::max)(value, entry.uploadValue);
+		}
+		if (value == 0)
+			return;
+
+		const VkSemaphore semaphore = device->uploader->getSemaphore();
+		VkSemaphoreWaitInfo waitInfo{};
+		waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+		waitInfo.semaphoreCount = 1;
+		waitInfo.pSemaphores = &semaphore;
+		waitInfo.pValues = &value;
+		VK_CHECK_RESULT(vkWaitSemaphores(device->logicalDevice, &waitInfo, UINT64_MAX));
+	}
+
+	void vkglTF::TextureStreamer::flush() {
+		while (!idle()) {
+			(void)update(VK_WHOLE_SIZE);
+			waitForUploads();
+			device->uploader->collect();
+		}
+	}
+
+	void vkglTF::TextureStreamer::clear() {
+		waitForUploads();
+		entries.clear();
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			incoming.clear();
+			queuedBytes = 0;
+		}
+		condition.notify_all();
+	}
+}
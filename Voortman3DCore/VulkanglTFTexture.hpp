@@ -0,0 +1,129 @@
+/*
+* glTF textures
+*
+* Images are kept encoded while the file is parsed and decoded on worker threads afterwards. KTX2 files keep the block
+* format and levels they were baked with, PNG and JPEG are decoded to RGBA8 and get their mip chain generated. The levels
+* are streamed to the GPU smallest first, so a texture shows a blurred version right away and sharpens over a few frames
+* instead of holding up the model
+*
+* There is no Basis Universal transcoder: KTX2 files have to be baked to a BC or ETC2 format the device can sample and
+* without supercompression. Other KTX2 images fall back to the PNG or JPEG of KHR_texture_basisu, or are left out
+*/
+
+#pragma once
+#include "pch.hpp"
+#include "VulkanglTFModel.hpp"
+#include <atomic>
+#include <deque>
+
+namespace Voortman3D {
+	namespace vkglTF {
+		/** @brief 1x1 white texture that fills the texture slots no material uses, created once before models are loaded */
+		extern Texture* defaultTexture;
+
+		void createDefaultTexture(VulkanDevice* device);
+		void destroyDefaultTexture();
+
+		/*
+			Mip chain of a decoded image, level 0 is the full resolution
+		*/
+		struct TextureLevels {
+			VkFormat format{ VK_FORMAT_UNDEFINED };
+			uint32_t width{};
+			uint32_t height{};
+			std::vector<uint8_t> data;
+			// Start of every level in data plus the end of the last one, starts are aligned for image copies
+			std::vector<VkDeviceSize> offsets;
+
+			_NODISCARD uint32_t levelCount() const noexcept { return offsets.empty() ? 0 : static_cast<uint32_t>(offsets.size() - 1); }
+			_NODISCARD VkDeviceSize levelSize(uint32_t level) const noexcept { return offsets[level + 1] - offsets[level]; }
+			_NODISCARD uint32_t levelWidth(uint32_t level) const noexcept { return (std::max)(1u, width >> level); }
+			_NODISCARD uint32_t levelHeight(uint32_t level) const noexcept { return (std::max)(1u, height >> level); }
+		};
+
+		/**
+		* Decode an image into a full mip chain, safe to call from any thread
+		*
+		* @param encoded File contents, KTX2 is recognized by its identifier and everything else is left to stb_image
+		* @param srgb Whether decoded PNG and JPEG images hold color, KTX2 files carry this in their format
+		* @param isFormatSupported Whether the device can sample a format, KTX2 files in other formats are rejected
+		* @param levels Receives the levels
+		* @param error Receives the reason when decoding failed
+		*/
+		bool decodeTexture(const std::vector<unsigned char>& encoded, bool srgb, const std::function<bool(VkFormat)>& isFormatSupported, TextureLevels& levels, std::string& error);
+
+		/** @brief Decodes the image of a texture source and falls back to its plain image when that fails, errors are reported on std::cerr */
+		bool decodeTextureSource(VulkanDevice* device, const Model::TextureSource& source, TextureLevels& levels);
+
+		/** @brief Replaces the levels of an RGBA8 image with level 0 and box filtered levels down to 1x1, sRGB images are filtered in linear space */
+		void generateMipChain(TextureLevels& levels);
+
+		/*
+			Uploads decoded textures level by level, always the smallest missing level of any texture first
+		*/
+		class TextureStreamer {
+		public:
+			explicit TextureStreamer(VulkanDevice* device) : device(device) {}
+			~TextureStreamer();
+
+			/** @brief Hand over the levels of a texture of the model, thread safe */
+			void push(Model* model, Texture* texture, TextureLevels&& levels);
+
+			/** @brief Block while more than maxQueuedBytes of decoded levels wait for their upload, so decoding never runs far ahead of the GPU */
+			void waitForSpace(const std::atomic<bool>& cancelled);
+
+			/**
+			* Retire completed uploads and record new ones for about budget bytes, called once per frame from the render thread
+			*
+			* @return True when texture descriptors of a model were written, without bindless textures the command buffers binding its node set have to be recorded again
+			*/
+			_NODISCARD bool update(VkDeviceSize budget);
+
+			/** @brief Upload everything that was pushed and make the next frame wait for it, for loading without a frame loop */
+			void flush();
+
+			/** @brief Wait for the uploads in flight and drop everything else, before the textures are destroyed */
+			void clear();
+
+			/** @brief Nothing queued and nothing in flight */
+			_NODISCARD bool idle();
+
+		private:
+			struct Entry {
+				Model* model{ nullptr };
+				Texture* texture{ nullptr };
+				TextureLevels levels;
+				// Finest level that has been recorded, levelCount before the first step
+				uint32_t nextLevel{ 0 };
+				uint64_t uploadValue{ 0 };
+				bool inFlight{ false };
+			};
+
+			// A 4k RGBA8 chain is about 85 MB
+			static constexpr VkDeviceSize maxQueuedBytes = 256ull * 1024 * 1024;
+			// Levels up to this size go up together in the first step of a texture
+			static constexpr uint32_t tailSize = 64;
+			// How long a decoding thread sleeps between checks for cancellation while too much is queued
+			static constexpr std::chrono::milliseconds spaceWaitTimeout{ 10 };
+
+			VulkanDevice* device;
+
+			std::mutex mutex;
+			std::condition_variable condition;
+			std::deque<Entry> incoming;
+			VkDeviceSize queuedBytes{ 0 };
+
+			// Only touched by the render thread
+			std::vector<Entry> entries;
+
+			void createImage(Entry& entry);
+			/** @brief Size in bytes of the next step of the entry */
+			_NODISCARD VkDeviceSize stepSize(const Entry& entry) const noexcept;
+			/** @brief False when the staging ring is full, the entry is left as it was */
+			_NODISCARD bool recordStep(Entry& entry);
+			/** @brief Makes the level that was recorded last visible to the materials, true when descriptors were written */
+			bool retireStep(Entry& entry);
+			void waitForUploads();
+		};
+	}
+}
@@ -6,7 +6,9 @@
 * This code is licensed under the MIT license (MIT) (http://opensource.org/licenses/MIT)
 */
 
+#pragma once
 #include "pch.hpp"
+#include <atomic>
 
 namespace Voortman3D
 {
@@ -103,6 +105,34 @@ namespace Voortman3D
 				thread->wait();
 			}
 		}
+
+		// Runs job(i) for every i in [0, count) and waits until all of them are done
+		// Every thread pulls the next index from a shared counter, so uneven jobs are balanced over the pool
+		void parallelFor(size_t count, const std::function<void(size_t)>& job)
+		{
+			if (threads.empty() || count < 2)
+			{
+				for (size_t i = 0; i < count; i++)
+				{
+					job(i);
+				}
+				return;
+			}
+
+			std::atomic<size_t> next{ 0 };
+			const size_t threadCount = (std::min)(threads.size(), count);
+			for (size_t t = 0; t < threadCount; t++)
+			{
+				threads[t]->addJob([&next, &job, count]
+				{
+					for (size_t i = next++; i < count; i = next++)
+					{
+						job(i);
+					}
+				});
+			}
+			wait();
+		}
 	};
 
 }